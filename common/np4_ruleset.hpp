@@ -0,0 +1,136 @@
+/*
+ * np4_ruleset.hpp: Installation of NP4 rulesets to Netcope P4 card shared by Netcope P4 examples.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NP4_RULESET
+#define __HEADER_FILE_NP4_RULESET
+
+#include <stdexcept>
+#include <vector>
+#include <libnp4.h>
+
+#include "ruleset.hpp"
+
+/**
+ * \brief Core of Netcope P4 card as destination of rules.
+ *
+ * Every bulk of rules becomes one Netcope P4 ruleset inserted by one call.
+ * Single rules cannot be removed, only by reset of the whole core, which
+ * drops traffic until the rules are in again. Reset is therefore done only
+ * when allowed: otherwise the first load goes over the rules the core
+ * holds, and any later load that would remove or change a rule is refused
+ * before the core is touched. The core is enabled once the rules are in.
+ */
+class np4_ruleset_target : public ruleset_target {
+
+    private:
+
+        np4_t *np4;     //!< Netcope P4 instance.
+        int core;       //!< Core the rules are installed to.
+        bool reset;     //!< Core may be reset to remove rules.
+        bool loaded;    //!< Rules were inserted to the core.
+        bool enable;    //!< Core was reset or loaded first and needs to be enabled.
+
+        /**
+         * \brief Free ruleset and throw on error.
+         */
+        static inline void check(np4_error_t err, np4_ruleset_t *ruleset) {
+            if (err) {
+                np4_ruleset_free(ruleset);
+                throw np4_print_error(err);
+            }
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param np4   Netcope P4 instance
+         * @param core  Core the rules are installed to
+         * @param reset Core may be reset to remove rules (drops traffic meanwhile)
+         */
+        np4_ruleset_target(np4_t *np4, int core = 0, bool reset = false) :
+            np4(np4),
+            core(core),
+            reset(reset),
+            loaded(false),
+            enable(false)
+            {
+        }
+
+        void clear() {
+            if (!reset) {
+                if (loaded)
+                    throw std::runtime_error("removal of rules needs reset of Netcope P4 core, which is not allowed");
+                enable = true;
+                return;
+            }
+            np4_error_t err = np4_core_reset(np4, core);
+            if (err)
+                throw np4_print_error(err);
+            enable = true;
+        }
+
+        void insert(const std::vector<ruleset_rule> &rules);
+
+        bool remove(const std::vector<ruleset_rule> &) {
+            return false;
+        }
+
+        void commit() {
+            if (!enable)
+                return;
+            np4_error_t err = np4_core_enable(np4, core);
+            if (err)
+                throw np4_print_error(err);
+            enable = false;
+        }
+};
+
+inline void np4_ruleset_target::insert(const std::vector<ruleset_rule> &rules) {
+    np4_ruleset_t *ruleset = np4_ruleset_create(np4, core);
+    if (ruleset == NULL)
+        throw std::runtime_error("unable to create Netcope P4 ruleset");
+    for (unsigned i = 0; i < rules.size(); i++) {
+        const ruleset_rule &r = rules[i];
+        np4_rule_t *rule;
+        check(np4_rule_create(&rule, ruleset, r.table.c_str()), ruleset);
+        if (r.is_default)
+            check(np4_rule_mark_default(rule), ruleset);
+        // Library takes values by non-const pointer, but does not modify them
+        for (unsigned k = 0; k < r.keys.size(); k++) {
+            const ruleset_field &key = r.keys[k];
+            check(np4_rule_add_key(rule, key.name.c_str(), const_cast<uint8_t *>(&key.value[0]),
+                                   key.mask.empty() ? NULL : const_cast<uint8_t *>(&key.mask[0]), key.value.size()), ruleset);
+        }
+        check(np4_rule_set_action(rule, r.action.c_str()), ruleset);
+        for (unsigned p = 0; p < r.params.size(); p++) {
+            const ruleset_field &param = r.params[p];
+            check(np4_rule_add_action_parameter(rule, param.name.c_str(), const_cast<uint8_t *>(&param.value[0]),
+                                                param.value.size()), ruleset);
+        }
+    }
+    loaded = true;
+    check(np4_core_insert_ruleset(np4, core, ruleset), ruleset);
+    np4_ruleset_free(ruleset);
+}
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * packet_tx_ring.hpp: Sending of complete Ethernet frames through PACKET_MMAP TX ring.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_PACKET_TX_RING
+#define __HEADER_FILE_PACKET_TX_RING
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#define PACKET_TX_FRAMES 4096 //!< Default number of frames in TX ring.
+
+/**
+ * \brief Sender of complete Ethernet frames through PACKET_MMAP TX ring of an interface.
+ *
+ * Frames are written by the caller directly into a ring shared with the
+ * kernel and handed to the driver by one send() call per kick(), bypassing
+ * qdisc where the kernel allows. A frame is reused once the kernel has sent
+ * it; if the ring is full, next() waits for the kernel. Every thread needs
+ * its own ring.
+ *
+ * Frames longer than the interface MTU allows are not queued and count as
+ * errors. The kernel stops at a frame it rejects for any other reason and
+ * send() fails, so such a rejection is fatal: kick() takes the rejected
+ * frames back from the sent ones, counts them as errors and throws,
+ * rejected() tells the caller which frames they were.
+ */
+class packet_tx_ring {
+
+    private:
+
+        int sock;                    //!< Packet socket bound to the interface.
+        unsigned char *ring;         //!< Mapped TX ring.
+        size_t ring_len;             //!< Length of mapped TX ring.
+        unsigned frame_size;         //!< Length of one frame.
+        unsigned frames;             //!< Number of frames.
+        unsigned head;               //!< Frame for next packet.
+        unsigned pending;            //!< Frames queued since last send.
+        unsigned max_len;            //!< Longest frame the interface takes.
+        unsigned char mac[ETH_ALEN]; //!< MAC address of the interface.
+        in_addr_t saddr;             //!< IPv4 address of the interface (network byte order).
+
+        //! Offset of Ethernet frame in TX ring frame.
+        static const unsigned DATA_OFFSET = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+        packet_tx_ring(const packet_tx_ring &);
+        packet_tx_ring &operator=(const packet_tx_ring &);
+
+        inline struct tpacket2_hdr *frame(unsigned index) const {
+            return (struct tpacket2_hdr *) (ring + (size_t) index * frame_size);
+        }
+
+        inline unsigned status(unsigned index) const {
+            return __atomic_load_n(&frame(index)->tp_status, __ATOMIC_ACQUIRE);
+        }
+
+        void close_socket() {
+            if (ring)
+                munmap(ring, ring_len);
+            if (sock != -1)
+                close(sock);
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor, map TX ring of the interface.
+         * @param ifname    Interface to send frames through
+         * @param frame_len Longest frame written to the ring
+         * @param frames    Number of frames in TX ring
+         */
+        packet_tx_ring(const char *ifname, unsigned frame_len, unsigned frames = PACKET_TX_FRAMES);
+
+        ~packet_tx_ring() {
+            close_socket();
+        }
+
+        /**
+         * \brief MAC address of the interface.
+         */
+        const unsigned char *source() const {
+            return mac;
+        }
+
+        /**
+         * \brief IPv4 address of the interface (network byte order), 0 if it has none.
+         */
+        in_addr_t address() const {
+            return saddr;
+        }
+
+        /**
+         * \brief MTU of the interface, longest frame sent is MTU plus Ethernet header.
+         */
+        unsigned mtu() const {
+            return max_len - ETH_HLEN;
+        }
+
+        /**
+         * \brief Number of frames in the ring.
+         */
+        unsigned size() const {
+            return frames;
+        }
+
+        /**
+         * \brief Index of the frame returned by next().
+         */
+        unsigned index() const {
+            return head;
+        }
+
+        /**
+         * \brief Number of frames queued since last kick().
+         */
+        unsigned queued() const {
+            return pending;
+        }
+
+        /**
+         * \brief Check whether next() would wait for the kernel.
+         */
+        bool full() const {
+            return status(head) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING);
+        }
+
+        /**
+         * \brief Check whether the kernel rejected the frame, valid after kick() threw.
+         * @param index Index of the frame
+         */
+        bool rejected(unsigned index) const {
+            return status(index) == TP_STATUS_WRONG_FORMAT;
+        }
+
+        /**
+         * \brief Buffer for next frame, valid until commit(), wait for the kernel if the ring is full.
+         */
+        inline unsigned char *next();
+
+        /**
+         * \brief Queue the frame written to buffer returned by next().
+         * @param len Length of the frame
+         * @return False if the frame is longer than the interface takes, it is
+         *         counted as error and its buffer is returned by next() again
+         */
+        inline bool commit(unsigned len);
+
+        /**
+         * \brief Hand queued frames to the kernel.
+         * @param wait Wait until the kernel sent them
+         */
+        void kick(bool wait);
+
+        uint64_t sent;     //!< Frames handed to the kernel.
+        uint64_t errors;   //!< Frames too long or rejected by the kernel.
+        uint64_t syscalls; //!< Calls of send().
+};
+
+inline packet_tx_ring::packet_tx_ring(const char *ifname, unsigned frame_len, unsigned frames) :
+    sock(-1),
+    ring(NULL),
+    ring_len(0),
+    frame_size(TPACKET_ALIGNMENT),
+    frames(0),
+    head(0),
+    pending(0),
+    max_len(0),
+    saddr(0),
+    sent(0),
+    errors(0),
+    syscalls(0)
+    {
+    try {
+        unsigned ifindex = if_nametoindex(ifname);
+        if (ifindex == 0)
+            throw std::runtime_error(std::string() + "unknown interface '" + ifname + "'");
+        if ((sock = socket(AF_PACKET, SOCK_RAW, 0)) == -1)
+            throw std::runtime_error(std::string() + "packet socket error: " + strerror(errno));
+
+        // Addresses and MTU of the interface
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+        if (ioctl(sock, SIOCGIFHWADDR, &ifr) == -1)
+            throw std::runtime_error(std::string() + "unable to get MAC address of '" + ifname + "'");
+        memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+        ifr.ifr_addr.sa_family = AF_INET;
+        if (ioctl(sock, SIOCGIFADDR, &ifr) == 0)
+            saddr = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr;
+        if (ioctl(sock, SIOCGIFMTU, &ifr) == -1)
+            throw std::runtime_error(std::string() + "unable to get MTU of '" + ifname + "'");
+        max_len = ETH_HLEN + ifr.ifr_mtu;
+
+        // Frames hold TX ring header and the packet
+        while (frame_size < DATA_OFFSET + frame_len)
+            frame_size <<= 1;
+        unsigned block_size = frame_size > (unsigned) getpagesize() ? frame_size : getpagesize();
+        unsigned frames_per_block = block_size / frame_size;
+        struct tpacket_req req;
+        req.tp_block_size = block_size;
+        req.tp_frame_size = frame_size;
+        req.tp_block_nr = (frames + frames_per_block - 1) / frames_per_block;
+        req.tp_frame_nr = req.tp_block_nr * frames_per_block;
+        this->frames = req.tp_frame_nr;
+        ring_len = (size_t) block_size * req.tp_block_nr;
+
+        // Without PACKET_LOSS a frame the kernel rejects is marked TP_STATUS_WRONG_FORMAT, not skipped silently
+        int version = TPACKET_V2;
+        int one = 1;
+        if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 ||
+            setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1)
+            throw std::runtime_error(std::string() + "unable to set up TX ring: " + strerror(errno));
+        // Skipping qdisc is only an optimization
+        setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+        void *m = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+        if (m == MAP_FAILED) {
+            ring_len = 0;
+            throw std::runtime_error(std::string() + "unable to map TX ring: " + strerror(errno));
+        }
+        ring = (unsigned char *) m;
+
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = 0; // send only
+        addr.sll_ifindex = ifindex;
+        if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+            throw std::runtime_error(std::string() + "unable to bind packet socket: " + strerror(errno));
+    } catch (...) {
+        close_socket();
+        throw;
+    }
+}
+
+inline unsigned char *packet_tx_ring::next() {
+    // Ring is full, wait for the kernel
+    while (full())
+        kick(true);
+    return (unsigned char *) frame(head) + DATA_OFFSET;
+}
+
+inline bool packet_tx_ring::commit(unsigned len) {
+    // The kernel would reject the frame and stop at it, the frame is reused instead
+    if (len > max_len) {
+        errors++;
+        return false;
+    }
+    struct tpacket2_hdr *hdr = frame(head);
+    hdr->tp_len = len;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    head = head + 1 == frames ? 0 : head + 1;
+    pending++;
+    return true;
+}
+
+inline void packet_tx_ring::kick(bool wait) {
+    sent += pending;
+    pending = 0;
+    for (;;) {
+        int ret = send(sock, NULL, 0, wait ? 0 : MSG_DONTWAIT);
+        syscalls++;
+        if (ret != -1)
+            break;
+        if (errno == EINTR)
+            continue;
+        // Frames stay in the ring and go out with next send
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+            int err = errno;
+            // Rejected frame was counted as sent when handed to the kernel
+            for (unsigned f = 0; f < frames; f++)
+                if (rejected(f)) {
+                    sent--;
+                    errors++;
+                }
+            throw std::runtime_error(std::string() + "packet send error: " + strerror(err));
+        }
+        if (!wait)
+            break;
+        struct pollfd pfd = { sock, POLLOUT, 0 };
+        ::poll(&pfd, 1, 1);
+    }
+}
+
+#endif
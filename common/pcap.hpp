@@ -0,0 +1,285 @@
+/*
+ * pcap.hpp: Memory mapped reading and buffered writing of capture files shared by Netcope P4 examples.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_PCAP
+#define __HEADER_FILE_PCAP
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAP_MAGIC_US          0xa1b2c3d4 //!< Microsecond resolution capture.
+#define PCAP_MAGIC_NS          0xa1b23c4d //!< Nanosecond resolution capture.
+#define PCAP_LINKTYPE_ETHERNET 1          //!< Link type of Ethernet captures.
+#define PCAP_WRITER_BUFFER     (1 << 20)  //!< Bytes of records pcap_writer buffers before writing them.
+
+/**
+ * \brief Whole file mapped to memory.
+ *
+ * The mapping is private and writable, so records can be handed to code that
+ * expects modifiable buffers without touching the file.
+ */
+class mapped_file {
+
+    private:
+
+        mapped_file(const mapped_file &);
+        mapped_file &operator=(const mapped_file &);
+
+    public:
+
+        /**
+         * \brief Basic constructor, map the file and prefault its pages.
+         * @param path Path to the file
+         */
+        mapped_file(const char *path);
+
+        ~mapped_file() {
+            if (data)
+                munmap(data, size);
+        }
+
+        unsigned char *data; //!< Start of the mapped file.
+        size_t size;         //!< Size of the file.
+};
+
+inline mapped_file::mapped_file(const char *path) :
+    data(NULL),
+    size(0)
+    {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error(std::string() + "unable to open '" + path + "'");
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error(std::string() + "unable to stat '" + path + "'");
+    }
+    size = st.st_size;
+    if (size) {
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(std::string() + "unable to map '" + path + "'");
+        }
+        data = (unsigned char *) map;
+    }
+    close(fd);
+}
+
+/**
+ * \brief Sequential reader of packets from memory mapped pcap file.
+ */
+class pcap_reader {
+
+    private:
+
+        mapped_file file;   //!< Mapped capture.
+        bool swapped;       //!< Capture has opposite byte order.
+        bool nsec;          //!< Timestamps have nanosecond resolution.
+        size_t offset;      //!< Offset of next packet record.
+
+        inline uint32_t field(const unsigned char *p) const {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return swapped ? __builtin_bswap32(v) : v;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor, map the capture and check its header.
+         * @param path Path to the capture
+         */
+        pcap_reader(const char *path);
+
+        /**
+         * \brief Check whether the file is pcap capture.
+         * @param data Start of the file
+         * @param size Size of the file
+         */
+        static inline bool is_pcap(const unsigned char *data, size_t size) {
+            if (size < 24)
+                return false;
+            uint32_t magic;
+            memcpy(&magic, data, 4);
+            return magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ||
+                   magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+        }
+
+        /**
+         * \brief Read next packet.
+         * @param caplen Captured length of the packet
+         * @param ts_ns  Timestamp of the packet in nanoseconds (optional)
+         * @param len    Original length of the packet on the wire (optional)
+         * @return Packet data, NULL at the end of capture
+         */
+        inline unsigned char *next(unsigned *caplen, uint64_t *ts_ns = NULL, unsigned *len = NULL);
+
+        /**
+         * \brief Restart reading from the first packet.
+         */
+        inline void rewind() {
+            offset = 24;
+        }
+
+        uint32_t linktype; //!< Link type of the capture.
+};
+
+inline pcap_reader::pcap_reader(const char *path) :
+    file(path),
+    swapped(false),
+    nsec(false),
+    offset(24),
+    linktype(0)
+    {
+    if (!is_pcap(file.data, file.size))
+        throw std::runtime_error(std::string() + "'" + path + "' is not a pcap file");
+    uint32_t magic;
+    memcpy(&magic, file.data, 4);
+    swapped = magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS;
+    nsec = field(file.data) == PCAP_MAGIC_NS;
+    linktype = field(file.data + 20);
+}
+
+inline unsigned char *pcap_reader::next(unsigned *caplen, uint64_t *ts_ns, unsigned *len) {
+    if (offset + 16 > file.size)
+        return NULL;
+    unsigned char *rec = file.data + offset;
+    uint32_t incl_len = field(rec + 8);
+    if (offset + 16 + incl_len > file.size)
+        return NULL;
+    if (ts_ns)
+        *ts_ns = (uint64_t) field(rec) * 1000000000 + (uint64_t) field(rec + 4) * (nsec ? 1 : 1000);
+    if (len)
+        *len = field(rec + 12);
+    *caplen = incl_len;
+    offset += 16 + incl_len;
+    return rec + 16;
+}
+
+/**
+ * \brief Buffered writer of pcap captures with nanosecond timestamps.
+ *
+ * Records are gathered in memory and written by one write() per buffer, so
+ * writing millions of small packets costs few system calls.
+ */
+class pcap_writer {
+
+    private:
+
+        int fd;                             //!< Output file.
+        std::string path;                   //!< Path to the file, used in errors.
+        std::vector<unsigned char> buffer;  //!< Records not written yet.
+        size_t used;                        //!< Bytes of buffer used.
+        uint32_t snaplen;                   //!< Longest packet written as a whole.
+
+        pcap_writer(const pcap_writer &);
+        pcap_writer &operator=(const pcap_writer &);
+
+    public:
+
+        /**
+         * \brief Basic constructor, create the file and write pcap header.
+         * @param path     Path to the capture
+         * @param linktype Link type of the capture
+         * @param snaplen  Longer packets are truncated
+         */
+        pcap_writer(const char *path, uint32_t linktype = PCAP_LINKTYPE_ETHERNET, uint32_t snaplen = 65535);
+
+        /**
+         * \brief Destructor, write out buffered records, errors are ignored, call flush() to see them.
+         */
+        ~pcap_writer() {
+            try {
+                flush();
+            } catch (...) {
+            }
+            close(fd);
+        }
+
+        /**
+         * \brief Add packet to the capture.
+         * @param data   Packet data
+         * @param caplen Length of the packet data
+         * @param ts_ns  Timestamp of the packet in nanoseconds
+         * @param len    Original length of the packet on the wire, caplen if 0
+         */
+        inline void write(const unsigned char *data, unsigned caplen, uint64_t ts_ns, unsigned len = 0);
+
+        /**
+         * \brief Write out buffered records.
+         */
+        void flush();
+};
+
+inline pcap_writer::pcap_writer(const char *path, uint32_t linktype, uint32_t snaplen) :
+    fd(-1),
+    path(path),
+    buffer(PCAP_WRITER_BUFFER),
+    used(0),
+    snaplen(snaplen)
+    {
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        throw std::runtime_error(std::string() + "unable to create '" + path + "'");
+    uint32_t header[6] = { PCAP_MAGIC_NS, 2 | 4 << 16, 0, 0, snaplen, linktype };
+    memcpy(buffer.data(), header, sizeof(header));
+    used = sizeof(header);
+}
+
+inline void pcap_writer::write(const unsigned char *data, unsigned caplen, uint64_t ts_ns, unsigned len) {
+    if (caplen > snaplen)
+        caplen = snaplen;
+    if (used + 16 + caplen > buffer.size()) {
+        flush();
+        if (16 + caplen > buffer.size())
+            buffer.resize(16 + caplen);
+    }
+    uint32_t rec[4] = { (uint32_t) (ts_ns / 1000000000), (uint32_t) (ts_ns % 1000000000), caplen, len ? len : caplen };
+    memcpy(&buffer[used], rec, 16);
+    memcpy(&buffer[used + 16], data, caplen);
+    used += 16 + caplen;
+}
+
+inline void pcap_writer::flush() {
+    size_t done = 0;
+    while (done < used) {
+        ssize_t ret = ::write(fd, &buffer[done], used - done);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            used = 0;
+            throw std::runtime_error(std::string() + "unable to write '" + path + "'");
+        }
+        done += ret;
+    }
+    used = 0;
+}
+
+#endif
@@ -0,0 +1,930 @@
+/*
+ * ruleset.hpp: Model, parser and incremental installation of NP4 rulesets shared by Netcope P4 examples.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_RULESET
+#define __HEADER_FILE_RULESET
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * NP4 ruleset 2.0 text format, one rule per line after the header line:
+ *
+ *   NP4 ruleset 2.0
+ *   <table> default action <action> [params ( <name> <value> ... )]
+ *   <table> keys ( <field> <value>[:<mask>] ... ) action <action> [params ( <name> <value> ... )]
+ *
+ * Values are decimal (or 0x hexadecimal) numbers, or comma separated lists
+ * of bytes in network order (e.g. 0,96,8,159,177,243), padded or truncated to
+ * the width of the field where it is known (ruleset_widths). Empty lines and
+ * lines starting by '#' are ignored.
+ */
+
+#define RULESET_HEADER     "NP4 ruleset 2.0" //!< First line of ruleset file.
+#define RULESET_BULK_RULES 65536             //!< Rules handed to the target at once.
+
+/**
+ * \brief Named value of match key or action parameter.
+ */
+struct ruleset_field {
+    std::string name;             //!< Field or parameter name.
+    std::vector<uint8_t> value;   //!< Value, network byte order.
+    std::vector<uint8_t> mask;    //!< Mask of the same length as value, empty for exact match.
+};
+
+/**
+ * \brief One rule of a table, default rule or rule with match keys.
+ */
+struct ruleset_rule {
+    std::string table;                 //!< Table of the rule.
+    bool is_default;                   //!< Default rule of the table.
+    std::vector<ruleset_field> keys;   //!< Match keys (none for default rule).
+    std::string action;                //!< Action of the rule.
+    std::vector<ruleset_field> params; //!< Action parameters.
+
+    ruleset_rule() : is_default(false) {}
+};
+
+/**
+ * \brief Widths of match keys and action parameters declared by the P4 program.
+ *
+ * The card takes every value in the full width of its field, while numbers
+ * of the text format are stored in as few bytes as they need. Values of
+ * fields with declared width are padded by leading zeros, or leading zero
+ * bytes are dropped, so that every rule has one encoding whatever it was
+ * written like. Fields without declared width are kept as they are.
+ */
+class ruleset_widths {
+
+    private:
+
+        std::unordered_map<std::string, unsigned> bits_; //!< Width in bits by kind, table or action, and field.
+
+        static std::string id(char kind, const std::string &owner, const std::string &field) {
+            std::string id(1, kind);
+            id.append(owner);
+            id.push_back('\0');
+            id.append(field);
+            return id;
+        }
+
+        /**
+         * \brief Pad or truncate value to width.
+         * @return False if the value does not fit
+         */
+        static bool fit(std::vector<uint8_t> &value, unsigned bits);
+
+    public:
+
+        /**
+         * \brief Declare width of match key.
+         * @param table Table of the key
+         * @param field Field matched
+         * @param bits  Width of the field in bits
+         */
+        ruleset_widths &key(const std::string &table, const std::string &field, unsigned bits) {
+            bits_[id('k', table, field)] = bits;
+            return *this;
+        }
+
+        /**
+         * \brief Declare width of action parameter.
+         * @param action Action of the parameter
+         * @param name   Parameter name
+         * @param bits   Width of the parameter in bits
+         */
+        ruleset_widths &param(const std::string &action, const std::string &name, unsigned bits) {
+            bits_[id('p', action, name)] = bits;
+            return *this;
+        }
+
+        /**
+         * \brief Pad or truncate match key (value and mask) to its declared width.
+         * @param table Table of the key
+         * @param field Match key
+         * @return False if the value or mask does not fit
+         */
+        bool fit_key(const std::string &table, ruleset_field &field) const;
+
+        /**
+         * \brief Pad or truncate action parameter to its declared width.
+         * @param action Action of the parameter
+         * @param field  Action parameter
+         * @return False if the value does not fit
+         */
+        bool fit_param(const std::string &action, ruleset_field &field) const;
+
+        /**
+         * \brief Pad or truncate all match keys and action parameters of rule.
+         * @param rule Rule
+         */
+        void fit(ruleset_rule &rule) const;
+};
+
+inline bool ruleset_widths::fit(std::vector<uint8_t> &value, unsigned bits) {
+    size_t bytes = (bits + 7) / 8;
+    size_t extra = 0;
+    while (value.size() - extra > bytes && value[extra] == 0)
+        extra++;
+    if (value.size() - extra > bytes)
+        return false;
+    value.erase(value.begin(), value.begin() + extra);
+    value.insert(value.begin(), bytes - value.size(), 0);
+    return bits % 8 == 0 || bytes == 0 || (value[0] >> (bits % 8)) == 0;
+}
+
+inline bool ruleset_widths::fit_key(const std::string &table, ruleset_field &field) const {
+    std::unordered_map<std::string, unsigned>::const_iterator it = bits_.find(id('k', table, field.name));
+    if (it == bits_.end())
+        return true;
+    return fit(field.value, it->second) && (field.mask.empty() || fit(field.mask, it->second));
+}
+
+inline bool ruleset_widths::fit_param(const std::string &action, ruleset_field &field) const {
+    std::unordered_map<std::string, unsigned>::const_iterator it = bits_.find(id('p', action, field.name));
+    return it == bits_.end() || fit(field.value, it->second);
+}
+
+inline void ruleset_widths::fit(ruleset_rule &rule) const {
+    for (unsigned i = 0; i < rule.keys.size(); i++)
+        if (!fit_key(rule.table, rule.keys[i]))
+            throw std::runtime_error("match key '" + rule.keys[i].name + "' of table '" + rule.table +
+                                     "' wider than its field");
+    for (unsigned i = 0; i < rule.params.size(); i++)
+        if (!fit_param(rule.action, rule.params[i]))
+            throw std::runtime_error("parameter '" + rule.params[i].name + "' of action '" + rule.action +
+                                     "' wider than its field");
+}
+
+/**
+ * \brief Set of rules of one or more tables.
+ *
+ * Tables may hold millions of rules, so every rule is kept encoded in two
+ * strings: its match (table and match keys sorted by field name), which is
+ * the identity of the rule, and its action with parameters. Field names and
+ * values are stored as
+ *
+ *   name '\0' <length byte> value [<length byte> mask]
+ *
+ * (mask only in match keys). Rules are decoded to ruleset_rule on demand.
+ * Given widths of fields, values are stored in the widths of their fields.
+ */
+class ruleset {
+
+    public:
+
+        typedef std::unordered_map<std::string, std::string> rule_map; //!< Match to action.
+        typedef std::pair<const char *, const char *> token;            //!< Word of rule line.
+
+    private:
+
+        rule_map rules_;                //!< Rules by their match.
+        const ruleset_widths *widths;   //!< Widths of fields (NULL = values kept as written).
+
+        static void encode_field(std::string &out, const ruleset_field &field, bool masked);
+
+        static const char *decode_field(const char *p, ruleset_field &field, bool masked);
+
+        /**
+         * \brief Parse number or list of bytes.
+         * @param text  Text of the value
+         * @param value Output value
+         * @return False if the text is not a valid value
+         */
+        static bool parse_number(const token &text, std::vector<uint8_t> &value);
+
+        /**
+         * \brief Parse one rule line.
+         * @param tokens Words of the line
+         * @param widths Widths of fields, NULL to keep values as written
+         * @param match  Output encoded match
+         * @param action Output encoded action
+         * @param keys   Buffer for encoded match keys
+         * @return Error message, NULL on success
+         */
+        static const char *parse_rule(const std::vector<token> &tokens, const ruleset_widths *widths, std::string &match,
+                                      std::string &action, std::vector<std::string> &keys);
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param widths Widths of fields values are stored in, NULL to keep values as written
+         */
+        explicit ruleset(const ruleset_widths *widths = NULL) :
+            widths(widths)
+            {
+        }
+
+        /**
+         * \brief Encode rule.
+         * @param rule   Rule
+         * @param match  Output encoded match (identity of the rule)
+         * @param action Output encoded action
+         */
+        static void encode(const ruleset_rule &rule, std::string &match, std::string &action);
+
+        /**
+         * \brief Decode rule.
+         * @param entry Encoded match and action
+         * @return Rule, match keys sorted by field name
+         */
+        static ruleset_rule decode(const rule_map::value_type &entry);
+
+        /**
+         * \brief Value of a number in as few bytes as it needs, as read() stores it without widths.
+         * @param n Number
+         * @return Value, network byte order
+         */
+        static std::vector<uint8_t> number(uint64_t n) {
+            std::vector<uint8_t> value;
+            do {
+                value.insert(value.begin(), n & 0xFF);
+                n >>= 8;
+            } while (n);
+            return value;
+        }
+
+        /**
+         * \brief Check whether encoded match belongs to default rule.
+         */
+        static bool is_default(const std::string &match) {
+            return match[strlen(match.c_str()) + 1] == 'd';
+        }
+
+        /**
+         * \brief Add rule to the ruleset.
+         * @return False if the ruleset already has rule with the same match
+         */
+        bool add(const ruleset_rule &rule);
+
+        /**
+         * \brief Set default rule of a table, replacing the previous one.
+         * @param table  Table of the rule
+         * @param action Action of the rule
+         * @param params Action parameters
+         */
+        void set_default(const std::string &table, const std::string &action,
+                         const std::vector<ruleset_field> &params = std::vector<ruleset_field>());
+
+        /**
+         * \brief Remove rule from the ruleset.
+         * @param rule Rule or another rule with the same match
+         * @return False if the ruleset has no such rule
+         */
+        bool erase(const ruleset_rule &rule);
+
+        /**
+         * \brief Read rules in NP4 ruleset 2.0 format.
+         * @param in   Input stream
+         * @param name Name of the input for error messages
+         */
+        void read(std::istream &in, const std::string &name);
+
+        /**
+         * \brief Read rules from NP4 ruleset 2.0 file.
+         * @param path Path to the file
+         */
+        void load(const char *path);
+
+        /**
+         * \brief Write rules in NP4 ruleset 2.0 format.
+         * @param out Output stream
+         */
+        void write(std::ostream &out) const;
+
+        const rule_map &rules() const {
+            return rules_;
+        }
+
+        size_t size() const {
+            return rules_.size();
+        }
+
+        void swap(ruleset &other) {
+            rules_.swap(other.rules_);
+        }
+
+        void clear() {
+            rules_.clear();
+        }
+};
+
+inline void ruleset::encode_field(std::string &out, const ruleset_field &field, bool masked) {
+    out.append(field.name);
+    out.push_back('\0');
+    out.push_back((char) field.value.size());
+    out.append(field.value.begin(), field.value.end());
+    if (masked) {
+        out.push_back((char) field.mask.size());
+        out.append(field.mask.begin(), field.mask.end());
+    }
+}
+
+inline const char *ruleset::decode_field(const char *p, ruleset_field &field, bool masked) {
+    field.name = p;
+    p += field.name.size() + 1;
+    unsigned len = (uint8_t) *p++;
+    field.value.assign(p, p + len);
+    p += len;
+    if (masked) {
+        len = (uint8_t) *p++;
+        field.mask.assign(p, p + len);
+        p += len;
+    }
+    return p;
+}
+
+inline void ruleset::encode(const ruleset_rule &rule, std::string &match, std::string &action) {
+    std::vector<std::string> keys(rule.keys.size());
+    for (unsigned i = 0; i < rule.keys.size(); i++)
+        encode_field(keys[i], rule.keys[i], true);
+    // Field name ends by '\0', so keys sort by name
+    std::sort(keys.begin(), keys.end());
+    match = rule.table;
+    match.push_back('\0');
+    match.push_back(rule.is_default ? 'd' : 'k');
+    for (unsigned i = 0; i < keys.size(); i++)
+        match.append(keys[i]);
+    action = rule.action;
+    action.push_back('\0');
+    for (unsigned i = 0; i < rule.params.size(); i++)
+        encode_field(action, rule.params[i], false);
+}
+
+inline ruleset_rule ruleset::decode(const rule_map::value_type &entry) {
+    ruleset_rule rule;
+    const char *p = entry.first.data(), *end = p + entry.first.size();
+    rule.table = p;
+    p += rule.table.size() + 1;
+    rule.is_default = *p++ == 'd';
+    while (p < end) {
+        rule.keys.push_back(ruleset_field());
+        p = decode_field(p, rule.keys.back(), true);
+    }
+    p = entry.second.data();
+    end = p + entry.second.size();
+    rule.action = p;
+    p += rule.action.size() + 1;
+    while (p < end) {
+        rule.params.push_back(ruleset_field());
+        p = decode_field(p, rule.params.back(), false);
+    }
+    return rule;
+}
+
+inline bool ruleset::add(const ruleset_rule &rule) {
+    std::string match, action;
+    if (widths) {
+        ruleset_rule fitted = rule;
+        widths->fit(fitted);
+        encode(fitted, match, action);
+    } else {
+        encode(rule, match, action);
+    }
+    return rules_.insert(std::make_pair(match, action)).second;
+}
+
+inline void ruleset::set_default(const std::string &table, const std::string &action,
+                                 const std::vector<ruleset_field> &params) {
+    ruleset_rule rule;
+    rule.table = table;
+    rule.is_default = true;
+    rule.action = action;
+    rule.params = params;
+    if (widths)
+        widths->fit(rule);
+    std::string match, encoded;
+    encode(rule, match, encoded);
+    rules_[match] = encoded;
+}
+
+inline bool ruleset::erase(const ruleset_rule &rule) {
+    std::string match, action;
+    if (widths) {
+        ruleset_rule fitted = rule;
+        widths->fit(fitted);
+        encode(fitted, match, action);
+    } else {
+        encode(rule, match, action);
+    }
+    return rules_.erase(match) != 0;
+}
+
+inline bool ruleset::parse_number(const token &text, std::vector<uint8_t> &value) {
+    const char *p = text.first, *end = text.second;
+    value.clear();
+    if (p == end)
+        return false;
+    if (std::find(p, end, ',') != end) {
+        // List of bytes
+        while (true) {
+            unsigned byte = 0;
+            const char *start = p;
+            for (; p < end && *p >= '0' && *p <= '9' && byte <= 255; p++)
+                byte = byte * 10 + (*p - '0');
+            if (p == start || byte > 255)
+                return false;
+            value.push_back(byte);
+            if (p == end)
+                return true;
+            if (*p++ != ',')
+                return false;
+        }
+    }
+    // Number, stored in as few bytes as it needs
+    unsigned base = 10;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    for (; p < end; p++) {
+        unsigned digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else
+            return false;
+        // value = value * base + digit, byte by byte from the lowest
+        for (size_t i = value.size(); i-- > 0; ) {
+            digit += value[i] * base;
+            value[i] = digit & 0xFF;
+            digit >>= 8;
+        }
+        if (digit)
+            value.insert(value.begin(), digit);
+    }
+    if (value.empty())
+        value.push_back(0);
+    return true;
+}
+
+inline const char *ruleset::parse_rule(const std::vector<token> &tokens, const ruleset_widths *widths, std::string &match,
+                                       std::string &action, std::vector<std::string> &keys) {
+    ruleset_field field;
+    std::string table(tokens[0].first, tokens[0].second), name;
+    unsigned i = 0;
+    #define RULESET_TOKEN_IS(text) (i < tokens.size() && \
+        (size_t) (tokens[i].second - tokens[i].first) == sizeof(text) - 1 && \
+        memcmp(tokens[i].first, text, sizeof(text) - 1) == 0)
+
+    match.assign(tokens[0].first, tokens[0].second);
+    match.push_back('\0');
+    i++;
+    if (RULESET_TOKEN_IS("default")) {
+        match.push_back('d');
+        i++;
+    } else if (RULESET_TOKEN_IS("keys")) {
+        match.push_back('k');
+        i++;
+        if (!RULESET_TOKEN_IS("("))
+            return "expected '(' after 'keys'";
+        i++;
+        unsigned count = 0;
+        while (i < tokens.size() && !RULESET_TOKEN_IS(")")) {
+            if (i + 1 >= tokens.size())
+                return "missing value of match key";
+            field.name.assign(tokens[i].first, tokens[i].second);
+            const token &text = tokens[i + 1];
+            const char *colon = std::find(text.first, text.second, ':');
+            if (!parse_number(token(text.first, colon), field.value) ||
+                (colon != text.second && !parse_number(token(colon + 1, text.second), field.mask)))
+                return "invalid value of match key";
+            if (colon == text.second) {
+                field.mask.clear();
+            } else {
+                // Align value and mask to the longer of them
+                while (field.value.size() < field.mask.size())
+                    field.value.insert(field.value.begin(), 0);
+                while (field.mask.size() < field.value.size())
+                    field.mask.insert(field.mask.begin(), 0);
+            }
+            if (widths && !widths->fit_key(table, field))
+                return "value of match key wider than its field";
+            if (count == keys.size())
+                keys.push_back(std::string());
+            keys[count].clear();
+            encode_field(keys[count++], field, true);
+            i += 2;
+        }
+        if (i++ >= tokens.size())
+            return "expected ')' after match keys";
+        if (count == 0)
+            return "rule without match keys";
+        // Field name ends by '\0', so keys sort by name
+        std::sort(keys.begin(), keys.begin() + count);
+        for (unsigned k = 0; k < count; k++) {
+            if (k && strcmp(keys[k].c_str(), keys[k - 1].c_str()) == 0)
+                return "duplicate match key";
+            match.append(keys[k]);
+        }
+    } else {
+        return "expected 'default' or 'keys' after table name";
+    }
+
+    if (!RULESET_TOKEN_IS("action") || ++i >= tokens.size())
+        return "expected action";
+    name.assign(tokens[i].first, tokens[i].second);
+    action = name;
+    action.push_back('\0');
+    i++;
+
+    if (i < tokens.size()) {
+        if (!RULESET_TOKEN_IS("params"))
+            return "expected 'params' after action";
+        i++;
+        if (!RULESET_TOKEN_IS("("))
+            return "expected '(' after 'params'";
+        i++;
+        while (i < tokens.size() && !RULESET_TOKEN_IS(")")) {
+            if (i + 1 >= tokens.size())
+                return "missing value of action parameter";
+            field.name.assign(tokens[i].first, tokens[i].second);
+            if (!parse_number(tokens[i + 1], field.value))
+                return "invalid value of action parameter";
+            if (widths && !widths->fit_param(name, field))
+                return "value of action parameter wider than its field";
+            encode_field(action, field, false);
+            i += 2;
+        }
+        if (i++ >= tokens.size())
+            return "expected ')' after action parameters";
+        if (i < tokens.size())
+            return "unexpected text after action parameters";
+    }
+    #undef RULESET_TOKEN_IS
+    return NULL;
+}
+
+inline void ruleset::read(std::istream &in, const std::string &name) {
+    std::string line, match, action;
+    std::vector<token> tokens;
+    std::vector<std::string> keys;
+    unsigned number = 0;
+    bool header = false;
+    while (std::getline(in, line)) {
+        number++;
+        // Split the line to words
+        tokens.clear();
+        const char *p = line.data(), *end = p + line.size();
+        while (true) {
+            while (p < end && isspace((unsigned char) *p))
+                p++;
+            if (p == end)
+                break;
+            const char *start = p;
+            while (p < end && !isspace((unsigned char) *p))
+                p++;
+            tokens.push_back(token(start, p));
+        }
+        if (tokens.empty() || *tokens[0].first == '#')
+            continue;
+        const char *error = NULL;
+        if (!header) {
+            size_t first = line.find_first_not_of(" \t");
+            if (line.compare(first, sizeof(RULESET_HEADER) - 1, RULESET_HEADER) != 0)
+                error = "missing '" RULESET_HEADER "' header";
+            header = true;
+        } else {
+            error = parse_rule(tokens, widths, match, action, keys);
+            if (error == NULL && !rules_.insert(std::make_pair(match, action)).second)
+                error = "duplicate rule";
+        }
+        if (error) {
+            std::ostringstream msg;
+            msg << name << ":" << number << ": " << error;
+            throw std::runtime_error(msg.str());
+        }
+    }
+    if (!header)
+        throw std::runtime_error(name + ": missing '" RULESET_HEADER "' header");
+}
+
+inline void ruleset::load(const char *path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error(std::string() + "unable to open '" + path + "'");
+    read(in, path);
+}
+
+inline void ruleset::write(std::ostream &out) const {
+    out << RULESET_HEADER << "\n";
+    for (rule_map::const_iterator it = rules_.begin(); it != rules_.end(); ++it) {
+        ruleset_rule rule = decode(*it);
+        out << rule.table;
+        if (rule.is_default) {
+            out << " default";
+        } else {
+            out << " keys (";
+            for (unsigned i = 0; i < rule.keys.size(); i++) {
+                out << " " << rule.keys[i].name << " ";
+                for (unsigned b = 0; b < rule.keys[i].value.size(); b++)
+                    out << (b ? "," : "") << (unsigned) rule.keys[i].value[b];
+                for (unsigned b = 0; b < rule.keys[i].mask.size(); b++)
+                    out << (b ? "," : ":") << (unsigned) rule.keys[i].mask[b];
+            }
+            out << " )";
+        }
+        out << " action " << rule.action;
+        if (!rule.params.empty()) {
+            out << " params (";
+            for (unsigned i = 0; i < rule.params.size(); i++) {
+                out << " " << rule.params[i].name << " ";
+                for (unsigned b = 0; b < rule.params[i].value.size(); b++)
+                    out << (b ? "," : "") << (unsigned) rule.params[i].value[b];
+            }
+            out << " )";
+        }
+        out << "\n";
+    }
+}
+
+/**
+ * \brief Difference between installed and wanted ruleset.
+ *
+ * Changed rule with match keys is removed and inserted again; changed
+ * default rule is only inserted, it replaces the installed one.
+ */
+struct ruleset_delta {
+    typedef const ruleset::rule_map::value_type *entry;
+
+    std::vector<entry> insert;  //!< Rules of wanted ruleset to insert.
+    std::vector<entry> remove;  //!< Rules of installed ruleset to remove.
+    size_t unchanged;           //!< Rules present in both rulesets.
+
+    ruleset_delta() : unchanged(0) {}
+};
+
+/**
+ * \brief Compute difference between rulesets.
+ * @param installed Installed ruleset
+ * @param wanted    Wanted ruleset
+ * @return Rules to remove and insert, pointing into the rulesets
+ */
+inline ruleset_delta ruleset_diff(const ruleset &installed, const ruleset &wanted) {
+    ruleset_delta delta;
+    const ruleset::rule_map &old_rules = installed.rules();
+    const ruleset::rule_map &new_rules = wanted.rules();
+    for (ruleset::rule_map::const_iterator it = new_rules.begin(); it != new_rules.end(); ++it) {
+        ruleset::rule_map::const_iterator old = old_rules.find(it->first);
+        if (old == old_rules.end()) {
+            delta.insert.push_back(&*it);
+        } else if (old->second == it->second) {
+            delta.unchanged++;
+        } else {
+            if (!ruleset::is_default(old->first))
+                delta.remove.push_back(&*old);
+            delta.insert.push_back(&*it);
+        }
+    }
+    for (ruleset::rule_map::const_iterator it = old_rules.begin(); it != old_rules.end(); ++it)
+        if (new_rules.find(it->first) == new_rules.end())
+            delta.remove.push_back(&*it);
+    return delta;
+}
+
+/**
+ * \brief Destination of rules (card core, or a mock in tests).
+ */
+class ruleset_target {
+
+    public:
+
+        virtual ~ruleset_target() {}
+
+        /**
+         * \brief Remove all rules.
+         *
+         * Target that may not drop its rules throws before it changes anything.
+         */
+        virtual void clear() = 0;
+
+        /**
+         * \brief Insert rules in bulk.
+         * @param rules Rules to insert, default rules replace the current default rule of their table
+         */
+        virtual void insert(const std::vector<ruleset_rule> &rules) = 0;
+
+        /**
+         * \brief Remove rules in bulk.
+         * @param rules Rules to remove, never default rules
+         * @return False if the target cannot remove single rules (nothing is removed then)
+         */
+        virtual bool remove(const std::vector<ruleset_rule> &rules) = 0;
+
+        /**
+         * \brief Finish a batch of changes (e.g. enable the core again after clear()).
+         */
+        virtual void commit() {}
+};
+
+/**
+ * \brief Rules held in memory, stand-in for the card in tests and dry runs.
+ *
+ * Insertion of a rule that is already installed and removal of a rule that
+ * is not installed are errors, so wrong differences are caught.
+ */
+class ruleset_memory_target : public ruleset_target {
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param removable Target supports removal of single rules
+         */
+        ruleset_memory_target(bool removable = true) :
+            removable(removable),
+            clears(0),
+            inserts(0),
+            removes(0),
+            inserted(0),
+            removed(0)
+            {
+        }
+
+        void clear() {
+            installed.clear();
+            clears++;
+        }
+
+        void insert(const std::vector<ruleset_rule> &rules) {
+            for (unsigned i = 0; i < rules.size(); i++) {
+                if (rules[i].is_default)
+                    installed.set_default(rules[i].table, rules[i].action, rules[i].params);
+                else if (!installed.add(rules[i]))
+                    throw std::runtime_error("rule already installed in table '" + rules[i].table + "'");
+            }
+            inserts++;
+            inserted += rules.size();
+        }
+
+        bool remove(const std::vector<ruleset_rule> &rules) {
+            if (!removable)
+                return false;
+            for (unsigned i = 0; i < rules.size(); i++)
+                if (rules[i].is_default || !installed.erase(rules[i]))
+                    throw std::runtime_error("rule not installed in table '" + rules[i].table + "'");
+            removes++;
+            removed += rules.size();
+            return true;
+        }
+
+        bool removable;      //!< Target supports removal of single rules.
+        ruleset installed;   //!< Installed rules.
+        uint64_t clears;     //!< Calls of clear().
+        uint64_t inserts;    //!< Calls of insert().
+        uint64_t removes;    //!< Calls of remove().
+        uint64_t inserted;   //!< Inserted rules.
+        uint64_t removed;    //!< Removed rules.
+};
+
+/**
+ * \brief Result of ruleset installation.
+ */
+struct ruleset_stats {
+    size_t inserted;   //!< Inserted rules.
+    size_t removed;    //!< Removed rules.
+    size_t unchanged;  //!< Rules left as they were.
+    bool full;         //!< Target was cleared and the whole ruleset inserted.
+
+    ruleset_stats() : inserted(0), removed(0), unchanged(0), full(false) {}
+};
+
+/**
+ * \brief Installer of rulesets, applies only the difference to the installed one.
+ *
+ * The card cannot be asked for its rules, so the installer remembers what
+ * it installed. Until the first installation, or after a failed one, the
+ * installed rules are unknown and the target is cleared and loaded whole;
+ * so it is when the target cannot remove single rules. Installation refused
+ * by the target before any change keeps the installed rules known.
+ */
+class ruleset_installer {
+
+    private:
+
+        ruleset_installer(const ruleset_installer &);
+        ruleset_installer &operator=(const ruleset_installer &);
+
+        ruleset_target &target;  //!< Destination of rules.
+        ruleset installed;       //!< Rules installed in the target.
+        bool known;              //!< Installed rules are known.
+        unsigned bulk;           //!< Rules handed to the target at once.
+
+        /**
+         * \brief Decode rules from position in list to bulk.
+         * @return Position behind the decoded rules
+         */
+        size_t decode(const std::vector<ruleset_delta::entry> &entries, size_t pos, std::vector<ruleset_rule> &rules) const {
+            size_t end = std::min(entries.size(), pos + bulk);
+            rules.clear();
+            for (; pos < end; pos++)
+                rules.push_back(ruleset::decode(*entries[pos]));
+            return end;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param target Destination of rules
+         * @param bulk   Rules handed to the target at once
+         */
+        ruleset_installer(ruleset_target &target, unsigned bulk = RULESET_BULK_RULES) :
+            target(target),
+            known(false),
+            bulk(bulk ? bulk : 1)
+            {
+        }
+
+        /**
+         * \brief Install ruleset.
+         * @param wanted Ruleset to install, swapped with the previously installed one
+         * @return Numbers of changed rules
+         */
+        ruleset_stats apply(ruleset &wanted);
+
+        /**
+         * \brief Rules installed in the target.
+         */
+        const ruleset &rules() const {
+            return installed;
+        }
+};
+
+inline ruleset_stats ruleset_installer::apply(ruleset &wanted) {
+    ruleset_stats stats;
+    ruleset_delta delta;
+    std::vector<ruleset_rule> rules;
+    bool full = !known;
+    if (known) {
+        delta = ruleset_diff(installed, wanted);
+        stats.unchanged = delta.unchanged;
+    }
+    // Installed rules are unknown if any step changing the target fails
+    for (size_t pos = 0; !full && pos < delta.remove.size(); ) {
+        pos = decode(delta.remove, pos, rules);
+        bool first = pos == rules.size();
+        known = false;
+        if (!target.remove(rules)) {
+            if (!first)
+                throw std::runtime_error("ruleset target stopped removing rules");
+            // Nothing was removed yet
+            known = true;
+            full = true;
+        }
+    }
+    if (full) {
+        delta.insert.clear();
+        for (ruleset::rule_map::const_iterator it = wanted.rules().begin(); it != wanted.rules().end(); ++it)
+            delta.insert.push_back(&*it);
+        target.clear();
+        stats = ruleset_stats();
+        stats.full = true;
+    } else {
+        stats.removed = delta.remove.size();
+    }
+    known = false;
+    for (size_t pos = 0; pos < delta.insert.size(); ) {
+        pos = decode(delta.insert, pos, rules);
+        target.insert(rules);
+    }
+    target.commit();
+    stats.inserted = delta.insert.size();
+    installed.swap(wanted);
+    known = true;
+    return stats;
+}
+
+#endif
@@ -26,7 +26,14 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 extern const char *__progname; //!< Name of application executable.
 
@@ -39,8 +46,52 @@ class arguments {
 
         static const char *ARGUMENTS; //!< Supported options.
 
+        /**
+         * \brief Parse suboptions of report suppression.
+         * @param opts Text of the suboptions
+         */
+        void parse_suppress(char *opts);
+
+        /**
+         * \brief Parse suboptions of hop histograms.
+         * @param opts Text of the suboptions
+         */
+        void parse_histograms(char *opts);
+
+        /**
+         * \brief Parse suboptions of PACKET_MMAP TX ring.
+         * @param opts Text of the suboptions
+         */
+        void parse_tx_ring(char *opts);
+
+        /**
+         * \brief Parse suboptions of idle backoff.
+         * @param opts Text of the suboptions
+         */
+        void parse_idle(char *opts);
+
+        /**
+         * \brief Parse suboptions of collector health checks.
+         * @param opts Text of the suboptions
+         */
+        void parse_health(char *opts);
+
+        /**
+         * \brief Parse list of collectors given to option 't'.
+         * @param list Text of the list, ip[:port] separated by commas
+         */
+        void parse_collectors(const char *list);
+
     public:
 
+        /**
+         * \brief Parse list of numbers and ranges (e.g. "0-3,6").
+         * @param list   Text of the list
+         * @param option Option the list was given to
+         * @return Parsed numbers
+         */
+        static std::vector<int> parse_list(const char *list, char option);
+
         /**
          * \brief Basic constructor, process command line arguments given to application main function.
          * @param argc Number of arguments.
@@ -53,16 +104,267 @@ class arguments {
          */
         static inline void usage();
 
+        /**
+         * \brief Check whether Netcope P4 inputs come from the card, not from replay or software parser.
+         */
+        bool card() const {
+            return replay == NULL && packets == NULL && packet_if == NULL;
+        }
+
         int card_id;  //!< Card to use.
-        int rx_queue; //!< RX queue to use for metadata.
+        std::vector<int> rx_queues; //!< RX queues to use for metadata.
+        std::vector<int> cpus;      //!< CPU cores for workers of RX queues.
         bool help;    //!< Display of help (usage) message requested.
-        char *ip;     //!< Target IPv4 address for Telemetry reports.
-        int port;     //!< Target UDP port for Telemetry reports.
+        char *ip;     //!< Target IPv4 addresses for Telemetry reports as given.
+        int port;     //!< Target UDP port for Telemetry reports, default of collectors without port.
+        std::vector<struct sockaddr_in> collectors; //!< Collectors of Telemetry reports.
+        bool key_switch;              //!< Spread reports over collectors by switch ID instead of flow.
+        unsigned health_interval;     //!< Time between probes of collectors (milliseconds, 0 = no probes).
+        unsigned health_down;         //!< Failed probes in a row removing collector.
+        unsigned health_up;           //!< Clean probes in a row adding collector back.
         bool original;//!< Keep original packets, don't remove INT on output.
         bool verbose; //!< Verbose mode.
+        unsigned batch;    //!< Number of Telemetry reports sent at once.
+        unsigned flush_us; //!< Maximal delay of batched Telemetry report (microseconds).
+        unsigned pack_mtu; //!< Maximal length of datagram with packed Telemetry reports (0 = no packing).
+        char *tx_ring_if;             //!< Interface of PACKET_MMAP TX ring for reports (NULL = raw socket).
+        unsigned char tx_ring_dst[6]; //!< Destination MAC address of reports sent through TX ring.
+        unsigned tx_ring_frames;      //!< Frames in TX ring of each sending thread.
+        char *replay;      //!< Capture of Netcope P4 inputs to replay instead of card.
+        unsigned rate;     //!< Replay rate in records per second (0 = full speed).
+        unsigned loops;    //!< Passes over replayed capture (0 = endless).
+        char *packets;     //!< Capture of raw INT packets parsed in software instead of card.
+        char *packet_if;   //!< Interface of raw INT packets parsed in software instead of card.
+        bool suppress;                //!< Send only reports of changed flows.
+        unsigned suppress_latency;    //!< Hop latency change that triggers report.
+        unsigned suppress_occupancy;  //!< Queue occupancy change that triggers report.
+        unsigned suppress_refresh;    //!< Report every flow at least this often (milliseconds).
+        unsigned suppress_flows;      //!< Flows tracked by each worker.
+        unsigned suppress_age;        //!< Forget flows not seen for this long (milliseconds).
+        bool histograms;              //!< Keep hop latency and queue occupancy histograms.
+        unsigned hist_interval;       //!< Time between histogram snapshots (seconds).
+        unsigned hist_ports;          //!< Switch ports tracked by each worker.
+        char *hist_file;              //!< Output of histogram snapshots (NULL = standard output).
+        unsigned ring_size;           //!< Records in ring to TX stage (0 = no TX stage).
+        bool ring_drop;               //!< Drop records on full ring instead of waiting.
+        char *trace_file;             //!< Binary trace of records (NULL = none).
+        char *metrics;                //!< TCP port or Unix socket path of statistics server (NULL = none).
+        char *rules;                  //!< NP4 ruleset 2.0 file to load instead of built-in rules (NULL = built-in).
+        bool reset;                   //!< Card core may be reset to remove rules.
+        bool compact;                 //!< Netcope P4 inputs are compact variable-length records.
+        unsigned burst;               //!< Netcope P4 inputs read at once.
+        bool idle_busy;               //!< Spin endlessly without inputs, no backoff.
+        unsigned idle_spin;           //!< Idle polls spinning.
+        unsigned idle_pause;          //!< Idle polls spinning with CPU pause then.
+        unsigned idle_sleep_us;       //!< Length of short sleep (microseconds).
+        unsigned idle_block_us;       //!< Time of short sleeps before waits for input (microseconds).
+        unsigned idle_wait_us;        //!< Longest wait for input (microseconds).
 };
 
-const char *arguments::ARGUMENTS = "d:r:t:p:hvo";
+const char *arguments::ARGUMENTS = "d:r:c:t:p:b:l:M:X:f:P:i:R:n:s:H:q:DT:m:L:B:I:k:E:hvoCZ";
+
+std::vector<int> arguments::parse_list(const char *list, char option) {
+    std::vector<int> values;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            throw std::runtime_error(std::string() + "invalid list for option '" + option + "'");
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first)
+                throw std::runtime_error(std::string() + "invalid range for option '" + option + "'");
+            p = end;
+        }
+        for (long v = first; v <= last; v++)
+            values.push_back(v);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            throw std::runtime_error(std::string() + "invalid list for option '" + option + "'");
+    }
+    return values;
+}
+
+void arguments::parse_suppress(char *opts) {
+    enum { LAT, OCC, REFRESH, FLOWS, AGE, DEFAULTS };
+    static char lat[] = "lat", occ[] = "occ", refresh[] = "refresh", flows[] = "flows", age[] = "age", defaults[] = "defaults";
+    char *const tokens[] = { lat, occ, refresh, flows, age, defaults, NULL };
+    char *value;
+    suppress = true;
+    while (*opts) {
+        int token = getsubopt(&opts, tokens, &value);
+        if (token != DEFAULTS && (token < 0 || value == NULL))
+            throw std::runtime_error("invalid suboption for option 's'");
+        switch (token) {
+            case LAT:
+                suppress_latency = atoi(value);
+                break;
+            case OCC:
+                suppress_occupancy = atoi(value);
+                break;
+            case REFRESH:
+                suppress_refresh = atoi(value);
+                break;
+            case FLOWS:
+                suppress_flows = atoi(value);
+                break;
+            case AGE:
+                suppress_age = atoi(value);
+                break;
+        }
+    }
+}
+
+void arguments::parse_histograms(char *opts) {
+    enum { INTERVAL, PORTS, OUTPUT, DEFAULTS };
+    static char interval[] = "interval", ports[] = "ports", file[] = "file", defaults[] = "defaults";
+    char *const tokens[] = { interval, ports, file, defaults, NULL };
+    char *value;
+    histograms = true;
+    while (*opts) {
+        int token = getsubopt(&opts, tokens, &value);
+        if (token != DEFAULTS && (token < 0 || value == NULL))
+            throw std::runtime_error("invalid suboption for option 'H'");
+        switch (token) {
+            case INTERVAL:
+                hist_interval = atoi(value);
+                break;
+            case PORTS:
+                hist_ports = atoi(value);
+                break;
+            case OUTPUT:
+                hist_file = value;
+                break;
+        }
+    }
+    if (hist_interval == 0 || hist_ports == 0)
+        throw std::runtime_error("invalid suboption for option 'H'");
+}
+
+void arguments::parse_tx_ring(char *opts) {
+    enum { INTERFACE, DESTINATION, FRAMES };
+    static char interface[] = "if", destination[] = "dst", frames[] = "frames";
+    char *const tokens[] = { interface, destination, frames, NULL };
+    char *value;
+    while (*opts) {
+        int token = getsubopt(&opts, tokens, &value);
+        if (token < 0 || value == NULL)
+            throw std::runtime_error("invalid suboption for option 'X'");
+        switch (token) {
+            case INTERFACE:
+                tx_ring_if = value;
+                break;
+            case DESTINATION: {
+                unsigned mac[6];
+                char end;
+                if (sscanf(value, "%x:%x:%x:%x:%x:%x%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &end) != 6)
+                    throw std::runtime_error("invalid MAC address for option 'X'");
+                for (unsigned i = 0; i < 6; i++)
+                    tx_ring_dst[i] = mac[i];
+                break;
+            }
+            case FRAMES:
+                tx_ring_frames = atoi(value);
+                break;
+        }
+    }
+    if (tx_ring_if == NULL || tx_ring_frames == 0)
+        throw std::runtime_error("invalid suboption for option 'X'");
+}
+
+void arguments::parse_idle(char *opts) {
+    enum { BUSY, SPIN, PAUSE, SLEEP, BLOCK, WAIT };
+    static char busy[] = "busy", spin[] = "spin", pause[] = "pause", sleep[] = "sleep", block[] = "block", wait[] = "wait";
+    char *const tokens[] = { busy, spin, pause, sleep, block, wait, NULL };
+    char *value;
+    while (*opts) {
+        int token = getsubopt(&opts, tokens, &value);
+        if (token != BUSY && (token < 0 || value == NULL))
+            throw std::runtime_error("invalid suboption for option 'I'");
+        switch (token) {
+            case BUSY:
+                idle_busy = true;
+                break;
+            case SPIN:
+                idle_spin = atoi(value);
+                break;
+            case PAUSE:
+                idle_pause = atoi(value);
+                break;
+            case SLEEP:
+                idle_sleep_us = atoi(value);
+                break;
+            case BLOCK:
+                idle_block_us = atoi(value);
+                break;
+            case WAIT:
+                idle_wait_us = atoi(value);
+                break;
+        }
+    }
+    if (idle_sleep_us == 0 || idle_wait_us == 0)
+        throw std::runtime_error("invalid suboption for option 'I'");
+}
+
+void arguments::parse_health(char *opts) {
+    enum { INTERVAL, DOWN, UP, OFF };
+    static char interval[] = "interval", down[] = "down", up[] = "up", off[] = "off";
+    char *const tokens[] = { interval, down, up, off, NULL };
+    char *value;
+    while (*opts) {
+        int token = getsubopt(&opts, tokens, &value);
+        if (token != OFF && (token < 0 || value == NULL))
+            throw std::runtime_error("invalid suboption for option 'E'");
+        switch (token) {
+            case INTERVAL:
+                health_interval = atoi(value);
+                break;
+            case DOWN:
+                health_down = atoi(value);
+                break;
+            case UP:
+                health_up = atoi(value);
+                break;
+            case OFF:
+                health_interval = 0;
+                break;
+        }
+    }
+    if (health_down == 0 || health_up == 0)
+        throw std::runtime_error("invalid suboption for option 'E'");
+}
+
+void arguments::parse_collectors(const char *list) {
+    std::string text(list);
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(start, end - start);
+        size_t colon = item.find(':');
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        int target_port = port;
+        if (colon != std::string::npos) {
+            char *rest;
+            target_port = strtol(item.c_str() + colon + 1, &rest, 10);
+            if (*rest || colon + 1 == item.size())
+                target_port = -1;
+            item.resize(colon);
+        }
+        if (inet_aton(item.c_str(), &addr.sin_addr) == 0 || target_port <= 0 || target_port > 65535)
+            throw std::runtime_error("invalid collector for option 't'");
+        addr.sin_port = htons(target_port);
+        collectors.push_back(addr);
+        start = end + 1;
+    }
+}
 
 inline void arguments::usage() {
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
@@ -70,32 +372,128 @@ inline void arguments::usage() {
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
     std::cout << "-                                                                              -" << std::endl;
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
-    std::cout << "Usage: np4_int [-hvo] [-d card] -r queue -t ip [-p port]" << std::endl;
+    std::cout << "Usage: np4_int [-hvoC] [-d card] -r queue [-c cpus] -t ip[,ip...] [-p port] [-k key] [-E opts] [-b batch] [-l usec] [-M mtu] [-X opts] [-f file [-R rate] [-n loops]] [-P file [-n loops]] [-i iface] [-s opts] [-H opts] [-q size [-D]] [-T file] [-m addr] [-L file [-Z]] [-B burst] [-I opts]" << std::endl;
     std::cout << "  -d card  Card to use (default: 0)" << std::endl;
-    std::cout << "  -r queue RX queue to use for metadata" << std::endl;
-    std::cout << "  -t ip    Target IPv4 address for Telemetry reports" << std::endl;
+    std::cout << "  -r queue RX queues to use for metadata, list or range (e.g. 0-3,6)" << std::endl;
+    std::cout << "  -c cpus  CPU cores for workers of RX queues, then for TX stages (default: 0,1,...)" << std::endl;
+    std::cout << "  -t ip    Target IPv4 address for Telemetry reports, or comma separated list of" << std::endl;
+    std::cout << "           collectors ip[:port] sharing the reports, each flow goes to one of them" << std::endl;
     std::cout << "  -p port  Target UDP port for Telemetry reports (default: 32766)" << std::endl;
+    std::cout << "  -k key   Spread reports over collectors by flow (5-tuple) or switch (ID of" << std::endl;
+    std::cout << "           the last hop) (default: flow)" << std::endl;
+    std::cout << "  -E opts  Health checks of more collectors by empty UDP datagrams, comma separated" << std::endl;
+    std::cout << "           suboptions:" << std::endl;
+    std::cout << "             interval=ms Time between probes (default: 1000)" << std::endl;
+    std::cout << "             down=N      Failed probes in a row removing collector (default: 2)" << std::endl;
+    std::cout << "             up=N        Clean probes in a row adding collector back (default: 3)" << std::endl;
+    std::cout << "             off         No health checks, all collectors always take reports" << std::endl;
+    std::cout << "  -b batch Number of Telemetry reports sent at once (default: 1)" << std::endl;
+    std::cout << "  -l usec  Maximal delay of batched Telemetry report (default: 1000)" << std::endl;
+    std::cout << "  -M mtu   Pack Telemetry reports into datagrams of up to mtu bytes (at least 1151, at most route MTU)" << std::endl;
+    std::cout << "  -X opts  Send reports through PACKET_MMAP TX ring of interface instead of raw socket," << std::endl;
+    std::cout << "           falls back to raw socket if the ring is not available, comma separated suboptions:" << std::endl;
+    std::cout << "             if=name    Interface to send reports through (required)" << std::endl;
+    std::cout << "             dst=mac    Destination MAC address, next hop or collector (default: broadcast)" << std::endl;
+    std::cout << "             frames=N   Frames in TX ring of each sending thread (default: 1024)" << std::endl;
+    std::cout << "  -f file  Replay capture of Netcope P4 records (raw or pcap) instead of card" << std::endl;
+    std::cout << "  -P file  Parse raw INT packets of Ethernet pcap capture in software instead of card" << std::endl;
+    std::cout << "  -i iface Parse raw INT packets of interface (AF_PACKET) in software instead of card" << std::endl;
+    std::cout << "  -R rate  Replay rate in records per second per queue (default: full speed)" << std::endl;
+    std::cout << "  -n loops Passes over replayed capture, 0 for endless (default: 1)" << std::endl;
+    std::cout << "  -s opts  Send reports only on change of flow, comma separated suboptions:" << std::endl;
+    std::cout << "             lat=N      Hop latency change that triggers report (default: 1000)" << std::endl;
+    std::cout << "             occ=N      Queue occupancy change that triggers report (default: 100)" << std::endl;
+    std::cout << "             refresh=ms Report every flow at least this often (default: 1000)" << std::endl;
+    std::cout << "             flows=N    Flows tracked by each RX queue (default: 1048576)" << std::endl;
+    std::cout << "             age=ms     Forget flows not seen for this long (default: 60000)" << std::endl;
+    std::cout << "             defaults   Use default values" << std::endl;
+    std::cout << "  -H opts  Keep hop latency and queue occupancy histograms per switch and port," << std::endl;
+    std::cout << "           comma separated suboptions:" << std::endl;
+    std::cout << "             interval=s Time between snapshots (default: 10)" << std::endl;
+    std::cout << "             ports=N    Switch ports tracked by each RX queue (default: 1024)" << std::endl;
+    std::cout << "             file=path  Append snapshots to file (default: standard output)" << std::endl;
+    std::cout << "             defaults   Use default values" << std::endl;
+    std::cout << "  -q size  Send reports from separate TX stage fed by ring of size records" << std::endl;
+    std::cout << "  -D       Drop records when ring to TX stage is full instead of waiting" << std::endl;
+    std::cout << "  -T file  Write binary trace of records to file, read by np4_int_trace" << std::endl;
+    std::cout << "  -m addr  Serve statistics in Prometheus text format on TCP port (HTTP) or Unix socket path" << std::endl;
+    std::cout << "  -L file  Load NP4 ruleset 2.0 file instead of built-in rules, applied again" << std::endl;
+    std::cout << "           (only the changed rules) on SIGHUP" << std::endl;
+    std::cout << "  -Z       Reset the card core: clear rules of a previous run at start, and let reload" << std::endl;
+    std::cout << "           remove or change rules (traffic is dropped while the core is reloaded)" << std::endl;
+    std::cout << "  -B burst Netcope P4 records read at once, at most 64 (default: 32)" << std::endl;
+    std::cout << "  -I opts  Back off when there are no records, comma separated suboptions:" << std::endl;
+    std::cout << "             busy       Spin endlessly, lowest latency at full CPU load" << std::endl;
+    std::cout << "             spin=N     Idle polls spinning (default: 128)" << std::endl;
+    std::cout << "             pause=N    Idle polls spinning with CPU pause then (default: 1024)" << std::endl;
+    std::cout << "             sleep=us   Length of short sleeps then (default: 20)" << std::endl;
+    std::cout << "             block=us   Time of short sleeps before waiting for records (default: 1000)" << std::endl;
+    std::cout << "             wait=us    Longest wait, latency of first record after a pause, also" << std::endl;
+    std::cout << "                        bounded by -l (default: 1000)" << std::endl;
+    std::cout << "  -C       Receive compact records of variable length (only present hops and instructions)" << std::endl;
+    std::cout << "           instead of 256-byte records, needs card or pcap replay" << std::endl;
     std::cout << "  -o       Keep original packets, don't remove INT on output" << std::endl;
     std::cout << "  -h       Writes out help" << std::endl;
-    std::cout << "  -v       Verbose mode" << std::endl;
+    std::cout << "  -v       Verbose mode, records are traced and written out in background" << std::endl;
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
 }
 
 arguments::arguments(int argc, char * const argv[]) :
     card_id(0),
-    rx_queue(-1),
     help(false),
     ip(NULL),
     port(32766),
+    key_switch(false),
+    health_interval(1000),
+    health_down(2),
+    health_up(3),
     original(false),
-    verbose(false)
+    verbose(false),
+    batch(1),
+    flush_us(1000),
+    pack_mtu(0),
+    tx_ring_if(NULL),
+    tx_ring_dst{ 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF },
+    tx_ring_frames(1024),
+    replay(NULL),
+    rate(0),
+    loops(1),
+    packets(NULL),
+    packet_if(NULL),
+    suppress(false),
+    suppress_latency(1000),
+    suppress_occupancy(100),
+    suppress_refresh(1000),
+    suppress_flows(1048576),
+    suppress_age(60000),
+    histograms(false),
+    hist_interval(10),
+    hist_ports(1024),
+    hist_file(NULL),
+    ring_size(0),
+    ring_drop(false),
+    trace_file(NULL),
+    metrics(NULL),
+    rules(NULL),
+    reset(false),
+    compact(false),
+    burst(32),
+    idle_busy(false),
+    idle_spin(128),
+    idle_pause(1024),
+    idle_sleep_us(20),
+    idle_block_us(1000),
+    idle_wait_us(1000)
     {
     int c;
     opterr = 0; // silent getopt
     while((c = getopt(argc, argv, ARGUMENTS)) != -1)
         switch(c) {
             case 'r':
-                rx_queue = atoi(optarg);
+                rx_queues = parse_list(optarg, 'r');
+                break;
+            case 'c':
+                cpus = parse_list(optarg, 'c');
                 break;
             case 'h':
                 help = true;
@@ -109,12 +507,83 @@ arguments::arguments(int argc, char * const argv[]) :
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'l':
+                flush_us = atoi(optarg);
+                break;
+            case 'M':
+                pack_mtu = atoi(optarg);
+                break;
+            case 'X':
+                parse_tx_ring(optarg);
+                break;
+            case 'f':
+                replay = optarg;
+                break;
+            case 'P':
+                packets = optarg;
+                break;
+            case 'i':
+                packet_if = optarg;
+                break;
+            case 'R':
+                rate = atoi(optarg);
+                break;
+            case 'n':
+                loops = atoi(optarg);
+                break;
+            case 's':
+                parse_suppress(optarg);
+                break;
+            case 'H':
+                parse_histograms(optarg);
+                break;
+            case 'q':
+                ring_size = atoi(optarg);
+                break;
+            case 'D':
+                ring_drop = true;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'm':
+                metrics = optarg;
+                break;
+            case 'L':
+                rules = optarg;
+                break;
+            case 'Z':
+                reset = true;
+                break;
             case 'v':
                 verbose = true;
                 break;
             case 'o':
                 original = true;
                 break;
+            case 'C':
+                compact = true;
+                break;
+            case 'k':
+                if (strcmp(optarg, "switch") == 0)
+                    key_switch = true;
+                else if (strcmp(optarg, "flow") == 0)
+                    key_switch = false;
+                else
+                    throw std::runtime_error("invalid key for option 'k'");
+                break;
+            case 'E':
+                parse_health(optarg);
+                break;
+            case 'B':
+                burst = atoi(optarg);
+                break;
+            case 'I':
+                parse_idle(optarg);
+                break;
             case '?':
                 throw std::runtime_error(std::string() + "unknown option '" + (char)optopt + "'");
             case ':':
@@ -122,10 +591,19 @@ arguments::arguments(int argc, char * const argv[]) :
             default:
                 throw std::runtime_error(std::string() + "option '" + (char)optopt + "'not implemented");
         }
+    if ((replay != NULL) + (packets != NULL) + (packet_if != NULL) > 1)
+        throw std::runtime_error("options 'f', 'P' and 'i' are mutually exclusive");
+    if (compact && (packets != NULL || packet_if != NULL))
+        throw std::runtime_error("option 'C' needs card or replay");
+    // Replay and software parsing run single queue unless more are requested
+    if(!card() && rx_queues.empty())
+        rx_queues.push_back(0);
     argc -= optind;
     argv += optind;
-    if(argc != 0 || rx_queue < 0 || ip == NULL)
+    if(argc != 0 || rx_queues.empty() || ip == NULL || batch == 0 || burst == 0 || burst > 64)
         throw std::runtime_error("stray arguments");
+    // Ports of collectors default to option 'p' wherever it was given
+    parse_collectors(ip);
 }
 
 #endif
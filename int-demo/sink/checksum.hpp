@@ -0,0 +1,230 @@
+/*
+ * checksum.hpp: Internet checksum of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_CHECKSUM
+#define __HEADER_FILE_CHECKSUM
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+/*
+ * One's complement sum does not depend on byte order (RFC 1071), so all
+ * sums are kept over 16-bit words as they lie in memory and the folded,
+ * complemented result is stored back as is. Partial sums are 32-bit with
+ * end-around carry; they are folded to 16 bits only at the end.
+ */
+
+//! Shortest buffer summed by vector code.
+#define CHECKSUM_SIMD_MIN_LEN 64
+
+/**
+ * \brief Add two partial sums.
+ */
+inline uint32_t csum_add(uint32_t sum, uint32_t addend) {
+    sum += addend;
+    return sum + (sum < addend);
+}
+
+/**
+ * \brief Fold partial sum to 16 bits (not complemented).
+ */
+inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+/**
+ * \brief Add partial sum of block placed at the given offset of the summed data.
+ *
+ * Sum of block at odd offset has its bytes swapped.
+ */
+inline uint32_t csum_block_add(uint32_t sum, uint32_t block, size_t offset) {
+    if (offset & 1) {
+        block = csum_fold(block);
+        block = ((block & 0xFF) << 8) | (block >> 8);
+    }
+    return csum_add(sum, block);
+}
+
+/**
+ * \brief Fold 64-bit accumulator to partial sum.
+ */
+inline uint32_t csum_fold64(uint64_t acc) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return acc;
+}
+
+/**
+ * \brief Partial sum of buffer, scalar version.
+ * @param data Buffer, any alignment
+ * @param len  Length of buffer
+ * @param sum  Partial sum to add to
+ */
+inline uint32_t csum_partial_scalar(const void *data, size_t len, uint32_t sum) {
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t acc = sum;
+    // Whole 32-bit words, a 64-bit accumulator defers all carries
+    for (; len >= 4; len -= 4, p += 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        acc += word;
+    }
+    if (len >= 2) {
+        uint16_t word;
+        memcpy(&word, p, 2);
+        acc += word;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        // Last odd byte is the first byte of a zero-padded word
+        uint16_t word = 0;
+        memcpy(&word, p, 1);
+        acc += word;
+    }
+    return csum_fold64(acc);
+}
+
+#ifdef CHECKSUM_X86
+
+/**
+ * \brief Partial sum of buffer, SSE2 version.
+ */
+__attribute__((target("sse2")))
+inline uint32_t csum_partial_sse2(const void *data, size_t len, uint32_t sum) {
+    const unsigned char *p = (const unsigned char *) data;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    // 32-bit words are widened to 64-bit lanes, so no carry is lost
+    for (; len >= 16; len -= 16, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sum = csum_add(sum, csum_fold64(lanes[0]));
+    sum = csum_add(sum, csum_fold64(lanes[1]));
+    return csum_partial_scalar(p, len, sum);
+}
+
+/**
+ * \brief Partial sum of buffer, AVX2 version.
+ */
+__attribute__((target("avx2")))
+inline uint32_t csum_partial_avx2(const void *data, size_t len, uint32_t sum) {
+    const unsigned char *p = (const unsigned char *) data;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; len >= 32; len -= 32, p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    for (unsigned i = 0; i < 4; i++)
+        sum = csum_add(sum, csum_fold64(lanes[i]));
+    return csum_partial_scalar(p, len, sum);
+}
+
+#endif
+
+typedef uint32_t (*csum_partial_t)(const void *, size_t, uint32_t);
+
+/**
+ * \brief Choose implementation of partial sum.
+ * @param name Name of the implementation ("scalar", "sse2", "avx2"), NULL for the best one the CPU supports
+ * @return Implementation, NULL if the named one is not available
+ */
+inline csum_partial_t csum_partial_select(const char *name = NULL) {
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        return &csum_partial_avx2;
+    if ((name == NULL || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2"))
+        return &csum_partial_sse2;
+#endif
+    if (name == NULL || strcmp(name, "scalar") == 0)
+        return &csum_partial_scalar;
+    return NULL;
+}
+
+/**
+ * \brief Partial sum of buffer, vector code for longer buffers.
+ * @param data Buffer, any alignment
+ * @param len  Length of buffer
+ * @param sum  Partial sum to add to
+ */
+inline uint32_t csum_partial(const void *data, size_t len, uint32_t sum = 0) {
+    if (len < CHECKSUM_SIMD_MIN_LEN)
+        return csum_partial_scalar(data, len, sum);
+    static const csum_partial_t impl = csum_partial_select();
+    return impl(data, len, sum);
+}
+
+/**
+ * \brief Internet checksum of buffer.
+ * @param data Buffer, e.g. IP header with zero checksum field
+ * @param len  Length of buffer
+ * @return Checksum to be stored as is
+ */
+inline uint16_t ip_checksum(const void *data, size_t len) {
+    return ~csum_fold(csum_partial(data, len));
+}
+
+/**
+ * \brief Incremental update of checksum (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).
+ * @param check   Checksum before the change
+ * @param old_sum Partial sum of changed fields before the change
+ * @param new_sum Partial sum of changed fields after the change
+ * @return Checksum after the change
+ */
+inline uint16_t csum_update(uint16_t check, uint32_t old_sum, uint32_t new_sum) {
+    uint32_t sum = (uint16_t) ~check;
+    sum = csum_add(sum, ~old_sum);
+    sum = csum_add(sum, new_sum);
+    return ~csum_fold(sum);
+}
+
+/**
+ * \brief Incremental update of checksum for change of one 16-bit field.
+ */
+inline uint16_t csum_replace2(uint16_t check, uint16_t old_value, uint16_t new_value) {
+    return csum_update(check, old_value, new_value);
+}
+
+/**
+ * \brief Incremental update of checksum for change of one 32-bit field.
+ */
+inline uint16_t csum_replace4(uint16_t check, uint32_t old_value, uint32_t new_value) {
+    return csum_update(check, csum_fold(old_value), csum_fold(new_value));
+}
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * collector_set.hpp: Consistent-hash fan-out of Telemetry reports across collectors with health checks.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_COLLECTOR_SET
+#define __HEADER_FILE_COLLECTOR_SET
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "np4_int_header.hpp"
+#include "flow_table.hpp"
+
+#define COLLECTOR_BUCKET_BITS 12                          //!< Bits of report key choosing bucket.
+#define COLLECTOR_BUCKETS     (1 << COLLECTOR_BUCKET_BITS) //!< Buckets of report keys spread over collectors.
+#define COLLECTOR_MAX         256                         //!< Most collectors.
+
+/**
+ * \brief Mix 64-bit value into hash (finalizer of MurmurHash3).
+ */
+static inline uint64_t collector_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * \brief Key choosing collector of Telemetry report.
+ * @param hdr       Netcope INT header with valid INT
+ * @param by_switch Key by switch ID of the last hop before the sink instead of flow 5-tuple
+ * @return 64-bit hash, flow hash if there is no hop with switch ID
+ */
+inline uint64_t collector_key(const np4_int_header_t *hdr, bool by_switch) {
+    if (by_switch && (hdr->int_hop_vld & 1) && (hdr->int_insmap & (INT_INS_SWITCH_ID << 8)))
+        return collector_mix(0x9E3779B97F4A7C15ULL ^ hdr->int_hop[0].swid);
+    return flow_hash(hdr);
+}
+
+/**
+ * \brief Collectors of Telemetry reports and their health, shared by all sending threads.
+ *
+ * Health of every collector is probed by a background thread through a
+ * connected UDP socket: an empty datagram is sent to the collector every
+ * interval, and ICMP unreachable returned for it (seen as pending socket
+ * error at the next probe) counts as failed probe. A collector is removed
+ * after the given number of failed probes in a row and added back after
+ * the given number of clean probes in a row. Every change bumps the
+ * generation, senders then rebuild their collector_map.
+ */
+class collector_health {
+
+    private:
+
+        collector_health(const collector_health &);
+        collector_health &operator=(const collector_health &);
+
+        std::vector<struct sockaddr_in> collectors; //!< Collectors.
+        std::unique_ptr<std::atomic<bool>[]> up_;   //!< Collector takes reports.
+        std::unique_ptr<std::atomic<uint64_t>[]> reports_; //!< Reports sent to each collector.
+        std::atomic<unsigned> generation_;          //!< Number of health changes.
+        std::vector<int> probes;                    //!< Connected UDP sockets probing collectors.
+        unsigned interval_ms;                       //!< Time between probes.
+        unsigned down_after;                        //!< Failed probes in a row removing collector.
+        unsigned up_after;                          //!< Clean probes in a row adding collector back.
+        std::atomic<bool> running;                  //!< Probing thread keeps probing.
+        std::thread prober;                         //!< Probing thread.
+
+        void probe();
+
+        void close_probes() {
+            for (size_t i = 0; i < probes.size(); i++)
+                if (probes[i] != -1)
+                    close(probes[i]);
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor, start probing unless disabled.
+         * @param collectors  Collectors of Telemetry reports
+         * @param interval_ms Time between probes (0 = no health checks, all collectors always take reports)
+         * @param down_after  Failed probes in a row removing collector
+         * @param up_after    Clean probes in a row adding collector back
+         */
+        collector_health(const std::vector<struct sockaddr_in> &collectors, unsigned interval_ms, unsigned down_after,
+                         unsigned up_after);
+
+        ~collector_health() {
+            running = false;
+            if (prober.joinable())
+                prober.join();
+            close_probes();
+        }
+
+        /**
+         * \brief Number of collectors.
+         */
+        unsigned size() const {
+            return collectors.size();
+        }
+
+        /**
+         * \brief Address of collector.
+         * @param i Index of the collector
+         */
+        const struct sockaddr_in &address(unsigned i) const {
+            return collectors[i];
+        }
+
+        /**
+         * \brief Text form of collector address.
+         * @param i Index of the collector
+         */
+        std::string name(unsigned i) const {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &collectors[i].sin_addr, ip, sizeof(ip));
+            return std::string(ip) + ":" + std::to_string(ntohs(collectors[i].sin_port));
+        }
+
+        /**
+         * \brief Check whether collector takes reports.
+         * @param i Index of the collector
+         */
+        bool up(unsigned i) const {
+            return up_[i].load(std::memory_order_relaxed);
+        }
+
+        /**
+         * \brief Number of health changes so far, cheap to poll.
+         */
+        unsigned generation() const {
+            return generation_.load(std::memory_order_acquire);
+        }
+
+        /**
+         * \brief Add reports sent to collector by one thread.
+         * @param i Index of the collector
+         * @param n Number of reports
+         */
+        void account(unsigned i, uint64_t n) {
+            reports_[i].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        /**
+         * \brief Reports sent to collector by all threads that finished.
+         * @param i Index of the collector
+         */
+        uint64_t reports(unsigned i) const {
+            return reports_[i].load(std::memory_order_relaxed);
+        }
+};
+
+inline collector_health::collector_health(const std::vector<struct sockaddr_in> &collectors, unsigned interval_ms,
+                                          unsigned down_after, unsigned up_after) :
+    collectors(collectors),
+    up_(new std::atomic<bool>[collectors.size()]),
+    reports_(new std::atomic<uint64_t>[collectors.size()]),
+    generation_(0),
+    interval_ms(interval_ms),
+    down_after(down_after ? down_after : 1),
+    up_after(up_after ? up_after : 1),
+    running(true)
+    {
+    if (collectors.empty() || collectors.size() > COLLECTOR_MAX)
+        throw std::runtime_error("invalid number of collectors");
+    for (size_t i = 0; i < collectors.size(); i++) {
+        up_[i] = true;
+        reports_[i] = 0;
+    }
+    if (interval_ms == 0)
+        return;
+    try {
+        for (size_t i = 0; i < collectors.size(); i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            probes.push_back(fd);
+            if (fd == -1 || connect(fd, (const struct sockaddr *) &collectors[i], sizeof(collectors[i])) == -1)
+                throw std::runtime_error("unable to open probe of collector " + name(i) + ": " + strerror(errno));
+        }
+        prober = std::thread(&collector_health::probe, this);
+    } catch (...) {
+        close_probes();
+        throw;
+    }
+}
+
+inline void collector_health::probe() {
+    std::vector<unsigned> streak(collectors.size(), 0); // Probes in a row contradicting current state
+    bool sent = false;
+    while (running) {
+        for (size_t i = 0; i < collectors.size(); i++) {
+            // Error pending since the previous probe means it came back unreachable
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(probes[i], SOL_SOCKET, SO_ERROR, &err, &len);
+            if (send(probes[i], NULL, 0, MSG_DONTWAIT) == -1 && err == 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                err = errno;
+            if (!sent)
+                continue;
+            bool ok = err == 0;
+            if (ok == up(i)) {
+                streak[i] = 0;
+                continue;
+            }
+            if (++streak[i] < (ok ? up_after : down_after))
+                continue;
+            streak[i] = 0;
+            up_[i].store(ok, std::memory_order_relaxed);
+            generation_.fetch_add(1, std::memory_order_release);
+            std::cerr << "Collector " + name(i) + (ok ? " is back" : std::string(" is down (") + strerror(err) + ")") + "\n";
+        }
+        sent = true;
+        // Sleep in short steps to notice the end of processing
+        for (unsigned slept = 0; slept < interval_ms && running; slept += 100)
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(100u, interval_ms - slept)));
+    }
+}
+
+/**
+ * \brief Mapping of report keys to collectors, one for every sending thread.
+ *
+ * Keys fall into COLLECTOR_BUCKETS buckets, every bucket goes to the
+ * collector taking reports with the highest weight of the bucket
+ * (rendezvous hashing). Weights depend on the collector address, not on
+ * its position in the list, so all threads and restarts agree. When a
+ * collector is removed, only its buckets move; when it comes back, only
+ * the buckets it wins move back. If no collector takes reports, buckets
+ * are spread over all of them.
+ */
+class collector_map {
+
+    private:
+
+        const collector_health &health;    //!< Collectors and their health.
+        std::vector<uint64_t> seeds;       //!< Hash of address of each collector.
+        std::vector<uint8_t> buckets;      //!< Collector of each bucket.
+        unsigned generation;               //!< Generation of health the buckets follow.
+
+        /**
+         * \brief Assign buckets to collectors taking reports.
+         */
+        void rebuild();
+
+    public:
+
+        /**
+         * \brief Basic constructor, assign buckets.
+         * @param health Collectors and their health
+         */
+        explicit collector_map(const collector_health &health);
+
+        /**
+         * \brief Follow health changes, cheap when there is none.
+         * @return True if the buckets were assigned again
+         */
+        inline bool poll() {
+            if (health.generation() == generation)
+                return false;
+            rebuild();
+            return true;
+        }
+
+        /**
+         * \brief Collector of report key.
+         * @param key Hash of the key (collector_key())
+         * @return Index of the collector
+         */
+        inline unsigned lookup(uint64_t key) const {
+            return buckets[key >> (64 - COLLECTOR_BUCKET_BITS)];
+        }
+};
+
+inline collector_map::collector_map(const collector_health &health) :
+    health(health),
+    seeds(health.size()),
+    buckets(COLLECTOR_BUCKETS),
+    generation(0)
+    {
+    for (unsigned i = 0; i < health.size(); i++) {
+        const struct sockaddr_in &addr = health.address(i);
+        seeds[i] = collector_mix(((uint64_t) ntohl(addr.sin_addr.s_addr) << 16 | ntohs(addr.sin_port)) + 1);
+    }
+    rebuild();
+}
+
+inline void collector_map::rebuild() {
+    generation = health.generation();
+    bool any = false;
+    for (unsigned i = 0; i < health.size() && !any; i++)
+        any = health.up(i);
+    for (unsigned b = 0; b < COLLECTOR_BUCKETS; b++) {
+        uint64_t best = 0;
+        unsigned winner = 0;
+        for (unsigned i = 0; i < health.size(); i++) {
+            if (any && !health.up(i))
+                continue;
+            uint64_t weight = collector_mix(seeds[i] ^ b);
+            if (weight >= best) {
+                best = weight;
+                winner = i;
+            }
+        }
+        buckets[b] = winner;
+    }
+}
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * compact_record.hpp: Decoder of compact variable-length Netcope INT records.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_COMPACT_RECORD
+#define __HEADER_FILE_COMPACT_RECORD
+
+#include <cstring>
+#include <stdint.h>
+
+#include "np4_int_header.hpp"
+
+//! Longest compact record: header, IPv6 addresses and INT length of 255 words without shim and INT header.
+#define COMPACT_MAX_LEN (sizeof(np4_int_compact_t) + 32 + 4 * 252)
+
+/**
+ * \brief Decoder of compact Netcope INT records into Netcope INT header.
+ *
+ * The compact record carries only the hops present in the packet and only
+ * the instructions set in the instruction map, typically 40 to 100 bytes
+ * instead of 256. Records are expanded into np4_int_header_t, so the rest
+ * of processing does not change. Hops go to slots 0, 1, 2, ... in the order
+ * of the stack (newest first), every instruction takes one word as INT
+ * defines it. Since the stack is not parsed by the card, the depth is not
+ * limited by the parser; hops beyond NP4_INT_MAX_HOPS slots are counted and
+ * left out.
+ *
+ * The stack is valid when INT length is 4 + ins_cnt * hops with ins_cnt
+ * from 1 to 8 (or 4 with no hops) and the record holds all of it, INT tail
+ * included. Record whose ins_cnt differs from the number of instructions in
+ * the instruction map is malformed, its hops cannot be told apart.
+ */
+class compact_decoder {
+
+    private:
+
+        bool update;  //!< Update L4 protocol and destination port from INT tail as update_L4 actions do.
+
+        static inline uint16_t load16(const unsigned char *p) {
+            return (uint16_t) (p[0] << 8 | p[1]);
+        }
+
+        static inline uint32_t load32(const unsigned char *p) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return __builtin_bswap32(v);
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param update Update L4 protocol and destination port from INT tail as the built-in rules of np4_int do
+         *               (false for np4_int -o)
+         */
+        compact_decoder(bool update = true) :
+            update(update)
+            {
+        }
+
+        /**
+         * \brief Length of compact record of the header.
+         * @param rec Header of the record
+         * @return Length of the record, 0 if the header is not valid
+         */
+        static inline unsigned length(const np4_int_compact_t *rec) {
+            if (rec->version != NP4_COMPACT_VERSION || rec->int_length < 4 || (rec->ip_ver != 4 && rec->ip_ver != 6))
+                return 0;
+            return sizeof(np4_int_compact_t) + (rec->ip_ver == 4 ? 8 : 32) + 4 * (rec->int_length - 3);
+        }
+
+        /**
+         * \brief Expand compact record.
+         * @param data Compact record
+         * @param len  Length of the record
+         * @param hdr  Output Netcope INT header
+         * @param lost Output number of hops left out for lack of slots
+         * @return False if the record is malformed (wrong version, length or instruction count)
+         */
+        inline bool decode(const unsigned char *data, unsigned len, np4_int_header_t *hdr, unsigned *lost) const;
+};
+
+inline bool compact_decoder::decode(const unsigned char *data, unsigned len, np4_int_header_t *hdr,
+                                    unsigned *lost) const {
+    const np4_int_compact_t *rec = (const np4_int_compact_t *) data;
+    *lost = 0;
+    if (len < sizeof(np4_int_compact_t) || length(rec) != len)
+        return false;
+    memset(hdr, 0, sizeof(*hdr));
+    const unsigned char *p = data + sizeof(np4_int_compact_t);
+    hdr->ip_ver = rec->ip_ver;
+    if (rec->ip_ver == 4) {
+        hdr->source_ip[0] = load32(p);
+        hdr->destination_ip[0] = load32(p + 4);
+        p += 8;
+    } else {
+        for (unsigned i = 0; i < 4; i++) {
+            hdr->source_ip[3 - i] = load32(p + 4 * i);
+            hdr->destination_ip[3 - i] = load32(p + 16 + 4 * i);
+        }
+        p += 32;
+    }
+    hdr->l4_proto = rec->l4_proto;
+    hdr->source_port = load16((const unsigned char *) &rec->source_port);
+    hdr->destination_port = load16((const unsigned char *) &rec->destination_port);
+    hdr->int_length = rec->int_length;
+    hdr->int_inscnt = rec->int_inscnt & 0x1F;
+    hdr->int_insmap = load16((const unsigned char *) &rec->int_insmap);
+
+    // Stack of whole hops, every hop has one word of each instruction of the map
+    unsigned ins_cnt = hdr->int_inscnt;
+    unsigned words = rec->int_length - 4;
+    unsigned ins = hdr->int_insmap >> 8;
+    if (ins_cnt != (unsigned) __builtin_popcount(ins))
+        return false;
+    if (words && (ins_cnt == 0 || words % ins_cnt))
+        return true;
+    unsigned hops = words ? words / ins_cnt : 0;
+    for (unsigned k = 0; k < hops && k < NP4_INT_MAX_HOPS; k++) {
+        np4_int_hop_t &hop = hdr->int_hop[k];
+        const unsigned char *w = p + 4 * ins_cnt * k, *end = w + 4 * ins_cnt;
+        for (unsigned bit = 0x80; bit && w < end; bit >>= 1) {
+            if (!(ins & bit))
+                continue;
+            switch (bit) {
+                case INT_INS_SWITCH_ID:
+                    hop.swid = load32(w);
+                    break;
+                case INT_INS_PORT_IDS:
+                    hop.ingressport = load16(w);
+                    hop.egressport = load16(w + 2);
+                    break;
+                case INT_INS_HOP_LATENCY:
+                    hop.hoplatency = load32(w);
+                    break;
+                case INT_INS_Q_OCCUPANCY:
+                    hop.occupancy_queueid = w[0];
+                    hop.occupancy_occupancy = load32(w) & 0xFFFFFF;
+                    break;
+                case INT_INS_INGRESS_TSTAMP:
+                    hop.ingresstimestamp = load32(w);
+                    break;
+                case INT_INS_EGRESS_TSTAMP:
+                    hop.egresstimestamp = load32(w);
+                    break;
+                case INT_INS_Q_CONGESTION:
+                    hop.congestion_queueid = w[0];
+                    hop.congestion_congestion = load32(w) & 0xFFFFFF;
+                    break;
+                default:
+                    hop.egressporttxutilization = load32(w);
+                    break;
+            }
+            w += 4;
+        }
+        hdr->int_hop_vld |= 1 << k;
+    }
+    if (hops > NP4_INT_MAX_HOPS)
+        *lost = hops - NP4_INT_MAX_HOPS;
+
+    hdr->int_vld = 1;
+    if (update) {
+        const unsigned char *tail = p + 4 * words;
+        hdr->l4_proto = tail[0];
+        hdr->destination_port = load16(tail + 1);
+    }
+    return true;
+}
+
+#endif
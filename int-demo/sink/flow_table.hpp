@@ -0,0 +1,248 @@
+/*
+ * flow_table.hpp: Per-flow state for change-triggered Telemetry reports of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_FLOW_TABLE
+#define __HEADER_FILE_FLOW_TABLE
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+#include "np4_int_header.hpp"
+
+#define FLOW_WAYS   8   //!< Entries in one bucket of flow table.
+
+/**
+ * \brief Flow key (5-tuple) as carried by Netcope INT header.
+ */
+struct __attribute__((__packed__)) flow_key {
+    uint32_t   source_ip[4];
+    uint32_t   destination_ip[4];
+    uint16_t   source_port;
+    uint16_t   destination_port;
+    uint8_t    l4_proto;
+};
+
+/**
+ * \brief Hash of flow key.
+ * @param hdr Netcope INT header
+ * @return 64-bit hash
+ */
+inline uint64_t flow_hash(const np4_int_header_t *hdr) {
+    // Source IP, destination IP and ports are adjacent at the start of the header
+    const unsigned char *p = (const unsigned char *) hdr;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ hdr->l4_proto;
+    for (unsigned i = 0; i < 36; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+/**
+ * \brief State of one flow, exactly two cache lines.
+ */
+struct alignas(64) flow_entry {
+    struct flow_key key;                     //!< Flow 5-tuple.
+    uint16_t        insmap;                  //!< Instruction bitmap of last report.
+    uint32_t        path;                    //!< Signature of switch IDs of last report.
+    uint64_t        seen_ns;                 //!< Time the flow was seen last.
+    uint64_t        report_ns;               //!< Time of last report.
+    uint32_t        latency[NP4_INT_MAX_HOPS];   //!< Hop latencies of last report.
+    uint32_t        occupancy[NP4_INT_MAX_HOPS]; //!< Queue occupancies of last report.
+};
+
+static_assert(sizeof(flow_entry) == 128, "flow entry must span two cache lines");
+
+/**
+ * \brief Per-flow state table deciding which Telemetry reports carry news.
+ *
+ * The table is open addressing with probing limited to one bucket of
+ * FLOW_WAYS entries. Tags of one bucket share a cache line, so a miss costs a
+ * single line. Memory is fixed at construction; when a bucket is full, an
+ * aged-out entry or the least recently seen one is replaced. A flow not seen
+ * for the age is forgotten, it starts over as a new flow when it comes back.
+ */
+class flow_table {
+
+    private:
+
+        flow_table(const flow_table &);
+        flow_table &operator=(const flow_table &);
+
+        uint32_t *tags;       //!< Tags of entries, 0 for free entry.
+        flow_entry *entries;  //!< Entries, FLOW_WAYS per bucket.
+        uint64_t mask;        //!< Bucket index mask.
+        uint32_t latency;     //!< Hop latency change that triggers report.
+        uint32_t occupancy;   //!< Queue occupancy change that triggers report.
+        uint64_t refresh_ns;  //!< Report at least this often for every flow.
+        uint64_t age_ns;      //!< Flows not seen for this long are dropped.
+
+        static inline uint32_t distance(uint32_t a, uint32_t b) {
+            return a > b ? a - b : b - a;
+        }
+
+        inline flow_entry *lookup(const np4_int_header_t *hdr, uint64_t now, bool &created);
+
+    public:
+
+        /**
+         * \brief Basic constructor, allocate the table.
+         * @param flows      Maximal number of flows (rounded up to power of two)
+         * @param latency    Hop latency change that triggers report
+         * @param occupancy  Queue occupancy change that triggers report
+         * @param refresh_ms Report at least this often for every flow (milliseconds)
+         * @param age_ms     Flows not seen for this long are dropped (milliseconds)
+         */
+        flow_table(unsigned flows, uint32_t latency, uint32_t occupancy, unsigned refresh_ms, unsigned age_ms);
+
+        ~flow_table() {
+            free(tags);
+            free(entries);
+        }
+
+        /**
+         * \brief Update flow state and decide whether the record is worth reporting.
+         * @param hdr Netcope INT header with valid INT
+         * @param now Current time in nanoseconds
+         * @return True if path, hop latency or queue occupancy changed, or refresh is due
+         */
+        inline bool should_report(const np4_int_header_t *hdr, uint64_t now);
+
+        uint64_t evictions; //!< Number of live flows replaced for lack of space.
+};
+
+inline flow_table::flow_table(unsigned flows, uint32_t latency, uint32_t occupancy, unsigned refresh_ms, unsigned age_ms) :
+    tags(NULL),
+    entries(NULL),
+    latency(latency),
+    occupancy(occupancy),
+    refresh_ns((uint64_t) refresh_ms * 1000000),
+    age_ns((uint64_t) age_ms * 1000000),
+    evictions(0)
+    {
+    uint64_t buckets = 1;
+    while (buckets * FLOW_WAYS < flows)
+        buckets <<= 1;
+    mask = buckets - 1;
+    void *t, *e;
+    if (posix_memalign(&t, 64, buckets * FLOW_WAYS * sizeof(uint32_t)))
+        throw std::bad_alloc();
+    if (posix_memalign(&e, 64, buckets * FLOW_WAYS * sizeof(flow_entry))) {
+        free(t);
+        throw std::bad_alloc();
+    }
+    tags = (uint32_t *) t;
+    entries = (flow_entry *) e;
+    memset(tags, 0, buckets * FLOW_WAYS * sizeof(uint32_t));
+}
+
+inline flow_entry *flow_table::lookup(const np4_int_header_t *hdr, uint64_t now, bool &created) {
+    uint64_t h = flow_hash(hdr);
+    uint64_t bucket = (h & mask) * FLOW_WAYS;
+    uint32_t tag = (uint32_t) (h >> 32) | 1;
+    uint32_t *t = tags + bucket;
+    flow_entry *e = entries + bucket;
+
+    struct flow_key key;
+    memcpy(&key, hdr, 36);
+    key.l4_proto = hdr->l4_proto;
+
+    // Find the flow, only entries with matching tag are touched
+    unsigned victim = FLOW_WAYS;
+    for (unsigned i = 0; i < FLOW_WAYS; i++) {
+        if (t[i] == tag && memcmp(&e[i].key, &key, sizeof(key)) == 0) {
+            if (now - e[i].seen_ns < age_ns) {
+                created = false;
+                return &e[i];
+            }
+            // Aged out flow starts over in its own entry
+            victim = i;
+            break;
+        }
+    }
+
+    // New flow takes free or aged-out entry, otherwise replaces the least recently seen one
+    if (victim == FLOW_WAYS) {
+        uint64_t oldest = UINT64_MAX;
+        for (unsigned i = 0; i < FLOW_WAYS; i++) {
+            if (!t[i] || now - e[i].seen_ns >= age_ns) {
+                victim = i;
+                break;
+            }
+            if (e[i].seen_ns < oldest) {
+                oldest = e[i].seen_ns;
+                victim = i;
+            }
+        }
+        if (t[victim] && now - e[victim].seen_ns < age_ns)
+            evictions++;
+    }
+    t[victim] = tag;
+    memset(&e[victim], 0, sizeof(flow_entry));
+    e[victim].key = key;
+    created = true;
+    return &e[victim];
+}
+
+inline bool flow_table::should_report(const np4_int_header_t *hdr, uint64_t now) {
+    bool created;
+    flow_entry *e = lookup(hdr, now, created);
+    e->seen_ns = now;
+
+    unsigned vld = hdr->int_hop_vld;
+    unsigned ins = hdr->int_insmap >> 8;
+
+    // Signature of the path
+    uint32_t path = vld;
+    if (ins & INT_INS_SWITCH_ID)
+        for (unsigned i = 0; i < NP4_INT_MAX_HOPS; i++)
+            if (vld & (1 << i))
+                path = (path ^ hdr->int_hop[i].swid) * 0x01000193;
+
+    bool report = created || path != e->path || e->insmap != hdr->int_insmap || now - e->report_ns >= refresh_ns;
+    for (unsigned i = 0; i < NP4_INT_MAX_HOPS && !report; i++) {
+        if (!(vld & (1 << i)))
+            continue;
+        if ((ins & INT_INS_HOP_LATENCY) && distance(hdr->int_hop[i].hoplatency, e->latency[i]) > latency)
+            report = true;
+        if ((ins & INT_INS_Q_OCCUPANCY) && distance(hdr->int_hop[i].occupancy_occupancy, e->occupancy[i]) > occupancy)
+            report = true;
+    }
+    if (!report)
+        return false;
+
+    // Remember what was reported
+    e->insmap = hdr->int_insmap;
+    e->path = path;
+    e->report_ns = now;
+    for (unsigned i = 0; i < NP4_INT_MAX_HOPS; i++) {
+        e->latency[i] = hdr->int_hop[i].hoplatency;
+        e->occupancy[i] = hdr->int_hop[i].occupancy_occupancy;
+    }
+    return true;
+}
+
+#endif
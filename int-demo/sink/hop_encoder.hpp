@@ -0,0 +1,251 @@
+/*
+ * hop_encoder.hpp: Byte order conversion of INT hop metadata of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_HOP_ENCODER
+#define __HEADER_FILE_HOP_ENCODER
+
+#include <cstring>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HOP_ENCODER_X86
+#endif
+
+#include "np4_int_header.hpp"
+
+//! Bytes a hop encoder may write behind the encoded hops.
+#define HOP_ENCODER_OVERRUN 32
+//! Fewest fields per hop the vector encoders beat the scalar one with.
+#define HOP_ENCODER_SIMD_MIN_FIELDS 4
+
+/**
+ * \brief Store 32-bit value in network byte order to unaligned location.
+ * @return Pointer behind the stored value
+ */
+inline unsigned char *int_store_be32(unsigned char *out, uint32_t value) {
+    value = htonl(value);
+    memcpy(out, &value, 4);
+    return out + 4;
+}
+
+/**
+ * \brief Encode INT metadata of all valid hops.
+ *
+ * One instance is generated for each instruction bitmap, so the presence of
+ * every metadata field is resolved at compile time. Hops are written in the
+ * INT stack order (the last hop first).
+ * @tparam INS  Upper byte of INT instruction bitmap
+ * @param out   Output position
+ * @param hop   Array of hops from Netcope INT header
+ * @param vld   Bitmap of valid hops (bit N for hop N)
+ * @return Pointer behind the last written byte
+ */
+template <unsigned INS>
+unsigned char *int_encode_hops(unsigned char *out, const np4_int_hop_t *hop, unsigned vld) {
+    while (vld) {
+        unsigned i = 31 - __builtin_clz(vld);
+        vld &= ~(1u << i);
+        const np4_int_hop_t &h = hop[i];
+        if (INS & INT_INS_SWITCH_ID)           out = int_store_be32(out, h.swid);
+        if (INS & INT_INS_PORT_IDS)            out = int_store_be32(out, ((uint32_t) h.ingressport << 16) | h.egressport);
+        if (INS & INT_INS_HOP_LATENCY)         out = int_store_be32(out, h.hoplatency);
+        if (INS & INT_INS_Q_OCCUPANCY)         out = int_store_be32(out, ((uint32_t) h.occupancy_queueid << 24) | h.occupancy_occupancy);
+        if (INS & INT_INS_INGRESS_TSTAMP)      out = int_store_be32(out, h.ingresstimestamp);
+        if (INS & INT_INS_EGRESS_TSTAMP)       out = int_store_be32(out, h.egresstimestamp);
+        if (INS & INT_INS_Q_CONGESTION)        out = int_store_be32(out, ((uint32_t) h.congestion_queueid << 24) | h.congestion_congestion);
+        if (INS & INT_INS_EGRESS_PORT_TX_UTIL) out = int_store_be32(out, h.egressporttxutilization);
+    }
+    return out;
+}
+
+typedef unsigned char *(*int_hop_encoder_t)(unsigned char *, const np4_int_hop_t *, unsigned);
+
+/**
+ * \brief Dispatch table of hop encoders indexed by upper byte of instruction bitmap.
+ *
+ * Entry N-1 is filled by the N-th level of the (compile-time generated) class hierarchy.
+ */
+template <unsigned N>
+struct int_hop_encoder_table : int_hop_encoder_table<N - 1> {
+    int_hop_encoder_table() { this->encoders[N - 1] = &int_encode_hops<N - 1>; }
+};
+
+template <>
+struct int_hop_encoder_table<0> {
+    int_hop_encoder_t encoders[256];
+};
+
+/**
+ * \brief Encoder of all valid hops for any instruction bitmap.
+ * @param out Output position, HOP_ENCODER_OVERRUN bytes behind the hops may be overwritten
+ * @param hop Array of hops from Netcope INT header
+ * @param vld Bitmap of valid hops (bit N for hop N)
+ * @param ins Upper byte of INT instruction bitmap
+ * @return Pointer behind the last encoded byte
+ */
+typedef unsigned char *(*int_hops_encoder_t)(unsigned char *, const np4_int_hop_t *, unsigned, unsigned);
+
+/**
+ * \brief Scalar hop encoder, dispatches to the instance for the instruction bitmap.
+ */
+inline unsigned char *int_encode_hops_scalar(unsigned char *out, const np4_int_hop_t *hop, unsigned vld, unsigned ins) {
+    static const int_hop_encoder_table<256> table;
+    return table.encoders[ins](out, hop, vld);
+}
+
+#ifdef HOP_ENCODER_X86
+
+/*
+ * In memory every hop is eight little-endian 32-bit words in the order of
+ * instruction bits. Each word is converted to network byte order by one
+ * byte permutation: whole word reversed, except port IDs (two 16-bit
+ * halves swapped in place) and queue ID/value pairs (queue ID byte kept
+ * first, 24-bit value reversed). The permutation does not depend on the
+ * instruction bitmap, only the selection of words does.
+ */
+
+/**
+ * \brief Byte permutation of one hop word to network byte order.
+ * @param word Index of the word in hop
+ * @param byte Index of output byte in the word
+ * @return Index of input byte in the word
+ */
+inline unsigned hop_swap_byte(unsigned word, unsigned byte) {
+    static const unsigned char reverse[4] = { 3, 2, 1, 0 };
+    static const unsigned char ports[4] = { 1, 0, 3, 2 };
+    static const unsigned char queue[4] = { 0, 3, 2, 1 };
+    if (word == 1)
+        return ports[byte];
+    if (word == 3 || word == 6)
+        return queue[byte];
+    return reverse[byte];
+}
+
+/**
+ * \brief Shuffle masks for SSSE3 encoder, one per half of hop and instruction nibble.
+ *
+ * The mask converts the words of the half selected by the nibble and packs
+ * them to the start of the register.
+ */
+struct hop_masks_ssse3 {
+    unsigned char mask[2][16][16]; //!< [half][nibble][byte]
+
+    hop_masks_ssse3() {
+        for (unsigned half = 0; half < 2; half++)
+            for (unsigned nibble = 0; nibble < 16; nibble++) {
+                memset(mask[half][nibble], 0x80, 16);
+                unsigned pos = 0;
+                for (unsigned w = 0; w < 4; w++) {
+                    if (!(nibble & (8 >> w)))
+                        continue;
+                    for (unsigned b = 0; b < 4; b++)
+                        mask[half][nibble][pos * 4 + b] = w * 4 + hop_swap_byte(half * 4 + w, b);
+                    pos++;
+                }
+            }
+    }
+};
+
+/**
+ * \brief Word permutations for AVX2 encoder, one per instruction bitmap.
+ */
+struct hop_masks_avx2 {
+    int32_t perm[256][8];           //!< Selected words packed to the start.
+    unsigned char swap[32];         //!< Byte permutation of every word.
+
+    hop_masks_avx2() {
+        for (unsigned ins = 0; ins < 256; ins++) {
+            unsigned pos = 0;
+            for (unsigned w = 0; w < 8; w++)
+                if (ins & (0x80 >> w))
+                    perm[ins][pos++] = w;
+            while (pos < 8)
+                perm[ins][pos++] = 0;
+        }
+        for (unsigned w = 0; w < 8; w++)
+            for (unsigned b = 0; b < 4; b++)
+                swap[w * 4 + b] = (w & 3) * 4 + hop_swap_byte(w, b);
+    }
+};
+
+/**
+ * \brief SSSE3 hop encoder, two shuffles per hop.
+ */
+__attribute__((target("ssse3")))
+inline unsigned char *int_encode_hops_ssse3(unsigned char *out, const np4_int_hop_t *hop, unsigned vld, unsigned ins) {
+    static const hop_masks_ssse3 masks;
+    __m128i lo_mask = _mm_loadu_si128((const __m128i *) masks.mask[0][ins >> 4]);
+    __m128i hi_mask = _mm_loadu_si128((const __m128i *) masks.mask[1][ins & 0xF]);
+    unsigned lo_len = __builtin_popcount(ins >> 4) * 4;
+    unsigned hi_len = __builtin_popcount(ins & 0xF) * 4;
+    while (vld) {
+        unsigned i = 31 - __builtin_clz(vld);
+        vld &= ~(1u << i);
+        const __m128i *h = (const __m128i *) &hop[i];
+        _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(_mm_loadu_si128(h), lo_mask));
+        out += lo_len;
+        _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(_mm_loadu_si128(h + 1), hi_mask));
+        out += hi_len;
+    }
+    return out;
+}
+
+/**
+ * \brief AVX2 hop encoder, one shuffle and one permutation per hop.
+ */
+__attribute__((target("avx2")))
+inline unsigned char *int_encode_hops_avx2(unsigned char *out, const np4_int_hop_t *hop, unsigned vld, unsigned ins) {
+    static const hop_masks_avx2 masks;
+    __m256i swap = _mm256_loadu_si256((const __m256i *) masks.swap);
+    __m256i perm = _mm256_loadu_si256((const __m256i *) masks.perm[ins]);
+    unsigned len = __builtin_popcount(ins) * 4;
+    while (vld) {
+        unsigned i = 31 - __builtin_clz(vld);
+        vld &= ~(1u << i);
+        __m256i h = _mm256_loadu_si256((const __m256i *) &hop[i]);
+        _mm256_storeu_si256((__m256i *) out, _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(h, swap), perm));
+        out += len;
+    }
+    return out;
+}
+
+#endif
+
+/**
+ * \brief Choose hop encoder.
+ * @param name Name of the encoder ("scalar", "ssse3", "avx2"), NULL for the best one the CPU supports
+ * @return Hop encoder, NULL if the named one is not available
+ */
+inline int_hops_encoder_t int_hops_encoder_select(const char *name = NULL) {
+#ifdef HOP_ENCODER_X86
+    __builtin_cpu_init();
+    if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        return &int_encode_hops_avx2;
+    if ((name == NULL || strcmp(name, "ssse3") == 0) && __builtin_cpu_supports("ssse3"))
+        return &int_encode_hops_ssse3;
+#endif
+    if (name == NULL || strcmp(name, "scalar") == 0)
+        return &int_encode_hops_scalar;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ * hop_histograms.hpp: Per-switch/per-port hop latency and queue occupancy histograms of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_HOP_HISTOGRAMS
+#define __HEADER_FILE_HOP_HISTOGRAMS
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "np4_int_header.hpp"
+
+#define HIST_SUB_BITS   5                                         //!< Linear sub-buckets per power of two (log2).
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)                      //!< Linear sub-buckets per power of two.
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT) //!< Buckets covering whole 32-bit range.
+
+/**
+ * \brief Log-linear histogram of 32-bit values.
+ *
+ * Values below HIST_SUB_COUNT have a bucket each, every higher power of two
+ * is split into HIST_SUB_COUNT equal buckets, so the relative error is below
+ * 1 / HIST_SUB_COUNT over the whole range.
+ */
+struct log_histogram {
+    uint64_t count;                  //!< Number of values.
+    uint64_t sum;                    //!< Sum of values.
+    uint32_t min;                    //!< Lowest value.
+    uint32_t max;                    //!< Highest value.
+    uint32_t buckets[HIST_BUCKETS];  //!< Number of values in each bucket.
+
+    /**
+     * \brief Bucket of the value.
+     */
+    static inline unsigned index(uint32_t value) {
+        if (value < HIST_SUB_COUNT)
+            return value;
+        unsigned msb = 31 - __builtin_clz(value);
+        return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (value >> (msb - HIST_SUB_BITS)) - HIST_SUB_COUNT;
+    }
+
+    /**
+     * \brief Highest value falling into the bucket.
+     */
+    static inline uint32_t highest(unsigned index) {
+        unsigned group = index >> HIST_SUB_BITS;
+        if (group == 0)
+            return index;
+        uint64_t low = (uint64_t) (HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1))) << (group - 1);
+        return low + ((uint64_t) 1 << (group - 1)) - 1;
+    }
+
+    inline void reset() {
+        count = 0;
+        sum = 0;
+        min = UINT32_MAX;
+        max = 0;
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    inline void record(uint32_t value) {
+        buckets[index(value)]++;
+        count++;
+        sum += value;
+        if (value < min)
+            min = value;
+        if (value > max)
+            max = value;
+    }
+
+    /**
+     * \brief Value below which the given fraction of values falls.
+     * @param fraction Fraction of values (e.g. 0.99)
+     * @return Highest value of the bucket reaching the fraction, at most max
+     */
+    uint32_t percentile(double fraction) const {
+        uint64_t target = (uint64_t) (fraction * count + 0.5);
+        if (target == 0)
+            target = 1;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= target)
+                return highest(i) < max ? highest(i) : max;
+        }
+        return max;
+    }
+};
+
+/**
+ * \brief Histograms of one egress port of one switch.
+ */
+struct port_histograms {
+    uint32_t       swid;       //!< Switch ID.
+    uint16_t       port;       //!< Egress port.
+    bool           used;       //!< Entry holds a port.
+    log_histogram  latency;    //!< Hop latency.
+    log_histogram  occupancy;  //!< Queue occupancy.
+};
+
+/**
+ * \brief Hop latency and queue occupancy histograms of all switches and ports seen.
+ *
+ * Every valid hop of a record goes to the histograms of its (switch ID,
+ * egress port), so the insert is a hash lookup and two bucket increments.
+ * Memory is allocated once for the given number of ports; hops of ports
+ * beyond that are only counted. Once per interval the table is swapped with
+ * a spare one, and hist_log writes the snapshot out in background as one
+ * text line per port and metric and clears it:
+ *
+ *   time queue switch port metric count min p50 p99 p999 max bucket:count,...
+ *
+ * Bucket numbers refer to HIST_SUB_BITS log-linear layout, so snapshots of
+ * several queues or intervals can be merged by adding bucket counts. If the
+ * writer has not taken the previous snapshot yet, the swap waits for the
+ * next poll and the interval gets longer.
+ */
+class hop_histograms {
+
+    private:
+
+        hop_histograms(const hop_histograms &);
+        hop_histograms &operator=(const hop_histograms &);
+
+        port_histograms *table;     //!< Open addressing table of ports.
+        port_histograms *spare;     //!< Table of snapshot being written, empty otherwise.
+        unsigned mask;              //!< Table index mask.
+        unsigned capacity;          //!< Maximal number of ports.
+        std::vector<unsigned> used; //!< Indexes of used entries.
+        std::vector<unsigned> spare_used; //!< Indexes of used entries of spare table.
+        long spare_time;            //!< Time of snapshot in spare table.
+        std::atomic<bool> pending;  //!< Spare table holds snapshot for the writer.
+        uint64_t interval_ns;       //!< Time between snapshots.
+        uint64_t next_ns;           //!< Time of next snapshot.
+        int queue;                  //!< RX queue the histograms belong to.
+
+        inline port_histograms *lookup(uint32_t swid, uint16_t port);
+
+        void write(FILE *file, const port_histograms &entry, const char *metric, const log_histogram &hist);
+
+    public:
+
+        /**
+         * \brief Basic constructor, allocate histograms.
+         * @param ports    Maximal number of (switch, port) pairs
+         * @param interval Time between snapshots (seconds)
+         * @param queue    RX queue the histograms belong to
+         */
+        hop_histograms(unsigned ports, unsigned interval, int queue);
+
+        ~hop_histograms() {
+            free(table);
+            free(spare);
+        }
+
+        /**
+         * \brief Add hops of the record to histograms.
+         * @param hdr Netcope INT header with valid INT
+         */
+        inline void record(const np4_int_header_t *hdr);
+
+        /**
+         * \brief Hand snapshot to the writer if the interval has passed.
+         * @param now Current monotonic time in nanoseconds
+         */
+        inline void poll(uint64_t now) {
+            if (now >= next_ns && snapshot())
+                next_ns = now + interval_ns;
+        }
+
+        /**
+         * \brief Hand all histograms to the writer and start over with empty table, never waits.
+         * @return False if the writer has not taken the previous snapshot yet
+         */
+        inline bool snapshot();
+
+        /**
+         * \brief Hand the last histograms to the writer, waits for it to take the previous snapshot.
+         */
+        void flush() {
+            while (!snapshot())
+                usleep(1000);
+        }
+
+        /**
+         * \brief Write out and clear snapshot handed to the writer, called by hist_log only.
+         * @param file Output of snapshots
+         * @return False if there was no snapshot
+         */
+        bool write_snapshot(FILE *file);
+
+        uint64_t untracked; //!< Number of hops not recorded for lack of space.
+};
+
+inline hop_histograms::hop_histograms(unsigned ports, unsigned interval, int queue) :
+    table(NULL),
+    spare(NULL),
+    capacity(ports),
+    spare_time(0),
+    pending(false),
+    interval_ns((uint64_t) interval * 1000000000),
+    next_ns(0),
+    queue(queue),
+    untracked(0)
+    {
+    // Keep the table at most half full
+    unsigned size = 1;
+    while (size < 2 * ports)
+        size <<= 1;
+    mask = size - 1;
+    void *t, *s;
+    if (posix_memalign(&t, 64, size * sizeof(port_histograms)))
+        throw std::bad_alloc();
+    if (posix_memalign(&s, 64, size * sizeof(port_histograms))) {
+        free(t);
+        throw std::bad_alloc();
+    }
+    table = (port_histograms *) t;
+    spare = (port_histograms *) s;
+    for (unsigned i = 0; i < size; i++)
+        table[i].used = spare[i].used = false;
+    used.reserve(ports);
+    spare_used.reserve(ports);
+}
+
+inline port_histograms *hop_histograms::lookup(uint32_t swid, uint16_t port) {
+    unsigned i = ((swid * 0x9E3779B1u) ^ (port * 0x85EBCA6Bu)) >> 7 & mask;
+    while (table[i].used) {
+        if (table[i].swid == swid && table[i].port == port)
+            return &table[i];
+        i = (i + 1) & mask;
+    }
+    if (used.size() == capacity)
+        return NULL;
+    port_histograms &entry = table[i];
+    entry.swid = swid;
+    entry.port = port;
+    entry.used = true;
+    entry.latency.reset();
+    entry.occupancy.reset();
+    used.push_back(i);
+    return &entry;
+}
+
+inline void hop_histograms::record(const np4_int_header_t *hdr) {
+    unsigned ins = hdr->int_insmap >> 8;
+    if (!(ins & (INT_INS_HOP_LATENCY | INT_INS_Q_OCCUPANCY)))
+        return;
+    for (unsigned i = 0; i < NP4_INT_MAX_HOPS; i++) {
+        if (!(hdr->int_hop_vld & (1 << i)))
+            continue;
+        const np4_int_hop_t &hop = hdr->int_hop[i];
+        port_histograms *entry = lookup(ins & INT_INS_SWITCH_ID ? hop.swid : 0, ins & INT_INS_PORT_IDS ? hop.egressport : 0);
+        if (entry == NULL) {
+            untracked++;
+            continue;
+        }
+        if (ins & INT_INS_HOP_LATENCY)
+            entry->latency.record(hop.hoplatency);
+        if (ins & INT_INS_Q_OCCUPANCY)
+            entry->occupancy.record(hop.occupancy_occupancy);
+    }
+}
+
+inline bool hop_histograms::snapshot() {
+    if (pending.load(std::memory_order_acquire))
+        return false;
+    if (used.empty())
+        return true;
+    std::swap(table, spare);
+    used.swap(spare_used);
+    spare_time = time(NULL);
+    pending.store(true, std::memory_order_release);
+    return true;
+}
+
+inline void hop_histograms::write(FILE *file, const port_histograms &entry, const char *metric, const log_histogram &hist) {
+    if (hist.count == 0)
+        return;
+    fprintf(file, "%ld %d %u %u %s %llu %u %u %u %u %u ", spare_time, queue, entry.swid, entry.port, metric,
+            (unsigned long long) hist.count, hist.min, hist.percentile(0.5), hist.percentile(0.99), hist.percentile(0.999), hist.max);
+    const char *separator = "";
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        if (hist.buckets[i]) {
+            fprintf(file, "%s%u:%u", separator, i, hist.buckets[i]);
+            separator = ",";
+        }
+    }
+    fputc('\n', file);
+}
+
+inline bool hop_histograms::write_snapshot(FILE *file) {
+    if (!pending.load(std::memory_order_acquire))
+        return false;
+    for (unsigned i = 0; i < spare_used.size(); i++) {
+        const port_histograms &entry = spare[spare_used[i]];
+        write(file, entry, "latency", entry.latency);
+        write(file, entry, "occupancy", entry.occupancy);
+    }
+
+    // Give the table back empty
+    for (unsigned i = 0; i < spare_used.size(); i++)
+        spare[spare_used[i]].used = false;
+    spare_used.clear();
+    pending.store(false, std::memory_order_release);
+    return true;
+}
+
+/**
+ * \brief Background writer of histogram snapshots.
+ *
+ * Histograms of every RX queue are created by its worker, so they are
+ * allocated on its CPU, and owned by the log. One background thread writes
+ * out snapshots the workers hand over, lines of one snapshot are kept
+ * together.
+ */
+class hist_log {
+
+    private:
+
+        hist_log(const hist_log &);
+        hist_log &operator=(const hist_log &);
+
+        std::unique_ptr<std::atomic<hop_histograms *>[]> queues; //!< Histograms of each RX queue, NULL until created.
+        unsigned count;          //!< Number of RX queues.
+        FILE *file;              //!< Output of snapshots.
+        std::atomic<bool> done;  //!< All workers have finished.
+        std::thread writer;      //!< Background writer thread.
+
+        void write();
+
+    public:
+
+        /**
+         * \brief Basic constructor, start writer.
+         * @param queues Number of RX queues
+         * @param file   Output of snapshots
+         */
+        hist_log(unsigned queues, FILE *file);
+
+        /**
+         * \brief Write out the remaining snapshots, free histograms.
+         *
+         * No worker may use its histograms any more.
+         */
+        ~hist_log();
+
+        /**
+         * \brief Create histograms of the RX queue, called by its worker.
+         * @param index    Index of the RX queue
+         * @param ports    Maximal number of (switch, port) pairs
+         * @param interval Time between snapshots (seconds)
+         * @param queue    RX queue the histograms belong to
+         */
+        hop_histograms &create(unsigned index, unsigned ports, unsigned interval, int queue) {
+            hop_histograms *hists = new hop_histograms(ports, interval, queue);
+            queues[index].store(hists, std::memory_order_release);
+            return *hists;
+        }
+};
+
+inline hist_log::hist_log(unsigned queues, FILE *file) :
+    queues(new std::atomic<hop_histograms *>[queues]),
+    count(queues),
+    file(file),
+    done(false)
+    {
+    for (unsigned i = 0; i < queues; i++)
+        this->queues[i] = NULL;
+    writer = std::thread(&hist_log::write, this);
+}
+
+inline hist_log::~hist_log() {
+    done = true;
+    writer.join();
+    for (unsigned i = 0; i < count; i++)
+        delete queues[i].load();
+    fflush(file);
+}
+
+inline void hist_log::write() {
+    while (true) {
+        bool finished = done.load(std::memory_order_acquire);
+        unsigned written = 0;
+        for (unsigned i = 0; i < count; i++) {
+            hop_histograms *hists = queues[i].load(std::memory_order_acquire);
+            if (hists && hists->write_snapshot(file))
+                written++;
+        }
+        if (written) {
+            fflush(file);
+            continue;
+        }
+        // Snapshots handed over before the end are written
+        if (finished)
+            break;
+        usleep(1000);
+    }
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * idle_policy.hpp: Adaptive backoff of polling threads without work.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_IDLE_POLICY
+#define __HEADER_FILE_IDLE_POLICY
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * \brief Hint to the CPU that the thread spins, frees pipeline to the sibling hyperthread.
+ */
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/**
+ * \brief Adaptive backoff of a polling thread, trading latency of the first input after a pause for CPU time.
+ *
+ * Consecutive polls without work go through four stages: plain spinning,
+ * spinning with CPU pause, short sleeps, and finally waits for input of up
+ * to a given time, blocking where the source allows it. Any work brings the
+ * thread back to spinning. Under load the thread never leaves the first
+ * stage, at zero traffic it wakes up once per wait.
+ */
+class idle_policy {
+
+    private:
+
+        bool busy_poll;      //!< Never back off, spin endlessly.
+        unsigned spin;       //!< Idle polls spinning.
+        unsigned pause;      //!< Idle polls spinning with CPU pause then.
+        unsigned sleep_us;   //!< Length of short sleep.
+        uint64_t block_ns;   //!< Time of short sleeps before waits.
+        unsigned wait_us;    //!< Longest wait for input.
+        unsigned polls;      //!< Consecutive idle polls, counted up to spin + pause.
+        uint64_t since_ns;   //!< Start of short sleeps.
+
+        static inline uint64_t now() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param busy_poll Never back off, spin endlessly
+         * @param spin      Idle polls spinning
+         * @param pause     Idle polls spinning with CPU pause then
+         * @param sleep_us  Length of short sleep (microseconds)
+         * @param block_us  Time of short sleeps before waits (microseconds)
+         * @param wait_us   Longest wait for input (microseconds)
+         */
+        idle_policy(bool busy_poll, unsigned spin, unsigned pause, unsigned sleep_us, unsigned block_us, unsigned wait_us) :
+            busy_poll(busy_poll),
+            spin(spin),
+            pause(pause),
+            sleep_us(sleep_us),
+            block_ns((uint64_t) block_us * 1000),
+            wait_us(wait_us),
+            polls(0),
+            since_ns(0),
+            sleeps(0),
+            waits(0)
+            {
+        }
+
+        /**
+         * \brief Note a poll with work, back to spinning.
+         */
+        inline void busy() {
+            polls = 0;
+        }
+
+        /**
+         * \brief Back off after a poll without work.
+         * @return Time to wait for input (microseconds), 0 to poll again right away
+         */
+        inline unsigned idle();
+
+        uint64_t sleeps;  //!< Short sleeps.
+        uint64_t waits;   //!< Waits for input.
+};
+
+inline unsigned idle_policy::idle() {
+    if (busy_poll)
+        return 0;
+    if (polls < spin) {
+        polls++;
+        return 0;
+    }
+    if (polls < spin + pause) {
+        polls++;
+        cpu_relax();
+        return 0;
+    }
+    uint64_t t = now();
+    if (polls == spin + pause) {
+        polls++;
+        since_ns = t;
+    }
+    if (t - since_ns < block_ns) {
+        struct timespec ts = { (time_t) (sleep_us / 1000000), (long) (sleep_us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+        sleeps++;
+        return 0;
+    }
+    waits++;
+    return wait_us;
+}
+
+#endif
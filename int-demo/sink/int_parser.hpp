@@ -0,0 +1,408 @@
+/*
+ * int_parser.hpp: Software model of the parser of Netcope P4 INT sink, building Netcope INT metadata records.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_INT_PARSER
+#define __HEADER_FILE_INT_PARSER
+
+#include <cstring>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+#include "compact_record.hpp"
+#include "np4_int_header.hpp"
+
+#define INT_PARSER_BATCH    32  //!< Packets parsed together by batch parse().
+#define INT_PARSER_PREFETCH 4   //!< Packets of a batch prefetched ahead of the parsed one.
+#define INT_PARSER_SNAPLEN  256 //!< Longest start of packet the parser can read (deepest parse is 230 bytes).
+
+#define INT_GTP_PORT        2152 //!< UDP port of GTP-U.
+#define INT_DSCP            0x01 //!< DSCP value marking INT over TCP/UDP.
+
+/**
+ * \brief Packet given to the parser.
+ */
+struct int_packet {
+    const unsigned char *data;  //!< Packet from Ethernet header on.
+    unsigned caplen;            //!< Captured length of the packet.
+    uint32_t timestamp_s;       //!< Timestamp, seconds.
+    uint32_t timestamp_ns;      //!< Timestamp, nanoseconds.
+};
+
+/**
+ * \brief Software model of p4/parser.p4 and of the metadata updates of p4/tables.p4.
+ *
+ * The parse graph is followed in closed form rather than state by state:
+ * Ethernet, IPv4 (fixed 20 bytes) or IPv6, UDP or TCP (fixed 20 bytes),
+ * GTP-U with inner IPv4 and UDP or TCP, then INT shim and header when DSCP
+ * is INT_DSCP. Hops of the INT stack carry only the instructions the P4
+ * parser extracts (switch ID, port IDs, queue occupancy and the 8-byte
+ * ingress timestamp holding both timestamps), in the order of the
+ * instruction bitmap. Quirks of the P4 parser are kept so the records match
+ * the card bit for bit:
+ *
+ *  - hop slot 4 is never used, the fifth hop goes to slot 5 and a sixth hop
+ *    ends parsing without tail;
+ *  - the tail is expected after hop k when length is 4 + ins_cnt * k with
+ *    ins_cnt from 1 to 8, the count of the extracted instructions is not
+ *    checked against ins_cnt;
+ *  - only hop slot 5 extracts egress timestamp, after queue occupancy or
+ *    ingress timestamp.
+ *
+ * A header not fully present in the packet is not extracted and ends
+ * parsing, metadata of the headers extracted so far stay set. Fields the
+ * card leaves undefined are zero.
+ */
+class int_parser {
+
+    private:
+
+        bool update_l4;      //!< Default action of tab_update_L4 is update_L4.
+        bool update_l4_v6;   //!< Default action of tab_update_L4_v6 is update_L4_v6.
+        bool update_enc_l4;  //!< Default action of tab_update_enc_L4 is update_enc_L4.
+
+        static inline uint16_t load16(const unsigned char *p) {
+            return (uint16_t) (p[0] << 8 | p[1]);
+        }
+
+        static inline uint32_t load32(const unsigned char *p) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            return __builtin_bswap32(v);
+        }
+
+        /**
+         * \brief Check whether default rule of table runs the action.
+         */
+        static bool default_action(const ruleset &rules, const char *table, const char *action);
+
+        /**
+         * \brief Parse INT stack from the shim header on.
+         * @return INT tail, NULL if the stack is not complete
+         */
+        static inline const unsigned char *parse_int(const unsigned char *p, const unsigned char *end, np4_int_header_t *hdr);
+
+        /**
+         * \brief Parse headers in front of INT shim.
+         * @param gtp Output, INT is inside GTP-U
+         * @param v6  Output, INT is behind IPv6
+         * @return INT shim, NULL if the packet is not INT over TCP/UDP
+         */
+        static inline const unsigned char *parse_l4(const unsigned char *data, unsigned caplen, np4_int_header_t *hdr,
+                                                    bool &gtp, bool &v6);
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param update Update L4 protocol and destination port from INT tail as the built-in rules of np4_int do
+         *               (false for np4_int -o)
+         */
+        int_parser(bool update = true) :
+            update_l4(update),
+            update_l4_v6(update),
+            update_enc_l4(update)
+            {
+        }
+
+        /**
+         * \brief Constructor following the default rules of tab_update_L4, tab_update_L4_v6 and tab_update_enc_L4.
+         * @param rules NP4 ruleset of the sink
+         */
+        int_parser(const ruleset &rules) :
+            update_l4(default_action(rules, "tab_update_L4", "update_L4")),
+            update_l4_v6(default_action(rules, "tab_update_L4_v6", "update_L4_v6")),
+            update_enc_l4(default_action(rules, "tab_update_enc_L4", "update_enc_L4"))
+            {
+        }
+
+        /**
+         * \brief Parse one packet into Netcope INT header.
+         * @param data   Packet from Ethernet header on
+         * @param caplen Captured length of the packet
+         * @param hdr    Output Netcope INT header
+         * @return True if INT was found (int_vld)
+         */
+        inline bool parse(const unsigned char *data, unsigned caplen, np4_int_header_t *hdr) const;
+
+        /**
+         * \brief Parse batch of packets into Netcope P4 frames.
+         *
+         * Every frame is NP4_RECORD_LEN bytes long, Netcope INT header is
+         * preceded by frame header of NP4_FRAME_HDR_LEN bytes with timestamp
+         * seconds and nanoseconds in its first 8 bytes, the rest is zero.
+         * @param packets Packets
+         * @param count   Number of packets, at most INT_PARSER_BATCH
+         * @param frames  Output, count frames back to back
+         * @return Number of packets with INT
+         */
+        inline unsigned parse(const int_packet *packets, unsigned count, unsigned char *frames) const;
+
+        /**
+         * \brief Build compact record of one packet as tab_compact_record_build does with its clone.
+         *
+         * The record is built whenever INT header is present, the stack is
+         * copied as it is and the record is cut where the packet ends; L4
+         * fields are not updated from INT tail.
+         * @param data   Packet from Ethernet header on
+         * @param caplen Captured length of the packet
+         * @param record Output, at least COMPACT_MAX_LEN bytes
+         * @return Length of the record, 0 if the card sends no record
+         */
+        inline unsigned compact(const unsigned char *data, unsigned caplen, unsigned char *record) const;
+};
+
+inline bool int_parser::default_action(const ruleset &rules, const char *table, const char *action) {
+    for (ruleset::rule_map::const_iterator it = rules.rules().begin(); it != rules.rules().end(); ++it)
+        if (ruleset::is_default(it->first)) {
+            ruleset_rule rule = ruleset::decode(*it);
+            if (rule.table == table)
+                return rule.action == action;
+        }
+    return false;
+}
+
+inline const unsigned char *int_parser::parse_int(const unsigned char *p, const unsigned char *end, np4_int_header_t *hdr) {
+    // Shim and INT header
+    if (end - p < 4)
+        return NULL;
+    unsigned len = p[2];
+    hdr->int_length = len;
+    if (end - p < 12)
+        return NULL;
+    unsigned ins_cnt = p[5] & 0x1F;
+    unsigned ins = p[8];
+    hdr->int_inscnt = ins_cnt;
+    hdr->int_insmap = load16(p + 8);
+    p += 12;
+    if (len == 4)
+        return p;
+    bool counted = ins_cnt >= 1 && ins_cnt <= 8;
+    unsigned stack = ins & (INT_INS_SWITCH_ID | INT_INS_PORT_IDS | INT_INS_Q_OCCUPANCY | INT_INS_INGRESS_TSTAMP);
+    if (stack == 0)
+        return NULL;
+    // Hops in slots 0, 1, 2, 3 and 5
+    for (unsigned k = 1; k <= 5; k++) {
+        unsigned slot = k == 5 ? 5 : k - 1;
+        np4_int_hop_t &hop = hdr->int_hop[slot];
+        if (ins & INT_INS_SWITCH_ID) {
+            if (end - p < 4)
+                return NULL;
+            hop.swid = load32(p);
+            hdr->int_hop_vld |= 1 << slot;
+            p += 4;
+        }
+        if (ins & INT_INS_PORT_IDS) {
+            if (end - p < 4)
+                return NULL;
+            hop.ingressport = load16(p);
+            hop.egressport = load16(p + 2);
+            hdr->int_hop_vld |= 1 << slot;
+            p += 4;
+        }
+        if (ins & INT_INS_Q_OCCUPANCY) {
+            if (end - p < 4)
+                return NULL;
+            hop.occupancy_queueid = p[0];
+            hop.occupancy_occupancy = load32(p) & 0xFFFFFF;
+            hdr->int_hop_vld |= 1 << slot;
+            p += 4;
+        }
+        if (ins & INT_INS_INGRESS_TSTAMP) {
+            if (end - p < 8)
+                return NULL;
+            hop.ingresstimestamp = load32(p);
+            hop.egresstimestamp = load32(p + 4);
+            hdr->int_hop_vld |= 1 << slot;
+            p += 8;
+        }
+        if (slot == 5 && (ins & INT_INS_EGRESS_TSTAMP) && (ins & (INT_INS_Q_OCCUPANCY | INT_INS_INGRESS_TSTAMP))) {
+            if (end - p < 4)
+                return NULL;
+            hop.egresstimestamp = load32(p);
+            p += 4;
+        }
+        if (counted && len == 4 + ins_cnt * k)
+            return p;
+    }
+    return NULL;
+}
+
+inline const unsigned char *int_parser::parse_l4(const unsigned char *data, unsigned caplen, np4_int_header_t *hdr,
+                                                 bool &gtp, bool &v6) {
+    const unsigned char *p = data, *end = data + caplen;
+
+    // Ethernet and IP
+    if (caplen < 14)
+        return NULL;
+    uint16_t ethertype = load16(p + 12);
+    p += 14;
+    unsigned proto, dscp;
+    v6 = false;
+    if (ethertype == 0x0800) {
+        if (end - p < 20)
+            return NULL;
+        hdr->source_ip[0] = load32(p + 12);
+        hdr->destination_ip[0] = load32(p + 16);
+        hdr->ip_ver = 4;
+        dscp = p[1] >> 2;
+        proto = p[9];
+        p += 20;
+    } else if (ethertype == 0x86DD) {
+        if (end - p < 40)
+            return NULL;
+        for (unsigned i = 0; i < 4; i++) {
+            hdr->source_ip[3 - i] = load32(p + 8 + 4 * i);
+            hdr->destination_ip[3 - i] = load32(p + 24 + 4 * i);
+        }
+        hdr->ip_ver = 6;
+        v6 = true;
+        dscp = (load16(p) >> 6) & 0x3F;
+        proto = p[6];
+        p += 40;
+    } else {
+        return NULL;
+    }
+
+    // L4, GTP-U with inner IPv4 in UDP
+    gtp = false;
+    if (proto == 17) {
+        if (end - p < 8)
+            return NULL;
+        hdr->source_port = load16(p);
+        hdr->destination_port = load16(p + 2);
+        hdr->l4_proto = 17;
+        p += 8;
+        if (hdr->destination_port == INT_GTP_PORT) {
+            // GTP header and the version nibble of inner IP
+            if (end - p < 9 || p[8] >> 4 != 4 || end - p < 28)
+                return NULL;
+            gtp = true;
+            p += 8;
+            hdr->source_ip[0] = load32(p + 12);
+            hdr->destination_ip[0] = load32(p + 16);
+            hdr->source_ip[1] = hdr->source_ip[2] = hdr->source_ip[3] = 0;
+            hdr->destination_ip[1] = hdr->destination_ip[2] = hdr->destination_ip[3] = 0;
+            hdr->ip_ver = 4;
+            dscp = p[1] >> 2;
+            proto = p[9];
+            p += 20;
+            if (proto == 17) {
+                if (end - p < 8)
+                    return NULL;
+                hdr->source_port = load16(p);
+                hdr->destination_port = load16(p + 2);
+                p += 8;
+            } else if (proto != 6) {
+                return NULL;
+            }
+        }
+    } else if (proto != 6) {
+        return NULL;
+    }
+    if (proto == 6) {
+        if (end - p < 20)
+            return NULL;
+        hdr->source_port = load16(p);
+        hdr->destination_port = load16(p + 2);
+        hdr->l4_proto = 6;
+        p += 20;
+    }
+    if (dscp != INT_DSCP)
+        return NULL;
+    return p;
+}
+
+inline bool int_parser::parse(const unsigned char *data, unsigned caplen, np4_int_header_t *hdr) const {
+    const unsigned char *end = data + caplen;
+    bool gtp, v6;
+    memset(hdr, 0, sizeof(*hdr));
+    const unsigned char *p = parse_l4(data, caplen, hdr, gtp, v6);
+    if (p == NULL)
+        return false;
+
+    // INT stack and tail
+    const unsigned char *tail = parse_int(p, end, hdr);
+    if (tail == NULL || end - tail < 4)
+        return false;
+    hdr->int_vld = 1;
+    if (gtp ? update_enc_l4 : v6 ? update_l4_v6 : update_l4) {
+        hdr->l4_proto = tail[0];
+        hdr->destination_port = load16(tail + 1);
+    }
+    return true;
+}
+
+inline unsigned int_parser::parse(const int_packet *packets, unsigned count, unsigned char *frames) const {
+    unsigned found = 0;
+    for (unsigned i = 0; i < count && i < INT_PARSER_PREFETCH; i++)
+        __builtin_prefetch(packets[i].data);
+    for (unsigned i = 0; i < count; i++) {
+        if (i + INT_PARSER_PREFETCH < count)
+            __builtin_prefetch(packets[i + INT_PARSER_PREFETCH].data);
+        unsigned char *frame = frames + i * NP4_RECORD_LEN;
+        memset(frame, 0, NP4_FRAME_HDR_LEN);
+        memcpy(frame, &packets[i].timestamp_s, 4);
+        memcpy(frame + 4, &packets[i].timestamp_ns, 4);
+        found += parse(packets[i].data, packets[i].caplen, (np4_int_header_t *) (frame + NP4_FRAME_HDR_LEN));
+    }
+    return found;
+}
+
+inline unsigned int_parser::compact(const unsigned char *data, unsigned caplen, unsigned char *record) const {
+    np4_int_header_t hdr;
+    bool gtp, v6;
+    memset(&hdr, 0, sizeof(hdr));
+    const unsigned char *p = parse_l4(data, caplen, &hdr, gtp, v6), *end = data + caplen;
+    if (p == NULL || end - p < 12)
+        return 0;
+    np4_int_compact_t *rec = (np4_int_compact_t *) record;
+    rec->version = NP4_COMPACT_VERSION;
+    rec->ip_ver = hdr.ip_ver;
+    rec->l4_proto = hdr.l4_proto;
+    rec->int_length = p[2];
+    rec->int_inscnt = p[5] & 0x1F;
+    rec->reserved8 = 0;
+    memcpy(&rec->int_insmap, p + 8, 2);
+    rec->source_port = __builtin_bswap16(hdr.source_port);
+    rec->destination_port = __builtin_bswap16(hdr.destination_port);
+    unsigned char *out = record + sizeof(np4_int_compact_t);
+    // Addresses of the IP carrying INT, inner IPv4 of GTP-U even behind outer IPv6
+    unsigned addresses = hdr.ip_ver == 6 ? 32 : 8;
+    if (hdr.ip_ver == 6) {
+        np4_int_store_ip6(out, &hdr, false);
+        np4_int_store_ip6(out + 16, &hdr, true);
+    } else {
+        uint32_t src = __builtin_bswap32(hdr.source_ip[0]), dst = __builtin_bswap32(hdr.destination_ip[0]);
+        memcpy(out, &src, 4);
+        memcpy(out + 4, &dst, 4);
+    }
+    // truncate() to 4 * INTlen bytes besides addresses, shorter when the packet ends first
+    unsigned len = 4 * p[2] + addresses;
+    unsigned present = sizeof(np4_int_compact_t) + addresses + (end - p - 12);
+    if (len > present)
+        len = present;
+    if (len > sizeof(np4_int_compact_t) + addresses)
+        memcpy(out + addresses, p + 12, len - sizeof(np4_int_compact_t) - addresses);
+    return len;
+}
+
+#endif
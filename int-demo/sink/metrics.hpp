@@ -0,0 +1,384 @@
+/*
+ * metrics.hpp: Live statistics and their Prometheus exposition of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_METRICS
+#define __HEADER_FILE_METRICS
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "np4_int_header.hpp"
+
+/**
+ * \brief Counter written by one thread and read by any.
+ *
+ * Updates are plain load and store without lock prefix, readers see the
+ * value of some recent moment.
+ */
+class counter {
+
+    private:
+
+        counter(const counter &);
+        counter &operator=(const counter &);
+
+        std::atomic<uint64_t> value;
+
+    public:
+
+        counter() : value(0) {}
+
+        inline void operator++(int) {
+            value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        inline void operator+=(uint64_t n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        inline void operator=(uint64_t n) {
+            value.store(n, std::memory_order_relaxed);
+        }
+
+        inline operator uint64_t() const {
+            return value.load(std::memory_order_relaxed);
+        }
+};
+
+/**
+ * \brief Statistics of one processing thread, readable while processing runs.
+ *
+ * Every thread owns its block of whole cache lines, so counting never
+ * touches lines of other threads; readers sum the blocks.
+ */
+struct alignas(64) worker_stats {
+    counter records;    //!< Number of received Netcope P4 inputs.
+    counter wrong_size; //!< Number of inputs of unexpected size.
+    counter int_valid;  //!< Number of inputs with INT.
+    counter reports;    //!< Number of sent Telemetry reports.
+    counter datagrams;  //!< Number of sent datagrams with Telemetry reports.
+    counter syscalls;   //!< Number of send syscalls.
+    counter send_errors;//!< Number of Telemetry reports lost for lack of socket buffers.
+    counter send_ns;    //!< Time spent in send syscalls.
+    counter suppressed; //!< Number of Telemetry reports suppressed for no change of flow.
+    counter evictions;  //!< Number of live flows dropped for lack of space.
+    counter untracked;  //!< Number of hops left out of histograms for lack of space.
+    counter ring_drops; //!< Number of records dropped on full ring to TX stage.
+    counter ring_peak;  //!< Highest sampled occupancy of ring to TX stage.
+    counter trace_drops;//!< Number of records left out of trace for full trace ring.
+    counter record_bytes;//!< Bytes of received records with frame headers, counted for compact records.
+    counter lost_hops;  //!< Number of hops of compact records left out for lack of slots.
+    counter bursts;     //!< Number of reads returning inputs.
+    counter idle_sleeps;//!< Number of short sleeps without inputs.
+    counter idle_waits; //!< Number of waits for inputs.
+    counter hops[NP4_INT_MAX_HOPS + 1]; //!< Number of inputs with INT by count of valid hops.
+
+    worker_stats &operator+=(const worker_stats &other) {
+        records += other.records;
+        wrong_size += other.wrong_size;
+        int_valid += other.int_valid;
+        reports += other.reports;
+        datagrams += other.datagrams;
+        syscalls += other.syscalls;
+        send_errors += other.send_errors;
+        send_ns += other.send_ns;
+        suppressed += other.suppressed;
+        evictions += other.evictions;
+        untracked += other.untracked;
+        ring_drops += other.ring_drops;
+        if (other.ring_peak > ring_peak)
+            ring_peak = (uint64_t) other.ring_peak;
+        trace_drops += other.trace_drops;
+        record_bytes += other.record_bytes;
+        lost_hops += other.lost_hops;
+        bursts += other.bursts;
+        idle_sleeps += other.idle_sleeps;
+        idle_waits += other.idle_waits;
+        for (unsigned i = 0; i <= NP4_INT_MAX_HOPS; i++)
+            hops[i] += other.hops[i];
+        return *this;
+    }
+};
+
+/**
+ * \brief Cache line aligned array of worker statistics.
+ */
+class worker_stats_array {
+
+    private:
+
+        worker_stats_array(const worker_stats_array &);
+        worker_stats_array &operator=(const worker_stats_array &);
+
+        worker_stats *items;
+        unsigned count;
+
+    public:
+
+        worker_stats_array(unsigned count) :
+            items(NULL),
+            count(count)
+            {
+            void *p;
+            if (posix_memalign(&p, 64, count * sizeof(worker_stats)))
+                throw std::bad_alloc();
+            items = (worker_stats *) p;
+            for (unsigned i = 0; i < count; i++)
+                new (&items[i]) worker_stats();
+        }
+
+        ~worker_stats_array() {
+            for (unsigned i = 0; i < count; i++)
+                items[i].~worker_stats();
+            free(items);
+        }
+
+        worker_stats &operator[](unsigned i) {
+            return items[i];
+        }
+
+        const worker_stats &operator[](unsigned i) const {
+            return items[i];
+        }
+
+        unsigned size() const {
+            return count;
+        }
+};
+
+/**
+ * \brief Server of statistics in Prometheus text format.
+ *
+ * Listens either on TCP port, answering every connection as HTTP request,
+ * or on Unix socket path (address starting with '/'), writing plain
+ * exposition text to every connection. Statistics of threads of one RX
+ * queue are summed when read.
+ */
+class metrics_server {
+
+    private:
+
+        metrics_server(const metrics_server &);
+        metrics_server &operator=(const metrics_server &);
+
+        const worker_stats_array &stats;  //!< Statistics of all threads.
+        std::vector<int> queues;          //!< RX queue of each statistics block.
+        std::string path;                 //!< Unix socket path, empty for TCP.
+        int sock;                         //!< Listening socket.
+        std::atomic<bool> running;        //!< Server thread keeps serving.
+        std::thread server;               //!< Server thread.
+
+        void serve();
+
+    public:
+
+        /**
+         * \brief Basic constructor, open listening socket and start serving.
+         * @param address TCP port or Unix socket path
+         * @param stats   Statistics of all threads
+         * @param queues  RX queue of each statistics block
+         */
+        metrics_server(const char *address, const worker_stats_array &stats, const std::vector<int> &queues);
+
+        ~metrics_server();
+
+        /**
+         * \brief Format statistics in Prometheus text format.
+         * @return Exposition text
+         */
+        std::string format() const;
+};
+
+inline metrics_server::metrics_server(const char *address, const worker_stats_array &stats, const std::vector<int> &queues) :
+    stats(stats),
+    queues(queues),
+    sock(-1),
+    running(true)
+    {
+    if (address[0] == '/') {
+        struct sockaddr_un addr;
+        if (strlen(address) >= sizeof(addr.sun_path))
+            throw std::runtime_error("metrics socket path too long");
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        path = address;
+        unlink(address);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(sock, 8) == -1) {
+            if (sock != -1)
+                close(sock);
+            throw std::runtime_error(std::string() + "unable to listen on '" + address + "'");
+        }
+    } else {
+        struct sockaddr_in addr;
+        int one = 1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(atoi(address));
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock != -1)
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (sock == -1 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(sock, 8) == -1) {
+            if (sock != -1)
+                close(sock);
+            throw std::runtime_error(std::string() + "unable to listen on port " + address);
+        }
+    }
+    server = std::thread(&metrics_server::serve, this);
+}
+
+inline metrics_server::~metrics_server() {
+    running = false;
+    server.join();
+    close(sock);
+    if (!path.empty())
+        unlink(path.c_str());
+}
+
+inline void metrics_server::serve() {
+    while (running) {
+        // Wake up now and then to notice the end of processing
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        int client = accept(sock, NULL, NULL);
+        if (client == -1)
+            continue;
+        std::string response = format();
+        if (path.empty()) {
+            // Read (and ignore) the request, the only resource are metrics
+            char request[1024];
+            struct pollfd cfd = { client, POLLIN, 0 };
+            if (poll(&cfd, 1, 1000) > 0 && read(client, request, sizeof(request)) > 0) {
+                char header[160];
+                snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", response.size());
+                response.insert(0, header);
+            } else {
+                response.clear();
+            }
+        }
+        const char *p = response.data();
+        size_t left = response.size();
+        while (left) {
+            ssize_t ret = send(client, p, left, MSG_NOSIGNAL);
+            if (ret <= 0)
+                break;
+            p += ret;
+            left -= ret;
+        }
+        close(client);
+    }
+}
+
+inline std::string metrics_server::format() const {
+    // Sum statistics of threads of each queue
+    std::vector<int> order;
+    for (unsigned i = 0; i < queues.size(); i++) {
+        bool seen = false;
+        for (unsigned j = 0; j < order.size(); j++)
+            seen |= order[j] == queues[i];
+        if (!seen)
+            order.push_back(queues[i]);
+    }
+    worker_stats_array sums(order.size());
+    for (unsigned i = 0; i < stats.size(); i++)
+        for (unsigned j = 0; j < order.size(); j++)
+            if (queues[i] == order[j])
+                sums[j] += stats[i];
+
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        counter worker_stats::*field;
+    } metrics[] = {
+        { "np4_int_records_total", "counter", "Netcope P4 records received.", &worker_stats::records },
+        { "np4_int_wrong_size_total", "counter", "Records of unexpected size.", &worker_stats::wrong_size },
+        { "np4_int_int_records_total", "counter", "Records with INT.", &worker_stats::int_valid },
+        { "np4_int_reports_total", "counter", "Telemetry reports sent.", &worker_stats::reports },
+        { "np4_int_report_datagrams_total", "counter", "Datagrams with Telemetry reports sent.", &worker_stats::datagrams },
+        { "np4_int_send_syscalls_total", "counter", "Send syscalls.", &worker_stats::syscalls },
+        { "np4_int_send_errors_total", "counter", "Telemetry reports lost for lack of socket buffers.", &worker_stats::send_errors },
+        { "np4_int_suppressed_reports_total", "counter", "Telemetry reports suppressed for no change of flow.", &worker_stats::suppressed },
+        { "np4_int_evicted_flows_total", "counter", "Live flows dropped for lack of space.", &worker_stats::evictions },
+        { "np4_int_untracked_hops_total", "counter", "Hops left out of histograms for lack of space.", &worker_stats::untracked },
+        { "np4_int_ring_drops_total", "counter", "Records dropped on full ring to TX stage.", &worker_stats::ring_drops },
+        { "np4_int_ring_peak_occupancy", "gauge", "Highest sampled occupancy of ring to TX stage.", &worker_stats::ring_peak },
+        { "np4_int_trace_drops_total", "counter", "Records left out of trace for full trace ring.", &worker_stats::trace_drops },
+        { "np4_int_record_bytes_total", "counter", "Bytes of records received, counted for compact records.", &worker_stats::record_bytes },
+        { "np4_int_lost_hops_total", "counter", "Hops of compact records left out for lack of slots.", &worker_stats::lost_hops },
+        { "np4_int_bursts_total", "counter", "Reads of Netcope P4 records returning records.", &worker_stats::bursts },
+        { "np4_int_idle_sleeps_total", "counter", "Short sleeps without records.", &worker_stats::idle_sleeps },
+        { "np4_int_idle_waits_total", "counter", "Waits for records.", &worker_stats::idle_waits },
+    };
+
+    std::string out;
+    char line[256];
+    for (unsigned m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", metrics[m].name, metrics[m].help, metrics[m].name, metrics[m].type);
+        out += line;
+        for (unsigned j = 0; j < order.size(); j++) {
+            snprintf(line, sizeof(line), "%s{queue=\"%d\"} %llu\n", metrics[m].name, order[j], (unsigned long long) (sums[j].*metrics[m].field));
+            out += line;
+        }
+    }
+
+    out += "# HELP np4_int_non_int_records_total Records of expected size without INT.\n# TYPE np4_int_non_int_records_total counter\n";
+    for (unsigned j = 0; j < order.size(); j++) {
+        uint64_t records = sums[j].records, wrong = sums[j].wrong_size, valid = sums[j].int_valid;
+        snprintf(line, sizeof(line), "np4_int_non_int_records_total{queue=\"%d\"} %llu\n", order[j],
+                 (unsigned long long) (records > wrong + valid ? records - wrong - valid : 0));
+        out += line;
+    }
+
+    out += "# HELP np4_int_send_seconds_total Time spent in send syscalls.\n# TYPE np4_int_send_seconds_total counter\n";
+    for (unsigned j = 0; j < order.size(); j++) {
+        snprintf(line, sizeof(line), "np4_int_send_seconds_total{queue=\"%d\"} %.9f\n", order[j], sums[j].send_ns / 1e9);
+        out += line;
+    }
+
+    out += "# HELP np4_int_hop_records_total Records with INT by count of valid hops.\n# TYPE np4_int_hop_records_total counter\n";
+    for (unsigned j = 0; j < order.size(); j++)
+        for (unsigned h = 0; h <= NP4_INT_MAX_HOPS; h++) {
+            snprintf(line, sizeof(line), "np4_int_hop_records_total{queue=\"%d\",hops=\"%u\"} %llu\n", order[j], h, (unsigned long long) sums[j].hops[h]);
+            out += line;
+        }
+    return out;
+}
+
+#endif
@@ -10,14 +10,70 @@
  *   detection, extraction and capture of INT headers, and sending Telemetry      -
  *   reports.                                                                     -
  * --------------------------------------------------------------------------------
- * Usage: np4_int [-hvo] [-d card] -r queue -t ip [-p port]
+ * Usage: np4_int [-hvoC] [-d card] -r queue [-c cpus] -t ip[,ip...] [-p port] [-k key] [-E opts] [-b batch] [-l usec] [-M mtu] [-X opts] [-f file [-R rate] [-n loops]] [-P file [-n loops]] [-i iface] [-s opts] [-H opts] [-q size [-D]] [-T file] [-m addr] [-L file [-Z]] [-B burst] [-I opts]
  *   -d card  Card to use (default: 0)
- *   -r queue RX queue to use for metadata
- *   -t ip    Target IPv4 address for Telemetry reports
+ *   -r queue RX queues to use for metadata, list or range (e.g. 0-3,6)
+ *   -c cpus  CPU cores for workers of RX queues, then for TX stages (default: 0,1,...)
+ *   -t ip    Target IPv4 address for Telemetry reports, or comma separated list of
+ *            collectors ip[:port] sharing the reports, each flow goes to one of them
  *   -p port  Target UDP port for Telemetry reports (default: 32766)
+ *   -k key   Spread reports over collectors by flow (5-tuple) or switch (ID of
+ *            the last hop) (default: flow)
+ *   -E opts  Health checks of more collectors by empty UDP datagrams, comma separated
+ *            suboptions:
+ *              interval=ms Time between probes (default: 1000)
+ *              down=N      Failed probes in a row removing collector (default: 2)
+ *              up=N        Clean probes in a row adding collector back (default: 3)
+ *              off         No health checks, all collectors always take reports
+ *   -b batch Number of Telemetry reports sent at once (default: 1)
+ *   -l usec  Maximal delay of batched Telemetry report (default: 1000)
+ *   -M mtu   Pack Telemetry reports into datagrams of up to mtu bytes (at least 1151, at most route MTU)
+ *   -X opts  Send reports through PACKET_MMAP TX ring of interface instead of raw socket,
+ *            falls back to raw socket if the ring is not available, comma separated suboptions:
+ *              if=name    Interface to send reports through (required)
+ *              dst=mac    Destination MAC address, next hop or collector (default: broadcast)
+ *              frames=N   Frames in TX ring of each sending thread (default: 1024)
+ *   -f file  Replay capture of Netcope P4 records (raw or pcap) instead of card
+ *   -P file  Parse raw INT packets of Ethernet pcap capture in software instead of card
+ *   -i iface Parse raw INT packets of interface (AF_PACKET) in software instead of card
+ *   -R rate  Replay rate in records per second per queue (default: full speed)
+ *   -n loops Passes over replayed capture, 0 for endless (default: 1)
+ *   -s opts  Send reports only on change of flow, comma separated suboptions:
+ *              lat=N      Hop latency change that triggers report (default: 1000)
+ *              occ=N      Queue occupancy change that triggers report (default: 100)
+ *              refresh=ms Report every flow at least this often (default: 1000)
+ *              flows=N    Flows tracked by each RX queue (default: 1048576)
+ *              age=ms     Forget flows not seen for this long (default: 60000)
+ *              defaults   Use default values
+ *   -H opts  Keep hop latency and queue occupancy histograms per switch and port,
+ *            comma separated suboptions:
+ *              interval=s Time between snapshots (default: 10)
+ *              ports=N    Switch ports tracked by each RX queue (default: 1024)
+ *              file=path  Append snapshots to file (default: standard output)
+ *              defaults   Use default values
+ *   -q size  Send reports from separate TX stage fed by ring of size records
+ *   -D       Drop records when ring to TX stage is full instead of waiting
+ *   -T file  Write binary trace of records to file, read by np4_int_trace
+ *   -m addr  Serve statistics in Prometheus text format on TCP port (HTTP) or Unix socket path
+ *   -L file  Load NP4 ruleset 2.0 file instead of built-in rules, applied again
+ *            (only the changed rules) on SIGHUP
+ *   -Z       Reset the card core: clear rules of a previous run at start, and let reload
+ *            remove or change rules (traffic is dropped while the core is reloaded)
+ *   -B burst Netcope P4 records read at once, at most 64 (default: 32)
+ *   -I opts  Back off when there are no records, comma separated suboptions:
+ *              busy       Spin endlessly, lowest latency at full CPU load
+ *              spin=N     Idle polls spinning (default: 128)
+ *              pause=N    Idle polls spinning with CPU pause then (default: 1024)
+ *              sleep=us   Length of short sleeps then (default: 20)
+ *              block=us   Time of short sleeps before waiting for records (default: 1000)
+ *              wait=us    Longest wait, latency of first record after a pause, also
+ *                         bounded by -l (default: 1000)
+ *   -C       Receive compact records of variable length (only present hops and instructions)
+ *            instead of 256-byte records, needs card or pcap replay
  *   -o       Keep original packets, don't remove INT on output
  *   -h       Writes out help
- *   -v       Verbose mode
+ *   -v       Verbose mode, records are traced and written out in background
+ * Build: g++ -O2 -std=c++11 -o np4_int np4_int.cpp -lnp4 -lpthread
  * --------------------------------------------------------------------------------
  */
 
@@ -38,622 +94,557 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <iostream>
-#include <cstring>
-#include <bitset>
+#include <iomanip>
+#include <cstdio>
+#include <csignal>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <pthread.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netinet/ip.h>
-#include <netinet/udp.h>
-#include <netinet/tcp.h>
 
 // Netcope P4 library
 #include <libnp4.h>
 
 #include "arguments.hpp"
+#include "np4_int_header.hpp"
+#include "compact_record.hpp"
+#include "report_encoder.hpp"
+#include "report_sender.hpp"
+#include "report_packer.hpp"
+#include "report_tx_ring.hpp"
+#include "rx_source.hpp"
+#include "flow_table.hpp"
+#include "hop_histograms.hpp"
+#include "spsc_ring.hpp"
+#include "trace_log.hpp"
+#include "metrics.hpp"
+#include "idle_policy.hpp"
+#include "collector_set.hpp"
+#include "../../common/np4_ruleset.hpp"
+
+std::atomic<bool> run(true);
+std::atomic<bool> reload(false);
 
 /**
- * \brief Netcope P4 INT header
+ * \brief Record handed from RX stage to TX stage, one ring slot.
  */
-typedef struct __attribute__((__packed__)) np4_int_header {
-    uint32_t                source_ip[4];
-
-    uint32_t                destination_ip[4];
-
-    uint16_t                source_port;
-    uint16_t                destination_port;
-
-    uint8_t                 ip_ver;
-    uint8_t                 l4_proto;
-    uint16_t                reserved16_3;
-
-    uint8_t                 int_length;
-    uint8_t                 int_inscnt   : 5;
-    uint8_t                 int_vld      : 1;
-    uint8_t                 reserved2_4  : 2;
-    uint16_t                int_insmap;
-
-
-    uint8_t                 int_hop0_vld : 1;
-    uint8_t                 int_hop1_vld : 1;
-    uint8_t                 int_hop2_vld : 1;
-    uint8_t                 int_hop3_vld : 1;
-    uint8_t                 int_hop4_vld : 1;
-    uint8_t                 int_hop5_vld : 1;
-    uint8_t                 reserved2_5  : 2;
-    uint8_t                 reserved8_5;
-    uint16_t                reserved16_5;
-
-    uint32_t                int_hop0_swid;
-    uint16_t                int_hop0_ingressport;
-    uint16_t                int_hop0_egressport;
-    uint32_t                int_hop0_hoplatency;
-    uint32_t                int_hop0_occupancy_queueid   : 8;
-    uint32_t                int_hop0_occupancy_occupancy : 24;
-    uint32_t                int_hop0_ingresstimestamp;
-    uint32_t                int_hop0_egresstimestamp;
-    uint32_t                int_hop0_congestion_queueid    : 8;
-    uint32_t                int_hop0_congestion_congestion : 24;
-    uint32_t                int_hop0_egressporttxutilization;
-
-    uint32_t                int_hop1_swid;
-    uint16_t                int_hop1_ingressport;
-    uint16_t                int_hop1_egressport;
-    uint32_t                int_hop1_hoplatency;
-    uint32_t                int_hop1_occupancy_queueid   : 8;
-    uint32_t                int_hop1_occupancy_occupancy : 24;
-    uint32_t                int_hop1_ingresstimestamp;
-    uint32_t                int_hop1_egresstimestamp;
-    uint32_t                int_hop1_congestion_queueid    : 8;
-    uint32_t                int_hop1_congestion_congestion : 24;
-    uint32_t                int_hop1_egressporttxutilization;
-
-    uint32_t                int_hop2_swid;
-    uint16_t                int_hop2_ingressport;
-    uint16_t                int_hop2_egressport;
-    uint32_t                int_hop2_hoplatency;
-    uint32_t                int_hop2_occupancy_queueid   : 8;
-    uint32_t                int_hop2_occupancy_occupancy : 24;
-    uint32_t                int_hop2_ingresstimestamp;
-    uint32_t                int_hop2_egresstimestamp;
-    uint32_t                int_hop2_congestion_queueid    : 8;
-    uint32_t                int_hop2_congestion_congestion : 24;
-    uint32_t                int_hop2_egressporttxutilization;
-
-    uint32_t                int_hop3_swid;
-    uint16_t                int_hop3_ingressport;
-    uint16_t                int_hop3_egressport;
-    uint32_t                int_hop3_hoplatency;
-    uint32_t                int_hop3_occupancy_queueid   : 8;
-    uint32_t                int_hop3_occupancy_occupancy : 24;
-    uint32_t                int_hop3_ingresstimestamp;
-    uint32_t                int_hop3_egresstimestamp;
-    uint32_t                int_hop3_congestion_queueid    : 8;
-    uint32_t                int_hop3_congestion_congestion : 24;
-    uint32_t                int_hop3_egressporttxutilization;
-
-    uint32_t                int_hop4_swid;
-    uint16_t                int_hop4_ingressport;
-    uint16_t                int_hop4_egressport;
-    uint32_t                int_hop4_hoplatency;
-    uint32_t                int_hop4_occupancy_queueid   : 8;
-    uint32_t                int_hop4_occupancy_occupancy : 24;
-    uint32_t                int_hop4_ingresstimestamp;
-    uint32_t                int_hop4_egresstimestamp;
-    uint32_t                int_hop4_congestion_queueid    : 8;
-    uint32_t                int_hop4_congestion_congestion : 24;
-    uint32_t                int_hop4_egressporttxutilization;
-
-    uint32_t                int_hop5_swid;
-    uint16_t                int_hop5_ingressport;
-    uint16_t                int_hop5_egressport;
-    uint32_t                int_hop5_hoplatency;
-    uint32_t                int_hop5_occupancy_queueid   : 8;
-    uint32_t                int_hop5_occupancy_occupancy : 24;
-    uint32_t                int_hop5_ingresstimestamp;
-    uint32_t                int_hop5_egresstimestamp;
-    uint32_t                int_hop5_congestion_queueid    : 8;
-    uint32_t                int_hop5_congestion_congestion : 24;
-    uint32_t                int_hop5_egressporttxutilization;
-} np4_int_header_t;
+struct alignas(64) report_slot {
+    np4_int_header_t hdr;  //!< Netcope INT header.
+    uint32_t timestamp_s;  //!< Timestamp of the record (seconds).
+};
+
+typedef spsc_ring<report_slot> report_ring;
 
 /**
- * \brief Telemetry Report header
+ * \brief Signal handler, stops processing.
  */
-struct __attribute__((__packed__)) telemetry_report
-{
-    uint8_t    nproto: 4;
-    uint8_t    ver   : 4;
-    uint16_t   res16;
-    uint8_t    hw_id : 6;
-    uint8_t    res2  : 2;
-    uint32_t   sequence_number;
-    uint32_t   ingress_timestamp;
-};
+void stop_processing(int) {
+    run = false;
+}
 
 /**
- * \brief Ethernet header
+ * \brief Signal handler, requests reload of rules.
  */
-struct __attribute__((__packed__)) ethernet
-{
-    uint8_t    dmac[6];
-    uint8_t    smac[6];
-    uint16_t   ethtype;
-};
+void reload_rules(int) {
+    reload = true;
+}
 
 /**
- * \brief INT Shim header
+ * \brief Read coarse monotonic time, cheap enough to be read for every record.
+ * @return Time in nanoseconds
  */
-struct __attribute__((__packed__)) int_shim
-{
-    uint8_t    type;
-    uint8_t    res1;
-    uint8_t    length;
-    uint8_t    res2;
-};
+static inline uint64_t coarse_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 /**
- * \brief INT header
+ * \brief Prefetch Netcope P4 input, at most one full record.
+ * @param data Input
+ * @param len  Length of the input
  */
-struct __attribute__((__packed__)) int_hdr
-{
-    uint8_t    res4 : 4;
-    uint8_t    ver  : 4;
-    uint8_t    ins_cnt : 5;
-    uint8_t    res3    : 3;
-    uint8_t    max_hop_cnt;
-    uint8_t    total_hop_cnt;
-    uint16_t   instr_bitmap;
-    uint16_t   reserved;
-};
+static inline void np4_prefetch(const unsigned char *data, unsigned len) {
+    if (len > NP4_RECORD_LEN)
+        len = NP4_RECORD_LEN;
+    for (unsigned offset = 0; offset < len; offset += 64)
+        __builtin_prefetch(data + offset);
+}
 
 /**
- * \brief INT Tail header
+ * \brief Pin calling thread to CPU core.
+ * @param cpu  CPU core to run on
+ * @param what Description of the thread for error message
+ * @param queue RX queue the thread works for
  */
-struct __attribute__((__packed__)) int_tail
-{
-    uint8_t    proto;
-    uint16_t   dport;
-    uint8_t    dscp;
-};
-
-bool run = true;
+static void pin_thread(int cpu, const char *what, int queue) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+        std::cerr << "Unable to pin " << what << " of RX queue " << queue << " to CPU " << cpu << std::endl;
+}
 
 /**
- * \brief Function for calculating IP checksum
- * @param vdata  Pointer to IP header
- * @param length Length of IP header
- * Source: http://www.microhowto.info/howto/calculate_an_internet_protocol_checksum_in_c.html
+ * \brief Telemetry report output of one RX queue: report encoder and batched sender (TX ring or raw socket) of every collector.
+ *
+ * With more collectors, every report goes to the collector of its key
+ * (collector_map), each collector has its own queue of datagrams, so
+ * batching and packing work per collector.
  */
-uint16_t ip_checksum(void* vdata,size_t length) {
-    // Cast the data pointer to one that can be indexed.
-    char* data=(char*)vdata;
-
-    // Initialise the accumulator.
-    uint64_t acc=0xffff;
-
-    // Handle any partial block at the start of the data.
-    unsigned int offset=((uintptr_t)data)&3;
-    if (offset) {
-        size_t count=4-offset;
-        if (count>length) count=length;
-        uint32_t word=0;
-        memcpy(offset+(char*)&word,data,count);
-        acc+=ntohl(word);
-        data+=count;
-        length-=count;
-    }
+class report_output {
+
+    private:
+
+        report_output(const report_output &);
+        report_output &operator=(const report_output &);
+
+        /**
+         * \brief Reports of one collector.
+         */
+        struct collector_output {
+            report_encoder encoder;                //!< Encoder of Telemetry reports to the collector.
+            std::unique_ptr<report_sender> sender; //!< Batched sender of Telemetry reports.
+            std::unique_ptr<report_packer> packer; //!< Packer of Telemetry reports, NULL if not requested.
+            uint64_t syscalls;                     //!< Send syscalls already in statistics.
+
+            collector_output(const struct sockaddr_in &addr, uint8_t hw_id) :
+                encoder(addr.sin_addr.s_addr, ntohs(addr.sin_port), hw_id),
+                syscalls(0)
+                {
+            }
+        };
+
+        collector_health &health;        //!< Collectors and their health.
+        collector_map map;               //!< Collector of report keys.
+        bool key_switch;                 //!< Key reports by switch ID instead of flow.
+        int sock;                        //!< Raw socket for Telemetry reports, -1 if TX rings are used.
+        std::vector<std::unique_ptr<collector_output>> outputs; //!< Output of every collector.
+        worker_stats &stats;             //!< Statistics of the sending thread.
+
+        inline void update() {
+            uint64_t reports = 0, datagrams = 0, syscalls = 0, errors = 0, send_ns = 0;
+            for (size_t i = 0; i < outputs.size(); i++) {
+                const report_sender &sender = *outputs[i]->sender;
+                reports += sender.reports;
+                datagrams += sender.datagrams;
+                syscalls += sender.syscalls;
+                errors += sender.errors;
+                send_ns += sender.send_ns;
+                outputs[i]->syscalls = sender.syscalls;
+            }
+            stats.reports = reports;
+            stats.datagrams = datagrams;
+            stats.syscalls = syscalls;
+            stats.send_errors = errors;
+            stats.send_ns = send_ns;
+        }
 
-    // Handle any complete 32-bit blocks.
-    char* data_end=data+(length&~3);
-    while (data!=data_end) {
-        uint32_t word;
-        memcpy(&word,data,4);
-        acc+=ntohl(word);
-        data+=4;
-    }
-    length&=3;
+        /**
+         * \brief Find source address the kernel routes reports to the target from.
+         * @return Source IPv4 address (network byte order), 0 if unknown
+         */
+        static in_addr_t route_source(const struct sockaddr_in &addr) {
+            in_addr_t saddr = 0;
+            int probe = socket(AF_INET, SOCK_DGRAM, 0);
+            if (probe == -1)
+                return 0;
+            struct sockaddr_in local;
+            socklen_t len = sizeof(local);
+            if (connect(probe, (const struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+                getsockname(probe, (struct sockaddr *) &local, &len) == 0)
+                saddr = local.sin_addr.s_addr;
+            close(probe);
+            return saddr;
+        }
 
-    // Handle any partial block at the end of the data.
-    if (length) {
-        uint32_t word=0;
-        memcpy(&word,data,length);
-        acc+=ntohl(word);
-    }
+        /**
+         * \brief MTU of the route to collector, reports are sent with DF set.
+         * @param addr Collector
+         * @return MTU, 0 if unknown
+         */
+        static unsigned route_mtu(const struct sockaddr_in &addr) {
+            int mtu = 0;
+            int probe = socket(AF_INET, SOCK_DGRAM, 0);
+            if (probe == -1)
+                return 0;
+            socklen_t len = sizeof(mtu);
+            if (connect(probe, (const struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+                getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &len) == -1)
+                mtu = 0;
+            close(probe);
+            return mtu;
+        }
 
-    // Handle deferred carries.
-    acc=(acc&0xffffffff)+(acc>>32);
-    while (acc>>16) {
-        acc=(acc&0xffff)+(acc>>16);
-    }
+        static int open_socket() {
+            int sock;
+            if ((sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+                throw std::string("Socket error");
+            }
+            return sock;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor, open TX rings or socket and prepare common headers for Telemetry reports.
+         * @param args   Parsed command line arguments
+         * @param index  Index of the RX queue in the arguments
+         * @param stats  Statistics of the sending thread
+         * @param health Collectors and their health
+         */
+        report_output(arguments const &args, unsigned index, worker_stats &stats, collector_health &health) :
+            health(health),
+            map(health),
+            key_switch(args.key_switch),
+            sock(-1),
+            stats(stats)
+            {
+            unsigned buffer_len = args.pack_mtu ? report_packer::buffer_len(args.pack_mtu) : REPORT_MAX_LEN;
+            for (unsigned i = 0; i < health.size(); i++) {
+                const struct sockaddr_in &addr = health.address(i);
+                collector_output *output = new collector_output(addr, (1 + index) & 0x3F);
+                outputs.push_back(std::unique_ptr<collector_output>(output));
+                if (args.tx_ring_if) {
+                    try {
+                        ring_report_sender *ring = new ring_report_sender(args.tx_ring_if, args.tx_ring_dst, addr.sin_family,
+                                                                          args.batch, args.flush_us, buffer_len,
+                                                                          args.tx_ring_frames);
+                        output->sender.reset(ring);
+                        if (args.pack_mtu > ring->mtu()) {
+                            std::string mtu = std::to_string(ring->mtu());
+                            output->sender.reset();
+                            throw std::runtime_error("pack MTU " + std::to_string(args.pack_mtu) + " exceeds MTU " + mtu +
+                                                     " of " + args.tx_ring_if);
+                        }
+                        output->encoder.set_source(ring->source());
+                    } catch (std::runtime_error &e) {
+                        std::cerr << "TX ring of RX queue " << args.rx_queues[index] << " not available (" << e.what()
+                                  << "), using raw socket" << std::endl;
+                    }
+                }
+                if (!output->sender) {
+                    // Packed datagram over the MTU would fail to send as a whole
+                    unsigned mtu = route_mtu(addr);
+                    if (args.pack_mtu && mtu && args.pack_mtu > mtu)
+                        throw std::runtime_error("pack MTU " + std::to_string(args.pack_mtu) + " exceeds MTU " +
+                                                 std::to_string(mtu) + " of route to collector " + health.name(i));
+                    if (sock == -1)
+                        sock = open_socket();
+                    output->encoder.set_source(route_source(addr));
+                    output->sender.reset(new socket_report_sender(sock, addr, args.batch, args.flush_us, buffer_len));
+                }
+                if (args.pack_mtu)
+                    output->packer.reset(new report_packer(output->encoder, *output->sender, args.pack_mtu, args.flush_us));
+            }
+        }
+
+        ~report_output() {
+            // Senders go before the socket they use
+            outputs.clear();
+            if (sock != -1)
+                close(sock);
+        }
+
+        /**
+         * \brief Encode Telemetry report and queue it to its collector, send whole batch once full.
+         * @param hdr         Netcope INT header with valid INT
+         * @param timestamp_s Timestamp of the record (seconds)
+         */
+        inline void send(const np4_int_header_t *hdr, uint32_t timestamp_s) {
+            collector_output &output = *outputs[outputs.size() == 1 ? 0 : map.lookup(collector_key(hdr, key_switch))];
+            if (output.packer)
+                output.packer->add(hdr, timestamp_s);
+            else
+                output.sender->commit(output.encoder.encode(output.sender->next(), hdr, timestamp_s));
+            if (output.sender->syscalls != output.syscalls)
+                update();
+        }
+
+        /**
+         * \brief Send batched Telemetry reports waiting too long, follow health of collectors.
+         */
+        inline void poll() {
+            map.poll();
+            bool sent = false;
+            for (size_t i = 0; i < outputs.size(); i++) {
+                collector_output &output = *outputs[i];
+                if (output.packer)
+                    output.packer->poll();
+                else
+                    output.sender->poll();
+                sent |= output.sender->syscalls != output.syscalls;
+            }
+            if (sent)
+                update();
+        }
+
+        /**
+         * \brief Send remaining Telemetry reports, account them to collectors.
+         */
+        void finish() {
+            for (size_t i = 0; i < outputs.size(); i++) {
+                if (outputs[i]->packer)
+                    outputs[i]->packer->flush();
+                else
+                    outputs[i]->sender->flush();
+                health.account(i, outputs[i]->sender->reports);
+            }
+            update();
+        }
+};
+
+/**
+ * \brief Widths of match keys and action parameters of INT processing (p4/tables.p4).
+ */
+inline const ruleset_widths &np4_widths() {
+    static const ruleset_widths widths = ruleset_widths()
+        .key("tab_compact_record", "md_netcope.IPver", 8)
+        .key("tab_compact_record_build", "md_netcope.IPver", 8)
+        .param("send_to_port", "port", 8);
+    return widths;
+}
 
-    // If the data began at an odd byte address
-    // then reverse the byte order to compensate.
-    if (offset&1) {
-        acc=((acc&0xff00)>>8)|((acc&0x00ff)<<8);
+/**
+ * \brief Built-in rules of INT processing.
+ * @param original Keep original packets, don't remove INT on output
+ * @param compact  Send compact records instead of 256-byte records
+ * @param rules    Output ruleset
+ */
+inline void np4_builtin_rules(bool original, bool compact, ruleset &rules) {
+    rules.set_default("tab_compact_record", "permit");
+    rules.set_default("tab_compact_record_build", "drop_packet");
+    if (compact) {
+        // Clone of INT packet becomes compact record of the IP version carrying INT (clone session
+        // COMPACT_SESSION of p4/parser.p4 goes to DMA), the packet itself is forwarded as usual
+        ruleset_rule clone, build;
+        clone.table = "tab_compact_record";
+        clone.keys.resize(1);
+        clone.keys[0].name = "md_netcope.IPver";
+        clone.action = "compact_record_clone";
+        build.table = "tab_compact_record_build";
+        build.keys = clone.keys;
+        for (unsigned ver = 4; ver <= 6; ver += 2) {
+            clone.keys[0].value.assign(1, ver);
+            build.keys[0].value.assign(1, ver);
+            build.action = ver == 4 ? "compact_record_v4" : "compact_record_v6";
+            rules.add(clone);
+            rules.add(build);
+        }
     }
+    rules.set_default("tab_remove_int", original ? "permit" : "act_remove_int");
+    rules.set_default("tab_update_enc_L4", original ? "permit" : "update_enc_L4");
+    rules.set_default("tab_update_L4", original ? "permit" : "update_L4");
+    rules.set_default("tab_update_L4_v6", original ? "permit" : "update_L4_v6");
+    rules.set_default("tab_terminate_gtp", original ? "permit" : "terminate_gtp");
+
+    std::vector<ruleset_field> params(1);
+    params[0].name = "port";
+    params[0].value.push_back(1);
+    rules.set_default("tab_send", "send_to_port", params);
+}
 
-    // Return the checksum in network byte order.
-    return htons(~acc);
+/**
+ * \brief Rules of INT processing, loaded from rules file or built-in.
+ * @param args  Parsed command line arguments
+ * @param rules Output ruleset
+ */
+inline void np4_rules(arguments const &args, ruleset &rules) {
+    if (args.rules)
+        rules.load(args.rules);
+    else
+        np4_builtin_rules(args.original, args.compact, rules);
 }
 
 /**
- * \brief Packet processing function.
- * @param np4  Netcope P4 instance
- * @param args Parsed command line arguments
+ * \brief Packet processing function of one RX queue, also sends reports unless a TX stage is given.
+ * @param np4   Netcope P4 instance
+ * @param args  Parsed command line arguments
+ * @param index Index of the RX queue in the arguments
+ * @param cpu   CPU core to run on
+ * @param ring  Ring to TX stage, NULL to send reports directly
+ * @param hist  Writer of histogram snapshots, NULL if not keeping histograms
+ * @param trace Trace ring of the RX queue, NULL if not tracing
+ * @param stats Statistics of the worker, updated during processing
+ * @param health Collectors of reports and their health
  */
-void np4_processing(np4_t* np4, arguments const &args) {
-    np4_rx_stream_t *rx_stream = NULL; // Netcope P4 RX stream
+void np4_worker(np4_t* np4, arguments const &args, unsigned index, int cpu, report_ring *ring, hist_log *hist, trace_ring *trace, worker_stats &stats,
+                collector_health &health) {
+    std::unique_ptr<rx_source> source; // Source of Netcope P4 inputs
+    unsigned char *burst[RX_BURST_MAX];  // Burst of Netcope P4 inputs
+    unsigned burst_len[RX_BURST_MAX];    // Lengths of the inputs
     unsigned char *data;               // Pointer to Netcope P4 input
     unsigned data_len;                 // Length of Netcope P4 input
     np4_header_t np4_hdr;              // Netcope P4 frame header
     np4_int_header_t *np4_int_hdr;     // Netcope P4 INT header
     np4_error_t err;                   // Netcope P4 error type
     unsigned frame_len;
+    compact_decoder decoder(!args.original); // Decoder of compact records
+    unsigned char expanded[NP4_RECORD_LEN];  // Compact record expanded into full record
+    unsigned lost;
 
-    // Telemetry report packet types
-    int sock;
-    struct sockaddr_in sockaddr;
-    char buffer[512] = { 0 };
-    uint32_t seqnum = 0;
+    // Pin worker to its CPU core before any of its data is allocated
+    pin_thread(cpu, "worker", args.rx_queues[index]);
 
     try {
-        // Prepare socket for Telemetry reports
-        if ((sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {
-            throw std::string("Socket error");
-        }
-        memset((char *) &sockaddr, 0, sizeof(sockaddr));
-        sockaddr.sin_family = AF_INET;
-        if (inet_aton(args.ip, &sockaddr.sin_addr) == 0)
-        {
-            throw std::string("IP address error");
+        // Prepare Telemetry reports unless they are left to TX stage
+        std::unique_ptr<report_output> output;
+        if (ring == NULL)
+            output.reset(new report_output(args, index, stats, health));
+
+        // Prepare state of flows for change-triggered reports
+        std::unique_ptr<flow_table> flows;
+        if (args.suppress)
+            flows.reset(new flow_table(args.suppress_flows, args.suppress_latency, args.suppress_occupancy, args.suppress_refresh, args.suppress_age));
+
+        // Prepare histograms of switch ports
+        hop_histograms *hists = NULL;
+        if (hist)
+            hists = &hist->create(index, args.hist_ports, args.hist_interval, args.rx_queues[index]);
+
+        // Open Netcope P4 RX stream, replayed capture or raw packets parsed in software
+        if (args.replay) {
+            source.reset(new replay_rx_source(args.replay, args.rate, args.loops));
+        } else if (args.packets || args.packet_if) {
+            ruleset rules(&np4_widths());
+            np4_rules(args, rules);
+            if (args.packets)
+                source.reset(new packet_rx_source(int_parser(rules), args.packets, args.loops));
+            else
+                source.reset(new packet_rx_source(int_parser(rules), args.packet_if));
+        } else {
+            source.reset(new np4_rx_source(np4, args.rx_queues[index]));
         }
 
-        // Prepare common IP header for Telemetry reports
-        struct iphdr *ip = (struct iphdr *) &(buffer[0]);
-        ip->ihl = 5;
-        ip->version = 4;
-        ip->tos = 0;
-        ip->tot_len = 0;
-        ip->id = 0;
-        ip->frag_off = htons(0x4000);
-        ip->ttl = 255;
-        ip->protocol = 17;
-        ip->check = 0;
-        ip->saddr = 0;
-        ip->daddr = sockaddr.sin_addr.s_addr;
-
-        // Prepare common UDP header for Telemetry reports
-        struct udphdr *udp = (struct udphdr *) &(buffer[20]);
-        udp->source = 0;
-        udp->dest = htons(args.port);
-        udp->len = 0;
-        udp->check = 0;
-
-        // Open Netcope P4 RX stream
-        err = np4_rx_stream_open(np4, args.rx_queue, &rx_stream);
         // Main processing loop
-        while(run) {
-            // Rry to read next Netcope P4 input
-            data = np4_rx_stream_read_next(rx_stream, &data_len);
-            // New Netcope P4 input
-            if(data) {
+        idle_policy idle(args.idle_busy, args.idle_spin, args.idle_pause, args.idle_sleep_us, args.idle_block_us,
+                         std::min(args.idle_wait_us, args.flush_us));
+        unsigned sampled = 0;
+        while(run && !source->done()) {
+            // Try to read next burst of Netcope P4 inputs
+            unsigned count = source->read_burst(burst, burst_len, args.burst);
+            // Sample ring occupancy and table counters, write out histograms once per interval; checked when idle and every 1024 records
+            sampled += count;
+            if (count == 0 || sampled >= 1024) {
+                sampled = 0;
+                if (flows)
+                    stats.evictions = flows->evictions;
+                if (hists)
+                    stats.untracked = hists->untracked;
+                if (ring) {
+                    uint64_t occupancy = ring->size();
+                    if (occupancy > stats.ring_peak)
+                        stats.ring_peak = occupancy;
+                }
+                if (hists)
+                    hists->poll(coarse_time_ns());
+                stats.idle_sleeps = idle.sleeps;
+                stats.idle_waits = idle.waits;
+            }
+            if (count) {
+                stats.bursts++;
+                idle.busy();
+            }
+            // Prefetch first inputs of the burst, then each one RX_PREFETCH inputs ahead
+            for (unsigned i = 0; i < count && i < RX_PREFETCH; i++)
+                np4_prefetch(burst[i], burst_len[i]);
+            // New Netcope P4 inputs
+            for (unsigned i = 0; i < count; i++) {
+                if (i + RX_PREFETCH < count)
+                    np4_prefetch(burst[i + RX_PREFETCH], burst_len[i + RX_PREFETCH]);
+                data = burst[i];
+                data_len = burst_len[i];
+                stats.records++;
+                bool full = data_len == NP4_RECORD_LEN;
+                // Expand compact record behind its frame header, then process it as full record;
+                // packets without INT still come as full records
+                if (args.compact) {
+                    stats.record_bytes += data_len;
+                    if (data_len > NP4_FRAME_HDR_LEN &&
+                        decoder.decode(data + NP4_FRAME_HDR_LEN, data_len - NP4_FRAME_HDR_LEN,
+                                       (np4_int_header_t *) (expanded + NP4_FRAME_HDR_LEN), &lost)) {
+                        memcpy(expanded, data, NP4_FRAME_HDR_LEN);
+                        stats.lost_hops += lost;
+                        data = expanded;
+                        full = true;
+                    }
+                }
                 // Check length of Netcope INT header
-                if (data_len == 256) {
+                if (full) {
                     // Parse Netcope P4 input into Netcope P4 header and Netcope INT header
                     err = np4_parse_frame(data, &np4_hdr, (unsigned char **) &np4_int_hdr, &frame_len);
                     if (err) {
                         throw np4_print_error(err);
                     }
 
-                    // Debug output
-                    if (args.verbose) {
-                        std::cout << "Received INT header" << std::endl;
-                        std::cout << "\tFlow ID:" << std::endl;
-                        std::cout << "\t\tTimestamp           : " << np4_hdr.timestamp_s << "." << np4_hdr.timestamp_ns << std::endl;
-                        std::cout << "\t\tInterface           : " << (unsigned) np4_hdr.iface << std::endl;
-                        std::cout << "\t\tIP version          : " << (unsigned) np4_int_hdr->ip_ver << std::endl;
-                        std::cout << "\t\tSource IPv4         : "
-                                    << ((np4_int_hdr->source_ip[0] >> 24) & 0xFF) << "."
-                                    << ((np4_int_hdr->source_ip[0] >> 16) & 0xFF) << "."
-                                    << ((np4_int_hdr->source_ip[0] >> 8) & 0xFF) << "."
-                                    << ((np4_int_hdr->source_ip[0] & 0xFF)) << std::endl;
-                        std::cout << "\t\tDestination IPv4    : "
-                                    << ((np4_int_hdr->destination_ip[0] >> 24) & 0xFF) << "."
-                                    << ((np4_int_hdr->destination_ip[0] >> 16) & 0xFF) << "."
-                                    << ((np4_int_hdr->destination_ip[0] >> 8) & 0xFF) << "."
-                                    << ((np4_int_hdr->destination_ip[0] & 0xFF)) << std::endl;
-                        std::cout << "\t\tL4 protocol         : " << (unsigned) np4_int_hdr->l4_proto << std::endl;
-                        std::cout << "\t\tSource L4 port      : " << np4_int_hdr->source_port << std::endl;
-                        std::cout << "\t\tDestination L4 port : " << np4_int_hdr->destination_port << std::endl;
-                        std::cout << std::endl;
-                        // If INT was detected
-                        if (np4_int_hdr->int_vld) {
-                            std::cout << "\tINT common:"  << std::endl;
-                            std::cout << "\t\tLength              : " << (unsigned) np4_int_hdr->int_length << std::endl;
-                            std::cout << "\t\tInstruction count   : " << (unsigned) np4_int_hdr->int_inscnt << std::endl;
-                            std::cout << "\t\tInstruction map     : " << std::bitset<16>(np4_int_hdr->int_insmap) << std::endl;
-                            std::cout << std::endl;
-                            // If INT Hop 0 was detected
-                            if (np4_int_hdr->int_hop0_vld) {
-                                std::cout << "\tINT hop 0:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop0_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop0_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop0_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop0_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop0_occupancy_queueid << " : " << np4_int_hdr->int_hop0_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop0_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop0_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop0_congestion_queueid << " : " << np4_int_hdr->int_hop0_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop0_egressporttxutilization << std::endl;
-                            }
-                            // If INT Hop 1 was detected
-                            if (np4_int_hdr->int_hop1_vld) {
-                                std::cout << "\tINT hop 1:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop1_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop1_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop1_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop1_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop1_occupancy_queueid << " : " << np4_int_hdr->int_hop1_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop1_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop1_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop1_congestion_queueid << " : " << np4_int_hdr->int_hop1_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop1_egressporttxutilization << std::endl;
-                            }
-                            // If INT Hop 2 was detected
-                            if (np4_int_hdr->int_hop2_vld) {
-                                std::cout << "\tINT hop 2:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop2_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop2_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop2_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop2_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop2_occupancy_queueid << " : " << np4_int_hdr->int_hop2_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop2_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop2_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop2_congestion_queueid << " : " << np4_int_hdr->int_hop2_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop2_egressporttxutilization << std::endl;
-                            }
-                            // If INT Hop 3 was detected
-                            if (np4_int_hdr->int_hop3_vld) {
-                                std::cout << "\tINT hop 3:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop3_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop3_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop3_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop3_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop3_occupancy_queueid << " : " << np4_int_hdr->int_hop3_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop3_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop3_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop3_congestion_queueid << " : " << np4_int_hdr->int_hop3_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop3_egressporttxutilization << std::endl;
-                            }
-                            // If INT Hop 4 was detected
-                            if (np4_int_hdr->int_hop4_vld) {
-                                std::cout << "\tINT hop 4:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop4_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop4_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop4_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop4_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop4_occupancy_queueid << " : " << np4_int_hdr->int_hop4_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop4_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop4_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop4_congestion_queueid << " : " << np4_int_hdr->int_hop4_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop4_egressporttxutilization << std::endl;
-                            }
-                            // If INT Hop 5 was detected
-                            if (np4_int_hdr->int_hop5_vld) {
-                                std::cout << "\tINT hop 5:" << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x8000) std::cout << "\t\tSwitch ID           : " << np4_int_hdr->int_hop5_swid << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tIngress port        : " << np4_int_hdr->int_hop5_ingressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x4000) std::cout << "\t\tEgress port         : " << np4_int_hdr->int_hop5_egressport << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x2000) std::cout << "\t\tHop latency         : " << np4_int_hdr->int_hop5_hoplatency << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x1000) std::cout << "\t\tQueue occupancy     : " << np4_int_hdr->int_hop5_occupancy_queueid << " : " << np4_int_hdr->int_hop5_occupancy_occupancy << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0800) std::cout << "\t\tIngress timestamp   : " << np4_int_hdr->int_hop5_ingresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0400) std::cout << "\t\tEgress timestamp    : " << np4_int_hdr->int_hop5_egresstimestamp << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0200) std::cout << "\t\tQueue congestion    : " << np4_int_hdr->int_hop5_congestion_queueid << " : " << np4_int_hdr->int_hop5_congestion_congestion << std::endl;
-                                if (np4_int_hdr->int_insmap & 0x0100) std::cout << "\t\tEgress port TX util.: " << np4_int_hdr->int_hop5_egressporttxutilization << std::endl;
-                            }
-                        } else {
-                            std::cout << "\tINT not detected." << std::endl;
-                        }
-                    }
+                    // Debug output, copied aside and written out by background thread
+                    if (trace && !trace_push(*trace, args.rx_queues[index], data, (unsigned char *) np4_int_hdr - data,
+                                             np4_hdr.timestamp_s, np4_hdr.timestamp_ns, np4_hdr.iface))
+                        stats.trace_drops++;
 
                     // Prepare and send Telemetry report if INT was detected
                     if (np4_int_hdr->int_vld) {
-                        // Prepare Telemetry report header
-                        struct telemetry_report *tel = (struct telemetry_report *) &(buffer[28]);
-                        tel->ver = 0;
-                        tel->nproto = 0;
-                        tel->res16 = htons(0x2000);
-                        tel->res2 = 0;
-                        tel->hw_id = 1;
-                        tel->sequence_number = htonl(++seqnum);
-                        tel->ingress_timestamp = htonl(np4_hdr.timestamp_s);
-
-                        // Prepare Ethernet header
-                        struct ethernet *eth_in = (struct ethernet *) &(buffer[40]);
-                        eth_in->dmac[0] = 0x01; eth_in->dmac[1] = 0x02; eth_in->dmac[2] = 0x03; eth_in->dmac[3] = 0x04; eth_in->dmac[4] = 0x05; eth_in->dmac[5] = 0x06; // Static
-                        eth_in->smac[0] = 0x11; eth_in->smac[1] = 0x12; eth_in->smac[2] = 0x13; eth_in->smac[3] = 0x14; eth_in->smac[4] = 0x15; eth_in->smac[5] = 0x16; // Static
-                        eth_in->ethtype = htons(0x0800); // Static
-
-                        // Prepare Ethernet header
-                        struct iphdr *ip_in = (struct iphdr *) &(buffer[54]);
-                        ip_in->ihl = 5; // Static
-                        ip_in->version = 4; // Static
-                        ip_in->tos = 0x04; // Static
-                        ip_in->tot_len = 0; // Actual length is used
-                        ip_in->id = 0; // Static
-                        ip_in->frag_off = htons(0x4000); // Static
-                        ip_in->ttl = 255; // Static
-                        ip_in->protocol = np4_int_hdr->l4_proto;
-                        ip_in->check = 0; // Actual checksum is used
-                        ip_in->saddr = htonl(np4_int_hdr->source_ip[0]);
-                        ip_in->daddr = htonl(np4_int_hdr->destination_ip[0]);
-
-                        unsigned l4_in_size;
-                        struct tcphdr *tcp_in;
-                        struct udphdr *udp_in;
-                        if (ip_in->protocol == 6) {
-                            l4_in_size = 20;
-                            // Prepare TCP header
-                            tcp_in = (struct tcphdr *) &(buffer[74]);
-                            tcp_in->source = htons(np4_int_hdr->source_port);
-                            tcp_in->dest = htons(np4_int_hdr->destination_port);
-                            tcp_in->seq = 0;
-                            tcp_in->ack_seq = 0;
-                            tcp_in->res1 = 0;
-                            tcp_in->doff = 5;
-                            tcp_in->fin = 0;
-                            tcp_in->syn = 0;
-                            tcp_in->rst = 0;
-                            tcp_in->psh = 0;
-                            tcp_in->ack = 0;
-                            tcp_in->urg = 0;
-                            tcp_in->res2 = 0;
-                            tcp_in->window = 0;
-                            tcp_in->check = 0;
-                            tcp_in->urg_ptr = 0;
+                        stats.int_valid++;
+                        stats.hops[__builtin_popcount(np4_int_hdr->int_hop_vld)]++;
+                        if (hists)
+                            hists->record(np4_int_hdr);
+
+                        // Skip report if nothing has changed for the flow
+                        if (flows && !flows->should_report(np4_int_hdr, coarse_time_ns())) {
+                            stats.suppressed++;
+                        } else if (ring) {
+                            // Hand the record to TX stage, wait for free slot or drop it when full
+                            report_slot *slot;
+                            while ((slot = ring->reserve()) == NULL && !args.ring_drop && run)
+                                std::this_thread::yield();
+                            if (slot) {
+                                memcpy(&slot->hdr, np4_int_hdr, sizeof(np4_int_header_t));
+                                slot->timestamp_s = np4_hdr.timestamp_s;
+                                ring->publish();
+                            } else {
+                                stats.ring_drops++;
+                            }
                         } else {
-                            l4_in_size = 8;
-                            // Prepare UDP header
-                            udp_in = (struct udphdr *) &(buffer[74]);
-                            udp_in->source = htons(np4_int_hdr->source_port);
-                            udp_in->dest = htons(np4_int_hdr->destination_port);
-                            udp_in->len = 0; // Actual length is used
-                            udp_in->check = 0; // Static
-                        }
-
-                        // Prepare INT Shim header
-                        struct int_shim *int_sh = (struct int_shim *) &(buffer[74+l4_in_size]);
-                        int_sh->type = 1; // Static
-                        int_sh->res1 = 0;
-                        int_sh->length = np4_int_hdr->int_length;
-                        int_sh->res2 = 0;
-
-                        // Prepare INT header
-                        struct int_hdr *int_h = (struct int_hdr *) &(buffer[74+l4_in_size+4]);
-                        int_h->ver = 0; // Static
-                        int_h->res4 = 0;
-                        int_h->ins_cnt = np4_int_hdr->int_inscnt;
-                        int_h->res3 = 0;
-                        int_h->max_hop_cnt = 0; // Static
-                        int_h->total_hop_cnt = 0; // Static
-                        if (np4_int_hdr->int_hop0_vld) int_h->total_hop_cnt++;
-                        if (np4_int_hdr->int_hop1_vld) int_h->total_hop_cnt++;
-                        if (np4_int_hdr->int_hop2_vld) int_h->total_hop_cnt++;
-                        if (np4_int_hdr->int_hop3_vld) int_h->total_hop_cnt++;
-                        if (np4_int_hdr->int_hop4_vld) int_h->total_hop_cnt++;
-                        if (np4_int_hdr->int_hop5_vld) int_h->total_hop_cnt++;
-                        int_h->instr_bitmap = htons(np4_int_hdr->int_insmap);
-                        int_h->reserved = 0;
-
-                        unsigned index = 74+l4_in_size+4+8;
-                        if (np4_int_hdr->int_hop5_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop5_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop5_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop5_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop5_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop5_egressporttxutilization); index += 4; }
-                        }
-                        if (np4_int_hdr->int_hop4_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop4_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop4_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop4_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop4_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop4_egressporttxutilization); index += 4; }
-                        }
-                        if (np4_int_hdr->int_hop3_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop3_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop3_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop3_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop3_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop3_egressporttxutilization); index += 4; }
-                        }
-                        if (np4_int_hdr->int_hop2_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop2_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop2_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop2_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop2_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop2_egressporttxutilization); index += 4; }
-                        }
-                        if (np4_int_hdr->int_hop1_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop1_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop1_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop1_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop1_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop1_egressporttxutilization); index += 4; }
-                        }
-                        if (np4_int_hdr->int_hop0_vld) {
-                            if (np4_int_hdr->int_insmap & 0x8000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_swid); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop0_ingressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x4000) { *((uint16_t *) &(buffer[index])) = htons(np4_int_hdr->int_hop0_egressport); index += 2; }
-                            if (np4_int_hdr->int_insmap & 0x2000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_hoplatency); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop0_occupancy_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x1000) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_occupancy_occupancy)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0800) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_ingresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0400) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_egresstimestamp); index += 4; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint8_t  *) &(buffer[index])) = np4_int_hdr->int_hop0_congestion_queueid; index += 1; }
-                            if (np4_int_hdr->int_insmap & 0x0200) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_congestion_congestion)>>8; index += 3; }
-                            if (np4_int_hdr->int_insmap & 0x0100) { *((uint32_t *) &(buffer[index])) = htonl(np4_int_hdr->int_hop0_egressporttxutilization); index += 4; }
-                        }
-
-                        // Prepare INT Tail header
-                        struct int_tail *int_tl = (struct int_tail *) &(buffer[74+l4_in_size+(int_sh->length<<2)-4]);
-                        int_tl->proto = ip_in->protocol;
-                        int_tl->dport = (ip_in->protocol == 6) ? tcp_in->dest : udp_in->dest;
-                        int_tl->dscp = 0; // Static
-
-                        // Prepare payload
-                        char *payload = (char *) &(buffer[74+l4_in_size+(int_sh->length<<2)]);
-                        strncpy(payload, "Hello World", 11);
-
-                        // Update lengths and checksums
-                        udp->len = htons(8+12+14+20+l4_in_size+(int_sh->length<<2)+11);
-                        ip_in->tot_len = htons(20+l4_in_size+(int_sh->length<<2)+11);
-                        ip_in->check = ip_checksum(ip_in, 20);
-                        if (ip_in->protocol == 17) udp_in->len = htons(l4_in_size+(int_sh->length<<2)+11);
-
-                        // Send Telemetry report
-                        if (sendto(sock, buffer, 20+8+12+14+20+l4_in_size+(int_sh->length<<2)+11, 0 , (struct sockaddr *) &sockaddr, sizeof(sockaddr)) == -1)
-                        {
-                            throw std::string("Packet send error");
+                            output->send(np4_int_hdr, np4_hdr.timestamp_s);
                         }
                     }
                 } else {
-                    std::cerr << "Unexpected frame size (" << data_len << ")" << std::endl;
+                    // Only counted, printing every one of a burst of bad records would stall the worker
+                    stats.wrong_size++;
                 }
             }
+            // Send batched Telemetry reports waiting too long
+            if (output)
+                output->poll();
+            // Back off without inputs, wait for them once idle long enough
+            if (count == 0) {
+                unsigned wait_us = idle.idle();
+                if (wait_us)
+                    source->wait(wait_us);
+            }
+        }
+        stats.idle_sleeps = idle.sleeps;
+        stats.idle_waits = idle.waits;
+
+        // Send remaining Telemetry reports
+        if (output)
+            output->finish();
+        if (flows)
+            stats.evictions = flows->evictions;
+
+        // Write out histograms of the last interval
+        if (hists) {
+            hists->flush();
+            stats.untracked = hists->untracked;
         }
     } catch(std::exception &e) {
         run = false;
@@ -665,232 +656,252 @@ void np4_processing(np4_t* np4, arguments const &args) {
         run = false;
     }
 
-    // Close Telemetry reports socket
-    close(sock);
+    // Let TX stage and trace writer drain the rings
+    if (ring)
+        ring->finish();
+    if (trace)
+        trace->finish();
 
     // Close data receiving SZE channel
-    if(rx_stream)
-        np4_rx_stream_close(np4, &rx_stream);
+    source.reset();
 }
 
 /**
- * \brief Netcope P4 preparation function.
- * @param args Parsed command line arguments
- * @param np4  Netcope P4 instance
+ * \brief TX stage of one RX queue, encodes and sends reports of records taken from the ring.
+ * @param args  Parsed command line arguments
+ * @param index Index of the RX queue in the arguments
+ * @param cpu   CPU core to run on
+ * @param ring  Ring from RX stage
+ * @param stats Statistics of the stage, updated during processing
+ * @param health Collectors of reports and their health
  */
-inline void np4_preparation(arguments &args, np4_t **np4) {
-    // Initialize Netcope P4
-    np4_error_t err = np4_init_card(np4, args.card_id);
-    if(err)
-        throw np4_print_error(err);
+void np4_tx_worker(arguments const &args, unsigned index, int cpu, report_ring &ring, worker_stats &stats, collector_health &health) {
+    pin_thread(cpu, "TX stage", args.rx_queues[index]);
 
-    // Enable TX
-    err = np4_tx_enable(*np4);
-    if(err)
-        throw np4_print_error(err);
-
-    // Clear all tables (to not interfere with the rules we are about to load)
-    //np4_core_reset(*np4, 0);
-
-    // Create Netcope P4 ruleset
-    np4_ruleset_t *ruleset = np4_ruleset_create(*np4, 0);
-    np4_rule_t *rule;
-
-    // Setting Netcope P4 tables
-    if (args.original) {
-        //// tab_remove_int
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_remove_int");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"permit");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
+    try {
+        report_output output(args, index, stats, health);
+        idle_policy idle(args.idle_busy, args.idle_spin, args.idle_pause, args.idle_sleep_us, args.idle_block_us,
+                         std::min(args.idle_wait_us, args.flush_us));
+
+        // Take records until RX stage is done and the ring is empty
+        while (true) {
+            bool finished = ring.is_finished();
+            report_slot *slot = ring.front();
+            if (slot) {
+                output.send(&slot->hdr, slot->timestamp_s);
+                ring.release();
+                idle.busy();
+                continue;
+            }
+            if (finished)
+                break;
+            // Send batched Telemetry reports waiting too long
+            output.poll();
+            // Back off without records, the ring cannot be waited on
+            unsigned wait_us = idle.idle();
+            if (wait_us) {
+                stats.idle_sleeps = idle.sleeps;
+                stats.idle_waits = idle.waits;
+                std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+            }
         }
+        stats.idle_sleeps = idle.sleeps;
+        stats.idle_waits = idle.waits;
 
-        //// tab_update_enc_L4
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_update_enc_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"permit");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+        // Send remaining Telemetry reports
+        output.finish();
+    } catch(std::exception &e) {
+        run = false;
+        std::cerr << std::string() + __progname + ": " + e.what() + "\n";
+    } catch(std::string message) {
+        std::cerr << message << std::endl;
+        run = false;
+    }
+}
 
-        //// tab_update_L4
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_update_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"permit");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+/**
+ * \brief Packet processing function, runs one pinned worker for each RX queue.
+ *
+ * With ring size given, every RX queue gets a second pinned thread which
+ * encodes and sends its reports, so stalls of the network stack do not hold
+ * up reading of the card.
+ * @param np4  Netcope P4 instance
+ * @param args Parsed command line arguments
+ */
+void np4_processing(np4_t* np4, arguments const &args) {
+    unsigned workers = args.rx_queues.size();
+    unsigned cpus = std::thread::hardware_concurrency();
+    unsigned stages = args.ring_size ? 2 : 1;
+    worker_stats_array stats(workers * stages);
+    std::vector<std::unique_ptr<report_ring>> rings(workers);
+    std::vector<std::thread> threads;
+    struct timespec start, end;
+
+    // Open output of histogram snapshots, closed also when setup below fails
+    FILE *hist_file = stdout;
+    std::unique_ptr<FILE, int (*)(FILE *)> hist_opened(NULL, fclose);
+    if (args.histograms && args.hist_file) {
+        hist_opened.reset(fopen(args.hist_file, "a"));
+        if (!hist_opened)
+            throw std::runtime_error(std::string() + "unable to open '" + args.hist_file + "'");
+        hist_file = hist_opened.get();
+    }
 
-        //// tab_terminate_gtp
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_terminate_gtp");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"permit");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+    // Rings between RX and TX stages
+    if (args.ring_size)
+        for (unsigned i = 0; i < workers; i++)
+            rings[i].reset(new report_ring(args.ring_size));
+
+    // Statistics served while processing runs
+    std::unique_ptr<metrics_server> metrics;
+    if (args.metrics) {
+        std::vector<int> queues;
+        for (unsigned i = 0; i < workers * stages; i++)
+            queues.push_back(args.rx_queues[i % workers]);
+        metrics.reset(new metrics_server(args.metrics, stats, queues));
+    }
 
-    } else {
-        //// tab_remove_int
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_remove_int");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"act_remove_int");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+    // Collectors of reports, probed only when there are more of them
+    collector_health health(args.collectors, args.collectors.size() > 1 ? args.health_interval : 0, args.health_down,
+                            args.health_up);
 
-        //// tab_update_enc_L4
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_update_enc_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"update_enc_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+    // Trace of records, written out by background thread
+    std::unique_ptr<trace_log> trace;
+    if (args.verbose || args.trace_file)
+        trace.reset(new trace_log(workers, args.verbose ? stdout : NULL, args.trace_file));
 
-        //// tab_update_L4
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_update_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"update_L4");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
+    // Histogram snapshots, written out by background thread
+    std::unique_ptr<hist_log> hist;
+    if (args.histograms)
+        hist.reset(new hist_log(workers, hist_file));
 
-        //// tab_terminate_gtp
-        // 1. Create default rule
-        err = np4_rule_create(&rule, ruleset, "tab_terminate_gtp");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        err = np4_rule_mark_default(rule);
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
-        }
-        // 2. Set action of the rule
-        err = np4_rule_set_action(rule,"terminate_gtp");
-        if(err) {
-            np4_ruleset_free(ruleset);
-            throw np4_print_error(err);
+    // CPU cores are given to RX workers first, then to TX stages
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    try {
+        for (unsigned i = 0; i < workers * stages; i++) {
+            int cpu = i < args.cpus.size() ? args.cpus[i] : i % (cpus ? cpus : 1);
+            if (i < workers)
+                threads.push_back(std::thread(np4_worker, np4, std::cref(args), i, cpu, rings[i].get(), hist.get(), trace ? &trace->ring(i) : NULL, std::ref(stats[i]),
+                                              std::ref(health)));
+            else
+                threads.push_back(std::thread(np4_tx_worker, std::cref(args), i - workers, cpu, std::ref(*rings[i - workers]), std::ref(stats[i]),
+                                              std::ref(health)));
         }
+    } catch (...) {
+        // Stop the threads already running before the logs and rings go away
+        run = false;
+        for (unsigned i = 0; i < threads.size(); i++)
+            threads[i].join();
+        throw;
     }
 
-    //// tab_send
-    // 1. Create default rule
-    err = np4_rule_create(&rule, ruleset, "tab_send");
-    if(err) {
-        np4_ruleset_free(ruleset);
-        throw np4_print_error(err);
+    // Wait for all workers and merge their statistics
+    worker_stats total;
+    for (unsigned i = 0; i < threads.size(); i++) {
+        threads[i].join();
+        total += stats[i];
     }
-    err = np4_rule_mark_default(rule);
-    if(err) {
-        np4_ruleset_free(ruleset);
-        throw np4_print_error(err);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metrics.reset();
+    trace.reset();
+    hist.reset();
+    hist_opened.reset();
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Print statistics
+    std::cout << "Received records    : " << total.records << std::endl;
+    std::cout << "Unexpected size     : " << total.wrong_size << std::endl;
+    std::cout << "Telemetry reports   : " << total.reports << std::endl;
+    if (args.pack_mtu)
+        std::cout << "Report datagrams    : " << total.datagrams << std::endl;
+    std::cout << "Send syscalls       : " << total.syscalls << std::endl;
+    std::cout << "Send errors         : " << total.send_errors << std::endl;
+    if (health.size() > 1)
+        for (unsigned i = 0; i < health.size(); i++)
+            std::cout << std::left << std::setw(20) << health.name(i) << ": " << health.reports(i)
+                      << (health.up(i) ? "" : " (down)") << std::endl;
+    if (args.suppress) {
+        std::cout << "Suppressed reports  : " << total.suppressed << std::endl;
+        std::cout << "Evicted flows       : " << total.evictions << std::endl;
     }
-    // 2. Set action of the rule
-    err = np4_rule_set_action(rule,"send_to_port");
-    if(err) {
-        np4_ruleset_free(ruleset);
-        throw np4_print_error(err);
+    if (args.histograms)
+        std::cout << "Untracked hops      : " << total.untracked << std::endl;
+    if (args.compact) {
+        std::cout << "Average record size : " << (total.records ? (double) total.record_bytes / total.records : 0.0) << " / " << NP4_RECORD_LEN << std::endl;
+        std::cout << "Lost hops           : " << total.lost_hops << std::endl;
     }
-    uint8_t port[1] = { 1 };
-    err = np4_rule_add_action_parameter(rule, "port", port, 1);
-    if(err) {
-        np4_ruleset_free(ruleset);
-        throw np4_print_error(err);
+    if (trace)
+        std::cout << "Trace drops         : " << total.trace_drops << std::endl;
+    if (args.ring_size) {
+        std::cout << "Ring drops          : " << total.ring_drops << std::endl;
+        std::cout << "Ring peak occupancy : " << total.ring_peak << " / " << rings[0]->capacity() << std::endl;
     }
+    std::cout << "Records per burst   : " << (total.bursts ? (double) total.records / total.bursts : 0.0) << std::endl;
+    std::cout << "Idle sleeps         : " << total.idle_sleeps << std::endl;
+    std::cout << "Idle waits          : " << total.idle_waits << std::endl;
+    std::cout << "Syscalls per report : " << (total.reports ? (double) total.syscalls / total.reports : 0.0) << std::endl;
+    std::cout << "Elapsed time (s)    : " << elapsed << std::endl;
+    std::cout << "Records per second  : " << (elapsed > 0 ? total.records / elapsed : 0.0) << std::endl;
+}
 
-    // Insert Netcope P4 ruleset to hadrware
-    err = np4_core_insert_ruleset(*np4, 0, ruleset);
-    if(err) {
-        np4_ruleset_free(ruleset);
-        throw np4_print_error(err);
+/**
+ * \brief Install rules of INT processing, only the difference to the installed ones.
+ * @param args      Parsed command line arguments
+ * @param installer Installer of rules to the card
+ * @return Numbers of changed rules
+ */
+inline ruleset_stats np4_load_rules(arguments const &args, ruleset_installer &installer) {
+    ruleset rules(&np4_widths());
+    np4_rules(args, rules);
+    return installer.apply(rules);
+}
+
+/**
+ * \brief Apply rules file again whenever SIGHUP is received, until processing stops.
+ * @param args      Parsed command line arguments
+ * @param installer Installer of rules to the card
+ */
+void np4_reload_rules(arguments const &args, ruleset_installer &installer) {
+    while (run) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (!reload.exchange(false))
+            continue;
+        try {
+            ruleset_stats stats = np4_load_rules(args, installer);
+            std::cerr << "Rules reloaded      : " << stats.inserted << " inserted, " << stats.removed << " removed, "
+                      << stats.unchanged << " unchanged" << (stats.full ? " (full reload)" : "") << std::endl;
+        } catch (std::exception &e) {
+            std::cerr << __progname << ": rules not reloaded: " << e.what() << std::endl;
+        } catch (np4_error_t &e) {
+            std::cerr << __progname << ": rules not reloaded" << std::endl;
+        }
     }
+}
 
-    // Free ruleset
-    np4_ruleset_free(ruleset);
+/**
+ * \brief Netcope P4 preparation function.
+ * @param args      Parsed command line arguments
+ * @param np4       Netcope P4 instance
+ * @param installer Output of installer of rules to the card
+ */
+inline void np4_preparation(arguments &args, np4_t **np4, std::unique_ptr<np4_ruleset_target> &target,
+                            std::unique_ptr<ruleset_installer> &installer) {
+    // Initialize Netcope P4
+    np4_error_t err = np4_init_card(np4, args.card_id);
+    if(err)
+        throw np4_print_error(err);
 
-    // Enable Netcope P4
-    err = np4_core_enable(*np4, 0);
+    // Enable TX
+    err = np4_tx_enable(*np4);
     if(err)
         throw np4_print_error(err);
+
+    // First installation goes over the rules the core holds unless reset is allowed (then all
+    // tables are cleared to not interfere with the rules we load), Netcope P4 is enabled once
+    // the rules are in; without reset, reload can only add rules
+    target.reset(new np4_ruleset_target(*np4, 0, args.reset));
+    installer.reset(new ruleset_installer(*target));
+    np4_load_rules(args, *installer);
 }
 
 /**
@@ -903,6 +914,8 @@ int main(int argc, char *argv[]) {
     int exit_code = EXIT_SUCCESS;
     // Netcope P4 datatype
     np4_t* np4 = NULL;
+    std::unique_ptr<np4_ruleset_target> rules_target;
+    std::unique_ptr<ruleset_installer> rules;
 
     try {
         // Parse program command line arguments
@@ -911,11 +924,33 @@ int main(int argc, char *argv[]) {
         if(args.help)
             arguments::usage();
         else {
-            // Prepare Netcope P4
-            np4_preparation(args, &np4);
+            // Prepare Netcope P4 unless the input is replayed or parsed in software
+            if (args.card())
+                np4_preparation(args, &np4, rules_target, rules);
+
+            // Stop processing on interrupt
+            signal(SIGINT, stop_processing);
+            signal(SIGTERM, stop_processing);
+
+            // Rules file is applied again on SIGHUP
+            std::thread reloader;
+            if (rules && args.rules) {
+                signal(SIGHUP, reload_rules);
+                reloader = std::thread(np4_reload_rules, std::cref(args), std::ref(*rules));
+            }
 
             // Run processing
-            np4_processing(np4, args);
+            try {
+                np4_processing(np4, args);
+            } catch (...) {
+                run = false;
+                if (reloader.joinable())
+                    reloader.join();
+                throw;
+            }
+            run = false;
+            if (reloader.joinable())
+                reloader.join();
         }
     } catch(std::exception &e) {
         std::cerr << __progname << ": " << e.what() << std::endl;
@@ -0,0 +1,366 @@
+/*
+ * np4_int_bench.cpp: Benchmark of record-to-report path of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Netcope P4 INT processing benchmark ------------------------
+ * --------------------------------------------------------------------------------
+ * - Synthetic Netcope INT records with the given hop counts and instruction      -
+ *   bitmaps are pushed through the separate stages of the report path. Results  -
+ *   are written as CSV, one line per stage and parameter combination. Hop      -
+ *   encoding and checksumming are measured for every implementation the CPU      -
+ *   supports. The benchmark does not need the card nor the Netcope P4 library.   -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_int_bench [-h] [-n records] [-H hops] [-m insmaps] [-b batch] [-p port] [-i iface -t ip [-e mac]]
+ *   -n records Records per measurement (default: 1000000)
+ *   -H hops    Hop counts, list or range (default: 0-6)
+ *   -m insmaps Upper bytes of instruction bitmaps, list or range (default: 128,192,240,255)
+ *   -b batch   Reports sent at once by loopback sink (default: 32)
+ *   -p port    Local UDP port of loopback sink (default: 32766)
+ *   -i iface   Also compare raw socket and PACKET_MMAP TX ring sending through iface
+ *   -t ip      Target IPv4 address reachable through iface
+ *   -e mac     Destination MAC address for TX ring (default: broadcast)
+ *   -h         Writes out help
+ * Build: g++ -O2 -std=c++11 -o np4_int_bench np4_int_bench.cpp
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "arguments.hpp"
+#include "np4_int_header.hpp"
+#include "report_encoder.hpp"
+#include "report_sender.hpp"
+#include "report_tx_ring.hpp"
+
+//! Number of distinct synthetic records (power of two).
+#define BENCH_RECORDS       4096
+
+/**
+ * \brief Result of one measurement.
+ */
+struct bench_result {
+    uint64_t ns;     //!< Elapsed time.
+    uint64_t cycles; //!< Elapsed TSC cycles.
+};
+
+static inline uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t bench_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//! Sink for computed values, keeps the compiler from dropping measured code.
+volatile uint64_t bench_sink;
+
+/**
+ * \brief Generate synthetic Netcope P4 frames.
+ * @param records Output, BENCH_RECORDS frames of NP4_RECORD_LEN bytes
+ * @param hops    Number of valid hops
+ * @param ins     Upper byte of instruction bitmap
+ */
+void bench_generate(std::vector<unsigned char> &records, unsigned hops, unsigned ins) {
+    records.assign(BENCH_RECORDS * NP4_RECORD_LEN, 0);
+    srand(hops * 256 + ins);
+    for (unsigned i = 0; i < BENCH_RECORDS; i++) {
+        unsigned char *frame = &records[i * NP4_RECORD_LEN];
+        for (unsigned j = 0; j < NP4_RECORD_LEN; j++)
+            frame[j] = rand();
+        np4_int_header_t *hdr = (np4_int_header_t *) (frame + NP4_FRAME_HDR_LEN);
+        unsigned ins_cnt = __builtin_popcount(ins);
+        hdr->ip_ver = 4;
+        hdr->l4_proto = (i & 1) ? 6 : 17;
+        hdr->int_vld = 1;
+        hdr->int_inscnt = ins_cnt;
+        hdr->int_insmap = ins << 8;
+        hdr->int_hop_vld = (1 << hops) - 1;
+        hdr->int_length = 4 + ins_cnt * hops;
+    }
+}
+
+/**
+ * \brief Decoding stage, equivalent of np4_parse_frame() and the checks of processing loop.
+ */
+bench_result bench_decode(std::vector<unsigned char> &records, unsigned n) {
+    uint64_t acc = 0;
+    uint64_t t = bench_ns(), c = bench_cycles();
+    for (unsigned i = 0; i < n; i++) {
+        const unsigned char *frame = &records[(i & (BENCH_RECORDS - 1)) * NP4_RECORD_LEN];
+        const np4_int_header_t *hdr = (const np4_int_header_t *) (frame + NP4_FRAME_HDR_LEN);
+        uint32_t timestamp_s;
+        memcpy(&timestamp_s, frame, 4);
+        if (hdr->int_vld)
+            acc += timestamp_s + hdr->int_insmap + hdr->int_hop_vld + hdr->source_ip[0];
+    }
+    bench_result r = { bench_ns() - t, bench_cycles() - c };
+    bench_sink = acc;
+    return r;
+}
+
+/**
+ * \brief Encoding stage.
+ */
+bench_result bench_encode(std::vector<unsigned char> &records, unsigned n, report_encoder &encoder) {
+    static unsigned char buffer[REPORT_MAX_LEN];
+    uint64_t acc = 0;
+    uint64_t t = bench_ns(), c = bench_cycles();
+    for (unsigned i = 0; i < n; i++) {
+        const unsigned char *frame = &records[(i & (BENCH_RECORDS - 1)) * NP4_RECORD_LEN];
+        acc += encoder.encode(buffer, (const np4_int_header_t *) (frame + NP4_FRAME_HDR_LEN), i);
+    }
+    bench_result r = { bench_ns() - t, bench_cycles() - c };
+    bench_sink = acc;
+    return r;
+}
+
+/**
+ * \brief Hop encoding stage of the given hop encoder.
+ */
+bench_result bench_hops(std::vector<unsigned char> &records, unsigned n, int_hops_encoder_t encode_hops) {
+    static unsigned char buffer[NP4_INT_MAX_HOPS * sizeof(np4_int_hop_t) + HOP_ENCODER_OVERRUN];
+    uint64_t acc = 0;
+    uint64_t t = bench_ns(), c = bench_cycles();
+    for (unsigned i = 0; i < n; i++) {
+        const np4_int_header_t *hdr = (const np4_int_header_t *) (&records[(i & (BENCH_RECORDS - 1)) * NP4_RECORD_LEN] + NP4_FRAME_HDR_LEN);
+        acc += encode_hops(buffer, hdr->int_hop, hdr->int_hop_vld, hdr->int_insmap >> 8) - buffer;
+    }
+    bench_result r = { bench_ns() - t, bench_cycles() - c };
+    bench_sink = acc;
+    return r;
+}
+
+/**
+ * \brief Checksum stage, one's complement sum of whole prepared reports by the given implementation.
+ */
+bench_result bench_checksum(std::vector<unsigned char> &records, unsigned n, report_encoder &encoder, csum_partial_t csum) {
+    std::vector<unsigned char> reports(BENCH_RECORDS * REPORT_MAX_LEN);
+    std::vector<unsigned> lengths(BENCH_RECORDS);
+    for (unsigned i = 0; i < BENCH_RECORDS; i++)
+        lengths[i] = encoder.encode(&reports[i * REPORT_MAX_LEN], (const np4_int_header_t *) (&records[i * NP4_RECORD_LEN] + NP4_FRAME_HDR_LEN), i);
+    uint64_t acc = 0;
+    uint64_t t = bench_ns(), c = bench_cycles();
+    for (unsigned i = 0; i < n; i++) {
+        unsigned r = i & (BENCH_RECORDS - 1);
+        acc += csum(&reports[r * REPORT_MAX_LEN], lengths[r], 0);
+    }
+    bench_result r = { bench_ns() - t, bench_cycles() - c };
+    bench_sink = acc;
+    return r;
+}
+
+/**
+ * \brief Whole record-to-report path, reports are sent by the given sender or dropped.
+ */
+bench_result bench_pipeline(std::vector<unsigned char> &records, unsigned n, report_encoder &encoder, report_sender *sender) {
+    static unsigned char buffer[REPORT_MAX_LEN];
+    uint64_t acc = 0;
+    uint64_t t = bench_ns(), c = bench_cycles();
+    for (unsigned i = 0; i < n; i++) {
+        const unsigned char *frame = &records[(i & (BENCH_RECORDS - 1)) * NP4_RECORD_LEN];
+        const np4_int_header_t *hdr = (const np4_int_header_t *) (frame + NP4_FRAME_HDR_LEN);
+        uint32_t timestamp_s;
+        memcpy(&timestamp_s, frame, 4);
+        if (!hdr->int_vld)
+            continue;
+        if (sender)
+            sender->commit(encoder.encode(sender->next(), hdr, timestamp_s));
+        else
+            acc += encoder.encode(buffer, hdr, timestamp_s);
+    }
+    if (sender)
+        sender->flush();
+    bench_result r = { bench_ns() - t, bench_cycles() - c };
+    bench_sink = acc;
+    return r;
+}
+
+/**
+ * \brief Print one result as CSV line.
+ */
+void bench_print(const char *stage, unsigned hops, unsigned ins, unsigned n, const bench_result &r) {
+    double ns = (double) r.ns / n;
+    printf("%s,%u,0x%02x00,%u,%.2f,%.0f,%.2f\n", stage, hops, ins, n, ns, ns > 0 ? 1e9 / ns : 0.0, (double) r.cycles / n);
+}
+
+void bench_usage() {
+    std::cout << "Usage: np4_int_bench [-h] [-n records] [-H hops] [-m insmaps] [-b batch] [-p port] [-i iface -t ip [-e mac]]" << std::endl;
+    std::cout << "  -n records Records per measurement (default: 1000000)" << std::endl;
+    std::cout << "  -H hops    Hop counts, list or range (default: 0-6)" << std::endl;
+    std::cout << "  -m insmaps Upper bytes of instruction bitmaps, list or range (default: 128,192,240,255)" << std::endl;
+    std::cout << "  -b batch   Reports sent at once by loopback sink (default: 32)" << std::endl;
+    std::cout << "  -p port    Local UDP port of loopback sink (default: 32766)" << std::endl;
+    std::cout << "  -i iface   Also compare raw socket and PACKET_MMAP TX ring sending through iface" << std::endl;
+    std::cout << "  -t ip      Target IPv4 address reachable through iface" << std::endl;
+    std::cout << "  -e mac     Destination MAC address for TX ring (default: broadcast)" << std::endl;
+    std::cout << "  -h         Writes out help" << std::endl;
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    unsigned n = 1000000;
+    unsigned batch = 32;
+    int port = 32766;
+    const char *iface = NULL;
+    const char *target = NULL;
+    unsigned char mac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    std::vector<int> hops = arguments::parse_list("0-6", 'H');
+    std::vector<int> insmaps = arguments::parse_list("128,192,240,255", 'm');
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "n:H:m:b:p:i:t:e:h")) != -1)
+            switch (c) {
+                case 'n':
+                    n = atoi(optarg);
+                    break;
+                case 'H':
+                    hops = arguments::parse_list(optarg, 'H');
+                    break;
+                case 'm':
+                    insmaps = arguments::parse_list(optarg, 'm');
+                    break;
+                case 'b':
+                    batch = atoi(optarg);
+                    break;
+                case 'p':
+                    port = atoi(optarg);
+                    break;
+                case 'i':
+                    iface = optarg;
+                    break;
+                case 't':
+                    target = optarg;
+                    break;
+                case 'e': {
+                    unsigned m[6];
+                    if (sscanf(optarg, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+                        throw std::runtime_error("invalid MAC address");
+                    for (unsigned i = 0; i < 6; i++)
+                        mac[i] = m[i];
+                    break;
+                }
+                case 'h':
+                    bench_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    bench_usage();
+                    return EXIT_FAILURE;
+            }
+        for (unsigned i = 0; i < hops.size(); i++)
+            if (hops[i] > NP4_INT_MAX_HOPS)
+                throw std::runtime_error("hop count out of range");
+        for (unsigned i = 0; i < insmaps.size(); i++)
+            if (insmaps[i] > 255)
+                throw std::runtime_error("instruction bitmap out of range");
+
+        // Loopback sink: reports are sent as UDP payload to local socket that is never read
+        struct sockaddr_in sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sin_family = AF_INET;
+        sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sockaddr.sin_port = htons(port);
+        int rx = socket(AF_INET, SOCK_DGRAM, 0);
+        int tx = socket(AF_INET, SOCK_DGRAM, 0);
+        if (rx == -1 || tx == -1 || bind(rx, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) == -1)
+            throw std::runtime_error("unable to prepare loopback sink");
+        socket_report_sender sender(tx, sockaddr, batch, 1000);
+        report_encoder encoder(sockaddr.sin_addr.s_addr, port);
+        std::vector<unsigned char> records;
+        static const char *hop_encoders[] = { "hops_scalar", "hops_ssse3", "hops_avx2" };
+        static const char *checksums[] = { "csum_scalar", "csum_sse2", "csum_avx2" };
+
+        // Sending through interface: raw socket (IP stack) against TX ring
+        std::unique_ptr<report_encoder> iface_encoder;
+        std::unique_ptr<socket_report_sender> raw_sender;
+        std::unique_ptr<ring_report_sender> ring_sender;
+        int raw = -1;
+        if (iface) {
+            struct sockaddr_in taddr;
+            memset(&taddr, 0, sizeof(taddr));
+            taddr.sin_family = AF_INET;
+            if (target == NULL || inet_aton(target, &taddr.sin_addr) == 0)
+                throw std::runtime_error("option 'i' needs target IPv4 address");
+            if ((raw = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
+                throw std::runtime_error("unable to open raw socket");
+            iface_encoder.reset(new report_encoder(taddr.sin_addr.s_addr, port));
+            raw_sender.reset(new socket_report_sender(raw, taddr, batch, 1000));
+            ring_sender.reset(new ring_report_sender(iface, mac, AF_INET, batch, 1000));
+            iface_encoder->set_source(ring_sender->source());
+        }
+
+        printf("stage,hops,insmap,records,ns_per_record,records_per_s,cycles_per_record\n");
+        for (unsigned h = 0; h < hops.size(); h++)
+            for (unsigned m = 0; m < insmaps.size(); m++) {
+                bench_generate(records, hops[h], insmaps[m]);
+                bench_print("decode", hops[h], insmaps[m], n, bench_decode(records, n));
+                bench_print("encode", hops[h], insmaps[m], n, bench_encode(records, n, encoder));
+                for (unsigned e = 0; e < sizeof(hop_encoders) / sizeof(hop_encoders[0]); e++) {
+                    int_hops_encoder_t encode_hops = int_hops_encoder_select(hop_encoders[e] + 5);
+                    if (encode_hops)
+                        bench_print(hop_encoders[e], hops[h], insmaps[m], n, bench_hops(records, n, encode_hops));
+                }
+                for (unsigned e = 0; e < sizeof(checksums) / sizeof(checksums[0]); e++) {
+                    csum_partial_t csum = csum_partial_select(checksums[e] + 5);
+                    if (csum)
+                        bench_print(checksums[e], hops[h], insmaps[m], n, bench_checksum(records, n, encoder, csum));
+                }
+                bench_print("pipeline_null", hops[h], insmaps[m], n, bench_pipeline(records, n, encoder, NULL));
+                bench_print("pipeline_loopback", hops[h], insmaps[m], n, bench_pipeline(records, n, encoder, &sender));
+                if (iface) {
+                    bench_print("pipeline_raw", hops[h], insmaps[m], n, bench_pipeline(records, n, *iface_encoder, raw_sender.get()));
+                    bench_print("pipeline_txring", hops[h], insmaps[m], n, bench_pipeline(records, n, *iface_encoder, ring_sender.get()));
+                }
+            }
+        ring_sender.reset();
+        if (raw != -1)
+            close(raw);
+        close(tx);
+        close(rx);
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string message) {
+        std::cerr << __progname << ": " << message << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
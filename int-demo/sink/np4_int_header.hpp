@@ -0,0 +1,191 @@
+/*
+ * np4_int_header.hpp: Netcope INT metadata record and Telemetry report wire formats.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NP4_INT_HEADER
+#define __HEADER_FILE_NP4_INT_HEADER
+
+#include <stdint.h>
+
+#define NP4_INT_MAX_HOPS    6   //!< Number of hops carried by Netcope INT header.
+#define NP4_RECORD_LEN      256 //!< Length of Netcope INT metadata record (Netcope P4 frame).
+
+// INT instruction bits (upper byte of instruction bitmap)
+#define INT_INS_SWITCH_ID           0x80
+#define INT_INS_PORT_IDS            0x40
+#define INT_INS_HOP_LATENCY         0x20
+#define INT_INS_Q_OCCUPANCY         0x10
+#define INT_INS_INGRESS_TSTAMP      0x08
+#define INT_INS_EGRESS_TSTAMP       0x04
+#define INT_INS_Q_CONGESTION        0x02
+#define INT_INS_EGRESS_PORT_TX_UTIL 0x01
+
+/**
+ * \brief Netcope P4 INT hop
+ */
+typedef struct __attribute__((__packed__)) np4_int_hop {
+    uint32_t                swid;
+    uint16_t                ingressport;
+    uint16_t                egressport;
+    uint32_t                hoplatency;
+    uint32_t                occupancy_queueid   : 8;
+    uint32_t                occupancy_occupancy : 24;
+    uint32_t                ingresstimestamp;
+    uint32_t                egresstimestamp;
+    uint32_t                congestion_queueid    : 8;
+    uint32_t                congestion_congestion : 24;
+    uint32_t                egressporttxutilization;
+} np4_int_hop_t;
+
+/**
+ * \brief Netcope P4 INT header
+ *
+ * Addresses are 128-bit values with the lowest 32 bits in word 0, so IPv4
+ * address is source_ip[0] and IPv6 address starts with source_ip[3].
+ */
+typedef struct __attribute__((__packed__)) np4_int_header {
+    uint32_t                source_ip[4];
+
+    uint32_t                destination_ip[4];
+
+    uint16_t                source_port;
+    uint16_t                destination_port;
+
+    uint8_t                 ip_ver;
+    uint8_t                 l4_proto;
+    uint16_t                reserved16_3;
+
+    uint8_t                 int_length;
+    uint8_t                 int_inscnt   : 5;
+    uint8_t                 int_vld      : 1;
+    uint8_t                 reserved2_4  : 2;
+    uint16_t                int_insmap;
+
+    uint8_t                 int_hop_vld  : NP4_INT_MAX_HOPS; // Bit N set when hop N is valid
+    uint8_t                 reserved2_5  : 8 - NP4_INT_MAX_HOPS;
+    uint8_t                 reserved8_5;
+    uint16_t                reserved16_5;
+
+    np4_int_hop_t           int_hop[NP4_INT_MAX_HOPS];
+} np4_int_header_t;
+
+//! Length of Netcope P4 frame header in front of Netcope INT header.
+#define NP4_FRAME_HDR_LEN   (NP4_RECORD_LEN - sizeof(np4_int_header_t))
+
+#define NP4_COMPACT_VERSION 0x01 //!< Version of compact record (COMPACT_VERSION of p4/parser.p4).
+
+/**
+ * \brief Header of compact Netcope INT record (tab_compact_record of p4/tables.p4)
+ *
+ * Fields are in network byte order as deparsed by the card. The header is
+ * followed by source and destination address (4 bytes each for IPv4, 16 for
+ * IPv6), then by the INT hop stack and INT tail as received, int_length - 3
+ * words. Hops carry int_inscnt words each, the newest hop first.
+ */
+typedef struct __attribute__((__packed__)) np4_int_compact {
+    uint8_t                 version;
+    uint8_t                 ip_ver;
+    uint8_t                 l4_proto;
+    uint8_t                 int_length;
+    uint8_t                 int_inscnt;   // Lowest 5 bits
+    uint8_t                 reserved8;
+    uint16_t                int_insmap;
+    uint16_t                source_port;
+    uint16_t                destination_port;
+} np4_int_compact_t;
+
+/**
+ * \brief Store IPv6 address of Netcope INT header in network byte order.
+ * @param out         Output of 16 bytes
+ * @param hdr         Netcope INT header
+ * @param destination Store destination address instead of source one
+ */
+inline void np4_int_store_ip6(unsigned char *out, const np4_int_header_t *hdr, bool destination) {
+    for (unsigned i = 0; i < 4; i++) {
+        uint32_t word = destination ? hdr->destination_ip[3 - i] : hdr->source_ip[3 - i];
+        out[4 * i]     = word >> 24;
+        out[4 * i + 1] = word >> 16;
+        out[4 * i + 2] = word >> 8;
+        out[4 * i + 3] = word;
+    }
+}
+
+/**
+ * \brief Telemetry Report header
+ */
+struct __attribute__((__packed__)) telemetry_report
+{
+    uint8_t    nproto: 4;
+    uint8_t    ver   : 4;
+    uint16_t   res16;
+    uint8_t    hw_id : 6;
+    uint8_t    res2  : 2;
+    uint32_t   sequence_number;
+    uint32_t   ingress_timestamp;
+};
+
+/**
+ * \brief Ethernet header
+ */
+struct __attribute__((__packed__)) ethernet
+{
+    uint8_t    dmac[6];
+    uint8_t    smac[6];
+    uint16_t   ethtype;
+};
+
+/**
+ * \brief INT Shim header
+ */
+struct __attribute__((__packed__)) int_shim
+{
+    uint8_t    type;
+    uint8_t    res1;
+    uint8_t    length;
+    uint8_t    res2;
+};
+
+/**
+ * \brief INT header
+ */
+struct __attribute__((__packed__)) int_hdr
+{
+    uint8_t    res4 : 4;
+    uint8_t    ver  : 4;
+    uint8_t    ins_cnt : 5;
+    uint8_t    res3    : 3;
+    uint8_t    max_hop_cnt;
+    uint8_t    total_hop_cnt;
+    uint16_t   instr_bitmap;
+    uint16_t   reserved;
+};
+
+/**
+ * \brief INT Tail header
+ */
+struct __attribute__((__packed__)) int_tail
+{
+    uint8_t    proto;
+    uint16_t   dport;
+    uint8_t    dscp;
+};
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * np4_int_model.cpp: Software model of the parser of Netcope P4 INT sink for validation of the card.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Netcope P4 INT parser model --------------------------------
+ * --------------------------------------------------------------------------------
+ * - Raw packets of Ethernet capture are parsed by software model of the INT    -
+ *   sink parser into Netcope P4 records. Records can be written out as raw      -
+ *   capture replayed by np4_int -f, or compared field by field with records    -
+ *   captured from the card for the same packets. The model does not need the  -
+ *   card nor the Netcope P4 library.                                             -
+ * - Compact records of INT packets, as tab_compact_record sends them, can be    -
+ *   written out as pcap replayed by np4_int -C -f.                              -
+ * - Telemetry reports of INT records can be encoded as np4_int sends them and  -
+ *   their checksums verified by plain recomputation.                           -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_int_model [-hoR] [-L file] [-w file] [-C file] [-d file] [-n loops] file
+ *   -L file  Follow NP4 ruleset 2.0 file instead of built-in rules
+ *   -o       Keep original packets, L4 fields are not taken from INT tail
+ *   -w file  Write records as raw capture of Netcope P4 records
+ *   -C file  Write compact records of INT packets (full records of others) as pcap
+ *   -d file  Compare records with capture of the card (raw or pcap)
+ *   -R       Encode Telemetry reports of INT records and verify their checksums
+ *   -n loops Number of passes over the capture (default: 1)
+ *   -h       Writes out help
+ * Build: g++ -O2 -std=c++11 -o np4_int_model np4_int_model.cpp
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+
+#include "../../common/pcap.hpp"
+#include "../../common/ruleset.hpp"
+#include "int_parser.hpp"
+#include "np4_int_header.hpp"
+#include "report_encoder.hpp"
+
+#define MODEL_DIFFS_PRINTED 16  //!< Differing records written out one by one.
+#define MODEL_LINKTYPE_NP4  147 //!< Link type of pcap of Netcope P4 records (LINKTYPE_USER0).
+
+extern char *__progname;
+
+/**
+ * \brief Fields compared with records of the card.
+ */
+enum model_field {
+    MODEL_INT_VLD,
+    MODEL_IP_VER,
+    MODEL_IP,
+    MODEL_L4,
+    MODEL_INT,
+    MODEL_HOP_VLD,
+    MODEL_SWITCH_ID,
+    MODEL_PORT_IDS,
+    MODEL_Q_OCCUPANCY,
+    MODEL_TSTAMPS,
+    MODEL_FIELDS
+};
+
+//! Names of compared fields.
+static const char *model_field_names[MODEL_FIELDS] = {
+    "int_vld", "ip_ver", "addresses", "L4 fields", "INT header", "int_hop_vld",
+    "switch ID", "port IDs", "queue occupancy", "timestamps"
+};
+
+void model_usage() {
+    std::cout << "Usage: np4_int_model [-hoR] [-L file] [-w file] [-C file] [-d file] [-n loops] file" << std::endl;
+    std::cout << "  -L file  Follow NP4 ruleset 2.0 file instead of built-in rules" << std::endl;
+    std::cout << "  -o       Keep original packets, L4 fields are not taken from INT tail" << std::endl;
+    std::cout << "  -w file  Write records as raw capture of Netcope P4 records" << std::endl;
+    std::cout << "  -C file  Write compact records of INT packets (full records of others) as pcap" << std::endl;
+    std::cout << "  -d file  Compare records with capture of the card (raw or pcap)" << std::endl;
+    std::cout << "  -R       Encode Telemetry reports of INT records and verify their checksums" << std::endl;
+    std::cout << "  -n loops Number of passes over the capture (default: 1)" << std::endl;
+    std::cout << "  -h       Writes out help" << std::endl;
+}
+
+/**
+ * \brief Compare record of the model with record of the card.
+ *
+ * Only fields the parser sets for the packet are compared, the card leaves
+ * the others undefined.
+ * @param model Record of the model
+ * @param card  Record of the card
+ * @return First differing field, MODEL_FIELDS if the records match
+ */
+model_field model_compare(const np4_int_header_t &model, const np4_int_header_t &card) {
+    if (model.int_vld != card.int_vld)
+        return MODEL_INT_VLD;
+    if (model.ip_ver == 0)
+        return MODEL_FIELDS;
+    if (model.ip_ver != card.ip_ver)
+        return MODEL_IP_VER;
+    if (memcmp(model.source_ip, card.source_ip, sizeof(model.source_ip)) ||
+        memcmp(model.destination_ip, card.destination_ip, sizeof(model.destination_ip)))
+        return MODEL_IP;
+    if (model.l4_proto == 0)
+        return MODEL_FIELDS;
+    if (model.l4_proto != card.l4_proto || model.source_port != card.source_port || model.destination_port != card.destination_port)
+        return MODEL_L4;
+    if (!model.int_vld)
+        return MODEL_FIELDS;
+    if (model.int_length != card.int_length || model.int_inscnt != card.int_inscnt || model.int_insmap != card.int_insmap)
+        return MODEL_INT;
+    if (model.int_hop_vld != card.int_hop_vld)
+        return MODEL_HOP_VLD;
+    unsigned ins = model.int_insmap >> 8;
+    for (unsigned h = 0; h < NP4_INT_MAX_HOPS; h++) {
+        if (!(model.int_hop_vld & (1 << h)))
+            continue;
+        const np4_int_hop_t &m = model.int_hop[h], &c = card.int_hop[h];
+        if ((ins & INT_INS_SWITCH_ID) && m.swid != c.swid)
+            return MODEL_SWITCH_ID;
+        if ((ins & INT_INS_PORT_IDS) && (m.ingressport != c.ingressport || m.egressport != c.egressport))
+            return MODEL_PORT_IDS;
+        if ((ins & INT_INS_Q_OCCUPANCY) &&
+            (m.occupancy_queueid != c.occupancy_queueid || m.occupancy_occupancy != c.occupancy_occupancy))
+            return MODEL_Q_OCCUPANCY;
+        if ((ins & INT_INS_INGRESS_TSTAMP) && m.ingresstimestamp != c.ingresstimestamp)
+            return MODEL_TSTAMPS;
+        if ((ins & (INT_INS_INGRESS_TSTAMP | INT_INS_EGRESS_TSTAMP)) && m.egresstimestamp != c.egresstimestamp)
+            return MODEL_TSTAMPS;
+    }
+    return MODEL_FIELDS;
+}
+
+/**
+ * \brief Plain ones' complement sum of 16-bit words in network byte order.
+ * @param data Summed bytes
+ * @param len  Number of bytes, odd last byte is padded by zero
+ * @param sum  Sum of preceding data
+ * @return Sum folded to 16 bits
+ */
+uint32_t model_sum(const unsigned char *data, unsigned len, uint32_t sum) {
+    for (unsigned i = 0; i < len; i += 2)
+        sum += (data[i] << 8) | (i + 1 < len ? data[i + 1] : 0);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+/**
+ * \brief Verify checksums of Telemetry report by recomputing them from scratch.
+ * @param report Report starting by outer IP header
+ * @param len    Length of the report
+ * @return Name of the first bad checksum, NULL if all of them are right
+ */
+const char *model_check_report(const unsigned char *report, unsigned len) {
+    if (model_sum(report, 20, 0) != 0xFFFF)
+        return "outer IP";
+    const struct udphdr *udp = (const struct udphdr *) (report + REPORT_OFFSET_UDP);
+    if (udp->check) {
+        uint32_t pseudo = model_sum(report + 12, 8, IPPROTO_UDP + len - REPORT_OFFSET_UDP);
+        if (model_sum(report + REPORT_OFFSET_UDP, len - REPORT_OFFSET_UDP, pseudo) != 0xFFFF)
+            return "outer UDP";
+    }
+    const unsigned char *ip = report + REPORT_OFFSET_IP;
+    const unsigned char *l4;
+    uint32_t pseudo;
+    if ((ip[0] >> 4) == 6) {
+        l4 = report + REPORT_OFFSET_L4_V6;
+        pseudo = model_sum(ip + 8, 32, ip[6] + (ip[4] << 8 | ip[5]));
+    } else {
+        if (model_sum(ip, 20, 0) != 0xFFFF)
+            return "inner IP";
+        l4 = report + REPORT_OFFSET_L4;
+        pseudo = model_sum(ip + 12, 8, ip[9] + (ip[2] << 8 | ip[3]) - 20);
+    }
+    if (model_sum(l4, report + len - l4, pseudo) != 0xFFFF)
+        return "inner L4";
+    return NULL;
+}
+
+/**
+ * \brief Read records captured from the card.
+ * @param path    Raw capture of back-to-back records or pcap with one record per packet
+ * @param records Output records
+ * @param raw     Output mapping of raw capture, holds the records
+ * @param pcap    Output reader of pcap capture, holds the records
+ */
+void model_read_records(const char *path, std::vector<const np4_int_header_t *> &records, std::unique_ptr<mapped_file> &raw,
+                        std::unique_ptr<pcap_reader> &pcap) {
+    raw.reset(new mapped_file(path));
+    if (pcap_reader::is_pcap(raw->data, raw->size)) {
+        raw.reset();
+        pcap.reset(new pcap_reader(path));
+        unsigned char *data;
+        unsigned len;
+        while ((data = pcap->next(&len)) != NULL) {
+            if (len != NP4_RECORD_LEN)
+                throw std::runtime_error(std::string() + "'" + path + "' holds packet of " + std::to_string(len) +
+                                         " bytes instead of Netcope P4 record");
+            records.push_back((const np4_int_header_t *) (data + NP4_FRAME_HDR_LEN));
+        }
+    } else {
+        if (raw->size == 0 || raw->size % NP4_RECORD_LEN)
+            throw std::runtime_error(std::string() + "'" + path + "' is neither pcap nor raw capture of Netcope P4 records");
+        for (size_t offset = 0; offset < raw->size; offset += NP4_RECORD_LEN)
+            records.push_back((const np4_int_header_t *) (raw->data + offset + NP4_FRAME_HDR_LEN));
+    }
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *rules_path = NULL;
+    const char *output = NULL;
+    const char *compact = NULL;
+    const char *card = NULL;
+    bool original = false;
+    bool reports = false;
+    unsigned long loops = 1;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "L:w:C:d:n:oRh")) != -1)
+            switch (c) {
+                case 'L':
+                    rules_path = optarg;
+                    break;
+                case 'w':
+                    output = optarg;
+                    break;
+                case 'C':
+                    compact = optarg;
+                    break;
+                case 'd':
+                    card = optarg;
+                    break;
+                case 'n':
+                    loops = strtoul(optarg, NULL, 10);
+                    break;
+                case 'o':
+                    original = true;
+                    break;
+                case 'R':
+                    reports = true;
+                    break;
+                case 'h':
+                    model_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    model_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc - 1 || loops == 0) {
+            model_usage();
+            return EXIT_FAILURE;
+        }
+
+        std::unique_ptr<int_parser> parser;
+        if (rules_path) {
+            ruleset rules;
+            rules.load(rules_path);
+            parser.reset(new int_parser(rules));
+        } else {
+            parser.reset(new int_parser(!original));
+        }
+
+        pcap_reader reader(argv[optind]);
+        if (reader.linktype != PCAP_LINKTYPE_ETHERNET)
+            throw std::runtime_error(std::string() + "'" + argv[optind] + "' is not Ethernet capture");
+        std::vector<int_packet> packets;
+        int_packet packet;
+        uint64_t ts_ns;
+        while ((packet.data = reader.next(&packet.caplen, &ts_ns)) != NULL) {
+            packet.timestamp_s = ts_ns / 1000000000;
+            packet.timestamp_ns = ts_ns % 1000000000;
+            packets.push_back(packet);
+        }
+
+        // Records of all packets are kept only when they are written out or compared
+        bool keep = output || compact || card || reports;
+        std::vector<unsigned char> frames((keep ? packets.size() : INT_PARSER_BATCH) * NP4_RECORD_LEN);
+        uint64_t found = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned long l = 0; l < loops; l++)
+            for (size_t i = 0; i < packets.size(); i += INT_PARSER_BATCH) {
+                unsigned count = std::min((size_t) INT_PARSER_BATCH, packets.size() - i);
+                found += parser->parse(&packets[i], count, &frames[keep ? i * NP4_RECORD_LEN : 0]);
+            }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "Packets             : " << packets.size() << std::endl;
+        std::cout << "INT packets         : " << found / loops << std::endl;
+        if (keep) {
+            std::vector<uint64_t> hops(NP4_INT_MAX_HOPS + 1);
+            for (size_t i = 0; i < packets.size(); i++) {
+                const np4_int_header_t *hdr = (const np4_int_header_t *) &frames[i * NP4_RECORD_LEN + NP4_FRAME_HDR_LEN];
+                if (hdr->int_vld)
+                    hops[__builtin_popcount(hdr->int_hop_vld)]++;
+            }
+            for (unsigned h = 0; h <= NP4_INT_MAX_HOPS; h++)
+                std::cout << "INT with " << h << " hops     : " << hops[h] << std::endl;
+        }
+        std::cout << "Elapsed time (s)    : " << elapsed << std::endl;
+        std::cout << "Packets per second  : " << (elapsed > 0 ? packets.size() * loops / elapsed : 0.0) << std::endl;
+
+        if (output) {
+            std::ofstream out(output, std::ios::binary);
+            out.write((const char *) frames.data(), frames.size());
+            if (!out)
+                throw std::runtime_error(std::string() + "unable to write '" + output + "'");
+        }
+
+        if (compact) {
+            // Frame header of the full record followed by compact record, as the card sends it
+            pcap_writer writer(compact, MODEL_LINKTYPE_NP4);
+            unsigned char record[NP4_FRAME_HDR_LEN + COMPACT_MAX_LEN];
+            uint64_t bytes = 0;
+            for (size_t i = 0; i < packets.size(); i++) {
+                const unsigned char *frame = &frames[i * NP4_RECORD_LEN];
+                uint64_t ts_ns = packets[i].timestamp_s * 1000000000ull + packets[i].timestamp_ns;
+                unsigned len = parser->compact(packets[i].data, packets[i].caplen, record + NP4_FRAME_HDR_LEN);
+                if (len) {
+                    memcpy(record, frame, NP4_FRAME_HDR_LEN);
+                    writer.write(record, NP4_FRAME_HDR_LEN + len, ts_ns);
+                    bytes += NP4_FRAME_HDR_LEN + len;
+                } else {
+                    writer.write(frame, NP4_RECORD_LEN, ts_ns);
+                    bytes += NP4_RECORD_LEN;
+                }
+            }
+            writer.flush();
+            std::cout << "Average record size : " << (packets.size() ? (double) bytes / packets.size() : 0.0)
+                      << " / " << NP4_RECORD_LEN << std::endl;
+        }
+
+        if (reports) {
+            // Source address is needed for outer UDP checksum, the addresses themselves do not matter
+            report_encoder encoder(htonl(0x7F000001), 6000);
+            encoder.set_source(htonl(0x7F000002));
+            std::vector<unsigned char> report(REPORT_MAX_LEN);
+            uint64_t checked = 0, bad = 0;
+            for (size_t i = 0; i < packets.size(); i++) {
+                const np4_int_header_t *hdr = (const np4_int_header_t *) &frames[i * NP4_RECORD_LEN + NP4_FRAME_HDR_LEN];
+                if (!hdr->int_vld)
+                    continue;
+                unsigned len = encoder.encode(report.data(), hdr, packets[i].timestamp_s);
+                checked++;
+                const char *wrong = model_check_report(report.data(), len);
+                if (wrong && bad++ < MODEL_DIFFS_PRINTED)
+                    std::cout << "Report of record " << i << " has bad " << wrong << " checksum" << std::endl;
+            }
+            std::cout << "Reports checked     : " << checked << std::endl;
+            std::cout << "Bad checksums       : " << bad << std::endl;
+            if (bad)
+                return EXIT_FAILURE;
+        }
+
+        if (card) {
+            std::unique_ptr<mapped_file> raw;
+            std::unique_ptr<pcap_reader> pcap;
+            std::vector<const np4_int_header_t *> records;
+            model_read_records(card, records, raw, pcap);
+            if (records.size() != packets.size())
+                std::cerr << __progname << ": warning: " << records.size() << " records of the card for "
+                          << packets.size() << " packets, only the first ones are compared" << std::endl;
+            std::vector<uint64_t> diffs(MODEL_FIELDS);
+            uint64_t differing = 0;
+            for (size_t i = 0; i < std::min(records.size(), packets.size()); i++) {
+                const np4_int_header_t *hdr = (const np4_int_header_t *) &frames[i * NP4_RECORD_LEN + NP4_FRAME_HDR_LEN];
+                model_field field = model_compare(*hdr, *records[i]);
+                if (field == MODEL_FIELDS)
+                    continue;
+                if (differing++ < MODEL_DIFFS_PRINTED)
+                    std::cout << "Record " << i << " differs in " << model_field_names[field] << std::endl;
+                diffs[field]++;
+            }
+            std::cout << std::endl;
+            std::cout << "Differing records   : " << differing << std::endl;
+            for (unsigned f = 0; f < MODEL_FIELDS; f++)
+                if (diffs[f])
+                    std::cout << std::left << std::setw(20) << model_field_names[f] << ": " << diffs[f] << std::endl;
+            if (differing)
+                return EXIT_FAILURE;
+        }
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string &e) {
+        std::cerr << __progname << ": " << e << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
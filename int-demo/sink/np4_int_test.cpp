@@ -0,0 +1,236 @@
+/*
+ * np4_int_test.cpp: Tests of components of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Netcope P4 INT component tests -----------------------------
+ * --------------------------------------------------------------------------------
+ * - Components of the sink are checked on synthetic records, every failed      -
+ *   check is written out. The tests do not need the card nor the Netcope P4    -
+ *   library. TX ring is tested only on the given interface (needs root).        -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_int_test [-h] [-i iface]
+ *   -i iface Also test TX ring of interface, lo is enough
+ *   -h       Writes out help
+ * Build: g++ -O2 -std=c++11 -o np4_int_test np4_int_test.cpp -lpthread
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "flow_table.hpp"
+#include "hop_histograms.hpp"
+#include "np4_int_header.hpp"
+#include "report_tx_ring.hpp"
+
+#define MS 1000000ull //!< Nanoseconds of millisecond.
+
+//! Number of failed checks.
+static unsigned failures = 0;
+
+//! Write out failed check with its place.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+void test_usage() {
+    std::cout << "Usage: np4_int_test [-h] [-i iface]" << std::endl;
+    std::cout << "  -i iface Also test TX ring of interface, lo is enough" << std::endl;
+    std::cout << "  -h       Writes out help" << std::endl;
+}
+
+/**
+ * \brief Record of UDP flow with two hops.
+ * @param flow Number of the flow, becomes its source port
+ */
+np4_int_header_t test_record(unsigned flow) {
+    np4_int_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.source_ip[0] = htonl(0x0A000001);
+    hdr.destination_ip[0] = htonl(0x0B000001);
+    hdr.source_port = flow;
+    hdr.destination_port = 4789;
+    hdr.ip_ver = 4;
+    hdr.l4_proto = 17;
+    hdr.int_vld = 1;
+    hdr.int_insmap = (INT_INS_SWITCH_ID | INT_INS_HOP_LATENCY) << 8;
+    hdr.int_hop_vld = 3;
+    hdr.int_hop[0].swid = 1;
+    hdr.int_hop[1].swid = 2;
+    return hdr;
+}
+
+/**
+ * \brief Flow coming back after the age is new again.
+ */
+void test_flow_age() {
+    flow_table table(64, 1000, 100, 1000000, 10);
+    np4_int_header_t hdr = test_record(1);
+    CHECK(table.should_report(&hdr, 1 * MS));
+    CHECK(!table.should_report(&hdr, 5 * MS));
+    // Seen 5 ms ago, still within the age
+    CHECK(!table.should_report(&hdr, 14 * MS));
+    // Not seen for the age
+    CHECK(table.should_report(&hdr, 24 * MS));
+    CHECK(!table.should_report(&hdr, 25 * MS));
+    CHECK(table.evictions == 0);
+}
+
+/**
+ * \brief Full bucket gives up aged-out flow before live ones.
+ */
+void test_flow_victim() {
+    // One bucket holds all flows
+    flow_table table(FLOW_WAYS, 1000, 100, 1000000, 100);
+    np4_int_header_t hdr[FLOW_WAYS + 2];
+    for (unsigned i = 0; i < FLOW_WAYS + 2; i++)
+        hdr[i] = test_record(i + 1);
+
+    // Flow 0 ages out, the others stay live
+    CHECK(table.should_report(&hdr[0], 0));
+    for (unsigned i = 1; i < FLOW_WAYS; i++)
+        CHECK(table.should_report(&hdr[i], 90 * MS + i));
+    CHECK(table.should_report(&hdr[FLOW_WAYS], 120 * MS));
+    CHECK(table.evictions == 0);
+    for (unsigned i = 1; i <= FLOW_WAYS; i++)
+        CHECK(!table.should_report(&hdr[i], 121 * MS + i));
+
+    // All flows are live, the least recently seen one is evicted
+    CHECK(table.should_report(&hdr[FLOW_WAYS + 1], 122 * MS));
+    CHECK(table.evictions == 1);
+    for (unsigned i = 2; i <= FLOW_WAYS + 1; i++)
+        CHECK(!table.should_report(&hdr[i], 123 * MS));
+    CHECK(table.should_report(&hdr[1], 124 * MS));
+}
+
+/**
+ * \brief Snapshots handed to the writer are written out whole, each once.
+ */
+void test_hist_snapshot() {
+    FILE *file = tmpfile();
+    CHECK(file != NULL);
+    if (file == NULL)
+        return;
+    np4_int_header_t hdr = test_record(1);
+    hdr.int_insmap = (INT_INS_SWITCH_ID | INT_INS_PORT_IDS | INT_INS_Q_OCCUPANCY) << 8;
+    {
+        hist_log log(1, file);
+        hop_histograms &hists = log.create(0, 16, 1, 7);
+        hists.record(&hdr);
+        CHECK(hists.snapshot());
+        hists.record(&hdr);
+        hists.record(&hdr);
+        hists.flush();
+    }
+    // Two hops in each of two snapshots
+    rewind(file);
+    char line[4096];
+    unsigned lines = 0, counts = 0;
+    while (fgets(line, sizeof(line), file)) {
+        long time;
+        int queue;
+        unsigned swid, port;
+        char metric[16];
+        unsigned long long count;
+        if (sscanf(line, "%ld %d %u %u %15s %llu", &time, &queue, &swid, &port, metric, &count) == 6 && queue == 7 &&
+            strcmp(metric, "occupancy") == 0)
+            counts += count;
+        lines++;
+    }
+    CHECK(lines == 4);
+    CHECK(counts == 6);
+    fclose(file);
+}
+
+/**
+ * \brief Datagram too long for the interface counts as error, not as sent.
+ * @param iface Interface of the TX ring
+ */
+void test_tx_ring(const char *iface) {
+    static const unsigned char broadcast[ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    try {
+        unsigned mtu = ring_report_sender(iface, broadcast, AF_INET, 1, 1000, REPORT_MAX_LEN, 1).mtu();
+        // Frames have room for datagrams over the MTU
+        ring_report_sender ring(iface, broadcast, AF_INET, 4, 1000, mtu + 64, 8);
+        unsigned lens[3] = { 100, mtu + 1, mtu };
+        unsigned reports[3] = { 2, 3, 1 };
+        for (unsigned i = 0; i < 3; i++) {
+            unsigned char *datagram = ring.next();
+            memset(datagram, 0, 20);
+            datagram[0] = 0x45;
+            ring.commit(lens[i], reports[i]);
+        }
+        ring.flush();
+        CHECK(ring.reports == 3);
+        CHECK(ring.datagrams == 2);
+        CHECK(ring.errors == 3);
+    } catch (std::exception &e) {
+        std::cout << "TX ring of " << iface << ": " << e.what() << std::endl;
+        failures++;
+    } catch (std::string &e) {
+        std::cout << "TX ring of " << iface << ": " << e << std::endl;
+        failures++;
+    }
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero when all checks pass, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *iface = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:h")) != -1)
+        switch (c) {
+            case 'i':
+                iface = optarg;
+                break;
+            case 'h':
+                test_usage();
+                return EXIT_SUCCESS;
+            default:
+                test_usage();
+                return EXIT_FAILURE;
+        }
+
+    test_flow_age();
+    test_flow_victim();
+    test_hist_snapshot();
+    if (iface)
+        test_tx_ring(iface);
+
+    if (failures) {
+        std::cout << "Failed checks       : " << failures << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
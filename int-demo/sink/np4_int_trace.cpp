@@ -0,0 +1,119 @@
+/*
+ * np4_int_trace.cpp: Decoder of binary traces of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Netcope P4 INT trace decoder -------------------------------
+ * --------------------------------------------------------------------------------
+ * - Records traced by np4_int -T are written out in the same form as the        -
+ *   verbose mode of np4_int. The decoder does not need the card nor the Netcope -
+ *   P4 library.                                                                  -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_int_trace [-h] [-r queues] [-n count] file
+ *   -r queues  Only records of RX queues, list or range (default: all)
+ *   -n count   Stop after count records (default: all)
+ *   -h         Writes out help
+ * Build: g++ -O2 -std=c++11 -o np4_int_trace np4_int_trace.cpp -lpthread
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+
+#include "arguments.hpp"
+#include "trace_log.hpp"
+
+void trace_usage() {
+    std::cout << "Usage: np4_int_trace [-h] [-r queues] [-n count] file" << std::endl;
+    std::cout << "  -r queues  Only records of RX queues, list or range (default: all)" << std::endl;
+    std::cout << "  -n count   Stop after count records (default: all)" << std::endl;
+    std::cout << "  -h         Writes out help" << std::endl;
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    std::vector<int> queues;
+    unsigned long count = 0;
+    FILE *file = NULL;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "r:n:h")) != -1)
+            switch (c) {
+                case 'r':
+                    queues = arguments::parse_list(optarg, 'r');
+                    break;
+                case 'n':
+                    count = strtoul(optarg, NULL, 10);
+                    break;
+                case 'h':
+                    trace_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    trace_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc - 1) {
+            trace_usage();
+            return EXIT_FAILURE;
+        }
+
+        // Check header of the trace
+        file = fopen(argv[optind], "r");
+        if (file == NULL)
+            throw std::runtime_error(std::string() + "unable to open '" + argv[optind] + "'");
+        trace_file_header header;
+        if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)))
+            throw std::runtime_error(std::string() + "'" + argv[optind] + "' is not a trace of np4_int");
+        if (header.version != TRACE_VERSION || header.entry_len != sizeof(trace_entry))
+            throw std::runtime_error("unsupported version of trace");
+
+        // Write out entries of selected queues
+        std::vector<bool> selected;
+        for (unsigned i = 0; i < queues.size(); i++) {
+            if ((unsigned) queues[i] >= selected.size())
+                selected.resize(queues[i] + 1);
+            selected[queues[i]] = true;
+        }
+        trace_entry entry;
+        unsigned long printed = 0;
+        while ((count == 0 || printed < count) && fread(&entry, sizeof(entry), 1, file) == 1) {
+            if (!selected.empty() && (entry.queue >= selected.size() || !selected[entry.queue]))
+                continue;
+            trace_print(stdout, entry);
+            printed++;
+        }
+        fclose(file);
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        if (file)
+            fclose(file);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+/*
+ * report_encoder.hpp: Telemetry report encoder for Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_REPORT_ENCODER
+#define __HEADER_FILE_REPORT_ENCODER
+
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+
+#include "np4_int_header.hpp"
+#include "hop_encoder.hpp"
+#include "checksum.hpp"
+
+// Layout of Telemetry report (outer IP, UDP, Telemetry report header, inner Ethernet, IP, L4)
+#define REPORT_OFFSET_UDP       20
+#define REPORT_OFFSET_TELEMETRY 28
+#define REPORT_OFFSET_ETH       40
+#define REPORT_OFFSET_IP        54
+#define REPORT_OFFSET_L4        74  //!< Inner L4 behind IPv4.
+#define REPORT_OFFSET_L4_V6     94  //!< Inner L4 behind IPv6.
+#define REPORT_TEMPLATE_LEN     (REPORT_OFFSET_L4 + 20)
+#define REPORT_TEMPLATE_LEN_V6  (REPORT_OFFSET_L4_V6 + 20)
+
+#define REPORT_PAYLOAD          "Hello World"
+#define REPORT_PAYLOAD_LEN      11
+
+//! Longest possible report (TCP, INT length field at its maximum).
+#define REPORT_MAX_LEN          (REPORT_OFFSET_L4_V6 + 20 + (255 << 2) + REPORT_PAYLOAD_LEN)
+
+/**
+ * \brief Encoder of Telemetry reports from Netcope INT headers.
+ *
+ * Inner packet of the report carries IPv4 or IPv6 header according to the
+ * flow; each version has its own prepared template. Checksums of template
+ * headers are computed once and only patched for the fields set per report
+ * (RFC 1624); inner TCP/UDP checksums are completed from the sums of their
+ * parts, and so is the outer UDP checksum once the source address is known.
+ */
+class report_encoder {
+
+    private:
+
+        unsigned char tmpl[REPORT_TEMPLATE_LEN];       //!< Static part of every IPv4 report.
+        unsigned char tmpl_v6[REPORT_TEMPLATE_LEN_V6]; //!< Static part of every IPv6 report.
+        int_hops_encoder_t encode_hops;                 //!< Hop encoder chosen for the CPU.
+        uint16_t ip_check;      //!< Checksum of outer IP header of the template (zero length).
+        uint16_t ip_in_check;   //!< Checksum of inner IPv4 header of the template (zero length, protocol, addresses).
+        uint32_t pseudo_sum;    //!< Partial sum of outer UDP pseudo header without length.
+        uint32_t payload_sum;   //!< Partial sum of report payload.
+
+    public:
+
+        /**
+         * \brief Basic constructor, prepare static parts of reports.
+         * @param daddr Target IPv4 address for Telemetry reports (network byte order)
+         * @param port  Target UDP port for Telemetry reports
+         * @param hw_id Hardware ID of the reporting sink
+         */
+        report_encoder(in_addr_t daddr, uint16_t port, uint8_t hw_id = 1);
+
+        /**
+         * \brief Encode Telemetry report with its own outer IP and UDP header.
+         * @param buffer      Output buffer of at least REPORT_MAX_LEN bytes
+         * @param hdr         Netcope INT header with valid INT
+         * @param timestamp_s Ingress timestamp (seconds)
+         * @return Length of the report
+         */
+        inline unsigned encode(unsigned char *buffer, const np4_int_header_t *hdr, uint32_t timestamp_s) {
+            uint32_t sum;
+            unsigned len = encode_report(buffer + REPORT_OFFSET_TELEMETRY, hdr, timestamp_s, &sum);
+            encode_header(buffer, len, sum);
+            return REPORT_OFFSET_TELEMETRY + len;
+        }
+
+        /**
+         * \brief Set source IPv4 address of Telemetry reports, needed for outer UDP checksum.
+         * @param saddr Source IPv4 address (network byte order), 0 to leave it to the kernel
+         */
+        void set_source(in_addr_t saddr);
+
+        /**
+         * \brief Encode outer IP and UDP header of Telemetry report datagram.
+         * @param buffer      Output buffer of at least REPORT_OFFSET_TELEMETRY bytes
+         * @param payload_len Length of UDP payload
+         * @param payload_sum Partial sum of UDP payload
+         */
+        inline void encode_header(unsigned char *buffer, unsigned payload_len, uint32_t payload_sum) {
+            memcpy(buffer, tmpl, REPORT_OFFSET_TELEMETRY);
+            struct iphdr *ip = (struct iphdr *) buffer;
+            ip->tot_len = htons(REPORT_OFFSET_TELEMETRY + payload_len);
+            ip->check = csum_replace2(ip_check, 0, ip->tot_len);
+            struct udphdr *udp = (struct udphdr *) &(buffer[REPORT_OFFSET_UDP]);
+            udp->len = htons(REPORT_OFFSET_TELEMETRY - REPORT_OFFSET_UDP + payload_len);
+            // Without source address the checksum stays zero (none)
+            if (ip->saddr) {
+                uint32_t sum = csum_add(pseudo_sum, udp->len);
+                uint16_t check = ~csum_fold(csum_add(sum, csum_partial_scalar(udp, sizeof(struct udphdr), payload_sum)));
+                udp->check = check ? check : 0xFFFF;
+            }
+        }
+
+        /**
+         * \brief Encode Telemetry report without outer headers, starting by Telemetry report header.
+         * @param report      Output buffer of at least REPORT_MAX_LEN - REPORT_OFFSET_TELEMETRY bytes
+         * @param hdr         Netcope INT header with valid INT
+         * @param timestamp_s Ingress timestamp (seconds)
+         * @param sum         Output of partial sum of the report, NULL if not needed
+         * @return Length of the report, equal to report_length()
+         */
+        inline unsigned encode_report(unsigned char *report, const np4_int_header_t *hdr, uint32_t timestamp_s,
+                                      uint32_t *sum = NULL);
+
+        /**
+         * \brief Length of Telemetry report without outer headers.
+         * @param hdr Netcope INT header with valid INT
+         */
+        static inline unsigned report_length(const np4_int_header_t *hdr) {
+            return REPORT_OFFSET_IP - REPORT_OFFSET_TELEMETRY + (hdr->ip_ver == 6 ? 40 : 20) +
+                   (hdr->l4_proto == 6 ? 20 : 8) + (hdr->int_length << 2) + REPORT_PAYLOAD_LEN;
+        }
+
+        uint32_t seqnum; //!< Sequence number of last report.
+};
+
+inline report_encoder::report_encoder(in_addr_t daddr, uint16_t port, uint8_t hw_id) :
+    tmpl(),
+    tmpl_v6(),
+    ip_check(0),
+    ip_in_check(0),
+    pseudo_sum(0),
+    payload_sum(csum_partial(REPORT_PAYLOAD, REPORT_PAYLOAD_LEN)),
+    seqnum(0)
+    {
+    encode_hops = int_hops_encoder_select();
+
+    // Prepare common IP header for Telemetry reports
+    struct iphdr *ip = (struct iphdr *) &(tmpl[0]);
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tos = 0;
+    ip->tot_len = 0;
+    ip->id = 0;
+    ip->frag_off = htons(0x4000);
+    ip->ttl = 255;
+    ip->protocol = 17;
+    ip->check = 0;
+    ip->saddr = 0;
+    ip->daddr = daddr;
+
+    // Prepare common UDP header for Telemetry reports
+    struct udphdr *udp = (struct udphdr *) &(tmpl[REPORT_OFFSET_UDP]);
+    udp->source = 0;
+    udp->dest = htons(port);
+    udp->len = 0;
+    udp->check = 0;
+
+    // Prepare Telemetry report header
+    struct telemetry_report *tel = (struct telemetry_report *) &(tmpl[REPORT_OFFSET_TELEMETRY]);
+    tel->ver = 0;
+    tel->nproto = 0;
+    tel->res16 = htons(0x2000);
+    tel->res2 = 0;
+    tel->hw_id = hw_id;
+
+    // Prepare Ethernet header
+    static const struct ethernet eth = {
+        { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 },
+        { 0x11, 0x12, 0x13, 0x14, 0x15, 0x16 },
+        0
+    };
+    struct ethernet *eth_in = (struct ethernet *) &(tmpl[REPORT_OFFSET_ETH]);
+    *eth_in = eth;
+    eth_in->ethtype = htons(0x0800);
+
+    // Prepare IP header
+    struct iphdr *ip_in = (struct iphdr *) &(tmpl[REPORT_OFFSET_IP]);
+    ip_in->ihl = 5;
+    ip_in->version = 4;
+    ip_in->tos = 0x04;
+    ip_in->frag_off = htons(0x4000);
+    ip_in->ttl = 255;
+    ip_in_check = ip_checksum(ip_in, 20);
+
+    // Prepare TCP header (only ports differ for UDP, which overwrites the rest)
+    struct tcphdr *tcp_in = (struct tcphdr *) &(tmpl[REPORT_OFFSET_L4]);
+    tcp_in->doff = 5;
+
+    // IPv6 template shares headers up to inner Ethernet
+    memcpy(tmpl_v6, tmpl, REPORT_OFFSET_IP);
+    eth_in = (struct ethernet *) &(tmpl_v6[REPORT_OFFSET_ETH]);
+    eth_in->ethtype = htons(0x86DD);
+
+    // Prepare IPv6 header (traffic class as TOS of IPv4)
+    struct ip6_hdr *ip6_in = (struct ip6_hdr *) &(tmpl_v6[REPORT_OFFSET_IP]);
+    ip6_in->ip6_flow = htonl((6 << 28) | (0x04 << 20));
+    ip6_in->ip6_hlim = 255;
+
+    tcp_in = (struct tcphdr *) &(tmpl_v6[REPORT_OFFSET_L4_V6]);
+    tcp_in->doff = 5;
+
+    set_source(0);
+}
+
+inline void report_encoder::set_source(in_addr_t saddr) {
+    struct iphdr *ip = (struct iphdr *) &(tmpl[0]);
+    ip->saddr = saddr;
+    ((struct iphdr *) &(tmpl_v6[0]))->saddr = saddr;
+    ip->check = 0;
+    ip_check = ip_checksum(ip, 20);
+    pseudo_sum = csum_add(csum_partial_scalar(&ip->saddr, 8, 0), htons(IPPROTO_UDP));
+}
+
+inline unsigned report_encoder::encode_report(unsigned char *report, const np4_int_header_t *hdr, uint32_t timestamp_s,
+                                              uint32_t *sum) {
+    // Offsets of report layout are counted from the start of outer IP header
+    unsigned char *buffer = report - REPORT_OFFSET_TELEMETRY;
+    bool v6 = hdr->ip_ver == 6;
+    unsigned ip_in_size = v6 ? 40 : 20;
+    if (v6)
+        memcpy(report, tmpl_v6 + REPORT_OFFSET_TELEMETRY, REPORT_TEMPLATE_LEN_V6 - REPORT_OFFSET_TELEMETRY);
+    else
+        memcpy(report, tmpl + REPORT_OFFSET_TELEMETRY, REPORT_TEMPLATE_LEN - REPORT_OFFSET_TELEMETRY);
+
+    struct telemetry_report *tel = (struct telemetry_report *) &(buffer[REPORT_OFFSET_TELEMETRY]);
+    tel->sequence_number = htonl(++seqnum);
+    tel->ingress_timestamp = htonl(timestamp_s);
+
+    struct iphdr *ip_in = (struct iphdr *) &(buffer[REPORT_OFFSET_IP]);
+    struct ip6_hdr *ip6_in = (struct ip6_hdr *) &(buffer[REPORT_OFFSET_IP]);
+    if (v6) {
+        ip6_in->ip6_nxt = hdr->l4_proto;
+        np4_int_store_ip6((unsigned char *) &ip6_in->ip6_src, hdr, false);
+        np4_int_store_ip6((unsigned char *) &ip6_in->ip6_dst, hdr, true);
+    } else {
+        ip_in->protocol = hdr->l4_proto;
+        ip_in->saddr = htonl(hdr->source_ip[0]);
+        ip_in->daddr = htonl(hdr->destination_ip[0]);
+    }
+
+    // Source and destination ports are at the same place in TCP and UDP
+    struct udphdr *l4_in = (struct udphdr *) &(buffer[REPORT_OFFSET_IP + ip_in_size]);
+    l4_in->source = htons(hdr->source_port);
+    l4_in->dest = htons(hdr->destination_port);
+    unsigned l4_in_size = (hdr->l4_proto == 6) ? 20 : 8;
+
+    unsigned int_size = hdr->int_length << 2;
+    unsigned in_size = ip_in_size + l4_in_size + int_size + REPORT_PAYLOAD_LEN;
+
+    // Prepare INT Shim header
+    unsigned char *out = &(buffer[REPORT_OFFSET_IP + ip_in_size + l4_in_size]);
+    struct int_shim *int_sh = (struct int_shim *) out;
+    int_sh->type = 1;
+    int_sh->res1 = 0;
+    int_sh->length = hdr->int_length;
+    int_sh->res2 = 0;
+
+    // Prepare INT header
+    struct int_hdr *int_h = (struct int_hdr *) (out + sizeof(struct int_shim));
+    int_h->ver = 0;
+    int_h->res4 = 0;
+    int_h->ins_cnt = hdr->int_inscnt;
+    int_h->res3 = 0;
+    int_h->max_hop_cnt = 0;
+    int_h->total_hop_cnt = __builtin_popcount(hdr->int_hop_vld);
+    int_h->instr_bitmap = htons(hdr->int_insmap);
+    int_h->reserved = 0;
+
+    // Prepare INT metadata of all hops, sparse bitmaps are faster field by field
+    // (vector encoders write behind the hops, INT Tail header and payload are written afterwards)
+    unsigned ins = hdr->int_insmap >> 8;
+    if (__builtin_popcount(ins) < HOP_ENCODER_SIMD_MIN_FIELDS)
+        int_encode_hops_scalar(out + sizeof(struct int_shim) + sizeof(struct int_hdr), hdr->int_hop, hdr->int_hop_vld, ins);
+    else
+        encode_hops(out + sizeof(struct int_shim) + sizeof(struct int_hdr), hdr->int_hop, hdr->int_hop_vld, ins);
+
+    // Prepare INT Tail header
+    struct int_tail *int_tl = (struct int_tail *) (out + int_size - sizeof(struct int_tail));
+    int_tl->proto = hdr->l4_proto;
+    int_tl->dport = l4_in->dest;
+    int_tl->dscp = 0;
+
+    // Prepare payload
+    memcpy(out + int_size, REPORT_PAYLOAD, REPORT_PAYLOAD_LEN);
+
+    // Update lengths and checksums of inner packet
+    unsigned l4_len = l4_in_size + int_size + REPORT_PAYLOAD_LEN;
+    uint32_t addr_sum;
+    if (v6) {
+        ip6_in->ip6_plen = htons(l4_len);
+        addr_sum = csum_partial_scalar(&ip6_in->ip6_src, 32, 0);
+    } else {
+        ip_in->tot_len = htons(in_size);
+        addr_sum = csum_partial_scalar(&ip_in->saddr, 8, 0);
+        // Fields zero in the template; protocol is the second byte of its word
+        ip_in->check = csum_update(ip_in_check, 0, csum_add(csum_add(addr_sum, ip_in->tot_len), htons(hdr->l4_proto)));
+    }
+
+    // Inner TCP/UDP checksum: pseudo header, L4 header, INT and payload (all at even offsets)
+    uint16_t *l4_check = (hdr->l4_proto == 6) ? &((struct tcphdr *) l4_in)->check : &l4_in->check;
+    if (hdr->l4_proto == 17)
+        l4_in->len = htons(l4_len);
+    *l4_check = 0;
+    uint32_t pseudo = csum_add(csum_add(addr_sum, htons(hdr->l4_proto)), htons(l4_len));
+    uint32_t l4_sum = csum_partial(out, int_size, payload_sum);
+    l4_sum = csum_partial_scalar(l4_in, l4_in_size, l4_sum);
+    uint16_t check = ~csum_fold(csum_add(pseudo, l4_sum));
+    *l4_check = (check == 0 && hdr->l4_proto == 17) ? 0xFFFF : check;
+
+    if (sum) {
+        // Checksummed parts sum to zero: inner IPv4 header adds nothing, L4 segment the complement of its pseudo header
+        *sum = csum_partial_scalar(report, REPORT_OFFSET_IP - REPORT_OFFSET_TELEMETRY, (uint16_t) ~csum_fold(pseudo));
+        if (v6)
+            *sum = csum_partial_scalar(ip6_in, 8, csum_add(*sum, addr_sum));
+    }
+    return REPORT_OFFSET_IP - REPORT_OFFSET_TELEMETRY + in_size;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * report_packer.hpp: Packing of several Telemetry reports into one datagram for Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_REPORT_PACKER
+#define __HEADER_FILE_REPORT_PACKER
+
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "report_encoder.hpp"
+#include "report_sender.hpp"
+
+/*
+ * Packed datagram (UDP payload, all fields in network byte order):
+ *
+ *   +---------+----------+-------+--------+----------+--------+----------+---
+ *   | version | reserved | count | length | report 1 | length | report 2 | ...
+ *   | 8 bits  | 8 bits   | 16 b  | 16 b   |          | 16 b   |          |
+ *   +---------+----------+-------+--------+----------+--------+----------+---
+ *
+ * Every report starts by its Telemetry report header, exactly as the UDP
+ * payload of an unpacked report. Length does not include itself.
+ */
+
+#define REPORT_PACK_VERSION  1  //!< Version of packed datagram.
+//! Offset of the first length field in packed datagram.
+#define REPORT_PACK_OFFSET   (REPORT_OFFSET_TELEMETRY + sizeof(struct report_pack_header))
+//! Smallest MTU every report fits into.
+#define REPORT_PACK_MIN_MTU  (REPORT_PACK_OFFSET + 2 + REPORT_MAX_LEN - REPORT_OFFSET_TELEMETRY)
+//! Largest MTU (IPv4 datagram).
+#define REPORT_PACK_MAX_MTU  65535
+
+/**
+ * \brief Header of packed datagram.
+ */
+struct __attribute__((__packed__)) report_pack_header {
+    uint8_t  version;   //!< REPORT_PACK_VERSION.
+    uint8_t  reserved;
+    uint16_t count;     //!< Number of reports in the datagram.
+};
+
+/**
+ * \brief Packer of Telemetry reports into datagrams of limited size.
+ *
+ * Reports are encoded in place behind each other into the buffer of the
+ * sender; the datagram is handed to the sender once the next report would
+ * not fit into MTU, or once its oldest report waited for the maximal delay.
+ */
+class report_packer {
+
+    private:
+
+        report_packer(const report_packer &);
+        report_packer &operator=(const report_packer &);
+
+        report_encoder &encoder;  //!< Encoder of Telemetry reports.
+        report_sender &sender;    //!< Sender of packed datagrams.
+        unsigned mtu;             //!< Maximal length of datagram.
+        uint64_t wait_ns;         //!< Maximal delay of report in open datagram.
+        unsigned char *datagram;  //!< Open datagram.
+        unsigned len;             //!< Length of open datagram.
+        unsigned count;           //!< Number of reports in open datagram (0 = none open).
+        uint32_t sum;             //!< Partial sum of reports in open datagram.
+        uint64_t deadline;        //!< Time to close open datagram.
+
+    public:
+
+        /**
+         * \brief Sender buffer length needed for packed datagrams.
+         * @param mtu Maximal length of datagram
+         */
+        static unsigned buffer_len(unsigned mtu) {
+            // Encoder may write behind the last report
+            return mtu + REPORT_MAX_LEN;
+        }
+
+        /**
+         * \brief Basic constructor.
+         * @param encoder Encoder of Telemetry reports
+         * @param sender  Sender of packed datagrams, with buffers of buffer_len(mtu) bytes
+         * @param mtu     Maximal length of datagram
+         * @param wait_us Maximal delay of report in open datagram in microseconds
+         */
+        report_packer(report_encoder &encoder, report_sender &sender, unsigned mtu, unsigned wait_us) :
+            encoder(encoder),
+            sender(sender),
+            mtu(mtu),
+            wait_ns((uint64_t) wait_us * 1000),
+            datagram(NULL),
+            len(0),
+            count(0),
+            sum(0),
+            deadline(0)
+            {
+            if (mtu < REPORT_PACK_MIN_MTU || mtu > REPORT_PACK_MAX_MTU)
+                throw std::runtime_error("MTU out of range for packed Telemetry reports");
+        }
+
+        /**
+         * \brief Encode Telemetry report into open datagram, hand the datagram to sender when full.
+         * @param hdr         Netcope INT header with valid INT
+         * @param timestamp_s Ingress timestamp (seconds)
+         */
+        inline void add(const np4_int_header_t *hdr, uint32_t timestamp_s) {
+            unsigned report_len = report_encoder::report_length(hdr);
+            if (count && len + 2 + report_len > mtu)
+                close();
+            if (count == 0) {
+                datagram = sender.next();
+                len = REPORT_PACK_OFFSET;
+                sum = 0;
+                deadline = report_sender::now() + wait_ns;
+            }
+            uint16_t prefix = htons(report_len);
+            memcpy(datagram + len, &prefix, 2);
+            uint32_t report_sum;
+            encoder.encode_report(datagram + len + 2, hdr, timestamp_s, &report_sum);
+            // Reports of odd length shift the following ones to odd offsets
+            sum = csum_block_add(sum, csum_add(prefix, report_sum), len);
+            len += 2 + report_len;
+            count++;
+        }
+
+        /**
+         * \brief Hand open datagram to sender.
+         */
+        inline void close() {
+            if (count == 0)
+                return;
+            struct report_pack_header *pack = (struct report_pack_header *) &(datagram[REPORT_OFFSET_TELEMETRY]);
+            pack->version = REPORT_PACK_VERSION;
+            pack->reserved = 0;
+            pack->count = htons(count);
+            encoder.encode_header(datagram, len - REPORT_OFFSET_TELEMETRY,
+                                  csum_partial_scalar(pack, sizeof(struct report_pack_header), sum));
+            sender.commit(len, count);
+            count = 0;
+        }
+
+        /**
+         * \brief Send open datagram and queued datagrams if the oldest report waits too long.
+         */
+        inline void poll() {
+            // Open datagram sits in the buffer behind the queued ones, both go out together
+            if ((count && report_sender::now() >= deadline) || sender.expired())
+                flush();
+        }
+
+        /**
+         * \brief Send all reports.
+         */
+        inline void flush() {
+            close();
+            sender.flush();
+        }
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * report_sender.hpp: Batched transmission of Telemetry reports for Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_REPORT_SENDER
+#define __HEADER_FILE_REPORT_SENDER
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "report_encoder.hpp"
+
+/**
+ * \brief Batched sender of Telemetry reports.
+ *
+ * Reports are encoded directly into buffers owned by the sender and sent
+ * at once when the batch is full or the oldest report has waited for the
+ * maximal flush latency. One buffer (datagram) may carry several packed
+ * reports.
+ */
+class report_sender {
+
+    private:
+
+        report_sender(const report_sender &);
+        report_sender &operator=(const report_sender &);
+
+    protected:
+
+        unsigned batch;                        //!< Maximal number of datagrams sent at once.
+        uint64_t flush_ns;                     //!< Maximal delay of queued report.
+        unsigned count;                        //!< Number of queued datagrams.
+        uint64_t deadline;                     //!< Time to flush queued reports.
+
+        /**
+         * \brief Account datagram queued by commit(), flush when batch is full.
+         */
+        inline void queued() {
+            if (count++ == 0)
+                deadline = now() + flush_ns;
+            if (count == batch)
+                flush();
+        }
+
+    public:
+
+        /**
+         * \brief Read monotonic time.
+         * @return Time in nanoseconds
+         */
+        static inline uint64_t now() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+        /**
+         * \brief Basic constructor.
+         * @param batch    Maximal number of datagrams sent at once
+         * @param flush_us Maximal delay of queued report in microseconds
+         */
+        report_sender(unsigned batch, unsigned flush_us) :
+            batch(batch ? batch : 1),
+            flush_ns((uint64_t) flush_us * 1000),
+            count(0),
+            deadline(0),
+            reports(0),
+            datagrams(0),
+            syscalls(0),
+            errors(0),
+            send_ns(0)
+            {
+        }
+
+        virtual ~report_sender() {}
+
+        /**
+         * \brief Get buffer for next report.
+         * @return Buffer of the length given to the sender
+         */
+        virtual unsigned char *next() = 0;
+
+        /**
+         * \brief Queue datagram written to buffer returned by next(), flush when batch is full.
+         * @param len     Length of the datagram
+         * @param reports Number of reports packed in the datagram
+         */
+        virtual void commit(unsigned len, unsigned reports) = 0;
+
+        /**
+         * \brief Queue datagram with one report.
+         * @param len Length of the datagram
+         */
+        inline void commit(unsigned len) {
+            commit(len, 1);
+        }
+
+        /**
+         * \brief Send all queued reports.
+         */
+        virtual void flush() = 0;
+
+        /**
+         * \brief Check whether the oldest queued report waits too long.
+         */
+        inline bool expired() const {
+            return count && now() >= deadline;
+        }
+
+        /**
+         * \brief Flush queued reports if the oldest one waits too long.
+         */
+        inline void poll() {
+            if (expired())
+                flush();
+        }
+
+        uint64_t reports;  //!< Number of sent reports.
+        uint64_t datagrams;//!< Number of sent datagrams.
+        uint64_t syscalls; //!< Number of send syscalls.
+        uint64_t errors;   //!< Number of reports lost for lack of socket buffers.
+        uint64_t send_ns;  //!< Time spent in send syscalls.
+};
+
+/**
+ * \brief Sender of Telemetry reports through raw IP socket.
+ *
+ * Queued reports sit in a ring of buffers and are sent by one sendmmsg()
+ * call.
+ */
+class socket_report_sender : public report_sender {
+
+    private:
+
+        int sock;                              //!< Socket for Telemetry reports.
+        struct sockaddr_in sockaddr;           //!< Target of Telemetry reports.
+        unsigned buffer_len;                   //!< Length of one report buffer.
+        std::vector<unsigned char> buffers;    //!< Report buffers, buffer_len bytes each.
+        std::vector<struct iovec> iovecs;      //!< I/O vectors, one for each report buffer.
+        std::vector<struct mmsghdr> msgs;      //!< Messages, one for each report buffer.
+        std::vector<unsigned> packed;          //!< Number of reports in each report buffer.
+
+    public:
+
+        /**
+         * \brief Basic constructor, prepare ring of report buffers.
+         * @param sock       Socket for Telemetry reports
+         * @param sockaddr   Target of Telemetry reports
+         * @param batch      Maximal number of datagrams sent at once
+         * @param flush_us   Maximal delay of queued report in microseconds
+         * @param buffer_len Length of one report buffer (datagram)
+         */
+        socket_report_sender(int sock, const struct sockaddr_in &sockaddr, unsigned batch, unsigned flush_us,
+                             unsigned buffer_len = REPORT_MAX_LEN);
+
+        unsigned char *next() {
+            return &buffers[count * buffer_len];
+        }
+
+        using report_sender::commit;
+
+        void commit(unsigned len, unsigned reports) {
+            iovecs[count].iov_len = len;
+            packed[count] = reports;
+            queued();
+        }
+
+        void flush();
+};
+
+inline socket_report_sender::socket_report_sender(int sock, const struct sockaddr_in &sockaddr, unsigned batch,
+                                                  unsigned flush_us, unsigned buffer_len) :
+    report_sender(batch, flush_us),
+    sock(sock),
+    sockaddr(sockaddr),
+    buffer_len(buffer_len),
+    buffers(this->batch * buffer_len),
+    iovecs(this->batch),
+    msgs(this->batch),
+    packed(this->batch)
+    {
+    for (unsigned i = 0; i < this->batch; i++) {
+        iovecs[i].iov_base = &buffers[i * buffer_len];
+        iovecs[i].iov_len = 0;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &this->sockaddr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(this->sockaddr);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+inline void socket_report_sender::flush() {
+    unsigned sent = 0;
+    uint64_t start = now();
+    while (sent < count) {
+        int ret = sendmmsg(sock, &msgs[sent], count - sent, 0);
+        syscalls++;
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            // Transient lack of buffers loses the rest of the batch, anything else is fatal
+            if (errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) {
+                count = 0;
+                throw std::string("Packet send error");
+            }
+            for (unsigned i = sent; i < count; i++)
+                errors += packed[i];
+            break;
+        }
+        for (int i = 0; i < ret; i++)
+            reports += packed[sent + i];
+        sent += ret;
+    }
+    send_ns += now() - start;
+    datagrams += sent;
+    count = 0;
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * report_tx_ring.hpp: Transmission of Telemetry reports through PACKET_MMAP TX ring for Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_REPORT_TX_RING
+#define __HEADER_FILE_REPORT_TX_RING
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include "../../common/packet_tx_ring.hpp"
+#include "report_encoder.hpp"
+#include "report_sender.hpp"
+
+#define TX_RING_FRAMES 1024 //!< Default number of frames in TX ring.
+
+/**
+ * \brief Sender of Telemetry reports through PACKET_MMAP TX ring of an interface.
+ *
+ * Reports are encoded directly into frames of a packet_tx_ring, framed by
+ * Ethernet header and handed to the driver by one send() call per batch,
+ * bypassing the IP stack and qdisc. Since the IP stack is bypassed, reports
+ * must carry complete outer IPv4 header, the encoder needs source() as its
+ * source address. Reports of frames longer than the interface MTU allows
+ * count as errors; reports of a frame the kernel rejects are taken back
+ * from the sent ones before the sender gives up.
+ */
+class ring_report_sender : public report_sender {
+
+    private:
+
+        packet_tx_ring ring;              //!< TX ring of the interface.
+        std::vector<unsigned> packed;     //!< Number of reports in each frame.
+        struct ethhdr eth;                //!< Ethernet header of every frame.
+
+        /**
+         * \brief Hand queued frames to the kernel.
+         * @param wait Wait until the kernel sent them
+         */
+        void kick(bool wait);
+
+    public:
+
+        /**
+         * \brief Basic constructor, map TX ring of the interface.
+         * @param ifname     Interface to send reports through
+         * @param dst_mac    Destination MAC address of reports (next hop or collector)
+         * @param family     Address family of outer IP header of reports, only AF_INET is supported
+         * @param batch      Maximal number of datagrams sent at once
+         * @param flush_us   Maximal delay of queued report in microseconds
+         * @param buffer_len Length of one report buffer (datagram)
+         * @param frames     Number of frames in TX ring
+         */
+        ring_report_sender(const char *ifname, const unsigned char dst_mac[ETH_ALEN], int family, unsigned batch,
+                           unsigned flush_us, unsigned buffer_len = REPORT_MAX_LEN, unsigned frames = TX_RING_FRAMES);
+
+        /**
+         * \brief MTU of the interface, longest datagram sent.
+         */
+        unsigned mtu() const {
+            return ring.mtu();
+        }
+
+        /**
+         * \brief Source IPv4 address of the interface (network byte order), 0 if it has none.
+         */
+        in_addr_t source() const {
+            return ring.address();
+        }
+
+        unsigned char *next();
+
+        using report_sender::commit;
+
+        void commit(unsigned len, unsigned reports);
+
+        void flush() {
+            if (count)
+                kick(false);
+        }
+};
+
+inline ring_report_sender::ring_report_sender(const char *ifname, const unsigned char dst_mac[ETH_ALEN], int family,
+                                              unsigned batch, unsigned flush_us, unsigned buffer_len, unsigned frames) :
+    report_sender(batch, flush_us),
+    ring(ifname, ETH_HLEN + buffer_len, frames)
+    {
+    if (family != AF_INET)
+        throw std::runtime_error("TX ring sends only IPv4 reports");
+    // Ethernet header is fixed for all frames
+    memcpy(eth.h_source, ring.source(), ETH_ALEN);
+    memcpy(eth.h_dest, dst_mac, ETH_ALEN);
+    eth.h_proto = htons(ETH_P_IP);
+    packed.resize(ring.size());
+}
+
+inline unsigned char *ring_report_sender::next() {
+    // Ring is full, wait for the kernel
+    while (ring.full())
+        kick(true);
+    return ring.next() + ETH_HLEN;
+}
+
+inline void ring_report_sender::commit(unsigned len, unsigned reports) {
+    unsigned index = ring.index();
+    memcpy(ring.next(), &eth, ETH_HLEN);
+    if (!ring.commit(ETH_HLEN + len)) {
+        errors += reports;
+        return;
+    }
+    packed[index] = reports;
+    queued();
+}
+
+inline void ring_report_sender::kick(bool wait) {
+    uint64_t start = now();
+    // Reports of frames handed to the kernel
+    unsigned frames = ring.size();
+    for (unsigned i = 0, f = (ring.index() + frames - ring.queued()) % frames; i < ring.queued();
+         i++, f = f + 1 == frames ? 0 : f + 1) {
+        reports += packed[f];
+        datagrams++;
+    }
+    count = 0;
+    uint64_t calls = ring.syscalls;
+    try {
+        ring.kick(wait);
+    } catch (std::runtime_error &) {
+        syscalls += ring.syscalls - calls;
+        // Rejected frame was counted as sent when handed to the kernel
+        for (unsigned f = 0; f < frames; f++)
+            if (ring.rejected(f)) {
+                reports -= packed[f];
+                datagrams--;
+                errors += packed[f];
+            }
+        throw std::string("Packet send error");
+    }
+    syscalls += ring.syscalls - calls;
+    send_ns += now() - start;
+}
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * rx_source.hpp: Sources of Netcope INT metadata records for Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_RX_SOURCE
+#define __HEADER_FILE_RX_SOURCE
+
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+// Netcope P4 library
+#include <libnp4.h>
+
+#include "../../common/pcap.hpp"
+#include "int_parser.hpp"
+#include "np4_int_header.hpp"
+
+#define PACKET_RX_RCVBUF (4 << 20) //!< Receive buffer of packet socket, absorbs bursts between batches.
+#define RX_BURST_MAX     64        //!< Most inputs read at once.
+#define RX_COPY_LEN      2048      //!< Longest input of card RX stream kept through a burst.
+#define RX_PREFETCH      4         //!< Inputs of a burst prefetched ahead of the processed one.
+
+/**
+ * \brief Source of Netcope P4 inputs.
+ */
+class rx_source {
+
+    public:
+
+        virtual ~rx_source() {}
+
+        /**
+         * \brief Try to read next Netcope P4 input.
+         * @param len Length of the input
+         * @return Input data, NULL if there is none at the moment
+         */
+        virtual unsigned char *read_next(unsigned *len) = 0;
+
+        /**
+         * \brief Try to read burst of Netcope P4 inputs, valid until next read.
+         *
+         * The default reads inputs one by one, which suits sources whose
+         * inputs stay valid across reads.
+         * @param data Output inputs
+         * @param len  Output lengths of the inputs
+         * @param max  Most inputs to read, up to RX_BURST_MAX
+         * @return Number of inputs read, 0 if there is none at the moment
+         */
+        virtual unsigned read_burst(unsigned char **data, unsigned *len, unsigned max) {
+            unsigned n = 0;
+            while (n < max && (data[n] = read_next(&len[n])) != NULL)
+                n++;
+            return n;
+        }
+
+        /**
+         * \brief Wait for next input, returns early when it may be available.
+         * @param timeout_us Longest wait (microseconds)
+         */
+        virtual void wait(unsigned timeout_us) {
+            struct timespec ts = { (time_t) (timeout_us / 1000000), (long) (timeout_us % 1000000) * 1000 };
+            nanosleep(&ts, NULL);
+        }
+
+        /**
+         * \brief Check whether the source is exhausted.
+         */
+        virtual bool done() const {
+            return false;
+        }
+};
+
+/**
+ * \brief Netcope P4 RX stream of the card.
+ *
+ * The library keeps an input valid only until the next read, and has no
+ * blocking read. Inputs of a burst except the last one are therefore copied
+ * aside as the next one is read; an input too long to copy ends the burst.
+ * Waits for input are plain sleeps.
+ */
+class np4_rx_source : public rx_source {
+
+    private:
+
+        np4_rx_source(const np4_rx_source &);
+        np4_rx_source &operator=(const np4_rx_source &);
+
+        np4_t *np4;                  //!< Netcope P4 instance.
+        np4_rx_stream_t *rx_stream;  //!< Netcope P4 RX stream.
+        unsigned char copies[RX_BURST_MAX - 1][RX_COPY_LEN]; //!< Inputs of the current burst but the last.
+
+    public:
+
+        /**
+         * \brief Basic constructor, open RX stream.
+         * @param np4   Netcope P4 instance
+         * @param queue RX queue to read
+         */
+        np4_rx_source(np4_t *np4, int queue) :
+            np4(np4),
+            rx_stream(NULL)
+            {
+            np4_error_t err = np4_rx_stream_open(np4, queue, &rx_stream);
+            if (err)
+                throw np4_print_error(err);
+        }
+
+        ~np4_rx_source() {
+            // Close data receiving SZE channel
+            if (rx_stream)
+                np4_rx_stream_close(np4, &rx_stream);
+        }
+
+        unsigned char *read_next(unsigned *len) {
+            return np4_rx_stream_read_next(rx_stream, len);
+        }
+
+        inline unsigned read_burst(unsigned char **data, unsigned *len, unsigned max);
+};
+
+inline unsigned np4_rx_source::read_burst(unsigned char **data, unsigned *len, unsigned max) {
+    unsigned n = 0;
+    while (n < max && (data[n] = np4_rx_stream_read_next(rx_stream, &len[n])) != NULL) {
+        if (++n == max || len[n - 1] > RX_COPY_LEN)
+            break;
+        memcpy(copies[n - 1], data[n - 1], len[n - 1]);
+        data[n - 1] = copies[n - 1];
+    }
+    return n;
+}
+
+/**
+ * \brief Replay of captured Netcope P4 inputs.
+ *
+ * The capture is either raw file of back-to-back 256-byte records, or pcap
+ * file with one record per packet. Records are fed either at full speed or
+ * paced to the given rate.
+ */
+class replay_rx_source : public rx_source {
+
+    private:
+
+        std::unique_ptr<mapped_file> raw;   //!< Raw capture.
+        std::unique_ptr<pcap_reader> pcap;  //!< Pcap capture.
+        size_t offset;                      //!< Offset of next record in raw capture.
+        unsigned loops;                     //!< Remaining passes over capture (0 = endless).
+        uint64_t period_ns;                 //!< Time between records (0 = full speed).
+        uint64_t next_ns;                   //!< Time of next record.
+        bool exhausted;                     //!< All passes over capture are done.
+
+        static inline uint64_t now() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+        inline unsigned char *read_capture(unsigned *len);
+
+    public:
+
+        /**
+         * \brief Basic constructor, map the capture.
+         * @param path  Path to the capture
+         * @param rate  Records per second (0 = full speed)
+         * @param loops Passes over capture (0 = endless)
+         */
+        replay_rx_source(const char *path, unsigned rate, unsigned loops);
+
+        unsigned char *read_next(unsigned *len);
+
+        void wait(unsigned timeout_us) {
+            // Paced replay waits only until the next record is due
+            if (period_ns && next_ns) {
+                uint64_t t = now();
+                if (t >= next_ns)
+                    return;
+                if (next_ns - t < (uint64_t) timeout_us * 1000)
+                    timeout_us = (next_ns - t + 999) / 1000;
+            }
+            rx_source::wait(timeout_us);
+        }
+
+        bool done() const {
+            return exhausted;
+        }
+};
+
+inline replay_rx_source::replay_rx_source(const char *path, unsigned rate, unsigned loops) :
+    offset(0),
+    loops(loops),
+    period_ns(rate ? 1000000000 / rate : 0),
+    next_ns(0),
+    exhausted(false)
+    {
+    raw.reset(new mapped_file(path));
+    if (pcap_reader::is_pcap(raw->data, raw->size)) {
+        raw.reset();
+        pcap.reset(new pcap_reader(path));
+    } else if (raw->size == 0 || raw->size % NP4_RECORD_LEN) {
+        throw std::runtime_error(std::string() + "'" + path + "' is neither pcap nor raw capture of Netcope P4 records");
+    }
+}
+
+inline unsigned char *replay_rx_source::read_capture(unsigned *len) {
+    if (pcap)
+        return pcap->next(len);
+    if (offset == raw->size)
+        return NULL;
+    unsigned char *data = raw->data + offset;
+    offset += NP4_RECORD_LEN;
+    *len = NP4_RECORD_LEN;
+    return data;
+}
+
+inline unsigned char *replay_rx_source::read_next(unsigned *len) {
+    if (exhausted)
+        return NULL;
+    if (period_ns) {
+        uint64_t t = now();
+        if (next_ns == 0)
+            next_ns = t;
+        if (t < next_ns)
+            return NULL;
+        next_ns += period_ns;
+    }
+    unsigned char *data = read_capture(len);
+    if (data == NULL) {
+        // End of one pass over capture
+        if (loops && --loops == 0) {
+            exhausted = true;
+            return NULL;
+        }
+        offset = 0;
+        if (pcap)
+            pcap->rewind();
+        data = read_capture(len);
+        if (data == NULL)
+            exhausted = true;
+    }
+    return data;
+}
+
+/**
+ * \brief Raw INT packets turned into Netcope P4 inputs by software model of the P4 parser.
+ *
+ * Packets are read from Ethernet pcap capture or from interface through
+ * AF_PACKET socket, INT_PARSER_BATCH at a time, and parsed by int_parser
+ * into frames of the same layout as the card delivers, so the sink runs
+ * without the card. Sockets of all RX queues join one fanout group, the
+ * kernel spreads flows among them. Packets sent by the host itself are
+ * skipped.
+ */
+class packet_rx_source : public rx_source {
+
+    private:
+
+        packet_rx_source(const packet_rx_source &);
+        packet_rx_source &operator=(const packet_rx_source &);
+
+        int_parser parser;                  //!< Model of the P4 parser.
+        std::unique_ptr<pcap_reader> pcap;  //!< Capture of packets.
+        int fd;                             //!< AF_PACKET socket, -1 for capture.
+        unsigned loops;                     //!< Remaining passes over capture (0 = endless).
+        bool exhausted;                     //!< All passes over capture are done.
+        unsigned count;                     //!< Frames of the current batch.
+        unsigned next;                      //!< Next frame of the current batch.
+        int_packet packets[INT_PARSER_BATCH];                         //!< Packets of the current batch.
+        unsigned char frames[INT_PARSER_BATCH * NP4_RECORD_LEN];     //!< Frames of the current batch.
+        unsigned char buffers[INT_PARSER_BATCH][INT_PARSER_SNAPLEN]; //!< Packets received from socket.
+        struct mmsghdr messages[INT_PARSER_BATCH];                    //!< Messages of batch receive.
+        struct iovec vectors[INT_PARSER_BATCH];                       //!< Buffers of the messages.
+        struct sockaddr_ll addresses[INT_PARSER_BATCH];               //!< Link layer addresses of the messages.
+
+        inline unsigned read_capture();
+
+        inline unsigned read_socket();
+
+        /**
+         * \brief Read and parse next batch of packets.
+         * @return False if there are no packets at the moment
+         */
+        inline bool refill();
+
+    public:
+
+        /**
+         * \brief Constructor reading Ethernet pcap capture.
+         * @param parser Model of the P4 parser
+         * @param path   Path to the capture
+         * @param loops  Passes over capture (0 = endless)
+         */
+        packet_rx_source(const int_parser &parser, const char *path, unsigned loops);
+
+        /**
+         * \brief Constructor reading interface, joins fanout group of the other RX queues.
+         * @param parser Model of the P4 parser
+         * @param iface  Name of the interface
+         */
+        packet_rx_source(const int_parser &parser, const char *iface);
+
+        ~packet_rx_source() {
+            if (fd != -1)
+                close(fd);
+        }
+
+        unsigned char *read_next(unsigned *len);
+
+        inline unsigned read_burst(unsigned char **data, unsigned *len, unsigned max);
+
+        void wait(unsigned timeout_us) {
+            if (fd == -1) {
+                rx_source::wait(timeout_us);
+                return;
+            }
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            ::poll(&pfd, 1, (timeout_us + 999) / 1000);
+        }
+
+        bool done() const {
+            return exhausted;
+        }
+};
+
+inline packet_rx_source::packet_rx_source(const int_parser &parser, const char *path, unsigned loops) :
+    parser(parser),
+    pcap(new pcap_reader(path)),
+    fd(-1),
+    loops(loops),
+    exhausted(false),
+    count(0),
+    next(0)
+    {
+    if (pcap->linktype != PCAP_LINKTYPE_ETHERNET)
+        throw std::runtime_error(std::string() + "'" + path + "' is not Ethernet capture");
+}
+
+inline packet_rx_source::packet_rx_source(const int_parser &parser, const char *iface) :
+    parser(parser),
+    fd(-1),
+    loops(0),
+    exhausted(false),
+    count(0),
+    next(0)
+    {
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd == -1)
+        throw std::runtime_error(std::string() + "unable to open packet socket: " + strerror(errno));
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(iface);
+    // Fanout group is shared by the RX queues of this process
+    int fanout = (getpid() & 0xFFFF) | (PACKET_FANOUT_HASH << 16);
+    if (addr.sll_ifindex == 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) == -1) {
+        close(fd);
+        throw std::runtime_error(std::string() + "unable to bind packet socket to '" + iface + "': " + strerror(errno));
+    }
+    int rcvbuf = PACKET_RX_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    for (unsigned i = 0; i < INT_PARSER_BATCH; i++) {
+        vectors[i].iov_base = buffers[i];
+        vectors[i].iov_len = INT_PARSER_SNAPLEN;
+        memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+    }
+}
+
+inline unsigned packet_rx_source::read_capture() {
+    unsigned n = 0;
+    uint64_t ts_ns;
+    while (n < INT_PARSER_BATCH) {
+        packets[n].data = pcap->next(&packets[n].caplen, &ts_ns);
+        if (packets[n].data == NULL) {
+            // End of one pass over capture, the batch is finished first
+            if (n || (loops && --loops == 0))
+                break;
+            pcap->rewind();
+            packets[n].data = pcap->next(&packets[n].caplen, &ts_ns);
+            if (packets[n].data == NULL)
+                break;
+        }
+        packets[n].timestamp_s = ts_ns / 1000000000;
+        packets[n].timestamp_ns = ts_ns % 1000000000;
+        n++;
+    }
+    if (n == 0)
+        exhausted = true;
+    return n;
+}
+
+inline unsigned packet_rx_source::read_socket() {
+    for (unsigned i = 0; i < INT_PARSER_BATCH; i++)
+        messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+    int received = recvmmsg(fd, messages, INT_PARSER_BATCH, MSG_DONTWAIT, NULL);
+    if (received <= 0)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned n = 0;
+    for (int i = 0; i < received; i++) {
+        if (addresses[i].sll_pkttype == PACKET_OUTGOING)
+            continue;
+        packets[n].data = buffers[i];
+        packets[n].caplen = messages[i].msg_len;
+        packets[n].timestamp_s = ts.tv_sec;
+        packets[n].timestamp_ns = ts.tv_nsec;
+        n++;
+    }
+    return n;
+}
+
+inline bool packet_rx_source::refill() {
+    if (exhausted)
+        return false;
+    count = fd == -1 ? read_capture() : read_socket();
+    next = 0;
+    if (count == 0)
+        return false;
+    parser.parse(packets, count, frames);
+    return true;
+}
+
+inline unsigned char *packet_rx_source::read_next(unsigned *len) {
+    if (next == count && !refill())
+        return NULL;
+    *len = NP4_RECORD_LEN;
+    return frames + next++ * NP4_RECORD_LEN;
+}
+
+inline unsigned packet_rx_source::read_burst(unsigned char **data, unsigned *len, unsigned max) {
+    // Frames of one batch only, the next batch overwrites them
+    unsigned n = 0;
+    if (next == count && !refill())
+        return 0;
+    while (n < max && next < count) {
+        len[n] = NP4_RECORD_LEN;
+        data[n++] = frames + next++ * NP4_RECORD_LEN;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * spsc_ring.hpp: Lock-free single-producer/single-consumer ring of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_SPSC_RING
+#define __HEADER_FILE_SPSC_RING
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE 64 //!< Distance keeping producer and consumer data apart.
+
+/**
+ * \brief Lock-free ring of fixed-size slots between one producer and one consumer thread.
+ *
+ * Slots are written and read in place: the producer fills the slot returned
+ * by reserve() and makes it visible by publish(), the consumer reads the
+ * slot returned by front() and hands it back by release(). Each side keeps
+ * a cached copy of the other side's index, so the shared cache line is only
+ * touched when the ring looks full or empty.
+ */
+template <typename T>
+class spsc_ring {
+
+    private:
+
+        spsc_ring(const spsc_ring &);
+        spsc_ring &operator=(const spsc_ring &);
+
+        T *slots;                                 //!< Ring slots.
+        uint64_t mask;                            //!< Slot index mask.
+        char pad0[SPSC_CACHE_LINE];
+
+        std::atomic<uint64_t> head;               //!< Next slot to write, owned by producer.
+        uint64_t tail_cache;                      //!< Producer's copy of tail.
+        char pad1[SPSC_CACHE_LINE];
+
+        std::atomic<uint64_t> tail;               //!< Next slot to read, owned by consumer.
+        uint64_t head_cache;                      //!< Consumer's copy of head.
+        char pad2[SPSC_CACHE_LINE];
+
+        std::atomic<bool> finished;               //!< Producer is done.
+
+    public:
+
+        /**
+         * \brief Basic constructor, allocate slots.
+         * @param size Number of slots (rounded up to power of two)
+         */
+        spsc_ring(unsigned size) :
+            slots(NULL),
+            head(0),
+            tail_cache(0),
+            tail(0),
+            head_cache(0),
+            finished(false)
+            {
+            uint64_t n = 1;
+            while (n < size)
+                n <<= 1;
+            mask = n - 1;
+            void *s;
+            if (posix_memalign(&s, SPSC_CACHE_LINE, n * sizeof(T)))
+                throw std::bad_alloc();
+            slots = (T *) s;
+        }
+
+        ~spsc_ring() {
+            free(slots);
+        }
+
+        /**
+         * \brief Get free slot to write (producer).
+         * @return Slot, NULL if the ring is full
+         */
+        inline T *reserve() {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            if (h - tail_cache > mask) {
+                tail_cache = tail.load(std::memory_order_acquire);
+                if (h - tail_cache > mask)
+                    return NULL;
+            }
+            return &slots[h & mask];
+        }
+
+        /**
+         * \brief Make slot returned by reserve() visible to consumer (producer).
+         */
+        inline void publish() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /**
+         * \brief Get oldest written slot (consumer).
+         * @return Slot, NULL if the ring is empty
+         */
+        inline T *front() {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            if (t == head_cache) {
+                head_cache = head.load(std::memory_order_acquire);
+                if (t == head_cache)
+                    return NULL;
+            }
+            return &slots[t & mask];
+        }
+
+        /**
+         * \brief Hand slot returned by front() back to producer (consumer).
+         */
+        inline void release() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /**
+         * \brief Number of written slots not yet released.
+         */
+        inline uint64_t size() const {
+            uint64_t t = tail.load(std::memory_order_acquire);
+            return head.load(std::memory_order_acquire) - t;
+        }
+
+        /**
+         * \brief Number of slots.
+         */
+        inline uint64_t capacity() const {
+            return mask + 1;
+        }
+
+        /**
+         * \brief Mark that no more slots will be published (producer).
+         */
+        inline void finish() {
+            finished.store(true, std::memory_order_release);
+        }
+
+        /**
+         * \brief Check whether the producer is done; slots published before stay readable.
+         */
+        inline bool is_finished() const {
+            return finished.load(std::memory_order_acquire);
+        }
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * trace_log.hpp: Non-blocking trace of Netcope INT metadata records of Netcope P4 INT processing example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_TRACE_LOG
+#define __HEADER_FILE_TRACE_LOG
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "np4_int_header.hpp"
+#include "spsc_ring.hpp"
+
+#define TRACE_MAGIC     "NP4TRACE" //!< Magic of binary trace file.
+#define TRACE_VERSION   1          //!< Version of binary trace file.
+#define TRACE_RING_SIZE 16384      //!< Entries in trace ring of one RX queue.
+
+/**
+ * \brief Header of binary trace file.
+ */
+struct __attribute__((__packed__)) trace_file_header {
+    char       magic[8];    //!< TRACE_MAGIC without terminating zero.
+    uint32_t   version;     //!< TRACE_VERSION.
+    uint32_t   entry_len;   //!< Length of one entry.
+};
+
+/**
+ * \brief One traced record, also the entry of binary trace file.
+ */
+struct __attribute__((__packed__)) trace_entry {
+    uint32_t       timestamp_s;          //!< Frame timestamp (seconds).
+    uint32_t       timestamp_ns;         //!< Frame timestamp (nanoseconds).
+    uint16_t       queue;                //!< RX queue of the record.
+    uint8_t        iface;                //!< Interface of the record.
+    uint8_t        reserved;
+    uint16_t       header_offset;        //!< Offset of Netcope INT header in the record.
+    uint16_t       len;                  //!< Length of the record.
+    unsigned char  record[NP4_RECORD_LEN]; //!< Raw Netcope P4 record.
+};
+
+typedef spsc_ring<trace_entry> trace_ring;
+
+/**
+ * \brief Copy record to trace ring, never waits.
+ * @param ring          Trace ring of the RX queue
+ * @param queue         RX queue of the record
+ * @param data          Raw Netcope P4 record
+ * @param header_offset Offset of Netcope INT header in the record
+ * @param timestamp_s   Frame timestamp (seconds)
+ * @param timestamp_ns  Frame timestamp (nanoseconds)
+ * @param iface         Interface of the record
+ * @return False if the ring is full and the record was dropped
+ */
+inline bool trace_push(trace_ring &ring, unsigned queue, const unsigned char *data, unsigned header_offset,
+                       uint32_t timestamp_s, uint32_t timestamp_ns, uint8_t iface) {
+    trace_entry *entry = ring.reserve();
+    if (entry == NULL)
+        return false;
+    entry->timestamp_s = timestamp_s;
+    entry->timestamp_ns = timestamp_ns;
+    entry->queue = queue;
+    entry->iface = iface;
+    entry->reserved = 0;
+    entry->header_offset = header_offset;
+    entry->len = NP4_RECORD_LEN;
+    memcpy(entry->record, data, NP4_RECORD_LEN);
+    ring.publish();
+    return true;
+}
+
+/**
+ * \brief Write out traced record in human readable form.
+ * @param out   Output
+ * @param entry Traced record
+ */
+inline void trace_print(FILE *out, const trace_entry &entry) {
+    np4_int_header_t hdr;
+    if (entry.header_offset + sizeof(hdr) > sizeof(entry.record)) {
+        fprintf(out, "Corrupted trace entry\n");
+        return;
+    }
+    memcpy(&hdr, entry.record + entry.header_offset, sizeof(hdr));
+
+    fprintf(out, "Received INT header\n");
+    fprintf(out, "\tFlow ID:\n");
+    fprintf(out, "\t\tTimestamp           : %u.%u\n", entry.timestamp_s, entry.timestamp_ns);
+    fprintf(out, "\t\tRX queue            : %u\n", entry.queue);
+    fprintf(out, "\t\tInterface           : %u\n", entry.iface);
+    fprintf(out, "\t\tIP version          : %u\n", hdr.ip_ver);
+    if (hdr.ip_ver == 6) {
+        unsigned char addr[16];
+        char text[INET6_ADDRSTRLEN];
+        np4_int_store_ip6(addr, &hdr, false);
+        fprintf(out, "\t\tSource IPv6         : %s\n", inet_ntop(AF_INET6, addr, text, sizeof(text)));
+        np4_int_store_ip6(addr, &hdr, true);
+        fprintf(out, "\t\tDestination IPv6    : %s\n", inet_ntop(AF_INET6, addr, text, sizeof(text)));
+    } else {
+        fprintf(out, "\t\tSource IPv4         : %u.%u.%u.%u\n",
+                (hdr.source_ip[0] >> 24) & 0xFF, (hdr.source_ip[0] >> 16) & 0xFF,
+                (hdr.source_ip[0] >> 8) & 0xFF, hdr.source_ip[0] & 0xFF);
+        fprintf(out, "\t\tDestination IPv4    : %u.%u.%u.%u\n",
+                (hdr.destination_ip[0] >> 24) & 0xFF, (hdr.destination_ip[0] >> 16) & 0xFF,
+                (hdr.destination_ip[0] >> 8) & 0xFF, hdr.destination_ip[0] & 0xFF);
+    }
+    fprintf(out, "\t\tL4 protocol         : %u\n", hdr.l4_proto);
+    fprintf(out, "\t\tSource L4 port      : %u\n", hdr.source_port);
+    fprintf(out, "\t\tDestination L4 port : %u\n", hdr.destination_port);
+    fprintf(out, "\n");
+    // If INT was detected
+    if (!hdr.int_vld) {
+        fprintf(out, "\tINT not detected.\n");
+        return;
+    }
+    char insmap[17];
+    for (unsigned i = 0; i < 16; i++)
+        insmap[i] = hdr.int_insmap & (0x8000 >> i) ? '1' : '0';
+    insmap[16] = '\0';
+    fprintf(out, "\tINT common:\n");
+    fprintf(out, "\t\tLength              : %u\n", hdr.int_length);
+    fprintf(out, "\t\tInstruction count   : %u\n", hdr.int_inscnt);
+    fprintf(out, "\t\tInstruction map     : %s\n", insmap);
+    fprintf(out, "\n");
+    for (unsigned i = 0; i < NP4_INT_MAX_HOPS; i++) {
+        // If INT Hop i was detected
+        if (!(hdr.int_hop_vld & (1 << i)))
+            continue;
+        const np4_int_hop_t &hop = hdr.int_hop[i];
+        fprintf(out, "\tINT hop %u:\n", i);
+        if (hdr.int_insmap & 0x8000) fprintf(out, "\t\tSwitch ID           : %u\n", hop.swid);
+        if (hdr.int_insmap & 0x4000) fprintf(out, "\t\tIngress port        : %u\n", hop.ingressport);
+        if (hdr.int_insmap & 0x4000) fprintf(out, "\t\tEgress port         : %u\n", hop.egressport);
+        if (hdr.int_insmap & 0x2000) fprintf(out, "\t\tHop latency         : %u\n", hop.hoplatency);
+        if (hdr.int_insmap & 0x1000) fprintf(out, "\t\tQueue occupancy     : %u : %u\n", (unsigned) hop.occupancy_queueid, (unsigned) hop.occupancy_occupancy);
+        if (hdr.int_insmap & 0x0800) fprintf(out, "\t\tIngress timestamp   : %u\n", hop.ingresstimestamp);
+        if (hdr.int_insmap & 0x0400) fprintf(out, "\t\tEgress timestamp    : %u\n", hop.egresstimestamp);
+        if (hdr.int_insmap & 0x0200) fprintf(out, "\t\tQueue congestion    : %u : %u\n", (unsigned) hop.congestion_queueid, (unsigned) hop.congestion_congestion);
+        if (hdr.int_insmap & 0x0100) fprintf(out, "\t\tEgress port TX util.: %u\n", hop.egressporttxutilization);
+    }
+}
+
+/**
+ * \brief Background writer of traced records.
+ *
+ * Every RX queue copies its records into its own trace ring and never waits
+ * for it; records which do not fit are dropped and counted by the queue.
+ * One background thread drains all rings, formatting the records as text,
+ * writing them to binary trace file, or both.
+ */
+class trace_log {
+
+    private:
+
+        trace_log(const trace_log &);
+        trace_log &operator=(const trace_log &);
+
+        std::vector<std::unique_ptr<trace_ring>> rings; //!< Trace ring of each RX queue.
+        FILE *text;         //!< Output of text form, NULL if not requested.
+        FILE *binary;       //!< Binary trace file, NULL if not requested.
+        std::thread writer; //!< Background writer thread.
+
+        void write();
+
+    public:
+
+        /**
+         * \brief Basic constructor, open binary trace file and start writer.
+         * @param queues Number of RX queues
+         * @param text   Output of text form, NULL if not requested
+         * @param path   Path of binary trace file, NULL if not requested
+         */
+        trace_log(unsigned queues, FILE *text, const char *path);
+
+        /**
+         * \brief Wait for writer to drain all rings, close binary trace file.
+         *
+         * No RX queue may push to its ring any more, rings not finished by
+         * their queues (e.g. setup failed before the workers started) are
+         * finished here.
+         */
+        ~trace_log();
+
+        /**
+         * \brief Trace ring of the RX queue.
+         * @param index Index of the RX queue
+         */
+        trace_ring &ring(unsigned index) {
+            return *rings[index];
+        }
+};
+
+inline trace_log::trace_log(unsigned queues, FILE *text, const char *path) :
+    text(text),
+    binary(NULL)
+    {
+    if (path) {
+        binary = fopen(path, "w");
+        if (binary == NULL)
+            throw std::runtime_error(std::string() + "unable to open '" + path + "'");
+        trace_file_header header;
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.entry_len = sizeof(trace_entry);
+        fwrite(&header, sizeof(header), 1, binary);
+    }
+    for (unsigned i = 0; i < queues; i++)
+        rings.push_back(std::unique_ptr<trace_ring>(new trace_ring(TRACE_RING_SIZE)));
+    writer = std::thread(&trace_log::write, this);
+}
+
+inline trace_log::~trace_log() {
+    for (unsigned i = 0; i < rings.size(); i++)
+        rings[i]->finish();
+    writer.join();
+    if (binary)
+        fclose(binary);
+    if (text)
+        fflush(text);
+}
+
+inline void trace_log::write() {
+    unsigned active = rings.size();
+    while (active) {
+        unsigned written = 0;
+        active = 0;
+        for (unsigned i = 0; i < rings.size(); i++) {
+            trace_ring &ring = *rings[i];
+            bool finished = ring.is_finished();
+            // Bounded drain keeps the rings of all queues moving
+            for (unsigned n = 0; n < 256; n++) {
+                trace_entry *entry = ring.front();
+                if (entry == NULL)
+                    break;
+                if (text)
+                    trace_print(text, *entry);
+                if (binary)
+                    fwrite(entry, sizeof(trace_entry), 1, binary);
+                ring.release();
+                written++;
+            }
+            if (!finished || ring.front())
+                active++;
+        }
+        // Nothing to write, let the output go out and sleep
+        if (written == 0 && active) {
+            if (text)
+                fflush(text);
+            usleep(1000);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Smoke test of INT tools that run without the card: builds them, runs the
+# component tests, generates a capture of INT packets, parses it by the
+# software model, verifies the checksums of Telemetry reports encoded from
+# the records and runs the benchmark briefly. When the Netcope P4 library is
+# installed and the test runs as root, the records are also replayed
+# through np4_int and its trace decoded.
+#
+# Usage: ./smoke.sh [build directory]
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+OUT=${1:-$(mktemp -d)}
+CXX=${CXX:-g++}
+CXXFLAGS="-O2 -std=c++11"
+
+mkdir -p ${OUT}
+echo "Building to ${OUT}"
+${CXX} ${CXXFLAGS} -o ${OUT}/np4_int_gen ${DIR}/source/np4_int_gen.cpp -lpthread
+${CXX} ${CXXFLAGS} -o ${OUT}/np4_int_model ${DIR}/sink/np4_int_model.cpp
+${CXX} ${CXXFLAGS} -o ${OUT}/np4_int_trace ${DIR}/sink/np4_int_trace.cpp -lpthread
+${CXX} ${CXXFLAGS} -o ${OUT}/np4_int_bench ${DIR}/sink/np4_int_bench.cpp
+${CXX} ${CXXFLAGS} -o ${OUT}/np4_int_test ${DIR}/sink/np4_int_test.cpp -lpthread
+
+# TX ring needs root
+if [ $(id -u) -eq 0 ]; then
+    ${OUT}/np4_int_test -i lo
+else
+    ${OUT}/np4_int_test
+fi
+
+# All hop counts the sink parses, IPv4 and GTP, TCP and UDP
+${OUT}/np4_int_gen -f 64 -H 0-5 -m 0xD000,0xDC00,0x8000 -g 25 -p mix -l 33 -n 3000 -w ${OUT}/int.pcap
+
+# Records, compact records and report checksums, then the records read back
+${OUT}/np4_int_model -R -w ${OUT}/records.raw -C ${OUT}/compact.pcap ${OUT}/int.pcap
+${OUT}/np4_int_model -d ${OUT}/records.raw ${OUT}/int.pcap
+
+${OUT}/np4_int_bench -n 1000 -H 0,5 -m 255 > ${OUT}/bench.csv
+
+if echo '#include <libnp4.h>' | ${CXX} -E -x c++ - > /dev/null 2>&1 && [ $(id -u) -eq 0 ]; then
+    ${CXX} ${CXXFLAGS} -o ${OUT}/np4_int ${DIR}/sink/np4_int.cpp -lnp4 -lpthread
+    ${OUT}/np4_int -r 0 -f ${OUT}/records.raw -t 127.0.0.1 -E off -T ${OUT}/trace.bin
+    ${OUT}/np4_int_trace -n 16 ${OUT}/trace.bin
+else
+    echo "Skipping np4_int replay, it needs the Netcope P4 library and root"
+fi
+
+echo "Smoke test passed"
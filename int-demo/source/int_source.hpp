@@ -0,0 +1,266 @@
+/*
+ * int_source.hpp: Software model of INT source and transit processing, builds packet templates.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_INT_SOURCE
+#define __HEADER_FILE_INT_SOURCE
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#define INT_SOURCE_MAX_HOPS     8      //!< Most hops of a flow (ins_cnt of LEN_HOPS_* patterns goes up to 8).
+#define INT_SOURCE_MAX_LEN      1514   //!< Longest packet built, Ethernet MTU.
+#define INT_SOURCE_MIN_LEN      60     //!< Packets are padded to Ethernet minimum.
+#define INT_SOURCE_DSCP         0x20   //!< INT_DSCP of p4/defines.p4.
+#define INT_SOURCE_HOP_DELAY    1000   //!< Nanoseconds between ingress timestamps of consecutive hops.
+#define INT_SOURCE_GTP_PORT     2152   //!< GTPV1_PORT_VALUE of p4/defines.p4.
+#define INT_SOURCE_HOP_LATENCY  1      //!< CONST_HOP_LATENCY of p4/defines.p4.
+#define INT_SOURCE_Q_OCCUPANCY  2      //!< CONST_Q_OCCUPANCY of p4/defines.p4.
+
+#define INT_MAP_SWITCH_ID       0x8000 //!< Instruction bit of switch ID.
+#define INT_MAP_PORT_IDS        0x4000 //!< Instruction bit of ingress and egress port IDs.
+#define INT_MAP_Q_OCCUPANCY     0x1000 //!< Instruction bit of queue occupancy.
+#define INT_MAP_INGRESS_TSTAMP  0x0800 //!< Instruction bit of ingress timestamp.
+#define INT_MAP_EGRESS_TSTAMP   0x0400 //!< Instruction bit of egress timestamp.
+//! Instructions tb_int_inst_0003 and tb_int_inst_0407 have actions for, the others are commented out.
+#define INT_MAP_SUPPORTED       (INT_MAP_SWITCH_ID | INT_MAP_PORT_IDS | INT_MAP_Q_OCCUPANCY | \
+                                 INT_MAP_INGRESS_TSTAMP | INT_MAP_EGRESS_TSTAMP)
+
+/**
+ * \brief Flow entering the INT domain and its path through INT transit switches.
+ */
+struct int_flow {
+    uint32_t src_ip;                                //!< Source IPv4 address.
+    uint32_t dst_ip;                                //!< Destination IPv4 address.
+    uint16_t src_port;                              //!< L4 source port.
+    uint16_t dst_port;                              //!< L4 destination port.
+    uint8_t proto;                                  //!< L4 protocol, 6 (TCP) or 17 (UDP).
+    uint8_t dscp;                                   //!< DSCP of the packet before INT source, kept in INT tail.
+    unsigned payload;                               //!< Length of L4 payload.
+    uint16_t ins_map;                               //!< Instruction map given to int_source.
+    unsigned max_hop;                               //!< Maximal hop count given to int_source.
+    unsigned hops;                                  //!< Number of INT hops, the source switch is the first one.
+    uint32_t switch_id[INT_SOURCE_MAX_HOPS];        //!< Switch ID given to int_transit of every hop.
+    uint16_t ingress_port[INT_SOURCE_MAX_HOPS];     //!< Ingress port of every hop.
+    uint16_t egress_port[INT_SOURCE_MAX_HOPS];      //!< Egress port of every hop.
+    bool gtp;                                       //!< Last hop encapsulates the packet by add_gtp_to_udp/tcp.
+    uint32_t gtp_src;                               //!< Outer source IPv4 address of GTP tunnel.
+    uint32_t gtp_dst;                               //!< Outer destination IPv4 address of GTP tunnel.
+};
+
+/**
+ * \brief Packet of a flow as it leaves the last hop of p4/tables.p4, with timestamps patched per packet.
+ *
+ * The packet is built once, following the actions in the order the switches
+ * apply them: int_source_dscp on the first hop, int_transit with the
+ * int_set_header_* actions and the length updates of process_int_outer_encap
+ * on every hop (the newest hop is inserted right after INT header), and
+ * optionally add_gtp_to_udp or add_gtp_to_tcp. Only the ingress and egress
+ * timestamps change between packets of a flow, so copy() writes the template
+ * and patches their recorded offsets.
+ *
+ * Unlike the P4 program, which leaves them stale or zero, IPv4 header
+ * checksums are computed; L4 checksums stay zero as the P4 program leaves
+ * them after inserting INT.
+ */
+class int_template {
+
+    private:
+
+        /**
+         * \brief Timestamp field of a hop.
+         */
+        struct stamp {
+            unsigned offset;  //!< Offset of the field in the packet.
+            uint32_t delta;   //!< Added to the timestamp of the packet.
+        };
+
+        std::vector<unsigned char> data;  //!< Packet.
+        std::vector<stamp> stamps;        //!< Timestamp fields.
+
+        static inline void store16(unsigned char *p, uint16_t v) {
+            p[0] = v >> 8;
+            p[1] = v;
+        }
+
+        static inline void store32(unsigned char *p, uint32_t v) {
+            v = __builtin_bswap32(v);
+            memcpy(p, &v, 4);
+        }
+
+        /**
+         * \brief Write IPv4 header with its checksum.
+         */
+        static void ipv4(unsigned char *p, unsigned dscp, unsigned total_len, unsigned proto, uint32_t src, uint32_t dst);
+
+    public:
+
+        /**
+         * \brief Basic constructor, build the packet.
+         * @param flow    Flow of the packet
+         * @param dst_mac Destination MAC address
+         * @param src_mac Source MAC address
+         * @param dscp    DSCP set by int_source_dscp (INT_SOURCE_DSCP in the P4 program)
+         */
+        int_template(const int_flow &flow, const unsigned char dst_mac[6], const unsigned char src_mac[6],
+                     unsigned dscp = INT_SOURCE_DSCP);
+
+        /**
+         * \brief Number of 4-byte words every hop inserts (ins_cnt of INT header).
+         * @param ins_map Instruction map
+         */
+        static unsigned words(uint16_t ins_map) {
+            return __builtin_popcount(ins_map & INT_MAP_SUPPORTED);
+        }
+
+        /**
+         * \brief Length of the packet.
+         */
+        unsigned size() const {
+            return data.size();
+        }
+
+        /**
+         * \brief Write packet with timestamps.
+         * @param out Output buffer of size() bytes
+         * @param ts  Ingress timestamp of the first hop, later hops follow INT_SOURCE_HOP_DELAY apart
+         */
+        inline void copy(unsigned char *out, uint32_t ts) const {
+            memcpy(out, data.data(), data.size());
+            for (size_t i = 0; i < stamps.size(); i++)
+                store32(out + stamps[i].offset, ts + stamps[i].delta);
+        }
+};
+
+inline void int_template::ipv4(unsigned char *p, unsigned dscp, unsigned total_len, unsigned proto, uint32_t src,
+                               uint32_t dst) {
+    memset(p, 0, 20);
+    p[0] = 0x45;
+    p[1] = dscp << 2;
+    store16(p + 2, total_len);
+    p[8] = 64;
+    p[9] = proto;
+    store32(p + 12, src);
+    store32(p + 16, dst);
+    uint32_t sum = 0;
+    for (unsigned i = 0; i < 20; i += 2)
+        sum += p[i] << 8 | p[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    store16(p + 10, ~sum);
+}
+
+inline int_template::int_template(const int_flow &flow, const unsigned char dst_mac[6], const unsigned char src_mac[6],
+                                  unsigned dscp) {
+    if (flow.proto != 6 && flow.proto != 17)
+        throw std::runtime_error("INT source handles only TCP and UDP");
+    if (flow.ins_map & ~INT_MAP_SUPPORTED)
+        throw std::runtime_error("instruction map has instructions the INT source does not insert");
+    if (flow.hops > INT_SOURCE_MAX_HOPS || (flow.hops && words(flow.ins_map) == 0))
+        throw std::runtime_error("invalid number of hops");
+
+    // Lengths after all hops (int_source adds 16 bytes, every hop ins_cnt words)
+    unsigned ins_cnt = words(flow.ins_map);
+    unsigned stack = 16 + 4 * ins_cnt * flow.hops;
+    unsigned l4_len = flow.proto == 17 ? 8 : 20;
+    unsigned inner_len = 20 + l4_len + stack + flow.payload;
+    unsigned outer_len = flow.gtp ? 36 : 0;
+    if (14 + outer_len + inner_len > INT_SOURCE_MAX_LEN)
+        throw std::runtime_error("packet longer than " + std::to_string(INT_SOURCE_MAX_LEN) + " bytes");
+    data.assign(std::max(14 + outer_len + inner_len, (unsigned) INT_SOURCE_MIN_LEN), 0);
+
+    unsigned char *p = data.data();
+    memcpy(p, dst_mac, 6);
+    memcpy(p + 6, src_mac, 6);
+    store16(p + 12, 0x0800);
+    p += 14;
+
+    // add_gtp_set_new_outer: outer IPv4 and UDP to GTP port, add_gtp: GTPv1 header
+    if (flow.gtp) {
+        ipv4(p, 0, inner_len + 36, 17, flow.gtp_src, flow.gtp_dst);
+        store16(p + 20, INT_SOURCE_GTP_PORT);
+        store16(p + 22, INT_SOURCE_GTP_PORT);
+        store16(p + 24, inner_len + 16);
+        p[28] = 1 << 5;
+        p += 36;
+    }
+
+    // int_source_dscp: original DSCP goes to INT tail, the packet is marked
+    ipv4(p, dscp, inner_len, flow.proto, flow.src_ip, flow.dst_ip);
+    p += 20;
+    store16(p, flow.src_port);
+    store16(p + 2, flow.dst_port);
+    if (flow.proto == 17) {
+        store16(p + 4, 8 + stack + flow.payload);
+    } else {
+        p[12] = 5 << 4;
+        p[13] = 0x10;
+        store16(p + 14, 0xFFFF);
+    }
+    p += l4_len;
+
+    // INT shim (hop-by-hop), header v0.5; total_hop_count stays 0, int_update_total_hop_cnt is never applied
+    p[0] = 1;
+    p[2] = 4 + ins_cnt * flow.hops;
+    p[5] = ins_cnt;
+    p[6] = flow.max_hop;
+    store16(p + 8, flow.ins_map);
+    p += 12;
+
+    // Hops, the newest first, fields in order of instruction bits
+    for (unsigned h = flow.hops; h-- > 0; ) {
+        uint32_t ingress = INT_SOURCE_HOP_DELAY * h;
+        if (flow.ins_map & INT_MAP_SWITCH_ID) {
+            store32(p, flow.switch_id[h]);
+            p += 4;
+        }
+        if (flow.ins_map & INT_MAP_PORT_IDS) {
+            store16(p, flow.ingress_port[h]);
+            store16(p + 2, flow.egress_port[h]);
+            p += 4;
+        }
+        if (flow.ins_map & INT_MAP_Q_OCCUPANCY) {
+            store32(p, INT_SOURCE_Q_OCCUPANCY);
+            p += 4;
+        }
+        if (flow.ins_map & INT_MAP_INGRESS_TSTAMP) {
+            stamp s = { (unsigned) (p - data.data()), ingress };
+            stamps.push_back(s);
+            p += 4;
+        }
+        if (flow.ins_map & INT_MAP_EGRESS_TSTAMP) {
+            stamp s = { (unsigned) (p - data.data()), ingress + INT_SOURCE_HOP_LATENCY };
+            stamps.push_back(s);
+            p += 4;
+        }
+    }
+
+    // INT tail
+    p[0] = flow.proto;
+    store16(p + 1, flow.dst_port);
+    p[3] = flow.dscp;
+}
+
+#endif
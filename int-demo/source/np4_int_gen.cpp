@@ -0,0 +1,479 @@
+/*
+ * np4_int_gen.cpp: Generator of traffic leaving the INT source and transit example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- INT source traffic generator -------------------------------
+ * --------------------------------------------------------------------------------
+ * - Packets the INT source and transit program (p4/tables.p4) produces are      -
+ *   synthesized for configurable numbers of flows, hops, instruction maps and   -
+ *   GTP encapsulation, so the INT sink can be loaded without INT switches.     -
+ *   Every flow is built once as a template, packets only copy it and patch     -
+ *   hop timestamps. Threads write their own pcap files or send through their   -
+ *   own PACKET_MMAP TX ring of an interface (e.g. veth towards the sink).      -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_int_gen [-h] [-f flows] [-H hops] [-m maps] [-g percent] [-p proto] [-l bytes] [-S switches] [-d dscp] [-e mac] [-n count] [-t threads] [-c cpus] [-R rate] [-w file | -i iface [-F frames]]
+ *   -f flows    Number of flows (default: 1024)
+ *   -H hops     Hop counts of flows, list or range (default: 3)
+ *   -m maps     Instruction maps of flows, comma separated (default: 0xD000)
+ *   -g percent  Share of flows encapsulated in GTP (default: 0)
+ *   -p proto    L4 protocol of flows: udp, tcp or mix (default: udp)
+ *   -l bytes    L4 payload length (default: 0)
+ *   -S switches Number of switches on the paths of flows (default: 16)
+ *   -d dscp     DSCP marking INT (default: 1 as the sink expects, the P4 source uses 32)
+ *   -e mac      Destination MAC address (default: broadcast)
+ *   -n count    Packets generated by each thread, 0 for endless with -i (default: 10000000)
+ *   -t threads  Number of generating threads (default: 1)
+ *   -c cpus     CPU cores of threads, list or range (default: not pinned)
+ *   -R rate     Packets per second of each thread (default: full speed)
+ *   -w file     Write pcap capture, file.N for thread N when more threads are used
+ *   -i iface    Send packets through PACKET_MMAP TX ring of interface
+ *   -F frames   Frames in TX ring of each thread (default: 4096)
+ *   -h          Writes out help
+ *   Without -w and -i packets are only built in memory, which measures the generator.
+ * Build: g++ -O2 -std=c++11 -o np4_int_gen np4_int_gen.cpp -lpthread
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../common/packet_tx_ring.hpp"
+#include "../../common/pcap.hpp"
+#include "int_source.hpp"
+
+#define GEN_BATCH     32   //!< Packets generated between reads of the clock.
+#define GEN_SCRATCH   256  //!< Frames of scratch buffer when packets are only built.
+#define GEN_FRAME_LEN 2048 //!< Frame of scratch buffer, fits INT_SOURCE_MAX_LEN.
+
+extern char *__progname;
+
+std::atomic<bool> run(true);
+
+/**
+ * \brief L4 protocols of generated flows.
+ */
+enum gen_proto {
+    GEN_UDP,
+    GEN_TCP,
+    GEN_MIX
+};
+
+/**
+ * \brief Parsed command line arguments.
+ */
+struct gen_config {
+    unsigned flows;                 //!< Number of flows.
+    std::vector<int> hops;          //!< Hop counts, flows take them in turn.
+    std::vector<uint16_t> maps;     //!< Instruction maps, flows take them in turn.
+    unsigned gtp;                   //!< Percentage of flows encapsulated in GTP.
+    gen_proto proto;                //!< L4 protocol of flows.
+    unsigned payload;               //!< L4 payload length.
+    unsigned switches;              //!< Number of switches on the paths.
+    unsigned dscp;                  //!< DSCP marking INT.
+    unsigned char dst_mac[6];       //!< Destination MAC address.
+    uint64_t count;                 //!< Packets of each thread, 0 for endless.
+    unsigned threads;               //!< Number of threads.
+    std::vector<int> cpus;          //!< CPU cores of threads.
+    uint64_t rate;                  //!< Packets per second of each thread, 0 for full speed.
+    const char *file;               //!< Output pcap file.
+    const char *iface;              //!< Output interface.
+    unsigned frames;                //!< Frames in TX ring of each thread.
+};
+
+/**
+ * \brief Results of one thread.
+ */
+struct gen_stats {
+    uint64_t packets;   //!< Packets generated.
+    uint64_t bytes;     //!< Bytes of generated packets.
+    uint64_t errors;    //!< Packets too long for the interface or rejected by the kernel.
+    double elapsed;     //!< Seconds of generating.
+    std::string error;  //!< Error that stopped the thread.
+};
+
+void gen_usage() {
+    std::cout << "Usage: np4_int_gen [-h] [-f flows] [-H hops] [-m maps] [-g percent] [-p proto] [-l bytes] [-S switches] [-d dscp] [-e mac] [-n count] [-t threads] [-c cpus] [-R rate] [-w file | -i iface [-F frames]]" << std::endl;
+    std::cout << "  -f flows    Number of flows (default: 1024)" << std::endl;
+    std::cout << "  -H hops     Hop counts of flows, list or range (default: 3)" << std::endl;
+    std::cout << "  -m maps     Instruction maps of flows, comma separated (default: 0xD000)" << std::endl;
+    std::cout << "  -g percent  Share of flows encapsulated in GTP (default: 0)" << std::endl;
+    std::cout << "  -p proto    L4 protocol of flows: udp, tcp or mix (default: udp)" << std::endl;
+    std::cout << "  -l bytes    L4 payload length (default: 0)" << std::endl;
+    std::cout << "  -S switches Number of switches on the paths of flows (default: 16)" << std::endl;
+    std::cout << "  -d dscp     DSCP marking INT (default: 1 as the sink expects, the P4 source uses 32)" << std::endl;
+    std::cout << "  -e mac      Destination MAC address (default: broadcast)" << std::endl;
+    std::cout << "  -n count    Packets generated by each thread, 0 for endless with -i (default: 10000000)" << std::endl;
+    std::cout << "  -t threads  Number of generating threads (default: 1)" << std::endl;
+    std::cout << "  -c cpus     CPU cores of threads, list or range (default: not pinned)" << std::endl;
+    std::cout << "  -R rate     Packets per second of each thread (default: full speed)" << std::endl;
+    std::cout << "  -w file     Write pcap capture, file.N for thread N when more threads are used" << std::endl;
+    std::cout << "  -i iface    Send packets through PACKET_MMAP TX ring of interface" << std::endl;
+    std::cout << "  -F frames   Frames in TX ring of each thread (default: 4096)" << std::endl;
+    std::cout << "  -h          Writes out help" << std::endl;
+    std::cout << "  Without -w and -i packets are only built in memory, which measures the generator." << std::endl;
+}
+
+/**
+ * \brief Handler of SIGINT and SIGTERM, stops the threads.
+ * @param sig Received signal
+ */
+void gen_stop(int sig) {
+    (void) sig;
+    run = false;
+}
+
+/**
+ * \brief Parse list of numbers and ranges (e.g. 0-3,6).
+ * @param list   Text of the list
+ * @param option Option of the list for error message
+ */
+std::vector<int> gen_parse_list(const char *list, char option) {
+    std::vector<int> values;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 0);
+        long last = first;
+        if (end == p || first < 0)
+            throw std::runtime_error(std::string() + "invalid list for option '" + option + "'");
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 0);
+            if (end == p || last < first)
+                throw std::runtime_error(std::string() + "invalid range for option '" + option + "'");
+            p = end;
+        }
+        for (long v = first; v <= last; v++)
+            values.push_back(v);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            throw std::runtime_error(std::string() + "invalid list for option '" + option + "'");
+    }
+    return values;
+}
+
+/**
+ * \brief Mix of flow index and salt, spreads addresses, ports and paths of flows.
+ */
+static inline uint64_t gen_mix(uint64_t index, uint64_t salt) {
+    uint64_t z = index * 0x9E3779B97F4A7C15ULL + salt * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * \brief Flow of given index, the same for every run.
+ * @param config Parsed arguments
+ * @param index  Index of the flow
+ */
+int_flow gen_flow(const gen_config &config, unsigned index) {
+    int_flow flow;
+    memset(&flow, 0, sizeof(flow));
+    uint64_t m = gen_mix(index, 0);
+    flow.src_ip = 0x0A000000 | (index & 0xFFFFFF);
+    flow.dst_ip = 0x0B000000 | (m & 0xFFFFFF);
+    flow.src_port = 1024 + (m >> 24) % 64512;
+    flow.dst_port = 1024 + (m >> 40) % 64512;
+    flow.proto = config.proto == GEN_TCP || (config.proto == GEN_MIX && (index & 1)) ? 6 : 17;
+    flow.payload = config.payload;
+    flow.hops = config.hops[index % config.hops.size()];
+    flow.ins_map = config.maps[(index / config.hops.size()) % config.maps.size()];
+    flow.max_hop = INT_SOURCE_MAX_HOPS;
+    for (unsigned h = 0; h < flow.hops; h++) {
+        uint64_t hop = gen_mix(index, h + 1);
+        flow.switch_id[h] = 1 + hop % config.switches;
+        flow.ingress_port[h] = (hop >> 32) % 64;
+        flow.egress_port[h] = (hop >> 48) % 64;
+    }
+    flow.gtp = gen_mix(index, INT_SOURCE_MAX_HOPS + 1) % 100 < config.gtp;
+    flow.gtp_src = 0xAC100001;
+    flow.gtp_dst = 0xAC100000 | (2 + index % 254);
+    return flow;
+}
+
+static inline uint64_t gen_now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * \brief Generating thread, sends flows index, index + threads, ... round robin.
+ * @param config Parsed arguments
+ * @param index  Index of the thread
+ * @param stats  Results of the thread
+ */
+void gen_worker(const gen_config &config, unsigned index, gen_stats &stats) {
+    try {
+        if (!config.cpus.empty()) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(config.cpus[index % config.cpus.size()], &cpuset);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+                std::cerr << "Unable to pin thread " << index << " to CPU " << config.cpus[index % config.cpus.size()] << std::endl;
+        }
+
+        std::unique_ptr<packet_tx_ring> ring;
+        std::unique_ptr<pcap_writer> writer;
+        std::vector<unsigned char> scratch(GEN_SCRATCH * GEN_FRAME_LEN);
+        static const unsigned char local_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+        const unsigned char *src_mac = local_mac;
+        if (config.iface) {
+            ring.reset(new packet_tx_ring(config.iface, INT_SOURCE_MAX_LEN, config.frames));
+            src_mac = ring->source();
+        } else if (config.file) {
+            std::string path = config.file;
+            if (config.threads > 1)
+                path += "." + std::to_string(index);
+            writer.reset(new pcap_writer(path.c_str()));
+        }
+
+        std::vector<int_template> templates;
+        for (unsigned f = index; f < config.flows; f += config.threads)
+            templates.push_back(int_template(gen_flow(config, f), config.dst_mac, src_mac, config.dscp));
+
+        // Captures get timestamps spaced by the rate (10 Mpps at full speed), other outputs the real clock
+        uint64_t gap = config.rate ? 1000000000 / config.rate : 100;
+        uint64_t start = gen_now(CLOCK_MONOTONIC);
+        uint64_t ts = gen_now(CLOCK_REALTIME);
+        size_t next = 0;
+        uint64_t packets = 0, bytes = 0;
+        while (run && (config.count == 0 || packets < config.count)) {
+            unsigned batch = GEN_BATCH;
+            if (config.count && config.count - packets < batch)
+                batch = config.count - packets;
+            if (config.rate) {
+                // Wait for the time of the batch
+                uint64_t due = start + packets * 1000000000 / config.rate;
+                uint64_t now = gen_now(CLOCK_MONOTONIC);
+                if (due > now + 50000 && !writer) {
+                    uint64_t wait = due - now - 50000;
+                    struct timespec sleep = { (time_t) (wait / 1000000000), (long) (wait % 1000000000) };
+                    nanosleep(&sleep, NULL);
+                }
+                while (!writer && gen_now(CLOCK_MONOTONIC) < due)
+                    ;
+            }
+            if (!writer)
+                ts = gen_now(CLOCK_REALTIME);
+            for (unsigned i = 0; i < batch; i++) {
+                const int_template &tpl = templates[next];
+                next = next + 1 == templates.size() ? 0 : next + 1;
+                if (ring) {
+                    tpl.copy(ring->next(), ts);
+                    ring->commit(tpl.size());
+                } else if (writer) {
+                    tpl.copy(scratch.data(), ts);
+                    writer->write(scratch.data(), tpl.size(), ts);
+                    ts += gap;
+                } else {
+                    tpl.copy(&scratch[(packets + i) % GEN_SCRATCH * GEN_FRAME_LEN], ts);
+                }
+                bytes += tpl.size();
+            }
+            // One send() per batch hands its frames to the kernel
+            if (ring)
+                ring->kick(false);
+            packets += batch;
+        }
+        if (ring) {
+            ring->kick(true);
+            stats.errors = ring->errors;
+        }
+        if (writer)
+            writer->flush();
+        stats.elapsed = (gen_now(CLOCK_MONOTONIC) - start) / 1e9;
+        stats.packets = packets;
+        stats.bytes = bytes;
+    } catch (std::exception &e) {
+        stats.error = e.what();
+        run = false;
+    }
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    gen_config config;
+    config.flows = 1024;
+    config.hops.assign(1, 3);
+    config.maps.assign(1, INT_MAP_SWITCH_ID | INT_MAP_PORT_IDS | INT_MAP_Q_OCCUPANCY);
+    config.gtp = 0;
+    config.proto = GEN_UDP;
+    config.payload = 0;
+    config.switches = 16;
+    config.dscp = 0x01;
+    memset(config.dst_mac, 0xFF, sizeof(config.dst_mac));
+    config.count = 10000000;
+    config.threads = 1;
+    config.rate = 0;
+    config.file = NULL;
+    config.iface = NULL;
+    config.frames = PACKET_TX_FRAMES;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "f:H:m:g:p:l:S:d:e:n:t:c:R:w:i:F:h")) != -1)
+            switch (c) {
+                case 'f':
+                    config.flows = strtoul(optarg, NULL, 10);
+                    break;
+                case 'H':
+                    config.hops = gen_parse_list(optarg, 'H');
+                    for (size_t i = 0; i < config.hops.size(); i++)
+                        if (config.hops[i] > INT_SOURCE_MAX_HOPS)
+                            throw std::runtime_error("at most " + std::to_string(INT_SOURCE_MAX_HOPS) + " hops");
+                    break;
+                case 'm': {
+                    std::vector<int> maps = gen_parse_list(optarg, 'm');
+                    config.maps.clear();
+                    for (size_t i = 0; i < maps.size(); i++) {
+                        if (maps[i] > 0xFFFF || (maps[i] & ~INT_MAP_SUPPORTED) || maps[i] == 0) {
+                            char text[8];
+                            snprintf(text, sizeof(text), "0x%04X", (unsigned) maps[i]);
+                            throw std::runtime_error(std::string() + "instruction map " + text +
+                                                     " is not among the instructions the INT source inserts (0xDC00)");
+                        }
+                        config.maps.push_back(maps[i]);
+                    }
+                    break;
+                }
+                case 'g':
+                    config.gtp = strtoul(optarg, NULL, 10);
+                    break;
+                case 'p':
+                    if (std::string(optarg) == "udp")
+                        config.proto = GEN_UDP;
+                    else if (std::string(optarg) == "tcp")
+                        config.proto = GEN_TCP;
+                    else if (std::string(optarg) == "mix")
+                        config.proto = GEN_MIX;
+                    else
+                        throw std::runtime_error(std::string() + "unknown protocol '" + optarg + "'");
+                    break;
+                case 'l':
+                    config.payload = strtoul(optarg, NULL, 10);
+                    break;
+                case 'S':
+                    config.switches = strtoul(optarg, NULL, 10);
+                    break;
+                case 'd':
+                    config.dscp = strtoul(optarg, NULL, 0);
+                    break;
+                case 'e': {
+                    unsigned mac[6];
+                    char end;
+                    if (sscanf(optarg, "%x:%x:%x:%x:%x:%x%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &end) != 6)
+                        throw std::runtime_error(std::string() + "invalid MAC address '" + optarg + "'");
+                    for (unsigned i = 0; i < 6; i++)
+                        config.dst_mac[i] = mac[i];
+                    break;
+                }
+                case 'n':
+                    config.count = strtoull(optarg, NULL, 10);
+                    break;
+                case 't':
+                    config.threads = strtoul(optarg, NULL, 10);
+                    break;
+                case 'c':
+                    config.cpus = gen_parse_list(optarg, 'c');
+                    break;
+                case 'R':
+                    config.rate = strtoull(optarg, NULL, 10);
+                    break;
+                case 'w':
+                    config.file = optarg;
+                    break;
+                case 'i':
+                    config.iface = optarg;
+                    break;
+                case 'F':
+                    config.frames = strtoul(optarg, NULL, 10);
+                    break;
+                case 'h':
+                    gen_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    gen_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc || config.threads == 0 || config.flows < config.threads || config.switches == 0 ||
+            config.gtp > 100 || config.dscp > 0x3F || config.frames == 0 || (config.file && config.iface) ||
+            (config.count == 0 && !config.iface)) {
+            gen_usage();
+            return EXIT_FAILURE;
+        }
+
+        signal(SIGINT, gen_stop);
+        signal(SIGTERM, gen_stop);
+        std::vector<gen_stats> stats(config.threads);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < config.threads; i++)
+            threads.push_back(std::thread(gen_worker, std::cref(config), i, std::ref(stats[i])));
+        for (unsigned i = 0; i < threads.size(); i++)
+            threads[i].join();
+
+        uint64_t packets = 0, bytes = 0, errors = 0;
+        double pps = 0.0;
+        for (unsigned i = 0; i < config.threads; i++) {
+            if (!stats[i].error.empty())
+                throw std::runtime_error(stats[i].error);
+            double thread_pps = stats[i].elapsed > 0 ? stats[i].packets / stats[i].elapsed : 0.0;
+            if (config.threads > 1)
+                std::cout << "Thread " << i << "            : " << stats[i].packets << " pkts, "
+                          << thread_pps / 1e6 << " Mpps" << std::endl;
+            packets += stats[i].packets;
+            bytes += stats[i].bytes;
+            errors += stats[i].errors;
+            pps += thread_pps;
+        }
+        std::cout << "Flows               : " << config.flows << std::endl;
+        std::cout << "Packets             : " << packets << std::endl;
+        std::cout << "Bytes               : " << bytes << std::endl;
+        std::cout << "Average length      : " << (packets ? (double) bytes / packets : 0.0) << std::endl;
+        if (config.iface)
+            std::cout << "Send errors         : " << errors << std::endl;
+        std::cout << "Packets per second  : " << pps << std::endl;
+        std::cout << "Mpps per thread     : " << pps / config.threads / 1e6 << std::endl;
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string &e) {
+        std::cerr << __progname << ": " << e << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,467 @@
+/*
+ * nat_manager.hpp: Control plane of tab_nat of NAT offload example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NAT_MANAGER
+#define __HEADER_FILE_NAT_MANAGER
+
+#include <iterator>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+#include "nat_pool.hpp"
+#include "nat_sessions.hpp"
+
+#define NAT_PROTO_TCP     6      //!< IP protocol number of TCP.
+#define NAT_PROTO_UDP     17     //!< IP protocol number of UDP.
+#define NAT_TCP_TIMEOUT   300    //!< Lifetime of TCP session without punted packet (seconds).
+#define NAT_UDP_TIMEOUT   60     //!< Lifetime of UDP session without punted packet (seconds).
+#define NAT_BATCH_RULES   4096   //!< Rules pending before they are pushed to the card.
+
+/**
+ * \brief Parameters of the session manager.
+ */
+struct nat_config {
+    uint32_t tcp_timeout;   //!< Lifetime of TCP session (seconds).
+    uint32_t udp_timeout;   //!< Lifetime of UDP session (seconds).
+    unsigned batch;         //!< Rules pending before they are pushed.
+
+    nat_config() :
+        tcp_timeout(NAT_TCP_TIMEOUT),
+        udp_timeout(NAT_UDP_TIMEOUT),
+        batch(NAT_BATCH_RULES)
+        {
+    }
+};
+
+/**
+ * \brief Counters of the session manager.
+ */
+struct nat_stats {
+    uint64_t learned;       //!< New sessions.
+    uint64_t refreshed;     //!< Punted packets of known sessions.
+    uint64_t unsolicited;   //!< Inbound packets without session.
+    uint64_t exhausted;     //!< New sessions refused for lack of public ports.
+    uint64_t full;          //!< New sessions refused for full session table.
+    uint64_t expired;       //!< Expired sessions.
+    uint64_t inserted;      //!< Rules inserted to the card.
+    uint64_t removed;       //!< Rules removed from the card.
+    uint64_t batches;       //!< Pushes of pending rules.
+    uint64_t resyncs;       //!< Full reloads of the card.
+
+    nat_stats() :
+        learned(0), refreshed(0), unsolicited(0), exhausted(0), full(0), expired(0),
+        inserted(0), removed(0), batches(0), resyncs(0)
+        {
+    }
+};
+
+/**
+ * \brief Manager of NAT sessions and their tab_nat rules.
+ *
+ * Packets missing tab_nat are punted to the manager. The first outbound
+ * packet of a connection gets public address and port from the pool of its
+ * protocol and two rules are queued: srcnat for packets of the connection
+ * and dstnat for packets coming back to the public pair. Queued rules are
+ * pushed to the card in batches. Sessions expire after their timeout
+ * unless refreshed by another punted packet (the card does not report hits
+ * of its rules).
+ *
+ * A public pair of an expired session is reused only after its rules were
+ * removed from the card. If the card cannot remove single rules, such pairs
+ * wait in quarantine until the pool runs dry or quarantine holds an eighth
+ * of the pool; then the card is reloaded with the base rules and rules of
+ * live sessions, and the pairs are released.
+ */
+class nat_manager {
+
+    private:
+
+        nat_manager(const nat_manager &);
+        nat_manager &operator=(const nat_manager &);
+
+        typedef std::pair<uint8_t, uint32_t> pool_slot;  //!< Protocol and slot of public pair.
+
+        ruleset_target &target;               //!< Card (or its mock).
+        nat_pool &tcp_pool;                   //!< Public pairs of TCP.
+        nat_pool &udp_pool;                   //!< Public pairs of UDP.
+        nat_config config;                    //!< Parameters.
+        nat_session_table table;              //!< Sessions.
+        std::vector<uint32_t> tcp_owner;      //!< Session of every TCP public pair.
+        std::vector<uint32_t> udp_owner;      //!< Session of every UDP public pair.
+        std::vector<ruleset_rule> base;       //!< Rules of other tables, installed with every reload.
+        std::vector<ruleset_rule> inserts;    //!< Rules waiting for insertion (first insert_count).
+        std::vector<ruleset_rule> removes;    //!< Rules waiting for removal (first remove_count).
+        std::vector<ruleset_rule> spare;      //!< Unused rules set aside while pushing.
+        size_t insert_count;                  //!< Number of rules waiting for insertion.
+        size_t remove_count;                  //!< Number of rules waiting for removal.
+        std::vector<pool_slot> removing;      //!< Pairs released once pending removals are pushed.
+        std::vector<pool_slot> quarantine;    //!< Pairs released by the next reload.
+        std::vector<uint32_t> expired;        //!< Buffer of expired sessions.
+        bool removable;                       //!< Card removes single rules.
+
+        inline nat_pool &pool(uint8_t proto) {
+            return proto == NAT_PROTO_TCP ? tcp_pool : udp_pool;
+        }
+
+        inline std::vector<uint32_t> &owner(uint8_t proto) {
+            return proto == NAT_PROTO_TCP ? tcp_owner : udp_owner;
+        }
+
+        /**
+         * \brief Append tab_nat rules of a session.
+         *
+         * Rules are kept for reuse after they were pushed, so that filling
+         * them in does not allocate memory.
+         * @param s     Session
+         * @param rules Output rules, srcnat and dstnat
+         * @param count Number of used rules, increased by two
+         */
+        void session_rules(const nat_session &s, std::vector<ruleset_rule> &rules, size_t &count);
+
+        /**
+         * \brief Push used rules to the card.
+         * @param rules  Rules
+         * @param count  Number of used rules
+         * @param insert Insert (or remove) the rules
+         * @return False if the card cannot remove single rules
+         */
+        bool push(std::vector<ruleset_rule> &rules, size_t count, bool insert);
+
+        /**
+         * \brief Reload the card with base rules and rules of live sessions.
+         */
+        void resync();
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param target   Card (or its mock)
+         * @param tcp_pool Public pairs of TCP
+         * @param udp_pool Public pairs of UDP
+         * @param capacity Maximal number of sessions
+         * @param config   Parameters
+         * @param now      Current time in seconds
+         */
+        nat_manager(ruleset_target &target, nat_pool &tcp_pool, nat_pool &udp_pool, uint32_t capacity,
+                    const nat_config &config, uint32_t now);
+
+        /**
+         * \brief Clear the card and install rules of other tables.
+         * @param rules Rules of other tables (tab_extract_nat_metadata, tab_set_egress_port)
+         */
+        void install(const ruleset &rules);
+
+        /**
+         * \brief Handle punted outbound packet.
+         * @param t   Inside tuple of the packet
+         * @param now Current time in seconds
+         * @return True if the packet belongs to a session (new or known)
+         */
+        bool outbound(const nat_tuple &t, uint32_t now);
+
+        /**
+         * \brief Handle punted inbound packet to public pair.
+         * @param proto       IP protocol
+         * @param remote_addr Source address (host byte order)
+         * @param remote_port Source port
+         * @param public_addr Destination address (host byte order)
+         * @param public_port Destination port
+         * @param now         Current time in seconds
+         * @return True if the packet belongs to a session
+         */
+        bool inbound(uint8_t proto, uint32_t remote_addr, uint16_t remote_port, uint32_t public_addr,
+                     uint16_t public_port, uint32_t now);
+
+        /**
+         * \brief Check whether the address is public address of the NAT.
+         */
+        bool is_public(uint32_t addr) const {
+            return tcp_pool.contains(addr) || udp_pool.contains(addr);
+        }
+
+        /**
+         * \brief Expire sessions up to the current time.
+         * @param now Current time in seconds
+         */
+        void advance(uint32_t now);
+
+        /**
+         * \brief Push pending rules to the card.
+         */
+        void flush();
+
+        /**
+         * \brief Number of rules waiting to be pushed.
+         */
+        size_t pending() const {
+            return insert_count + remove_count;
+        }
+
+        /**
+         * \brief Number of live sessions.
+         */
+        size_t sessions() const {
+            return table.size();
+        }
+
+        nat_stats stats;   //!< Counters.
+};
+
+/**
+ * \brief Store value in network byte order.
+ */
+static inline void nat_put(std::vector<uint8_t> &value, uint32_t n, unsigned len) {
+    value.resize(len);
+    for (unsigned i = len; i-- > 0; n >>= 8)
+        value[i] = n & 0xFF;
+}
+
+inline nat_manager::nat_manager(ruleset_target &target, nat_pool &tcp_pool, nat_pool &udp_pool, uint32_t capacity,
+                                const nat_config &config, uint32_t now) :
+    target(target),
+    tcp_pool(tcp_pool),
+    udp_pool(udp_pool),
+    config(config),
+    table(capacity, now),
+    tcp_owner(tcp_pool.size(), NAT_NONE),
+    udp_owner(udp_pool.size(), NAT_NONE),
+    insert_count(0),
+    remove_count(0),
+    removable(true)
+    {
+    if (this->config.batch == 0)
+        this->config.batch = 1;
+}
+
+inline void nat_manager::session_rules(const nat_session &s, std::vector<ruleset_rule> &rules, size_t &count) {
+    const nat_pool &p = pool(s.proto);
+    bool tcp = s.proto == NAT_PROTO_TCP;
+    uint32_t public_addr = p.addr(s.public_slot);
+    uint16_t public_port = p.port(s.public_slot);
+    while (rules.size() < count + 2)
+        rules.push_back(ruleset_rule());
+
+    for (unsigned dir = 0; dir < 2; dir++) {
+        ruleset_rule &rule = rules[count++];
+        rule.table = "tab_nat";
+        // Keys of both headers are matched, ports of the missing one are zero
+        rule.keys.resize(8);
+        rule.keys[0].name = "ipv4.srcAddr";
+        rule.keys[1].name = "ipv4.dstAddr";
+        rule.keys[2].name = tcp ? "tcp" : "udp";
+        nat_put(rule.keys[2].value, 1, 1);
+        rule.keys[3].name = tcp ? "tcp.srcPort" : "udp.srcPort";
+        rule.keys[4].name = tcp ? "tcp.dstPort" : "udp.dstPort";
+        rule.keys[5].name = tcp ? "udp" : "tcp";
+        nat_put(rule.keys[5].value, 0, 1);
+        rule.keys[6].name = tcp ? "udp.srcPort" : "tcp.srcPort";
+        nat_put(rule.keys[6].value, 0, 2);
+        rule.keys[7].name = tcp ? "udp.dstPort" : "tcp.dstPort";
+        nat_put(rule.keys[7].value, 0, 2);
+        rule.params.resize(2);
+        rule.params[0].name = "ipaddr";
+        rule.params[1].name = "port";
+        if (dir == 0) {
+            // Outbound packets get public source
+            nat_put(rule.keys[0].value, s.inside_addr, 4);
+            nat_put(rule.keys[1].value, s.remote_addr, 4);
+            nat_put(rule.keys[3].value, s.inside_port, 2);
+            nat_put(rule.keys[4].value, s.remote_port, 2);
+            rule.action = tcp ? "srcnat_tcp" : "srcnat_udp";
+            nat_put(rule.params[0].value, public_addr, 4);
+            nat_put(rule.params[1].value, public_port, 2);
+        } else {
+            // Inbound packets get private destination
+            nat_put(rule.keys[0].value, s.remote_addr, 4);
+            nat_put(rule.keys[1].value, public_addr, 4);
+            nat_put(rule.keys[3].value, s.remote_port, 2);
+            nat_put(rule.keys[4].value, public_port, 2);
+            rule.action = tcp ? "dstnat_tcp" : "dstnat_udp";
+            nat_put(rule.params[0].value, s.inside_addr, 4);
+            nat_put(rule.params[1].value, s.inside_port, 2);
+        }
+    }
+}
+
+inline bool nat_manager::push(std::vector<ruleset_rule> &rules, size_t count, bool insert) {
+    // Target takes the whole vector, unused rules are moved aside meanwhile
+    spare.assign(std::make_move_iterator(rules.begin() + count), std::make_move_iterator(rules.end()));
+    rules.resize(count);
+    bool done = true;
+    try {
+        if (insert)
+            target.insert(rules);
+        else
+            done = target.remove(rules);
+    } catch (...) {
+        rules.insert(rules.end(), std::make_move_iterator(spare.begin()), std::make_move_iterator(spare.end()));
+        throw;
+    }
+    rules.insert(rules.end(), std::make_move_iterator(spare.begin()), std::make_move_iterator(spare.end()));
+    spare.clear();
+    return done;
+}
+
+inline void nat_manager::install(const ruleset &rules) {
+    base.clear();
+    for (ruleset::rule_map::const_iterator it = rules.rules().begin(); it != rules.rules().end(); ++it)
+        base.push_back(ruleset::decode(*it));
+    resync();
+    stats.resyncs = 0;
+}
+
+inline void nat_manager::resync() {
+    // Everything pending is covered by the reload
+    insert_count = 0;
+    remove_count = 0;
+    target.clear();
+    if (!base.empty()) {
+        target.insert(base);
+        stats.inserted += base.size();
+    }
+    for (uint32_t p = 0; p < 2; p++) {
+        uint8_t proto = p ? NAT_PROTO_UDP : NAT_PROTO_TCP;
+        const std::vector<uint32_t> &sessions = owner(proto);
+        for (uint32_t slot = 0; slot < sessions.size(); slot++) {
+            if (sessions[slot] == NAT_NONE)
+                continue;
+            session_rules(table[sessions[slot]], inserts, insert_count);
+            if (insert_count >= RULESET_BULK_RULES) {
+                push(inserts, insert_count, true);
+                stats.inserted += insert_count;
+                insert_count = 0;
+            }
+        }
+    }
+    if (insert_count) {
+        push(inserts, insert_count, true);
+        stats.inserted += insert_count;
+        insert_count = 0;
+    }
+    target.commit();
+    for (size_t i = 0; i < removing.size(); i++)
+        pool(removing[i].first).release(removing[i].second);
+    for (size_t i = 0; i < quarantine.size(); i++)
+        pool(quarantine[i].first).release(quarantine[i].second);
+    removing.clear();
+    quarantine.clear();
+    stats.resyncs++;
+}
+
+inline bool nat_manager::outbound(const nat_tuple &t, uint32_t now) {
+    uint32_t expires = now + (t.proto == NAT_PROTO_TCP ? config.tcp_timeout : config.udp_timeout);
+    uint32_t index = table.find(t);
+    if (index != NAT_NONE) {
+        // Rules of the session are not in the card yet
+        table.refresh(index, expires);
+        stats.refreshed++;
+        return true;
+    }
+
+    nat_pool &p = pool(t.proto);
+    uint32_t slot = p.alloc();
+    if (slot == NAT_POOL_NONE && (!removing.empty() || !quarantine.empty())) {
+        // Pairs of expired sessions are waiting for their rules to go away
+        flush();
+        if (!removable && !quarantine.empty())
+            resync();
+        slot = p.alloc();
+    }
+    if (slot == NAT_POOL_NONE) {
+        stats.exhausted++;
+        return false;
+    }
+    index = table.insert(t, slot, expires);
+    if (index == NAT_NONE) {
+        p.release(slot);
+        stats.full++;
+        return false;
+    }
+    owner(t.proto)[slot] = index;
+    session_rules(table[index], inserts, insert_count);
+    stats.learned++;
+    if (pending() >= config.batch)
+        flush();
+    return true;
+}
+
+inline bool nat_manager::inbound(uint8_t proto, uint32_t remote_addr, uint16_t remote_port, uint32_t public_addr,
+                                 uint16_t public_port, uint32_t now) {
+    uint32_t slot = pool(proto).slot(public_addr, public_port);
+    uint32_t index = slot != NAT_POOL_NONE ? owner(proto)[slot] : NAT_NONE;
+    if (index == NAT_NONE || table[index].remote_addr != remote_addr || table[index].remote_port != remote_port) {
+        stats.unsolicited++;
+        return false;
+    }
+    table.refresh(index, now + (proto == NAT_PROTO_TCP ? config.tcp_timeout : config.udp_timeout));
+    stats.refreshed++;
+    return true;
+}
+
+inline void nat_manager::advance(uint32_t now) {
+    table.advance(now, expired);
+    for (size_t i = 0; i < expired.size(); i++) {
+        const nat_session &s = table[expired[i]];
+        if (removable)
+            session_rules(s, removes, remove_count);
+        removing.push_back(pool_slot(s.proto, s.public_slot));
+        owner(s.proto)[s.public_slot] = NAT_NONE;
+        table.erase(expired[i]);
+        stats.expired++;
+        if (pending() >= config.batch)
+            flush();
+    }
+}
+
+inline void nat_manager::flush() {
+    // Insert first, session may have expired before its rules were pushed
+    if (insert_count) {
+        push(inserts, insert_count, true);
+        stats.inserted += insert_count;
+        insert_count = 0;
+        stats.batches++;
+    }
+    if (remove_count) {
+        if (push(removes, remove_count, false)) {
+            stats.removed += remove_count;
+            stats.batches++;
+        } else {
+            removable = false;
+        }
+        remove_count = 0;
+    }
+    target.commit();
+    if (removable) {
+        for (size_t i = 0; i < removing.size(); i++)
+            pool(removing[i].first).release(removing[i].second);
+    } else {
+        quarantine.insert(quarantine.end(), removing.begin(), removing.end());
+    }
+    removing.clear();
+    if (!removable && quarantine.size() >= (tcp_pool.size() + udp_pool.size()) / 8)
+        resync();
+}
+
+#endif
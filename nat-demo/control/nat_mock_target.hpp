@@ -0,0 +1,124 @@
+/*
+ * nat_mock_target.hpp: Stand-in for the card in tests of NAT offload example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NAT_MOCK_TARGET
+#define __HEADER_FILE_NAT_MOCK_TARGET
+
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+
+/**
+ * \brief Card stand-in holding hashes of installed rules.
+ *
+ * Unlike ruleset_memory_target it keeps only 64-bit hash of the match of
+ * every rule, so it can follow tens of millions of sessions. Insertion of a
+ * rule already installed and removal of a missing one are errors.
+ */
+class nat_mock_target : public ruleset_target {
+
+    private:
+
+        std::unordered_set<uint64_t> installed;  //!< Hashes of matches of installed rules.
+
+        /**
+         * \brief Hash of the match of a rule.
+         *
+         * Only key values are hashed, rules of a table are expected to have
+         * the same keys in the same order.
+         */
+        static inline uint64_t key(const ruleset_rule &rule) {
+            uint64_t h = rule.table.size() << 1 | rule.is_default;
+            for (unsigned i = 0; i < rule.keys.size(); i++) {
+                const std::vector<uint8_t> &value = rule.keys[i].value;
+                uint64_t word = value.size();
+                for (unsigned b = 0; b < value.size(); b++) {
+                    word = word << 8 | value[b];
+                    if ((b & 7) == 6 || b + 1 == value.size()) {
+                        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+                        h ^= h >> 29;
+                        word = 0;
+                    }
+                }
+            }
+            return h;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param removable Target supports removal of single rules
+         */
+        nat_mock_target(bool removable = true) :
+            removable(removable),
+            clears(0),
+            inserts(0),
+            removes(0),
+            inserted(0),
+            removed(0)
+            {
+        }
+
+        void clear() {
+            installed.clear();
+            clears++;
+        }
+
+        void insert(const std::vector<ruleset_rule> &rules) {
+            for (unsigned i = 0; i < rules.size(); i++)
+                if (!installed.insert(key(rules[i])).second && !rules[i].is_default)
+                    throw std::runtime_error("rule already installed in table '" + rules[i].table + "'");
+            inserts++;
+            inserted += rules.size();
+        }
+
+        bool remove(const std::vector<ruleset_rule> &rules) {
+            if (!removable)
+                return false;
+            for (unsigned i = 0; i < rules.size(); i++)
+                if (installed.erase(key(rules[i])) == 0)
+                    throw std::runtime_error("rule not installed in table '" + rules[i].table + "'");
+            removes++;
+            removed += rules.size();
+            return true;
+        }
+
+        /**
+         * \brief Number of installed rules.
+         */
+        size_t size() const {
+            return installed.size();
+        }
+
+        bool removable;      //!< Target supports removal of single rules.
+        uint64_t clears;     //!< Calls of clear().
+        uint64_t inserts;    //!< Calls of insert().
+        uint64_t removes;    //!< Calls of remove().
+        uint64_t inserted;   //!< Inserted rules.
+        uint64_t removed;    //!< Removed rules.
+};
+
+#endif
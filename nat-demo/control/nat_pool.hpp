@@ -0,0 +1,148 @@
+/*
+ * nat_pool.hpp: Pool of public addresses and ports of NAT offload example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NAT_POOL
+#define __HEADER_FILE_NAT_POOL
+
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+
+#define NAT_POOL_NONE 0xFFFFFFFF //!< No slot.
+
+/**
+ * \brief Pool of public address and port pairs of one protocol.
+ *
+ * Addresses form a contiguous range, every pair is a slot numbered
+ * address index * ports + port offset. Free slots are kept in a FIFO ring,
+ * so both allocation and release are O(1) and a released pair is reused as
+ * late as possible.
+ */
+class nat_pool {
+
+    private:
+
+        uint32_t first_addr;          //!< First public address (host byte order).
+        uint32_t addrs;               //!< Number of public addresses.
+        uint16_t first_port;          //!< First public port.
+        uint32_t ports;               //!< Number of ports of every address.
+        std::vector<uint32_t> ring;   //!< Free slots.
+        size_t head;                  //!< Position of the next slot to allocate.
+        size_t count;                 //!< Number of free slots.
+
+    public:
+
+        /**
+         * \brief Basic constructor, all pairs are free.
+         * @param first_addr First public address (host byte order)
+         * @param addrs      Number of public addresses
+         * @param first_port First public port
+         * @param last_port  Last public port
+         */
+        nat_pool(uint32_t first_addr, uint32_t addrs, uint16_t first_port, uint16_t last_port);
+
+        /**
+         * \brief Allocate free pair.
+         * @return Slot of the pair, NAT_POOL_NONE if the pool is exhausted
+         */
+        inline uint32_t alloc() {
+            if (count == 0)
+                return NAT_POOL_NONE;
+            uint32_t slot = ring[head];
+            head = head + 1 == ring.size() ? 0 : head + 1;
+            count--;
+            return slot;
+        }
+
+        /**
+         * \brief Return pair to the pool.
+         * @param slot Slot of the pair
+         */
+        inline void release(uint32_t slot) {
+            size_t tail = head + count;
+            ring[tail >= ring.size() ? tail - ring.size() : tail] = slot;
+            count++;
+        }
+
+        /**
+         * \brief Slot of a pair.
+         * @param addr Public address (host byte order)
+         * @param port Public port
+         * @return Slot, NAT_POOL_NONE if the pair is not in the pool
+         */
+        inline uint32_t slot(uint32_t addr, uint16_t port) const {
+            uint32_t a = addr - first_addr, p = (uint16_t) (port - first_port);
+            if (a >= addrs || p >= ports)
+                return NAT_POOL_NONE;
+            return a * ports + p;
+        }
+
+        /**
+         * \brief Check whether the address belongs to the pool.
+         */
+        inline bool contains(uint32_t addr) const {
+            return addr - first_addr < addrs;
+        }
+
+        inline uint32_t addr(uint32_t slot) const {
+            return first_addr + slot / ports;
+        }
+
+        inline uint16_t port(uint32_t slot) const {
+            return first_port + slot % ports;
+        }
+
+        /**
+         * \brief Number of pairs in the pool.
+         */
+        size_t size() const {
+            return ring.size();
+        }
+
+        /**
+         * \brief Number of free pairs.
+         */
+        size_t available() const {
+            return count;
+        }
+};
+
+inline nat_pool::nat_pool(uint32_t first_addr, uint32_t addrs, uint16_t first_port, uint16_t last_port) :
+    first_addr(first_addr),
+    addrs(addrs),
+    first_port(first_port),
+    ports(last_port >= first_port ? last_port - first_port + 1 : 0),
+    head(0),
+    count(0)
+    {
+    if (addrs == 0 || ports == 0)
+        throw std::runtime_error("empty NAT pool");
+    if ((uint64_t) addrs * ports >= NAT_POOL_NONE)
+        throw std::runtime_error("NAT pool too large");
+    // Consecutive allocations spread over addresses
+    ring.resize((size_t) addrs * ports);
+    for (uint32_t p = 0; p < ports; p++)
+        for (uint32_t a = 0; a < addrs; a++)
+            ring[count++] = a * ports + p;
+}
+
+#endif
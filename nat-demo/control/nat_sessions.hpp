@@ -0,0 +1,259 @@
+/*
+ * nat_sessions.hpp: Session table with timer wheel of NAT offload example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_NAT_SESSIONS
+#define __HEADER_FILE_NAT_SESSIONS
+
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+
+#define NAT_NONE        0xFFFFFFFF //!< No session.
+#define NAT_WHEEL_SLOTS 4096       //!< Slots of timer wheel, one second each.
+
+/**
+ * \brief Connection seen from inside, host byte order.
+ */
+struct nat_tuple {
+    uint32_t inside_addr;   //!< Private address.
+    uint32_t remote_addr;   //!< Remote address.
+    uint16_t inside_port;   //!< Private port.
+    uint16_t remote_port;   //!< Remote port.
+    uint8_t proto;          //!< IP protocol (TCP or UDP).
+};
+
+/**
+ * \brief Translated session, 36 bytes, linked by indexes instead of pointers.
+ */
+struct nat_session {
+    uint32_t inside_addr;   //!< Private address.
+    uint32_t remote_addr;   //!< Remote address.
+    uint16_t inside_port;   //!< Private port.
+    uint16_t remote_port;   //!< Remote port.
+    uint32_t public_slot;   //!< Public address and port (slot of the pool of the protocol).
+    uint32_t next;          //!< Next session in hash chain, or in free list.
+    uint32_t timer_next;    //!< Next session in wheel slot.
+    uint32_t timer_prev;    //!< Previous session in wheel slot.
+    uint32_t expires;       //!< Expiration time in seconds.
+    uint8_t proto;          //!< IP protocol.
+};
+
+/**
+ * \brief Table of sessions with fixed capacity.
+ *
+ * Sessions live in one preallocated array and are found by their inside
+ * tuple through hash chains. Expiration is kept by hashed timer wheel of
+ * one second slots: refresh and removal are O(1), advancing the clock visits
+ * only the passed slots. Sessions expiring more than NAT_WHEEL_SLOTS seconds
+ * ahead stay in their slot until their round comes.
+ */
+class nat_session_table {
+
+    private:
+
+        nat_session_table(const nat_session_table &);
+        nat_session_table &operator=(const nat_session_table &);
+
+        std::vector<nat_session> sessions;  //!< Sessions.
+        std::vector<uint32_t> buckets;      //!< Heads of hash chains.
+        std::vector<uint32_t> wheel;        //!< Heads of timer wheel slots.
+        uint32_t free_head;                 //!< First unused session.
+        size_t used;                        //!< Number of sessions.
+        uint32_t clock;                     //!< Time the wheel was advanced to.
+
+        static inline uint32_t hash(const nat_tuple &t) {
+            uint64_t h = ((uint64_t) t.inside_addr << 32 | t.remote_addr) * 0x9E3779B97F4A7C15ULL;
+            h ^= ((uint64_t) t.inside_port << 24 | (uint64_t) t.remote_port << 8 | t.proto) * 0xC2B2AE3D27D4EB4FULL;
+            return h ^ h >> 32;
+        }
+
+        inline bool matches(const nat_session &s, const nat_tuple &t) const {
+            return s.inside_addr == t.inside_addr && s.remote_addr == t.remote_addr &&
+                   s.inside_port == t.inside_port && s.remote_port == t.remote_port && s.proto == t.proto;
+        }
+
+        inline void timer_link(uint32_t index) {
+            nat_session &s = sessions[index];
+            uint32_t &head = wheel[s.expires & (NAT_WHEEL_SLOTS - 1)];
+            s.timer_prev = NAT_NONE;
+            s.timer_next = head;
+            if (head != NAT_NONE)
+                sessions[head].timer_prev = index;
+            head = index;
+        }
+
+        inline void timer_unlink(uint32_t index) {
+            nat_session &s = sessions[index];
+            if (s.timer_prev != NAT_NONE)
+                sessions[s.timer_prev].timer_next = s.timer_next;
+            else
+                wheel[s.expires & (NAT_WHEEL_SLOTS - 1)] = s.timer_next;
+            if (s.timer_next != NAT_NONE)
+                sessions[s.timer_next].timer_prev = s.timer_prev;
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor, allocate the whole table.
+         * @param capacity Maximal number of sessions
+         * @param now      Current time in seconds
+         */
+        nat_session_table(uint32_t capacity, uint32_t now);
+
+        /**
+         * \brief Find session by its inside tuple.
+         * @return Index of the session, NAT_NONE if there is none
+         */
+        inline uint32_t find(const nat_tuple &t) const {
+            for (uint32_t i = buckets[hash(t) & (buckets.size() - 1)]; i != NAT_NONE; i = sessions[i].next)
+                if (matches(sessions[i], t))
+                    return i;
+            return NAT_NONE;
+        }
+
+        /**
+         * \brief Add session, the tuple must not be in the table.
+         * @param t       Inside tuple
+         * @param slot    Public address and port
+         * @param expires Expiration time in seconds
+         * @return Index of the session, NAT_NONE if the table is full
+         */
+        inline uint32_t insert(const nat_tuple &t, uint32_t slot, uint32_t expires);
+
+        /**
+         * \brief Remove session.
+         * @param index Index of the session
+         */
+        inline void erase(uint32_t index);
+
+        /**
+         * \brief Postpone expiration of session.
+         * @param index   Index of the session
+         * @param expires New expiration time in seconds
+         */
+        inline void refresh(uint32_t index, uint32_t expires) {
+            if (sessions[index].expires == expires)
+                return;
+            timer_unlink(index);
+            sessions[index].expires = expires;
+            timer_link(index);
+        }
+
+        /**
+         * \brief Advance the clock and collect expired sessions.
+         * @param now     Current time in seconds
+         * @param expired Output indexes of expired sessions, unlinked from the wheel
+         *                but still in the table until erased
+         */
+        void advance(uint32_t now, std::vector<uint32_t> &expired);
+
+        inline const nat_session &operator[](uint32_t index) const {
+            return sessions[index];
+        }
+
+        /**
+         * \brief Number of sessions.
+         */
+        size_t size() const {
+            return used;
+        }
+
+        /**
+         * \brief Maximal number of sessions.
+         */
+        size_t capacity() const {
+            return sessions.size();
+        }
+};
+
+inline nat_session_table::nat_session_table(uint32_t capacity, uint32_t now) :
+    wheel(NAT_WHEEL_SLOTS, NAT_NONE),
+    free_head(0),
+    used(0),
+    clock(now)
+    {
+    if (capacity == 0 || capacity >= NAT_NONE)
+        throw std::runtime_error("invalid capacity of NAT session table");
+    size_t count = 1;
+    while (count < capacity)
+        count <<= 1;
+    buckets.assign(count, NAT_NONE);
+    sessions.resize(capacity);
+    for (uint32_t i = 0; i < capacity; i++)
+        sessions[i].next = i + 1 < capacity ? i + 1 : NAT_NONE;
+}
+
+inline uint32_t nat_session_table::insert(const nat_tuple &t, uint32_t slot, uint32_t expires) {
+    uint32_t index = free_head;
+    if (index == NAT_NONE)
+        return NAT_NONE;
+    nat_session &s = sessions[index];
+    free_head = s.next;
+    s.inside_addr = t.inside_addr;
+    s.remote_addr = t.remote_addr;
+    s.inside_port = t.inside_port;
+    s.remote_port = t.remote_port;
+    s.proto = t.proto;
+    s.public_slot = slot;
+    // Session expiring before the clock would never be visited
+    s.expires = expires > clock ? expires : clock + 1;
+    uint32_t &head = buckets[hash(t) & (buckets.size() - 1)];
+    s.next = head;
+    head = index;
+    timer_link(index);
+    used++;
+    return index;
+}
+
+inline void nat_session_table::erase(uint32_t index) {
+    nat_session &s = sessions[index];
+    nat_tuple t = { s.inside_addr, s.remote_addr, s.inside_port, s.remote_port, s.proto };
+    uint32_t *link = &buckets[hash(t) & (buckets.size() - 1)];
+    while (*link != index)
+        link = &sessions[*link].next;
+    *link = s.next;
+    s.next = free_head;
+    free_head = index;
+    used--;
+}
+
+inline void nat_session_table::advance(uint32_t now, std::vector<uint32_t> &expired) {
+    expired.clear();
+    if ((int32_t) (now - clock) <= 0)
+        return;
+    // Every slot is visited at most once
+    uint32_t steps = now - clock < NAT_WHEEL_SLOTS ? now - clock : NAT_WHEEL_SLOTS;
+    for (uint32_t t = now - steps + 1; t != now + 1; t++) {
+        uint32_t &head = wheel[t & (NAT_WHEEL_SLOTS - 1)];
+        for (uint32_t i = head, next; i != NAT_NONE; i = next) {
+            next = sessions[i].timer_next;
+            if ((int32_t) (sessions[i].expires - now) <= 0) {
+                timer_unlink(i);
+                expired.push_back(i);
+            }
+        }
+    }
+    clock = now;
+}
+
+#endif
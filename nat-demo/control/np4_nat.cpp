@@ -0,0 +1,428 @@
+/*
+ * np4_nat.cpp: Session manager of NAT offload example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Netcope P4 NAT session manager -----------------------------
+ * --------------------------------------------------------------------------------
+ * - Packets missing tab_nat are punted to an RX queue. For the first outbound   -
+ *   packet of a connection a public address and port are allocated from the    -
+ *   pool and srcnat/dstnat rules are inserted to tab_nat in batches. Sessions   -
+ *   without punted packets expire and their rules are removed. With -m the     -
+ *   card is replaced by a mock and punted packets by synthetic connections.     -
+ * --------------------------------------------------------------------------------
+ * Usage: np4_nat [-h] [-d card] [-r queue] -P pool [-p ports] [-S sessions] [-L file]
+ *                [-t timeout] [-u timeout] [-b batch] [-l usec] [-m count [-R rate] [-N]]
+ *   -d card     Netcope P4 card (default: 0)
+ *   -r queue    RX queue of punted packets (default: 0)
+ *   -P pool     Public addresses, addr[/prefix]
+ *   -p ports    Public ports, first-last (default: 1024-65535)
+ *   -S sessions Maximal number of sessions (default: 33554432)
+ *   -L file     NP4 ruleset 2.0 file with rules of other tables, installed at
+ *               start and with every reload of the card
+ *   -t timeout  Lifetime of TCP session in seconds (default: 300)
+ *   -u timeout  Lifetime of UDP session in seconds (default: 60)
+ *   -b batch    Rules pushed to the card at once (default: 4096)
+ *   -l usec     Maximal delay of pending rules in microseconds (default: 1000)
+ *   -m count    Mock run, count synthetic connections and mock card
+ *   -R rate     New connections per simulated second of mock run (default: 100000)
+ *   -N          Mock card cannot remove single rules (like Netcope P4)
+ *   -h          Writes out help
+ * Build: g++ -O2 -std=c++11 -o np4_nat np4_nat.cpp -lnp4 -lpthread
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <ctime>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <libnp4.h>
+
+#include "../../common/np4_ruleset.hpp"
+#include "nat_manager.hpp"
+#include "nat_mock_target.hpp"
+
+#define NAT_SESSIONS   33554432 //!< Default capacity of session table (max_size of tab_nat).
+#define NAT_FLUSH_US   1000     //!< Default delay of pending rules.
+#define NAT_MOCK_RATE  100000   //!< Default new connections per simulated second.
+
+extern char *__progname;
+
+std::atomic<bool> run(true);
+
+/**
+ * \brief Signal handler, stops processing.
+ */
+void stop_processing(int) {
+    run = false;
+}
+
+/**
+ * \brief Read coarse monotonic time.
+ * @return Time in microseconds
+ */
+static inline uint64_t coarse_time_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * \brief Widths of match keys and action parameters of NAT processing (top.p4).
+ */
+inline const ruleset_widths &nat_widths() {
+    static const ruleset_widths widths = ruleset_widths()
+        .key("tab_extract_nat_metadata", "ipv4.srcAddr", 32)
+        .key("tab_set_egress_port", "nat_metadata.do_nat", 1)
+        .key("tab_nat", "ipv4.srcAddr", 32).key("tab_nat", "ipv4.dstAddr", 32)
+        .key("tab_nat", "tcp.srcPort", 16).key("tab_nat", "tcp.dstPort", 16)
+        .key("tab_nat", "udp.srcPort", 16).key("tab_nat", "udp.dstPort", 16)
+        .param("srcnat_tcp", "ipaddr", 32).param("srcnat_tcp", "port", 16)
+        .param("dstnat_tcp", "ipaddr", 32).param("dstnat_tcp", "port", 16)
+        .param("srcnat_udp", "ipaddr", 32).param("srcnat_udp", "port", 16)
+        .param("dstnat_udp", "ipaddr", 32).param("dstnat_udp", "port", 16);
+    return widths;
+}
+
+/**
+ * \brief Command line arguments.
+ */
+struct nat_arguments {
+    int card;               //!< Netcope P4 card.
+    int queue;              //!< RX queue of punted packets.
+    uint32_t pool_addr;     //!< First public address (host byte order).
+    uint32_t pool_addrs;    //!< Number of public addresses.
+    uint16_t first_port;    //!< First public port.
+    uint16_t last_port;     //!< Last public port.
+    uint32_t sessions;      //!< Capacity of session table.
+    const char *rules;      //!< File with rules of other tables.
+    nat_config config;      //!< Parameters of the manager.
+    uint64_t flush_us;      //!< Maximal delay of pending rules.
+    uint64_t mock;          //!< Synthetic connections of mock run, 0 to use the card.
+    uint32_t rate;          //!< New connections per simulated second.
+    bool removable;         //!< Mock card removes single rules.
+
+    nat_arguments() :
+        card(0), queue(0), pool_addr(0), pool_addrs(0), first_port(1024), last_port(65535),
+        sessions(NAT_SESSIONS), rules(NULL), flush_us(NAT_FLUSH_US), mock(0), rate(NAT_MOCK_RATE), removable(true)
+        {
+    }
+};
+
+void nat_usage() {
+    std::cout << "Usage: np4_nat [-h] [-d card] [-r queue] -P pool [-p ports] [-S sessions] [-L file]" << std::endl;
+    std::cout << "               [-t timeout] [-u timeout] [-b batch] [-l usec] [-m count [-R rate] [-N]]" << std::endl;
+    std::cout << "  -d card     Netcope P4 card (default: 0)" << std::endl;
+    std::cout << "  -r queue    RX queue of punted packets (default: 0)" << std::endl;
+    std::cout << "  -P pool     Public addresses, addr[/prefix]" << std::endl;
+    std::cout << "  -p ports    Public ports, first-last (default: 1024-65535)" << std::endl;
+    std::cout << "  -S sessions Maximal number of sessions (default: " << NAT_SESSIONS << ")" << std::endl;
+    std::cout << "  -L file     NP4 ruleset 2.0 file with rules of other tables, installed at" << std::endl;
+    std::cout << "              start and with every reload of the card" << std::endl;
+    std::cout << "  -t timeout  Lifetime of TCP session in seconds (default: " << NAT_TCP_TIMEOUT << ")" << std::endl;
+    std::cout << "  -u timeout  Lifetime of UDP session in seconds (default: " << NAT_UDP_TIMEOUT << ")" << std::endl;
+    std::cout << "  -b batch    Rules pushed to the card at once (default: " << NAT_BATCH_RULES << ")" << std::endl;
+    std::cout << "  -l usec     Maximal delay of pending rules in microseconds (default: " << NAT_FLUSH_US << ")" << std::endl;
+    std::cout << "  -m count    Mock run, count synthetic connections and mock card" << std::endl;
+    std::cout << "  -R rate     New connections per simulated second of mock run (default: " << NAT_MOCK_RATE << ")" << std::endl;
+    std::cout << "  -N          Mock card cannot remove single rules (like Netcope P4)" << std::endl;
+    std::cout << "  -h          Writes out help" << std::endl;
+}
+
+/**
+ * \brief Parse pool of public addresses.
+ * @param text  Address with optional prefix length
+ * @param args  Arguments to fill
+ */
+void nat_parse_pool(const char *text, nat_arguments &args) {
+    std::string addr(text);
+    unsigned prefix = 32;
+    size_t slash = addr.find('/');
+    if (slash != std::string::npos) {
+        prefix = strtoul(addr.c_str() + slash + 1, NULL, 10);
+        addr.resize(slash);
+    }
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr.c_str(), &in) != 1 || prefix == 0 || prefix > 32)
+        throw std::runtime_error(std::string() + "invalid pool '" + text + "'");
+    args.pool_addrs = prefix == 32 ? 1 : 1u << (32 - prefix);
+    args.pool_addr = ntohl(in.s_addr) & ~(args.pool_addrs - 1);
+}
+
+/**
+ * \brief Handle one punted frame.
+ * @param manager Session manager
+ * @param frame   Ethernet frame
+ * @param len     Length of the frame
+ * @param now     Current time in seconds
+ */
+void nat_punted(nat_manager &manager, const unsigned char *frame, unsigned len, uint32_t now) {
+    // Headers as parsed by parser_newnat.p4, IPv4 options are not skipped
+    if (len < 14 + 20 + 4 || frame[12] != 0x08 || frame[13] != 0x00)
+        return;
+    const unsigned char *ip = frame + 14;
+    uint8_t proto = ip[9];
+    if (proto != NAT_PROTO_TCP && proto != NAT_PROTO_UDP)
+        return;
+    uint32_t src, dst;
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+    src = ntohl(src);
+    dst = ntohl(dst);
+    uint16_t sport = ip[20] << 8 | ip[21];
+    uint16_t dport = ip[22] << 8 | ip[23];
+    if (manager.is_public(dst)) {
+        manager.inbound(proto, src, sport, dst, dport, now);
+    } else {
+        nat_tuple t = { src, dst, sport, dport, proto };
+        manager.outbound(t, now);
+    }
+}
+
+/**
+ * \brief Write out counters of the manager.
+ */
+void nat_print_stats(const nat_manager &manager, double elapsed) {
+    const nat_stats &stats = manager.stats;
+    std::cout << "Sessions learned    : " << stats.learned << std::endl;
+    std::cout << "Sessions refreshed  : " << stats.refreshed << std::endl;
+    std::cout << "Sessions expired    : " << stats.expired << std::endl;
+    std::cout << "Sessions live       : " << manager.sessions() << std::endl;
+    std::cout << "Unsolicited packets : " << stats.unsolicited << std::endl;
+    std::cout << "Pool exhausted      : " << stats.exhausted << std::endl;
+    std::cout << "Table full          : " << stats.full << std::endl;
+    std::cout << "Rules inserted      : " << stats.inserted << std::endl;
+    std::cout << "Rules removed       : " << stats.removed << std::endl;
+    std::cout << "Rule batches        : " << stats.batches << std::endl;
+    std::cout << "Card reloads        : " << stats.resyncs << std::endl;
+    std::cout << "Elapsed time (s)    : " << elapsed << std::endl;
+    std::cout << "Sessions per second : " << (elapsed > 0 ? stats.learned / elapsed : 0.0) << std::endl;
+}
+
+/**
+ * \brief Learn sessions from punted packets of the card.
+ * @param np4     Netcope P4 instance
+ * @param args    Parsed command line arguments
+ * @param manager Session manager
+ */
+void nat_processing(np4_t *np4, const nat_arguments &args, nat_manager &manager) {
+    np4_rx_stream_t *rx_stream = NULL;
+    np4_header_t np4_hdr;
+    unsigned char *frame;
+    unsigned frame_len;
+    np4_error_t err = np4_rx_stream_open(np4, args.queue, &rx_stream);
+    if (err)
+        throw np4_print_error(err);
+
+    try {
+        uint64_t packets = 0;
+        uint64_t now_us = coarse_time_us();
+        uint64_t flushed_us = now_us;
+        while (run) {
+            unsigned len;
+            unsigned char *data = np4_rx_stream_read_next(rx_stream, &len);
+            if (data) {
+                packets++;
+                err = np4_parse_frame(data, &np4_hdr, &frame, &frame_len);
+                if (err)
+                    throw np4_print_error(err);
+                nat_punted(manager, frame, frame_len, now_us / 1000000);
+            }
+            // Expire sessions and push pending rules, checked when idle and every 1024 packets
+            if (data == NULL || (packets & 0x3FF) == 0) {
+                now_us = coarse_time_us();
+                manager.advance(now_us / 1000000);
+                if (manager.pending() == 0)
+                    flushed_us = now_us;
+                else if (now_us - flushed_us >= args.flush_us) {
+                    manager.flush();
+                    flushed_us = now_us;
+                }
+            }
+        }
+        manager.flush();
+    } catch (...) {
+        np4_rx_stream_close(np4, &rx_stream);
+        throw;
+    }
+    np4_rx_stream_close(np4, &rx_stream);
+}
+
+/**
+ * \brief Learn synthetic connections with simulated time.
+ *
+ * Connections come at the given rate of simulated time from random private
+ * hosts of 10.0.0.0/8; one of 16 punts is a second packet of a recent
+ * connection whose rules are not in the card yet.
+ * @param args    Parsed command line arguments
+ * @param manager Session manager
+ */
+void nat_mock_processing(const nat_arguments &args, nat_manager &manager) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    nat_tuple last = { 0, 0, 0, 0, NAT_PROTO_TCP };
+    uint32_t start = 1000, clock = start;
+    for (uint64_t n = 0; n < args.mock && run; n++) {
+        uint32_t now = start + n / args.rate;
+        if (now != clock) {
+            manager.advance(now);
+            clock = now;
+        }
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t r = state * 0x2545F4914F6CDD1DULL;
+        if ((r & 0xF) == 0 && last.inside_addr) {
+            manager.outbound(last, now);
+            continue;
+        }
+        nat_tuple t;
+        t.inside_addr = 0x0A000000 | (r >> 8 & 0xFFFFFF);
+        t.remote_addr = (uint32_t) (r >> 32) | 0x01000000;
+        t.inside_port = 1024 + (r >> 4 & 0x7FFF);
+        t.remote_port = (r >> 20 & 1) ? 443 : 53;
+        t.proto = t.remote_port == 443 ? NAT_PROTO_TCP : NAT_PROTO_UDP;
+        manager.outbound(t, now);
+        last = t;
+    }
+    manager.flush();
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    int exit_code = EXIT_SUCCESS;
+    np4_t *np4 = NULL;
+    nat_arguments args;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "d:r:P:p:S:L:t:u:b:l:m:R:Nh")) != -1)
+            switch (c) {
+                case 'd':
+                    args.card = strtol(optarg, NULL, 10);
+                    break;
+                case 'r':
+                    args.queue = strtol(optarg, NULL, 10);
+                    break;
+                case 'P':
+                    nat_parse_pool(optarg, args);
+                    break;
+                case 'p': {
+                    char *end;
+                    args.first_port = strtoul(optarg, &end, 10);
+                    args.last_port = *end == '-' ? strtoul(end + 1, NULL, 10) : args.first_port;
+                    break;
+                }
+                case 'S':
+                    args.sessions = strtoul(optarg, NULL, 10);
+                    break;
+                case 'L':
+                    args.rules = optarg;
+                    break;
+                case 't':
+                    args.config.tcp_timeout = strtoul(optarg, NULL, 10);
+                    break;
+                case 'u':
+                    args.config.udp_timeout = strtoul(optarg, NULL, 10);
+                    break;
+                case 'b':
+                    args.config.batch = strtoul(optarg, NULL, 10);
+                    break;
+                case 'l':
+                    args.flush_us = strtoull(optarg, NULL, 10);
+                    break;
+                case 'm':
+                    args.mock = strtoull(optarg, NULL, 10);
+                    break;
+                case 'R':
+                    args.rate = strtoul(optarg, NULL, 10);
+                    break;
+                case 'N':
+                    args.removable = false;
+                    break;
+                case 'h':
+                    nat_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    nat_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc || args.pool_addrs == 0 || args.rate == 0) {
+            nat_usage();
+            return EXIT_FAILURE;
+        }
+
+        ruleset base(&nat_widths());
+        if (args.rules)
+            base.load(args.rules);
+        nat_pool tcp_pool(args.pool_addr, args.pool_addrs, args.first_port, args.last_port);
+        nat_pool udp_pool(args.pool_addr, args.pool_addrs, args.first_port, args.last_port);
+
+        signal(SIGINT, stop_processing);
+        signal(SIGTERM, stop_processing);
+
+        std::unique_ptr<ruleset_target> target;
+        if (args.mock) {
+            target.reset(new nat_mock_target(args.removable));
+        } else {
+            np4_error_t err = np4_init_card(&np4, args.card);
+            if (err)
+                throw np4_print_error(err);
+            // Expired sessions leave the card only by periodic reload of the core (see nat_manager)
+            target.reset(new np4_ruleset_target(np4, 0, true));
+        }
+        uint32_t now = args.mock ? 1000 : coarse_time_us() / 1000000;
+        nat_manager manager(*target, tcp_pool, udp_pool, args.sessions, args.config, now);
+
+        // Card is cleared, so that no rule of a previous run is left
+        manager.install(base);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (args.mock)
+            nat_mock_processing(args, manager);
+        else
+            nat_processing(np4, args, manager);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        nat_print_stats(manager, elapsed);
+        if (args.mock)
+            std::cout << "Mock card rules     : " << ((nat_mock_target &) *target).size() << std::endl;
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        exit_code = EXIT_FAILURE;
+    } catch(np4_error_t &e) {
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (np4 != NULL)
+        np4_exit(&np4);
+    return exit_code;
+}
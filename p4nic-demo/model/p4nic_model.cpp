@@ -0,0 +1,231 @@
+/*
+ * p4nic_model.cpp: Software model of P4 NIC example for analysis of RSS distribution.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- P4 NIC pipeline model --------------------------------------
+ * --------------------------------------------------------------------------------
+ * - Packets of a capture are passed through software model of the P4 NIC       -
+ *   pipeline (MAC filter, counters and RSS by table_rss) configured by the      -
+ *   same NP4 ruleset as the card. Distribution of packets and bytes among       -
+ *   queues and RSS indexes is written out, so balance of the traffic can be     -
+ *   checked before the card is flashed. Neither the card nor the Netcope P4     -
+ *   library is needed.                                                          -
+ * --------------------------------------------------------------------------------
+ * Usage: p4nic_model [-h] [-c rules] [-t threads] [-n loops] [-b bits] file
+ *   -c rules    NP4 ruleset 2.0 file with rules (default: ../commands.np4)
+ *   -t threads  Number of threads (default: 1)
+ *   -n loops    Number of passes over the capture (default: 1)
+ *   -b bits     Width of RSS index, table_rss has 2^bits entries (default: 4)
+ *   -h          Writes out help
+ * Build: g++ -O2 -std=c++11 -o p4nic_model p4nic_model.cpp -lpthread
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "../../common/pcap.hpp"
+#include "p4nic_pipeline.hpp"
+
+extern char *__progname;
+
+/**
+ * \brief Packet of the capture.
+ */
+struct model_packet {
+    const unsigned char *data; //!< Packet data.
+    unsigned caplen;           //!< Captured length.
+    unsigned len;              //!< Length on the wire.
+};
+
+void model_usage() {
+    std::cout << "Usage: p4nic_model [-h] [-c rules] [-t threads] [-n loops] [-b bits] file" << std::endl;
+    std::cout << "  -c rules    NP4 ruleset 2.0 file with rules (default: ../commands.np4)" << std::endl;
+    std::cout << "  -t threads  Number of threads (default: 1)" << std::endl;
+    std::cout << "  -n loops    Number of passes over the capture (default: 1)" << std::endl;
+    std::cout << "  -b bits     Width of RSS index, table_rss has 2^bits entries (default: 4)" << std::endl;
+    std::cout << "  -h          Writes out help" << std::endl;
+}
+
+/**
+ * \brief Pass part of the capture through the pipeline.
+ * @param pipeline Model of the pipeline
+ * @param packets  Packets of the capture
+ * @param first    First packet of the part
+ * @param last     Packet after the part
+ * @param loops    Number of passes
+ * @param stats    Statistics of the thread
+ */
+void model_thread(const p4nic_pipeline &pipeline, const std::vector<model_packet> &packets, size_t first, size_t last,
+                  unsigned long loops, p4nic_stats &stats) {
+    // Counters of neighbouring threads would share cache lines
+    p4nic_stats local = pipeline.stats();
+    for (unsigned long l = 0; l < loops; l++)
+        for (size_t i = first; i < last; i++)
+            pipeline.process(packets[i].data, packets[i].caplen, packets[i].len, local);
+    stats = local;
+}
+
+/**
+ * \brief Write out share of one queue or index.
+ */
+void model_print_share(const std::string &name, uint64_t packets, uint64_t bytes, uint64_t total_packets,
+                       uint64_t total_bytes) {
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::left << std::setw(20) << name << ": " << std::right
+              << std::setw(12) << packets << " pkts " << std::setw(6) << std::fixed << std::setprecision(2)
+              << (total_packets ? 100.0 * packets / total_packets : 0.0) << " %  "
+              << std::setw(14) << bytes << " B " << std::setw(6)
+              << (total_bytes ? 100.0 * bytes / total_bytes : 0.0) << " %" << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+    std::cout.precision(precision);
+}
+
+/**
+ * \brief Write out imbalance (busiest over average) of queues or indexes.
+ */
+void model_print_imbalance(const std::string &name, const std::vector<uint64_t> &values) {
+    uint64_t sum = 0, max = 0;
+    for (unsigned i = 0; i < values.size(); i++) {
+        sum += values[i];
+        if (values[i] > max)
+            max = values[i];
+    }
+    std::cout << std::left << std::setw(20) << name << std::right << ": "
+              << (sum ? (double) max * values.size() / sum : 0.0) << std::endl;
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *rules_path = "../commands.np4";
+    unsigned threads = 1;
+    unsigned long loops = 1;
+    unsigned bits = P4NIC_RSS_BITS;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "c:t:n:b:h")) != -1)
+            switch (c) {
+                case 'c':
+                    rules_path = optarg;
+                    break;
+                case 't':
+                    threads = strtoul(optarg, NULL, 10);
+                    break;
+                case 'n':
+                    loops = strtoul(optarg, NULL, 10);
+                    break;
+                case 'b':
+                    bits = strtoul(optarg, NULL, 10);
+                    break;
+                case 'h':
+                    model_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    model_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc - 1 || threads == 0 || loops == 0) {
+            model_usage();
+            return EXIT_FAILURE;
+        }
+
+        ruleset rules;
+        rules.load(rules_path);
+        p4nic_pipeline pipeline(rules, bits);
+
+        // Capture stays mapped while the threads run
+        pcap_reader reader(argv[optind]);
+        if (reader.linktype != PCAP_LINKTYPE_ETHERNET)
+            throw std::runtime_error(std::string() + "'" + argv[optind] + "' is not Ethernet capture");
+        std::vector<model_packet> packets;
+        model_packet packet;
+        while ((packet.data = reader.next(&packet.caplen, NULL, &packet.len)) != NULL)
+            packets.push_back(packet);
+        if (threads > packets.size() && !packets.empty())
+            threads = packets.size();
+
+        // Every thread takes contiguous part of the capture
+        std::vector<p4nic_stats> stats(threads, pipeline.stats());
+        std::vector<std::thread> workers;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < threads; t++)
+            workers.push_back(std::thread(model_thread, std::cref(pipeline), std::cref(packets),
+                                          packets.size() * t / threads, packets.size() * (t + 1) / threads, loops,
+                                          std::ref(stats[t])));
+        for (unsigned t = 0; t < threads; t++)
+            workers[t].join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        p4nic_stats total = pipeline.stats();
+        for (unsigned t = 0; t < threads; t++)
+            total.merge(stats[t]);
+
+        uint64_t steered_packets = 0, steered_bytes = 0;
+        for (unsigned q = 0; q < pipeline.queues(); q++) {
+            steered_packets += total.queue_packets[q];
+            steered_bytes += total.queue_bytes[q];
+        }
+        uint64_t processed = (uint64_t) packets.size() * loops;
+
+        std::cout << "Packets             : " << processed << std::endl;
+        std::cout << "Counter PKTS        : " << total.counters[P4NIC_COUNTERS_PKTS] << std::endl;
+        std::cout << "Counter RCVD        : " << total.counters[P4NIC_COUNTERS_RCVD] << std::endl;
+        std::cout << "Counter RCVD_BYTES  : " << total.counters[P4NIC_COUNTERS_RCVD_BYTES] << std::endl;
+        std::cout << "Counter DROPPED     : " << total.counters[P4NIC_COUNTERS_DROPPED] << std::endl;
+        std::cout << "Unsteered packets   : " << total.unsteered_packets << std::endl;
+        std::cout << std::endl;
+        for (unsigned q = 0; q < pipeline.queues(); q++)
+            model_print_share("Queue " + std::to_string(pipeline.port(q)), total.queue_packets[q],
+                              total.queue_bytes[q], steered_packets, steered_bytes);
+        model_print_imbalance("Queue imbalance", total.queue_packets);
+        std::cout << std::endl;
+        uint64_t hashed_packets = 0, hashed_bytes = 0;
+        for (unsigned i = 0; i < pipeline.indexes(); i++) {
+            hashed_packets += total.index_packets[i];
+            hashed_bytes += total.index_bytes[i];
+        }
+        for (unsigned i = 0; i < pipeline.indexes(); i++)
+            model_print_share("RSS index " + std::to_string(i), total.index_packets[i], total.index_bytes[i],
+                              hashed_packets, hashed_bytes);
+        model_print_imbalance("Index imbalance", total.index_packets);
+        std::cout << std::endl;
+        std::cout << "Threads             : " << threads << std::endl;
+        std::cout << "Elapsed time (s)    : " << elapsed << std::endl;
+        std::cout << "Packets per second  : " << (elapsed > 0 ? processed / elapsed : 0.0) << std::endl;
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string &e) {
+        std::cerr << __progname << ": " << e << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
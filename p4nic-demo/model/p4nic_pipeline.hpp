@@ -0,0 +1,369 @@
+/*
+ * p4nic_pipeline.hpp: Software model of P4 NIC example pipeline.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_P4NIC_PIPELINE
+#define __HEADER_FILE_P4NIC_PIPELINE
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+
+#define P4NIC_RSS_BITS       4 //!< Width of packet_metadata.rss_index.
+
+#define P4NIC_COUNTERS_PKTS        0 //!< All packets.
+#define P4NIC_COUNTERS_RCVD        1 //!< Received packets.
+#define P4NIC_COUNTERS_RCVD_BYTES  2 //!< Bytes of received packets.
+#define P4NIC_COUNTERS_DROPPED     3 //!< Dropped packets.
+#define P4NIC_COUNTERS             4 //!< Number of counters.
+
+/**
+ * \brief Statistics of packets passed through the pipeline.
+ *
+ * Every thread of the model keeps its own statistics, merged at the end.
+ */
+struct p4nic_stats {
+    uint32_t counters[P4NIC_COUNTERS];    //!< Register counters, 32 bits wide like in the card.
+    std::vector<uint64_t> queue_packets;  //!< Packets of every queue (egress port).
+    std::vector<uint64_t> queue_bytes;    //!< Bytes of every queue.
+    std::vector<uint64_t> index_packets;  //!< Packets of every RSS index.
+    std::vector<uint64_t> index_bytes;    //!< Bytes of every RSS index.
+    uint64_t unsteered_packets;           //!< Packets passed without egress port set by the pipeline.
+    uint64_t unsteered_bytes;             //!< Bytes of unsteered packets.
+
+    /**
+     * \brief Basic constructor.
+     * @param queues  Number of queues
+     * @param indexes Number of RSS indexes
+     */
+    p4nic_stats(unsigned queues = 0, unsigned indexes = 0) :
+        queue_packets(queues),
+        queue_bytes(queues),
+        index_packets(indexes),
+        index_bytes(indexes),
+        unsteered_packets(0),
+        unsteered_bytes(0)
+        {
+        memset(counters, 0, sizeof(counters));
+    }
+
+    /**
+     * \brief Add statistics of another thread.
+     */
+    void merge(const p4nic_stats &other);
+};
+
+inline void p4nic_stats::merge(const p4nic_stats &other) {
+    for (unsigned i = 0; i < P4NIC_COUNTERS; i++)
+        counters[i] += other.counters[i];
+    for (unsigned i = 0; i < queue_packets.size(); i++) {
+        queue_packets[i] += other.queue_packets[i];
+        queue_bytes[i] += other.queue_bytes[i];
+    }
+    for (unsigned i = 0; i < index_packets.size(); i++) {
+        index_packets[i] += other.index_packets[i];
+        index_bytes[i] += other.index_bytes[i];
+    }
+    unsteered_packets += other.unsteered_packets;
+    unsteered_bytes += other.unsteered_bytes;
+}
+
+/**
+ * \brief Software model of the P4 NIC example (p4/top.p4).
+ *
+ * Packets are parsed the same way as by p4/parser.p4: Ethernet, at most one
+ * VLAN tag, IPv4 or IPv6 and ports of TCP or UDP. As in the P4 program, IPv4
+ * header is always 20 bytes long (options are not skipped) and headers not
+ * fully present in the packet are not valid. Packets whose destination MAC
+ * address hits table_mac_filter go on to table_rss indexed by the lowest
+ * rss_bits bits of csum16 over ipv46_tcp_udp_fields (fields of valid headers
+ * only, see p4/calculated_fields.p4).
+ *
+ * Tables are filled from NP4 ruleset 2.0 rules such as commands.np4, egress
+ * ports of table_rss become queues numbered in ascending order of the ports.
+ * The model is read-only once built, so one instance can serve any number of
+ * threads.
+ */
+class p4nic_pipeline {
+
+    private:
+
+        /**
+         * \brief Action of table_mac_filter.
+         */
+        enum mac_action {
+            MAC_NONE,         //!< No action (table has no default rule).
+            MAC_DROP,         //!< _drop
+            MAC_COMPUTE_RSS   //!< compute_rss
+        };
+
+        std::unordered_map<uint64_t, mac_action> mac_rules;  //!< Rules of table_mac_filter by MAC address.
+        mac_action mac_default;                              //!< Default action of table_mac_filter.
+        std::vector<int> rss_rules;                          //!< Queue of every RSS index, -1 if no rule.
+        int rss_default;                                     //!< Queue of table_rss default rule, -1 if none.
+        std::vector<uint32_t> ports;                         //!< Egress port of every queue.
+        unsigned rss_bits;                                   //!< Width of RSS index.
+
+        static uint64_t number(const std::vector<uint8_t> &value, const ruleset_rule &rule);
+
+        int queue(const ruleset_rule &rule);
+
+        void add_rule(const ruleset_rule &rule);
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param rules    Rules of table_mac_filter and table_rss
+         * @param rss_bits Width of RSS index (size of table_rss is 2^rss_bits)
+         */
+        p4nic_pipeline(const ruleset &rules, unsigned rss_bits = P4NIC_RSS_BITS);
+
+        /**
+         * \brief Number of queues (distinct egress ports of table_rss).
+         */
+        unsigned queues() const {
+            return ports.size();
+        }
+
+        /**
+         * \brief Egress port of a queue.
+         */
+        uint32_t port(unsigned queue) const {
+            return ports[queue];
+        }
+
+        /**
+         * \brief Queue of RSS index by table_rss, -1 if the index has neither rule nor default rule.
+         */
+        int rss_queue(unsigned index) const {
+            return rss_rules[index] != -1 ? rss_rules[index] : rss_default;
+        }
+
+        /**
+         * \brief Number of RSS indexes.
+         */
+        unsigned indexes() const {
+            return rss_rules.size();
+        }
+
+        /**
+         * \brief Statistics for this pipeline, all zero.
+         */
+        p4nic_stats stats() const {
+            return p4nic_stats(queues(), indexes());
+        }
+
+        /**
+         * \brief Compute RSS hash of a packet.
+         * @param packet Packet starting with Ethernet header
+         * @param caplen Length of packet data
+         * @return csum16 over ipv46_tcp_udp_fields
+         */
+        static inline uint16_t hash(const unsigned char *packet, unsigned caplen);
+
+        /**
+         * \brief Pass packet through the pipeline.
+         * @param packet Packet starting with Ethernet header
+         * @param caplen Length of packet data
+         * @param len    Length of the packet on the wire (intrinsic_metadata.packet_len)
+         * @param stats  Statistics updated by the packet
+         */
+        inline void process(const unsigned char *packet, unsigned caplen, unsigned len, p4nic_stats &stats) const;
+};
+
+inline uint64_t p4nic_pipeline::number(const std::vector<uint8_t> &value, const ruleset_rule &rule) {
+    if (value.size() > 8)
+        throw std::runtime_error("value too long in rule of " + rule.table);
+    uint64_t n = 0;
+    for (unsigned i = 0; i < value.size(); i++)
+        n = n << 8 | value[i];
+    return n;
+}
+
+inline int p4nic_pipeline::queue(const ruleset_rule &rule) {
+    if (rule.action != "update_egress_spec")
+        throw std::runtime_error("unknown action " + rule.action + " of table_rss");
+    if (rule.params.size() != 1 || rule.params[0].name != "spec")
+        throw std::runtime_error("update_egress_spec needs parameter spec");
+    uint32_t spec = number(rule.params[0].value, rule);
+    for (unsigned q = 0; q < ports.size(); q++)
+        if (ports[q] == spec)
+            return q;
+    ports.push_back(spec);
+    return ports.size() - 1;
+}
+
+inline void p4nic_pipeline::add_rule(const ruleset_rule &rule) {
+    if (rule.table == "table_mac_filter") {
+        mac_action action;
+        if (rule.action == "_drop" || rule.action == "drop")
+            action = MAC_DROP;
+        else if (rule.action == "compute_rss")
+            action = MAC_COMPUTE_RSS;
+        else
+            throw std::runtime_error("unknown action " + rule.action + " of table_mac_filter");
+        if (rule.is_default) {
+            mac_default = action;
+            return;
+        }
+        if (rule.keys.size() != 1 || rule.keys[0].name != "ethernet.dstAddr" || !rule.keys[0].mask.empty())
+            throw std::runtime_error("table_mac_filter needs exact key ethernet.dstAddr");
+        mac_rules[number(rule.keys[0].value, rule)] = action;
+    } else if (rule.table == "table_rss") {
+        if (rule.is_default) {
+            rss_default = queue(rule);
+            return;
+        }
+        if (rule.keys.size() != 1 || rule.keys[0].name != "packet_metadata.rss_index" || !rule.keys[0].mask.empty())
+            throw std::runtime_error("table_rss needs exact key packet_metadata.rss_index");
+        uint64_t index = number(rule.keys[0].value, rule);
+        if (index >= rss_rules.size())
+            throw std::runtime_error("RSS index " + std::to_string(index) + " out of table_rss");
+        rss_rules[index] = queue(rule);
+    } else {
+        throw std::runtime_error("unknown table " + rule.table);
+    }
+}
+
+inline p4nic_pipeline::p4nic_pipeline(const ruleset &rules, unsigned rss_bits) :
+    mac_default(MAC_NONE),
+    rss_rules((size_t) 1 << rss_bits, -1),
+    rss_default(-1),
+    rss_bits(rss_bits)
+    {
+    if (rss_bits == 0 || rss_bits > 16)
+        throw std::runtime_error("RSS index must be 1 to 16 bits wide");
+    for (ruleset::rule_map::const_iterator it = rules.rules().begin(); it != rules.rules().end(); ++it)
+        add_rule(ruleset::decode(*it));
+
+    // Number queues in order of their egress ports rather than order of rules
+    std::vector<uint32_t> sorted(ports);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<int> renumber(ports.size());
+    for (unsigned q = 0; q < ports.size(); q++)
+        renumber[q] = std::lower_bound(sorted.begin(), sorted.end(), ports[q]) - sorted.begin();
+    for (unsigned i = 0; i < rss_rules.size(); i++)
+        if (rss_rules[i] != -1)
+            rss_rules[i] = renumber[rss_rules[i]];
+    if (rss_default != -1)
+        rss_default = renumber[rss_default];
+    ports.swap(sorted);
+}
+
+inline uint16_t p4nic_pipeline::hash(const unsigned char *packet, unsigned caplen) {
+    // Fields of valid headers in order of ipv46_tcp_udp_fields, padded by zero byte
+    unsigned char fields[38];
+    unsigned n = 0;
+    unsigned offset = 14;
+    if (caplen < offset)
+        return 0xffff;
+    uint16_t type = packet[12] << 8 | packet[13];
+    if (type == 0x8100 || type == 0x9100 || type == 0x9200 || type == 0x9300) {
+        if (caplen < offset + 4)
+            return 0xffff;
+        type = packet[16] << 8 | packet[17];
+        offset += 4;
+    }
+    uint8_t proto;
+    if (type == 0x0800) {
+        if (caplen < offset + 20)
+            return 0xffff;
+        proto = packet[offset + 9];
+        fields[0] = proto;
+        memcpy(fields + 1, packet + offset + 12, 8);
+        n = 9;
+        offset += 20;
+    } else if (type == 0x86dd) {
+        if (caplen < offset + 40)
+            return 0xffff;
+        proto = packet[offset + 6];
+        fields[0] = proto;
+        memcpy(fields + 1, packet + offset + 8, 32);
+        n = 33;
+        offset += 40;
+    } else {
+        return 0xffff;
+    }
+    if ((proto == 6 || proto == 17) && caplen >= offset + 4) {
+        memcpy(fields + n, packet + offset, 4);
+        n += 4;
+    }
+    fields[n] = 0;
+
+    uint32_t sum = 0;
+    for (unsigned i = 0; i < n; i += 2)
+        sum += fields[i] << 8 | fields[i + 1];
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+inline void p4nic_pipeline::process(const unsigned char *packet, unsigned caplen, unsigned len,
+                                    p4nic_stats &stats) const {
+    // Ethernet header is not valid in shorter packets, no table is applied
+    if (caplen < 14) {
+        stats.unsteered_packets++;
+        stats.unsteered_bytes += len;
+        return;
+    }
+    uint64_t mac = 0;
+    for (unsigned i = 0; i < 6; i++)
+        mac = mac << 8 | packet[i];
+    std::unordered_map<uint64_t, mac_action>::const_iterator rule = mac_rules.find(mac);
+    bool hit = rule != mac_rules.end();
+    mac_action action = hit ? rule->second : mac_default;
+
+    if (action == MAC_DROP) {
+        stats.counters[P4NIC_COUNTERS_PKTS]++;
+        stats.counters[P4NIC_COUNTERS_DROPPED]++;
+        return;
+    }
+    if (action != MAC_COMPUTE_RSS) {
+        stats.unsteered_packets++;
+        stats.unsteered_bytes += len;
+        return;
+    }
+    stats.counters[P4NIC_COUNTERS_PKTS]++;
+    stats.counters[P4NIC_COUNTERS_RCVD]++;
+    stats.counters[P4NIC_COUNTERS_RCVD_BYTES] += len;
+    unsigned index = hash(packet, caplen) & ((1u << rss_bits) - 1);
+    stats.index_packets[index]++;
+    stats.index_bytes[index] += len;
+
+    // table_rss is applied only on hit of table_mac_filter
+    int queue = hit ? rss_queue(index) : -1;
+    if (queue == -1) {
+        stats.unsteered_packets++;
+        stats.unsteered_bytes += len;
+        return;
+    }
+    stats.queue_packets[queue]++;
+    stats.queue_bytes[queue] += len;
+}
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * p4nic_rebalance.cpp: Simulation of RSS indirection table rebalancing of P4 NIC example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- P4 NIC RSS rebalancer --------------------------------------
+ * --------------------------------------------------------------------------------
+ * - Per RSS index load is sampled from simulated counter feed (synthetic flows  -
+ *   or a capture passed through the pipeline model) and table_rss is           -
+ *   rebalanced among queues of the given NP4 ruleset. Only changed table_rss    -
+ *   rules are pushed, here to rules held in memory. Imbalance of the static     -
+ *   and the rebalanced table is written out.                                    -
+ * - Netcope P4 card cannot remove single rules, every changed entry would reset -
+ *   the core and drop traffic, so changes are not pushed to the card live; the  -
+ *   resulting table is written by -o and loaded when traffic allows.            -
+ * --------------------------------------------------------------------------------
+ * Usage: p4nic_rebalance [-hv] [-c rules] [-b bits] [-s samples] [-p file] [-k packets]
+ *                        [-f flows] [-a alpha] [-T threshold] [-g gain] [-H hold] [-o file]
+ *   -c rules      NP4 ruleset 2.0 file with rules (default: ../commands.np4)
+ *   -b bits       Width of RSS index, table_rss has 2^bits entries (default: 4)
+ *   -s samples    Number of samples (default: 100)
+ *   -p file       Take load from a capture passed through the pipeline model
+ *                 (default: synthetic flows)
+ *   -k packets    Packets of the capture per sample (default: 10000)
+ *   -f flows      Number of synthetic flows (default: 64)
+ *   -a alpha      Weight of new sample in smoothed load (default: 0.5)
+ *   -T threshold  Imbalance that starts rebalancing (default: 1.2)
+ *   -g gain       Minimal relative decrease of busiest queue load (default: 0.1)
+ *   -H hold       Samples between two changes of the table (default: 5)
+ *   -o file       Write resulting ruleset to the file
+ *   -v            Writes out every change of the table
+ *   -h            Writes out help
+ * Build: g++ -O2 -std=c++11 -o p4nic_rebalance p4nic_rebalance.cpp
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+
+#include "../../common/pcap.hpp"
+#include "p4nic_pipeline.hpp"
+#include "rss_rebalancer.hpp"
+
+extern char *__progname;
+
+/**
+ * \brief Counter feed from a capture passed through the pipeline model.
+ *
+ * Load is the number of bytes of every RSS index; the capture is read again
+ * from the start when it ends.
+ */
+class capture_load_source : public rss_load_source {
+
+    private:
+
+        const p4nic_pipeline &pipeline;  //!< Model of the pipeline.
+        pcap_reader reader;              //!< Capture.
+        unsigned packets;                //!< Packets per sample.
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param pipeline Model of the pipeline
+         * @param path     Path to the capture
+         * @param packets  Packets per sample
+         */
+        capture_load_source(const p4nic_pipeline &pipeline, const char *path, unsigned packets) :
+            pipeline(pipeline),
+            reader(path),
+            packets(packets)
+            {
+            if (reader.linktype != PCAP_LINKTYPE_ETHERNET)
+                throw std::runtime_error(std::string() + "'" + path + "' is not Ethernet capture");
+        }
+
+        bool sample(std::vector<uint64_t> &load) {
+            p4nic_stats stats = pipeline.stats();
+            for (unsigned n = 0; n < packets; n++) {
+                unsigned caplen, len;
+                unsigned char *packet = reader.next(&caplen, NULL, &len);
+                if (packet == NULL) {
+                    reader.rewind();
+                    if ((packet = reader.next(&caplen, NULL, &len)) == NULL)
+                        return false;
+                }
+                pipeline.process(packet, caplen, len, stats);
+            }
+            load.swap(stats.index_bytes);
+            return true;
+        }
+};
+
+void rebalance_usage() {
+    std::cout << "Usage: p4nic_rebalance [-hv] [-c rules] [-b bits] [-s samples] [-p file] [-k packets]" << std::endl;
+    std::cout << "                       [-f flows] [-a alpha] [-T threshold] [-g gain] [-H hold] [-o file]" << std::endl;
+    std::cout << "  -c rules      NP4 ruleset 2.0 file with rules (default: ../commands.np4)" << std::endl;
+    std::cout << "  -b bits       Width of RSS index, table_rss has 2^bits entries (default: 4)" << std::endl;
+    std::cout << "  -s samples    Number of samples (default: 100)" << std::endl;
+    std::cout << "  -p file       Take load from a capture passed through the pipeline model" << std::endl;
+    std::cout << "                (default: synthetic flows)" << std::endl;
+    std::cout << "  -k packets    Packets of the capture per sample (default: 10000)" << std::endl;
+    std::cout << "  -f flows      Number of synthetic flows (default: 64)" << std::endl;
+    std::cout << "  -a alpha      Weight of new sample in smoothed load (default: 0.5)" << std::endl;
+    std::cout << "  -T threshold  Imbalance that starts rebalancing (default: 1.2)" << std::endl;
+    std::cout << "  -g gain       Minimal relative decrease of busiest queue load (default: 0.1)" << std::endl;
+    std::cout << "  -H hold       Samples between two changes of the table (default: 5)" << std::endl;
+    std::cout << "  -o file       Write resulting ruleset to the file" << std::endl;
+    std::cout << "  -v            Writes out every change of the table" << std::endl;
+    std::cout << "  -h            Writes out help" << std::endl;
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *rules_path = "../commands.np4";
+    const char *capture = NULL;
+    const char *output = NULL;
+    unsigned bits = P4NIC_RSS_BITS;
+    unsigned long samples = 100;
+    unsigned packets = 10000;
+    unsigned flows = 64;
+    bool verbose = false;
+    rss_rebalance_config config;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "c:b:s:p:k:f:a:T:g:H:o:vh")) != -1)
+            switch (c) {
+                case 'c':
+                    rules_path = optarg;
+                    break;
+                case 'b':
+                    bits = strtoul(optarg, NULL, 10);
+                    break;
+                case 's':
+                    samples = strtoul(optarg, NULL, 10);
+                    break;
+                case 'p':
+                    capture = optarg;
+                    break;
+                case 'k':
+                    packets = strtoul(optarg, NULL, 10);
+                    break;
+                case 'f':
+                    flows = strtoul(optarg, NULL, 10);
+                    break;
+                case 'a':
+                    config.alpha = strtod(optarg, NULL);
+                    break;
+                case 'T':
+                    config.threshold = strtod(optarg, NULL);
+                    break;
+                case 'g':
+                    config.gain = strtod(optarg, NULL);
+                    break;
+                case 'H':
+                    config.hold = strtoul(optarg, NULL, 10);
+                    break;
+                case 'o':
+                    output = optarg;
+                    break;
+                case 'v':
+                    verbose = true;
+                    break;
+                case 'h':
+                    rebalance_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    rebalance_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind != argc || packets == 0 || flows == 0 || config.alpha <= 0 || config.alpha > 1) {
+            rebalance_usage();
+            return EXIT_FAILURE;
+        }
+
+        ruleset rules;
+        rules.load(rules_path);
+        p4nic_pipeline pipeline(rules, bits);
+        rss_rebalancer rebalancer(pipeline, config);
+        std::unique_ptr<rss_load_source> source;
+        if (capture)
+            source.reset(new capture_load_source(pipeline, capture, packets));
+        else
+            source.reset(new rss_synthetic_source(pipeline.indexes(), flows));
+
+        // Every RSS index gets its own rule first, later only changed rules are pushed; the target
+        // removes single rules, which the card cannot (np4_ruleset_target would reset its core)
+        ruleset_memory_target target;
+        ruleset_installer installer(target);
+        rebalancer.rules(rules);
+        installer.apply(rules);
+        const uint64_t initial_rules = target.inserted;
+        const std::vector<int> initial = rebalancer.queues();
+
+        std::vector<uint64_t> load;
+        std::vector<unsigned> moved;
+        double static_sum = 0, rebalanced_sum = 0, static_max = 0, rebalanced_max = 0;
+        unsigned long taken = 0, changes = 0, moves = 0;
+        for (; taken < samples && source->sample(load); taken++) {
+            // Traffic of the sample went by the table before update
+            double static_imbalance = rss_rebalancer::imbalance(load, initial, pipeline.queues());
+            double rebalanced_imbalance = rss_rebalancer::imbalance(load, rebalancer.queues(), pipeline.queues());
+            static_sum += static_imbalance;
+            rebalanced_sum += rebalanced_imbalance;
+            static_max = std::max(static_max, static_imbalance);
+            rebalanced_max = std::max(rebalanced_max, rebalanced_imbalance);
+            if (!rebalancer.update(load, &moved))
+                continue;
+            ruleset wanted = installer.rules();
+            rebalancer.rules(wanted);
+            ruleset_stats stats = installer.apply(wanted);
+            changes++;
+            moves += moved.size();
+            if (verbose) {
+                std::cout << "Sample " << taken << ": imbalance " << rebalanced_imbalance << ", moved";
+                for (unsigned i = 0; i < moved.size(); i++)
+                    std::cout << " " << moved[i] << "->" << rebalancer.port(rebalancer.queues()[moved[i]]);
+                std::cout << " (" << stats.removed << " removed, " << stats.inserted << " inserted)" << std::endl;
+            }
+        }
+
+        std::cout << "Samples             : " << taken << std::endl;
+        std::cout << "Static imbalance    : " << (taken ? static_sum / taken : 0.0) << " (max " << static_max << ")"
+                  << std::endl;
+        std::cout << "Rebalanced imbalance: " << (taken ? rebalanced_sum / taken : 0.0) << " (max " << rebalanced_max
+                  << ")" << std::endl;
+        std::cout << "Table changes       : " << changes << std::endl;
+        std::cout << "Moved indexes       : " << moves << std::endl;
+        std::cout << "Rules removed       : " << target.removed << std::endl;
+        std::cout << "Rules inserted      : " << target.inserted - initial_rules << " (after initial "
+                  << initial_rules << ")" << std::endl;
+
+        if (output) {
+            std::ofstream out(output);
+            installer.rules().write(out);
+            if (!out)
+                throw std::runtime_error(std::string() + "unable to write '" + output + "'");
+        }
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string &e) {
+        std::cerr << __progname << ": " << e << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,391 @@
+/*
+ * rss_rebalancer.hpp: Rebalancing of RSS indirection table of P4 NIC example.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_RSS_REBALANCER
+#define __HEADER_FILE_RSS_REBALANCER
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+#include "p4nic_pipeline.hpp"
+
+#define RSS_REBALANCE_ALPHA     0.5 //!< Weight of new sample in smoothed load.
+#define RSS_REBALANCE_THRESHOLD 1.2 //!< Imbalance (busiest queue over average) that starts rebalancing.
+#define RSS_REBALANCE_GAIN      0.1 //!< Minimal relative decrease of busiest queue load to accept new assignment.
+#define RSS_REBALANCE_HOLD      5   //!< Samples between two changes of the table.
+
+/**
+ * \brief Source of per RSS index load (e.g. bytes or packets per interval).
+ */
+class rss_load_source {
+
+    public:
+
+        virtual ~rss_load_source() {}
+
+        /**
+         * \brief Take next sample.
+         * @param load Output load of every RSS index since previous sample
+         * @return False if the source has no more samples
+         */
+        virtual bool sample(std::vector<uint64_t> &load) = 0;
+};
+
+/**
+ * \brief Simulated counter feed for testing of the rebalancer.
+ *
+ * Flows with heavy-tailed (Pareto) rates are hashed to random indexes; rates
+ * jitter from sample to sample and every sample some flows end and are
+ * replaced by new ones, so heavy indexes come and go.
+ */
+class rss_synthetic_source : public rss_load_source {
+
+    private:
+
+        unsigned indexes;                  //!< Number of RSS indexes.
+        double churn;                      //!< Probability that a flow is replaced in one sample.
+        std::mt19937_64 random;            //!< Generator of the feed.
+        std::vector<unsigned> flow_index;  //!< RSS index of every flow.
+        std::vector<double> flow_rate;     //!< Load of every flow per sample.
+
+        inline double uniform() {
+            return std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        }
+
+        void new_flow(unsigned flow) {
+            flow_index[flow] = random() % indexes;
+            flow_rate[flow] = 1000.0 / std::pow(1.0 - uniform(), 1.0 / 1.2);
+        }
+
+    public:
+
+        /**
+         * \brief Basic constructor.
+         * @param indexes Number of RSS indexes
+         * @param flows   Number of concurrent flows
+         * @param churn   Probability that a flow is replaced in one sample
+         * @param seed    Seed of the generator
+         */
+        rss_synthetic_source(unsigned indexes, unsigned flows = 64, double churn = 0.02, uint64_t seed = 1) :
+            indexes(indexes),
+            churn(churn),
+            random(seed),
+            flow_index(flows),
+            flow_rate(flows)
+            {
+            for (unsigned f = 0; f < flows; f++)
+                new_flow(f);
+        }
+
+        bool sample(std::vector<uint64_t> &load) {
+            load.assign(indexes, 0);
+            for (unsigned f = 0; f < flow_rate.size(); f++) {
+                if (uniform() < churn)
+                    new_flow(f);
+                load[flow_index[f]] += flow_rate[f] * (0.9 + 0.2 * uniform());
+            }
+            return true;
+        }
+};
+
+/**
+ * \brief Parameters of the rebalancer.
+ */
+struct rss_rebalance_config {
+    double alpha;        //!< Weight of new sample in smoothed load (1 means no smoothing).
+    double threshold;    //!< Imbalance that starts rebalancing.
+    double gain;         //!< Minimal relative decrease of busiest queue load to accept new assignment.
+    unsigned hold;       //!< Samples between two changes of the table.
+
+    rss_rebalance_config() :
+        alpha(RSS_REBALANCE_ALPHA),
+        threshold(RSS_REBALANCE_THRESHOLD),
+        gain(RSS_REBALANCE_GAIN),
+        hold(RSS_REBALANCE_HOLD)
+        {
+    }
+};
+
+/**
+ * \brief Rebalancer of RSS indirection table (table_rss).
+ *
+ * Load of every index is smoothed over samples and indexes are assigned to
+ * queues by LPT (longest processing time first): heaviest index goes to the
+ * least loaded queue. Queues of the result are interchangeable, so they are
+ * matched to the current queues holding most of their load, and indexes
+ * without load keep their queue. LPT still moves many indexes, so the
+ * current assignment is also improved greedily by moving single indexes from
+ * the busiest queue to the least loaded one; this result is taken instead
+ * when its busiest queue is within the gain of the LPT one.
+ *
+ * To avoid flapping, new assignment is taken only when the imbalance of the
+ * current one exceeds the threshold, the load of the busiest queue drops by
+ * at least the gain, and no change was made during the last hold samples.
+ */
+class rss_rebalancer {
+
+    private:
+
+        std::vector<uint32_t> ports;   //!< Egress port of every queue.
+        std::vector<int> assignment;   //!< Queue of every RSS index.
+        std::vector<double> load;      //!< Smoothed load of every RSS index.
+        rss_rebalance_config config;   //!< Parameters.
+        unsigned samples;              //!< Samples since the last change.
+        bool primed;                   //!< Smoothed load holds at least one sample.
+
+        /**
+         * \brief Load of every queue under an assignment.
+         */
+        std::vector<double> queue_load(const std::vector<int> &queues) const {
+            std::vector<double> result(ports.size());
+            for (unsigned i = 0; i < queues.size(); i++)
+                result[queues[i]] += load[i];
+            return result;
+        }
+
+        /**
+         * \brief Compute LPT assignment closest to the current one.
+         */
+        std::vector<int> lpt() const;
+
+        /**
+         * \brief Improve the current assignment by moving single indexes.
+         */
+        std::vector<int> greedy() const;
+
+    public:
+
+        /**
+         * \brief Basic constructor, start with assignment of table_rss of the pipeline.
+         * @param pipeline Model of the pipeline with table_rss rules
+         * @param config   Parameters
+         */
+        rss_rebalancer(const p4nic_pipeline &pipeline, const rss_rebalance_config &config = rss_rebalance_config());
+
+        /**
+         * \brief Imbalance of queues, load of the busiest queue over average load.
+         */
+        static double imbalance(const std::vector<double> &queue_load) {
+            double sum = 0, max = 0;
+            for (unsigned q = 0; q < queue_load.size(); q++) {
+                sum += queue_load[q];
+                max = std::max(max, queue_load[q]);
+            }
+            return sum > 0 ? max * queue_load.size() / sum : 1.0;
+        }
+
+        /**
+         * \brief Imbalance of a sample under an assignment.
+         * @param sample Load of every RSS index
+         * @param queues Queue of every RSS index
+         * @param count  Number of queues
+         */
+        static double imbalance(const std::vector<uint64_t> &sample, const std::vector<int> &queues, unsigned count) {
+            std::vector<double> result(count);
+            for (unsigned i = 0; i < queues.size(); i++)
+                result[queues[i]] += sample[i];
+            return imbalance(result);
+        }
+
+        /**
+         * \brief Imbalance of smoothed load under the current assignment.
+         */
+        double imbalance() const {
+            return imbalance(queue_load(assignment));
+        }
+
+        /**
+         * \brief Take new sample and rebalance if needed.
+         * @param sample Load of every RSS index since previous sample
+         * @param moved  Output indexes assigned to another queue (optional)
+         * @return True if the assignment changed
+         */
+        bool update(const std::vector<uint64_t> &sample, std::vector<unsigned> *moved = NULL);
+
+        /**
+         * \brief Queue of every RSS index.
+         */
+        const std::vector<int> &queues() const {
+            return assignment;
+        }
+
+        /**
+         * \brief Egress port of a queue.
+         */
+        uint32_t port(unsigned queue) const {
+            return ports[queue];
+        }
+
+        /**
+         * \brief Set table_rss rules of every RSS index to the current assignment.
+         *
+         * Changed entries are removed and inserted again by ruleset_installer,
+         * so the rules are meant for targets removing single rules or for
+         * offline loading, not for live push to Netcope P4 card.
+         * @param rules Ruleset to update, other rules are kept
+         */
+        void rules(ruleset &rules) const;
+};
+
+inline rss_rebalancer::rss_rebalancer(const p4nic_pipeline &pipeline, const rss_rebalance_config &config) :
+    assignment(pipeline.indexes()),
+    load(pipeline.indexes()),
+    config(config),
+    samples(0),
+    primed(false)
+    {
+    if (pipeline.queues() == 0)
+        throw std::runtime_error("table_rss has no egress ports");
+    for (unsigned q = 0; q < pipeline.queues(); q++)
+        ports.push_back(pipeline.port(q));
+    // Indexes without rule are spread round robin
+    for (unsigned i = 0; i < assignment.size(); i++) {
+        int queue = pipeline.rss_queue(i);
+        assignment[i] = queue != -1 ? queue : i % ports.size();
+    }
+}
+
+inline std::vector<int> rss_rebalancer::lpt() const {
+    // Indexes by descending load
+    std::vector<std::pair<double, unsigned> > order(load.size());
+    for (unsigned i = 0; i < order.size(); i++)
+        order[i] = std::make_pair(-load[i], i);
+    std::sort(order.begin(), order.end());
+
+    std::vector<double> bins(ports.size());
+    std::vector<int> bin(load.size(), -1);
+    for (unsigned n = 0; n < order.size() && order[n].first < 0; n++) {
+        unsigned b = std::min_element(bins.begin(), bins.end()) - bins.begin();
+        bin[order[n].second] = b;
+        bins[b] -= order[n].first;
+    }
+
+    // Give every bin the current queue that already holds most of its load
+    std::vector<std::vector<double> > overlap(ports.size(), std::vector<double>(ports.size()));
+    for (unsigned i = 0; i < bin.size(); i++)
+        if (bin[i] != -1)
+            overlap[bin[i]][assignment[i]] += load[i];
+    std::vector<int> label(ports.size(), -1);
+    std::vector<bool> taken(ports.size());
+    for (unsigned n = 0; n < ports.size(); n++) {
+        int best_bin = -1, best_queue = -1;
+        for (unsigned b = 0; b < ports.size(); b++) {
+            if (label[b] != -1)
+                continue;
+            for (unsigned q = 0; q < ports.size(); q++)
+                if (!taken[q] && (best_bin == -1 || overlap[b][q] > overlap[best_bin][best_queue])) {
+                    best_bin = b;
+                    best_queue = q;
+                }
+        }
+        label[best_bin] = best_queue;
+        taken[best_queue] = true;
+    }
+
+    std::vector<int> result(assignment);
+    for (unsigned i = 0; i < bin.size(); i++)
+        if (bin[i] != -1)
+            result[i] = label[bin[i]];
+    return result;
+}
+
+inline std::vector<int> rss_rebalancer::greedy() const {
+    std::vector<int> result(assignment);
+    std::vector<double> queues = queue_load(result);
+    for (unsigned step = 0; step < result.size(); step++) {
+        unsigned busiest = std::max_element(queues.begin(), queues.end()) - queues.begin();
+        unsigned idlest = std::min_element(queues.begin(), queues.end()) - queues.begin();
+        double gap = queues[busiest] - queues[idlest];
+        // Index bringing both queues closest to each other
+        int best = -1;
+        for (unsigned i = 0; i < result.size(); i++)
+            if (result[i] == (int) busiest && load[i] > 0 && load[i] < gap &&
+                (best == -1 || std::fabs(gap / 2 - load[i]) < std::fabs(gap / 2 - load[best])))
+                best = i;
+        if (best == -1)
+            break;
+        result[best] = idlest;
+        queues[busiest] -= load[best];
+        queues[idlest] += load[best];
+    }
+    return result;
+}
+
+inline bool rss_rebalancer::update(const std::vector<uint64_t> &sample, std::vector<unsigned> *moved) {
+    if (sample.size() != load.size())
+        throw std::runtime_error("sample does not match size of table_rss");
+    for (unsigned i = 0; i < load.size(); i++)
+        load[i] = primed ? config.alpha * sample[i] + (1 - config.alpha) * load[i] : sample[i];
+    primed = true;
+    if (moved)
+        moved->clear();
+
+    if (++samples < config.hold)
+        return false;
+    std::vector<double> current = queue_load(assignment);
+    if (imbalance(current) <= config.threshold)
+        return false;
+    std::vector<int> candidate = lpt();
+    std::vector<double> proposed = queue_load(candidate);
+    double proposed_max = *std::max_element(proposed.begin(), proposed.end());
+    std::vector<int> moves = greedy();
+    std::vector<double> moved_load = queue_load(moves);
+    double moved_max = *std::max_element(moved_load.begin(), moved_load.end());
+    if (moved_max * (1 - config.gain) <= proposed_max) {
+        candidate.swap(moves);
+        proposed_max = moved_max;
+    }
+    if (proposed_max > *std::max_element(current.begin(), current.end()) * (1 - config.gain))
+        return false;
+
+    if (moved)
+        for (unsigned i = 0; i < assignment.size(); i++)
+            if (candidate[i] != assignment[i])
+                moved->push_back(i);
+    assignment.swap(candidate);
+    samples = 0;
+    return true;
+}
+
+inline void rss_rebalancer::rules(ruleset &rules) const {
+    ruleset_rule rule;
+    rule.table = "table_rss";
+    rule.keys.resize(1);
+    rule.keys[0].name = "packet_metadata.rss_index";
+    rule.action = "update_egress_spec";
+    rule.params.resize(1);
+    rule.params[0].name = "spec";
+    for (unsigned i = 0; i < assignment.size(); i++) {
+        rule.keys[0].value = ruleset::number(i);
+        rule.params[0].value = ruleset::number(ports[assignment[i]]);
+        rules.erase(rule);
+        rules.add(rule);
+    }
+}
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * srv6_model.cpp: Software model of segment routing example for validation of rules.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ * Description:
+ * --------------------------------------------------------------------------------
+ * ------------------- Segment routing pipeline model -----------------------------
+ * --------------------------------------------------------------------------------
+ * - NP4 ruleset (such as ../demo/rules.txt) is checked against the tables of    -
+ *   the segment routing pipeline and packets of a capture are passed through   -
+ *   software model of the pipeline (segment rewrite and ternary match on IPv6  -
+ *   destination) in batches. Packets of every action and egress port are       -
+ *   written out, so the rules can be checked before they are loaded to the     -
+ *   card. Synthetic prefix rules can be added to size large rule sets.          -
+ * --------------------------------------------------------------------------------
+ * Usage: srv6_model [-h] [-c rules] [-G count] [-s seed] [-o file] [-n loops] [file]
+ *   -c rules    NP4 ruleset 2.0 file with rules (default: ../demo/rules.txt)
+ *   -G count    Add count synthetic prefix rules of set_egress_port
+ *   -s seed     Seed of synthetic rules (default: 1)
+ *   -o file     Write resulting ruleset to the file
+ *   -n loops    Number of passes over the capture (default: 1)
+ *   -h          Writes out help
+ * Build: g++ -O2 -std=c++11 -o srv6_model srv6_model.cpp
+ * --------------------------------------------------------------------------------
+ */
+
+ /*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <vector>
+#include <unistd.h>
+
+#include "../../common/pcap.hpp"
+#include "srv6_pipeline.hpp"
+
+#define MODEL_RULES_PRINTED 32 //!< Rules whose hits are written out one by one.
+
+extern char *__progname;
+
+void model_usage() {
+    std::cout << "Usage: srv6_model [-h] [-c rules] [-G count] [-s seed] [-o file] [-n loops] [file]" << std::endl;
+    std::cout << "  -c rules    NP4 ruleset 2.0 file with rules (default: ../demo/rules.txt)" << std::endl;
+    std::cout << "  -G count    Add count synthetic prefix rules of set_egress_port" << std::endl;
+    std::cout << "  -s seed     Seed of synthetic rules (default: 1)" << std::endl;
+    std::cout << "  -o file     Write resulting ruleset to the file" << std::endl;
+    std::cout << "  -n loops    Number of passes over the capture (default: 1)" << std::endl;
+    std::cout << "  -h          Writes out help" << std::endl;
+}
+
+/**
+ * \brief Add synthetic rules, prefixes 32 to 64 bits long as used for SRv6 locators.
+ * @param rules Ruleset
+ * @param count Number of rules
+ * @param seed  Seed of the generator
+ */
+void model_synthetic_rules(ruleset &rules, unsigned long count, uint64_t seed) {
+    std::mt19937_64 random(seed);
+    ruleset_rule rule;
+    rule.table = "table_set_egress_port";
+    rule.keys.resize(1);
+    rule.keys[0].name = "ipv6.dstAddr";
+    rule.keys[0].value.assign(16, 0);
+    rule.keys[0].mask.assign(16, 0);
+    rule.action = "set_egress_port";
+    rule.params.resize(1);
+    rule.params[0].name = "eport";
+    for (unsigned long added = 0; added < count; ) {
+        unsigned length = 32 + 8 * (random() % 5);
+        uint64_t prefix = random();
+        for (unsigned b = 0; b < 16; b++) {
+            rule.keys[0].mask[b] = b < length / 8 ? 0xFF : 0;
+            rule.keys[0].value[b] = b < length / 8 ? prefix >> (56 - 8 * b) : 0;
+        }
+        rule.params[0].value = ruleset::number(random() % 16);
+        if (rules.add(rule))
+            added++;
+    }
+}
+
+/**
+ * \brief Write out share of one verdict or port.
+ */
+void model_print_share(const std::string &name, uint64_t packets, uint64_t total) {
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::left << std::setw(20) << name << ": " << std::right << std::setw(12) << packets << " pkts "
+              << std::setw(6) << std::fixed << std::setprecision(2) << (total ? 100.0 * packets / total : 0.0)
+              << " %" << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+    std::cout.precision(precision);
+}
+
+/**
+ * \brief Program main function.
+ * @param argc Number of arguments.
+ * @param argv Arguments themself.
+ * @return Zero on success, error code otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *rules_path = "../demo/rules.txt";
+    const char *output = NULL;
+    unsigned long synthetic = 0;
+    uint64_t seed = 1;
+    unsigned long loops = 1;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "c:G:s:o:n:h")) != -1)
+            switch (c) {
+                case 'c':
+                    rules_path = optarg;
+                    break;
+                case 'G':
+                    synthetic = strtoul(optarg, NULL, 10);
+                    break;
+                case 's':
+                    seed = strtoull(optarg, NULL, 10);
+                    break;
+                case 'o':
+                    output = optarg;
+                    break;
+                case 'n':
+                    loops = strtoul(optarg, NULL, 10);
+                    break;
+                case 'h':
+                    model_usage();
+                    return EXIT_SUCCESS;
+                default:
+                    model_usage();
+                    return EXIT_FAILURE;
+            }
+        if (optind < argc - 1 || loops == 0) {
+            model_usage();
+            return EXIT_FAILURE;
+        }
+
+        ruleset rules;
+        rules.load(rules_path);
+        model_synthetic_rules(rules, synthetic, seed);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        srv6_pipeline pipeline(rules);
+        double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (size_t i = 0; i < pipeline.warnings().size(); i++)
+            std::cerr << __progname << ": warning: " << pipeline.warnings()[i] << std::endl;
+
+        std::cout << "Rules               : " << pipeline.rules() << std::endl;
+        std::cout << "Masks               : " << pipeline.tuples() << std::endl;
+        std::cout << "Classifier memory   : " << pipeline.memory() << " B" << std::endl;
+        std::cout << "Build time (s)      : " << build << std::endl;
+        if (output) {
+            std::ofstream out(output);
+            rules.write(out);
+            if (!out)
+                throw std::runtime_error(std::string() + "unable to write '" + output + "'");
+        }
+        if (optind == argc)
+            return EXIT_SUCCESS;
+
+        pcap_reader reader(argv[optind]);
+        if (reader.linktype != PCAP_LINKTYPE_ETHERNET)
+            throw std::runtime_error(std::string() + "'" + argv[optind] + "' is not Ethernet capture");
+        std::vector<srv6_packet> packets;
+        srv6_packet packet;
+        while ((packet.data = reader.next(&packet.caplen, NULL, &packet.len)) != NULL)
+            packets.push_back(packet);
+
+        srv6_stats stats = pipeline.stats();
+        start = std::chrono::steady_clock::now();
+        for (unsigned long l = 0; l < loops; l++)
+            pipeline.process(packets.data(), packets.size(), stats);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t hashed_max = 0, hashed_used = 0;
+        for (unsigned i = 0; i < SRV6_HASH_CHANNELS; i++) {
+            hashed_max = std::max(hashed_max, stats.channel_packets[i]);
+            hashed_used += stats.channel_packets[i] != 0;
+        }
+        uint64_t unused = 0;
+        for (size_t i = 0; i < pipeline.rules(); i++)
+            unused += stats.rule_hits[i] == 0;
+
+        std::cout << std::endl;
+        std::cout << "Packets             : " << stats.packets << std::endl;
+        std::cout << "Invalid packets     : " << stats.invalid << std::endl;
+        std::cout << "IPv6 packets        : " << stats.ipv6 << std::endl;
+        std::cout << "Rewritten packets   : " << stats.rewritten << std::endl;
+        std::cout << std::endl;
+        model_print_share("No rule", stats.verdict_packets[SRV6_MISS], stats.packets);
+        model_print_share("Permitted", stats.verdict_packets[SRV6_PERMIT], stats.packets);
+        model_print_share("Dropped", stats.verdict_packets[SRV6_DROP], stats.packets);
+        model_print_share("Egress port set", stats.verdict_packets[SRV6_PORT], stats.packets);
+        model_print_share("Hash forwarded", stats.verdict_packets[SRV6_HASH], stats.packets);
+        std::cout << std::endl;
+        std::vector<std::pair<uint64_t, uint64_t> > ports(stats.port_packets.begin(), stats.port_packets.end());
+        std::sort(ports.begin(), ports.end());
+        for (size_t i = 0; i < ports.size(); i++)
+            model_print_share("Port " + std::to_string(ports[i].first), ports[i].second,
+                              stats.verdict_packets[SRV6_PORT]);
+        std::cout << "Hash channels used  : " << hashed_used << " (busiest " << hashed_max << " pkts)" << std::endl;
+        std::cout << std::endl;
+        if (pipeline.rules() <= MODEL_RULES_PRINTED)
+            for (size_t i = 0; i < pipeline.rules(); i++)
+                std::cout << std::setw(12) << stats.rule_hits[i] << " pkts  " << pipeline.rule(i) << std::endl;
+        std::cout << "Rules never hit     : " << unused << std::endl;
+        std::cout << "Elapsed time (s)    : " << elapsed << std::endl;
+        std::cout << "Packets per second  : " << (elapsed > 0 ? stats.packets / elapsed : 0.0) << std::endl;
+    } catch(std::exception &e) {
+        std::cerr << __progname << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch(std::string &e) {
+        std::cerr << __progname << ": " << e << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
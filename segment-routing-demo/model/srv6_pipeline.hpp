@@ -0,0 +1,406 @@
+/*
+ * srv6_pipeline.hpp: Software model of segment routing example pipeline.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_SRV6_PIPELINE
+#define __HEADER_FILE_SRV6_PIPELINE
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "../../common/ruleset.hpp"
+#include "ternary_classifier.hpp"
+
+#define SRV6_SEGMENTS       16      //!< Segments extracted by the parser (ipv6_seg0 to ipv6_seg15).
+#define SRV6_EGRESS_SIZE    15      //!< max_size of table_set_egress_port.
+#define SRV6_HASH_BASE      0       //!< BASE_DMA of forward_based_on_hash.
+#define SRV6_HASH_CHANNELS  65536   //!< NUM_OF_DMAS of forward_based_on_hash.
+#define SRV6_AMBIGUOUS      16      //!< Ambiguous pairs of rules reported.
+
+/**
+ * \brief Outcome of table_set_egress_port.
+ */
+enum srv6_verdict {
+    SRV6_MISS,      //!< No rule and no default rule, packet unchanged.
+    SRV6_PERMIT,    //!< permit
+    SRV6_DROP,      //!< drop_p
+    SRV6_PORT,      //!< set_egress_port
+    SRV6_HASH,      //!< forward_based_on_hash
+    SRV6_VERDICTS   //!< Number of verdicts.
+};
+
+/**
+ * \brief Packet passed through the pipeline.
+ */
+struct srv6_packet {
+    const unsigned char *data;  //!< Packet data starting with Ethernet header.
+    unsigned caplen;            //!< Captured length.
+    unsigned len;               //!< Length on the wire.
+};
+
+/**
+ * \brief Statistics of packets passed through the pipeline.
+ */
+struct srv6_stats {
+    uint64_t packets;                                   //!< All packets.
+    uint64_t invalid;                                   //!< Packets shorter than Ethernet header.
+    uint64_t ipv6;                                      //!< Packets with valid IPv6 header.
+    uint64_t rewritten;                                 //!< Packets rewritten by tab_rewrite.
+    uint64_t verdict_packets[SRV6_VERDICTS];            //!< Packets of every verdict.
+    uint64_t verdict_bytes[SRV6_VERDICTS];              //!< Bytes of every verdict.
+    std::unordered_map<uint64_t, uint64_t> port_packets;//!< Packets of every port set by set_egress_port.
+    std::vector<uint64_t> channel_packets;              //!< Packets of every channel of forward_based_on_hash.
+    std::vector<uint64_t> rule_hits;                    //!< Packets of every rule of table_set_egress_port.
+
+    /**
+     * \brief Basic constructor.
+     * @param rules Number of rules of table_set_egress_port
+     */
+    srv6_stats(size_t rules = 0) :
+        packets(0),
+        invalid(0),
+        ipv6(0),
+        rewritten(0),
+        channel_packets(SRV6_HASH_CHANNELS),
+        rule_hits(rules)
+        {
+        for (unsigned v = 0; v < SRV6_VERDICTS; v++) {
+            verdict_packets[v] = 0;
+            verdict_bytes[v] = 0;
+        }
+    }
+};
+
+/**
+ * \brief Software model of the segment routing example (p4/top.p4).
+ *
+ * Packets are parsed the same way as by p4/parser.p4: Ethernet, IPv6, the
+ * first 8 bytes of routing extension header (next header 43) and as many
+ * segments as its next_seg says, at most 16. Headers not fully present in
+ * the packet are not valid and end parsing. If ipv6_seg0 is valid,
+ * tab_rewrite rewrites ipv6.dstAddr by the last extracted segment and
+ * decrements next_seg. table_set_egress_port then matches the (rewritten)
+ * ipv6.dstAddr, zero if IPv6 header is not valid.
+ *
+ * Ruleset format has no priorities of ternary rules. The model takes the
+ * rule with the most mask bits, that is the longest prefix; overlapping rules
+ * of equal width are reported by validation as ambiguous. crc16 of
+ * forward_based_on_hash is CRC-16/ARC as in bmv2.
+ */
+class srv6_pipeline {
+
+    private:
+
+        /**
+         * \brief Action of table_set_egress_port rule.
+         */
+        struct action {
+            srv6_verdict verdict;   //!< Outcome.
+            uint64_t eport;         //!< Parameter of set_egress_port.
+        };
+
+        /**
+         * \brief Match of table_set_egress_port rule, kept for reports.
+         */
+        struct match {
+            ternary_key value;      //!< Value.
+            ternary_key mask;       //!< Mask.
+        };
+
+        ternary_classifier classifier;          //!< Rules of table_set_egress_port.
+        std::vector<action> actions;            //!< Action of every rule.
+        std::vector<match> matches;             //!< Match of every rule.
+        action egress_default;                  //!< Default action of table_set_egress_port.
+        bool rewrite;                           //!< tab_rewrite default action is rewrite.
+        std::vector<std::string> warnings_;     //!< Findings of validation.
+        uint16_t crc_table[256];                //!< Table of CRC-16/ARC.
+
+        static ternary_key key(const unsigned char *bytes);
+
+        static ternary_key key(const std::vector<uint8_t> &value, const ruleset_rule &rule);
+
+        static std::string format(const ternary_key &key);
+
+        action parse_action(const ruleset_rule &rule);
+
+        void add_rule(const ruleset_rule &rule);
+
+        /**
+         * \brief Parse packet and apply tab_rewrite.
+         * @param packet Packet
+         * @param dst    Output ipv6.dstAddr after tab_rewrite, zero if IPv6 is not valid
+         * @param stats  Statistics updated by the packet
+         * @return False if Ethernet header is not valid
+         */
+        inline bool parse(const srv6_packet &packet, ternary_key &dst, srv6_stats &stats) const;
+
+        inline uint16_t crc16(const ternary_key &dst) const;
+
+    public:
+
+        /**
+         * \brief Basic constructor, validate rules.
+         * @param rules Rules of tab_rewrite and table_set_egress_port
+         */
+        srv6_pipeline(const ruleset &rules);
+
+        /**
+         * \brief Problems of the rules that do not prevent their installation.
+         */
+        const std::vector<std::string> &warnings() const {
+            return warnings_;
+        }
+
+        /**
+         * \brief Number of rules of table_set_egress_port (without default rule).
+         */
+        size_t rules() const {
+            return actions.size();
+        }
+
+        /**
+         * \brief Number of distinct masks of table_set_egress_port.
+         */
+        size_t tuples() const {
+            return classifier.tuple_count();
+        }
+
+        /**
+         * \brief Bytes taken by the classifier.
+         */
+        size_t memory() const {
+            return classifier.memory();
+        }
+
+        /**
+         * \brief Text of a rule of table_set_egress_port, as in NP4 ruleset.
+         */
+        std::string rule(size_t id) const;
+
+        /**
+         * \brief Statistics for this pipeline, all zero.
+         */
+        srv6_stats stats() const {
+            return srv6_stats(rules());
+        }
+
+        /**
+         * \brief Pass packets through the pipeline.
+         * @param packets Packets
+         * @param count   Number of packets
+         * @param stats   Statistics updated by the packets
+         */
+        inline void process(const srv6_packet *packets, size_t count, srv6_stats &stats) const;
+};
+
+inline ternary_key srv6_pipeline::key(const unsigned char *bytes) {
+    ternary_key k;
+    for (unsigned i = 0; i < 8; i++) {
+        k.hi = k.hi << 8 | bytes[i];
+        k.lo = k.lo << 8 | bytes[i + 8];
+    }
+    return k;
+}
+
+inline ternary_key srv6_pipeline::key(const std::vector<uint8_t> &value, const ruleset_rule &rule) {
+    if (value.size() > 16)
+        throw std::runtime_error("value longer than 128 bits in rule of " + rule.table);
+    unsigned char bytes[16] = { 0 };
+    for (size_t i = 0; i < value.size(); i++)
+        bytes[16 - value.size() + i] = value[i];
+    return key(bytes);
+}
+
+inline std::string srv6_pipeline::format(const ternary_key &key) {
+    std::ostringstream out;
+    for (unsigned i = 0; i < 16; i++)
+        out << (i ? "," : "") << (unsigned) ((i < 8 ? key.hi >> (56 - 8 * i) : key.lo >> (120 - 8 * i)) & 0xFF);
+    return out.str();
+}
+
+inline srv6_pipeline::action srv6_pipeline::parse_action(const ruleset_rule &rule) {
+    action a;
+    a.eport = 0;
+    if (rule.action == "set_egress_port") {
+        if (rule.params.size() != 1 || rule.params[0].name != "eport")
+            throw std::runtime_error("set_egress_port needs parameter eport");
+        if (rule.params[0].value.size() > 6)
+            throw std::runtime_error("eport of set_egress_port is longer than 48 bits");
+        for (size_t i = 0; i < rule.params[0].value.size(); i++)
+            a.eport = a.eport << 8 | rule.params[0].value[i];
+        a.verdict = SRV6_PORT;
+        return a;
+    }
+    if (rule.action == "permit")
+        a.verdict = SRV6_PERMIT;
+    else if (rule.action == "drop_p")
+        a.verdict = SRV6_DROP;
+    else if (rule.action == "forward_based_on_hash")
+        a.verdict = SRV6_HASH;
+    else
+        throw std::runtime_error("unknown action " + rule.action + " of table_set_egress_port");
+    if (!rule.params.empty())
+        throw std::runtime_error(rule.action + " has no parameters");
+    return a;
+}
+
+inline void srv6_pipeline::add_rule(const ruleset_rule &rule) {
+    if (rule.table == "tab_rewrite") {
+        if (!rule.is_default)
+            throw std::runtime_error("tab_rewrite has no match keys, only default rule");
+        if (rule.action != "rewrite" || !rule.params.empty())
+            throw std::runtime_error("unknown action " + rule.action + " of tab_rewrite");
+        rewrite = true;
+    } else if (rule.table == "table_set_egress_port") {
+        action a = parse_action(rule);
+        if (rule.is_default) {
+            egress_default = a;
+            return;
+        }
+        if (rule.keys.size() != 1 || rule.keys[0].name != "ipv6.dstAddr")
+            throw std::runtime_error("table_set_egress_port needs key ipv6.dstAddr");
+        match m;
+        m.value = key(rule.keys[0].value, rule);
+        // Exact key matches all bits
+        m.mask = rule.keys[0].mask.empty() ? ternary_key(~0ULL, ~0ULL) : key(rule.keys[0].mask, rule);
+        if (!((m.value & m.mask) == m.value))
+            warnings_.push_back("value bits outside mask are ignored: " + rule.table + " keys ( ipv6.dstAddr " +
+                                format(m.value) + ":" + format(m.mask) + " )");
+        m.value = m.value & m.mask;
+        if (!classifier.add(m.value, m.mask, actions.size()))
+            throw std::runtime_error("duplicate match in table_set_egress_port: " + format(m.value) + ":" +
+                                     format(m.mask));
+        actions.push_back(a);
+        matches.push_back(m);
+    } else {
+        throw std::runtime_error("unknown table " + rule.table);
+    }
+}
+
+inline srv6_pipeline::srv6_pipeline(const ruleset &rules) :
+    rewrite(false)
+    {
+    egress_default.verdict = SRV6_MISS;
+    egress_default.eport = 0;
+    for (unsigned i = 0; i < 256; i++) {
+        uint16_t crc = i;
+        for (unsigned b = 0; b < 8; b++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        crc_table[i] = crc;
+    }
+    for (ruleset::rule_map::const_iterator it = rules.rules().begin(); it != rules.rules().end(); ++it)
+        add_rule(ruleset::decode(*it));
+
+    if (!rewrite)
+        warnings_.push_back("tab_rewrite has no default rule, segments are not rewritten");
+    if (actions.size() > SRV6_EGRESS_SIZE)
+        warnings_.push_back("table_set_egress_port has " + std::to_string(actions.size()) +
+                            " rules, max_size is " + std::to_string(SRV6_EGRESS_SIZE));
+    std::vector<std::pair<uint32_t, uint32_t> > pairs;
+    classifier.ambiguous(pairs, SRV6_AMBIGUOUS);
+    for (size_t i = 0; i < pairs.size(); i++)
+        warnings_.push_back("ambiguous overlap, model applies the first: " + rule(pairs[i].first) + " / " +
+                            rule(pairs[i].second));
+}
+
+inline std::string srv6_pipeline::rule(size_t id) const {
+    std::string text = "table_set_egress_port keys ( ipv6.dstAddr " + format(matches[id].value) + ":" +
+                       format(matches[id].mask) + " ) action ";
+    switch (actions[id].verdict) {
+        case SRV6_PERMIT:
+            return text + "permit";
+        case SRV6_DROP:
+            return text + "drop_p";
+        case SRV6_HASH:
+            return text + "forward_based_on_hash";
+        default:
+            return text + "set_egress_port params ( eport " + std::to_string(actions[id].eport) + " )";
+    }
+}
+
+inline bool srv6_pipeline::parse(const srv6_packet &packet, ternary_key &dst, srv6_stats &stats) const {
+    const unsigned char *p = packet.data;
+    dst = ternary_key();
+    if (packet.caplen < 14)
+        return false;
+    if ((p[12] << 8 | p[13]) != 0x86dd || packet.caplen < 54)
+        return true;
+    stats.ipv6++;
+    dst = key(p + 38);
+    if (p[20] != 0x2B || packet.caplen < 62)
+        return true;
+    // Segments follow the 8 bytes of ipv6_ext, the last extracted one is lastSeg.segVal
+    unsigned segments = p[57] < SRV6_SEGMENTS ? p[57] : SRV6_SEGMENTS;
+    if (segments > (packet.caplen - 62) / 16)
+        segments = (packet.caplen - 62) / 16;
+    if (segments == 0 || !rewrite)
+        return true;
+    dst = key(p + 62 + 16 * (segments - 1));
+    stats.rewritten++;
+    return true;
+}
+
+inline uint16_t srv6_pipeline::crc16(const ternary_key &dst) const {
+    uint16_t crc = 0;
+    for (int shift = 56; shift >= 0; shift -= 8)
+        crc = (crc >> 8) ^ crc_table[(crc ^ (dst.hi >> shift)) & 0xFF];
+    for (int shift = 56; shift >= 0; shift -= 8)
+        crc = (crc >> 8) ^ crc_table[(crc ^ (dst.lo >> shift)) & 0xFF];
+    return crc;
+}
+
+inline void srv6_pipeline::process(const srv6_packet *packets, size_t count, srv6_stats &stats) const {
+    ternary_key keys[TERNARY_BATCH];
+    uint32_t ids[TERNARY_BATCH];
+    bool valid[TERNARY_BATCH];
+
+    // Parse a batch first, then classify it at once
+    for (size_t first = 0; first < count; first += TERNARY_BATCH) {
+        unsigned n = count - first < TERNARY_BATCH ? count - first : TERNARY_BATCH;
+        for (unsigned i = 0; i < n; i++)
+            valid[i] = parse(packets[first + i], keys[i], stats);
+        classifier.find(keys, n, ids);
+        for (unsigned i = 0; i < n; i++) {
+            const srv6_packet &packet = packets[first + i];
+            stats.packets++;
+            if (!valid[i]) {
+                stats.invalid++;
+                continue;
+            }
+            const action &a = ids[i] != TERNARY_NONE ? actions[ids[i]] : egress_default;
+            if (ids[i] != TERNARY_NONE)
+                stats.rule_hits[ids[i]]++;
+            stats.verdict_packets[a.verdict]++;
+            stats.verdict_bytes[a.verdict] += packet.len;
+            if (a.verdict == SRV6_PORT)
+                stats.port_packets[a.eport]++;
+            else if (a.verdict == SRV6_HASH)
+                stats.channel_packets[(SRV6_HASH_BASE + crc16(keys[i])) % SRV6_HASH_CHANNELS]++;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * ternary_classifier.hpp: Tuple space classifier of 128-bit ternary keys.
+ * Copyright (C) 2018 Netcope Technologies, a.s.
+ */
+
+/*
+ * This file is part of Netcope distribution (https://github.com/netcope).
+ * Copyright (c) 2018 Netcope Technologies, a.s.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HEADER_FILE_TERNARY_CLASSIFIER
+#define __HEADER_FILE_TERNARY_CLASSIFIER
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#define TERNARY_NONE  0xFFFFFFFF //!< No rule.
+#define TERNARY_BATCH 32         //!< Keys looked up together by batch find().
+
+/**
+ * \brief 128-bit key, value or mask, hi holds the first 8 bytes in network order.
+ */
+struct ternary_key {
+    uint64_t hi;   //!< Upper 64 bits.
+    uint64_t lo;   //!< Lower 64 bits.
+
+    ternary_key(uint64_t hi = 0, uint64_t lo = 0) : hi(hi), lo(lo) {}
+
+    ternary_key operator&(const ternary_key &other) const {
+        return ternary_key(hi & other.hi, lo & other.lo);
+    }
+
+    bool operator==(const ternary_key &other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+
+    bool operator<(const ternary_key &other) const {
+        return hi < other.hi || (hi == other.hi && lo < other.lo);
+    }
+
+    /**
+     * \brief Number of set bits.
+     */
+    unsigned bits() const {
+        return __builtin_popcountll(hi) + __builtin_popcountll(lo);
+    }
+};
+
+/**
+ * \brief Classifier of ternary rules by tuple space search.
+ *
+ * Rules are grouped into tuples by their mask; every tuple is a hash table of
+ * masked values with open addressing. Lookup probes the tuples in descending
+ * order of mask width and stops at the first hit, so a rule with more mask
+ * bits takes precedence (longest prefix for prefix masks). Rules of equal
+ * width whose matches overlap are ambiguous, the tuple added first wins; see
+ * ambiguous().
+ *
+ * Cost of a lookup grows with the number of distinct masks rather than the
+ * number of rules. Batch lookup hashes all keys of a batch for one tuple and
+ * prefetches their slots before probing, so the cache misses of the keys
+ * overlap.
+ */
+class ternary_classifier {
+
+    private:
+
+        /**
+         * \brief Slot of tuple hash table.
+         */
+        struct entry {
+            ternary_key value;  //!< Masked value.
+            uint32_t id;        //!< Rule, TERNARY_NONE if the slot is empty.
+        };
+
+        /**
+         * \brief Rules with the same mask.
+         */
+        struct tuple {
+            ternary_key mask;             //!< Mask of the rules.
+            unsigned bits;                //!< Width of the mask.
+            unsigned shift;               //!< Shift of hash to slot index (64 - log2 of slots).
+            size_t size;                  //!< Number of rules.
+            std::vector<entry> entries;   //!< Hash table, power of two slots.
+        };
+
+        std::vector<tuple> tuples;                   //!< Tuples in descending order of width.
+        std::map<ternary_key, unsigned> tuple_index; //!< Tuple of every mask.
+        size_t rules;                                //!< Number of rules.
+
+        /**
+         * \brief Hash of masked value, slots are taken from its upper bits.
+         */
+        static inline uint64_t hash(const ternary_key &value) {
+            return (value.hi ^ (value.lo * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+        }
+
+        /**
+         * \brief Slot of value in tuple, its own or the empty one it would take.
+         */
+        static inline size_t slot(const tuple &t, const ternary_key &value) {
+            size_t mask = t.entries.size() - 1;
+            size_t i = hash(value) >> t.shift;
+            while (t.entries[i].id != TERNARY_NONE && !(t.entries[i].value == value))
+                i = (i + 1) & mask;
+            return i;
+        }
+
+        /**
+         * \brief Double the hash table of tuple.
+         */
+        static void grow(tuple &t);
+
+    public:
+
+        ternary_classifier() : rules(0) {}
+
+        /**
+         * \brief Add rule.
+         * @param value Value, bits outside mask are ignored
+         * @param mask  Mask
+         * @param id    Rule identifier returned by lookup
+         * @return False if a rule with the same value and mask is already present
+         */
+        bool add(const ternary_key &value, const ternary_key &mask, uint32_t id);
+
+        /**
+         * \brief Find the rule matching a key.
+         * @return Identifier of the rule, TERNARY_NONE if none matches
+         */
+        inline uint32_t find(const ternary_key &key) const;
+
+        /**
+         * \brief Find rules matching a batch of keys.
+         * @param keys  Keys
+         * @param count Number of keys, at most TERNARY_BATCH
+         * @param ids   Output identifiers of rules, TERNARY_NONE where none matches
+         */
+        inline void find(const ternary_key *keys, unsigned count, uint32_t *ids) const;
+
+        /**
+         * \brief Find pairs of overlapping rules of equal width.
+         *
+         * Rules of the same tuple never overlap, so only tuples of the same
+         * width are compared. The check is linear in their rules, but
+         * quadratic in the number of such tuples.
+         * @param pairs Output pairs of rules, winning rule first
+         * @param limit Maximal number of pairs found
+         */
+        void ambiguous(std::vector<std::pair<uint32_t, uint32_t> > &pairs, size_t limit) const;
+
+        /**
+         * \brief Number of rules.
+         */
+        size_t size() const {
+            return rules;
+        }
+
+        /**
+         * \brief Number of tuples (distinct masks).
+         */
+        size_t tuple_count() const {
+            return tuples.size();
+        }
+
+        /**
+         * \brief Bytes taken by the hash tables.
+         */
+        size_t memory() const {
+            size_t bytes = 0;
+            for (size_t t = 0; t < tuples.size(); t++)
+                bytes += tuples[t].entries.size() * sizeof(entry);
+            return bytes;
+        }
+};
+
+inline void ternary_classifier::grow(tuple &t) {
+    std::vector<entry> old;
+    old.swap(t.entries);
+    entry empty;
+    empty.id = TERNARY_NONE;
+    t.entries.assign(old.empty() ? 16 : old.size() * 2, empty);
+    t.shift = 64;
+    for (size_t n = t.entries.size(); n > 1; n >>= 1)
+        t.shift--;
+    for (size_t i = 0; i < old.size(); i++)
+        if (old[i].id != TERNARY_NONE)
+            t.entries[slot(t, old[i].value)] = old[i];
+}
+
+inline bool ternary_classifier::add(const ternary_key &value, const ternary_key &mask, uint32_t id) {
+    std::map<ternary_key, unsigned>::iterator it = tuple_index.find(mask);
+    if (it == tuple_index.end()) {
+        tuple t;
+        t.mask = mask;
+        t.bits = mask.bits();
+        t.size = 0;
+        grow(t);
+        // Keep order by width, tuples of equal width in order of addition
+        size_t pos = tuples.size();
+        while (pos > 0 && tuples[pos - 1].bits < t.bits)
+            pos--;
+        tuples.insert(tuples.begin() + pos, t);
+        for (it = tuple_index.begin(); it != tuple_index.end(); ++it)
+            if (it->second >= pos)
+                it->second++;
+        it = tuple_index.insert(std::make_pair(mask, (unsigned) pos)).first;
+    }
+    tuple &t = tuples[it->second];
+    ternary_key masked = value & mask;
+    size_t i = slot(t, masked);
+    if (t.entries[i].id != TERNARY_NONE)
+        return false;
+    // Load factor stays at most one half, probe sequences are short
+    if ((t.size + 1) * 2 > t.entries.size()) {
+        grow(t);
+        i = slot(t, masked);
+    }
+    t.entries[i].value = masked;
+    t.entries[i].id = id;
+    t.size++;
+    rules++;
+    return true;
+}
+
+inline uint32_t ternary_classifier::find(const ternary_key &key) const {
+    for (size_t t = 0; t < tuples.size(); t++) {
+        const tuple &tp = tuples[t];
+        uint32_t id = tp.entries[slot(tp, key & tp.mask)].id;
+        if (id != TERNARY_NONE)
+            return id;
+    }
+    return TERNARY_NONE;
+}
+
+inline void ternary_classifier::find(const ternary_key *keys, unsigned count, uint32_t *ids) const {
+    // Keys without a hit so far, compacted after every tuple
+    unsigned pending[TERNARY_BATCH];
+    size_t slots[TERNARY_BATCH];
+    unsigned left = count;
+    for (unsigned k = 0; k < count; k++) {
+        ids[k] = TERNARY_NONE;
+        pending[k] = k;
+    }
+    for (size_t t = 0; t < tuples.size() && left; t++) {
+        const tuple &tp = tuples[t];
+        for (unsigned k = 0; k < left; k++) {
+            slots[k] = hash(keys[pending[k]] & tp.mask) >> tp.shift;
+            __builtin_prefetch(&tp.entries[slots[k]]);
+        }
+        size_t mask = tp.entries.size() - 1;
+        unsigned kept = 0;
+        for (unsigned k = 0; k < left; k++) {
+            ternary_key masked = keys[pending[k]] & tp.mask;
+            size_t i = slots[k];
+            while (tp.entries[i].id != TERNARY_NONE && !(tp.entries[i].value == masked))
+                i = (i + 1) & mask;
+            if (tp.entries[i].id != TERNARY_NONE)
+                ids[pending[k]] = tp.entries[i].id;
+            else
+                pending[kept++] = pending[k];
+        }
+        left = kept;
+    }
+}
+
+inline void ternary_classifier::ambiguous(std::vector<std::pair<uint32_t, uint32_t> > &pairs, size_t limit) const {
+    std::vector<std::pair<ternary_key, uint32_t> > sorted;
+    for (size_t a = 0; a < tuples.size() && pairs.size() < limit; a++) {
+        for (size_t b = a + 1; b < tuples.size() && tuples[b].bits == tuples[a].bits && pairs.size() < limit; b++) {
+            // Rules overlap if they agree on the bits of both masks
+            ternary_key common = tuples[a].mask & tuples[b].mask;
+            sorted.clear();
+            for (size_t i = 0; i < tuples[b].entries.size(); i++)
+                if (tuples[b].entries[i].id != TERNARY_NONE)
+                    sorted.push_back(std::make_pair(tuples[b].entries[i].value & common, tuples[b].entries[i].id));
+            std::sort(sorted.begin(), sorted.end());
+            for (size_t i = 0; i < tuples[a].entries.size() && pairs.size() < limit; i++) {
+                if (tuples[a].entries[i].id == TERNARY_NONE)
+                    continue;
+                ternary_key key = tuples[a].entries[i].value & common;
+                std::vector<std::pair<ternary_key, uint32_t> >::const_iterator it =
+                    std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(key, (uint32_t) 0));
+                for (; it != sorted.end() && it->first == key && pairs.size() < limit; ++it)
+                    pairs.push_back(std::make_pair(tuples[a].entries[i].id, it->second));
+            }
+        }
+    }
+}
+
+#endif